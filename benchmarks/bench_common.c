@@ -0,0 +1,277 @@
+#include "bench_common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "curve.h"
+#include "protocol.h"
+#include "session_pre_key.h"
+#include "session_builder.h"
+#include "session_cipher.h"
+#include "test_common.h"
+
+#define BENCH_SIGNED_PRE_KEY_ID 22
+
+signal_context *bench_context = 0;
+
+/*------------------------------------------------------------------------*/
+
+/*
+ * With BENCH_COUNT_ALLOCATIONS, the linker redirects every malloc, calloc
+ * and realloc call in the library and the benchmark to these wrappers.
+ * Only the number of calls and the requested sizes are recorded.
+ */
+static int bench_alloc_counting = 0;
+static uint64_t bench_alloc_count = 0;
+static uint64_t bench_alloc_bytes = 0;
+
+#ifdef BENCH_COUNT_ALLOCATIONS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    if(bench_alloc_counting) {
+        bench_alloc_count++;
+        bench_alloc_bytes += size;
+    }
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    if(bench_alloc_counting) {
+        bench_alloc_count++;
+        bench_alloc_bytes += count * size;
+    }
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    if(bench_alloc_counting) {
+        bench_alloc_count++;
+        bench_alloc_bytes += size;
+    }
+    return __real_realloc(ptr, size);
+}
+#endif
+
+int bench_alloc_counting_supported(void)
+{
+#ifdef BENCH_COUNT_ALLOCATIONS
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void bench_alloc_set_counting(int enabled)
+{
+    bench_alloc_counting = enabled;
+}
+
+void bench_alloc_get_counts(uint64_t *count, uint64_t *bytes)
+{
+    *count = bench_alloc_count;
+    *bytes = bench_alloc_bytes;
+}
+
+/*------------------------------------------------------------------------*/
+
+static uint32_t bench_random_state = 0x9e3779b9U;
+
+uint32_t bench_random(void)
+{
+    /* xorshift32 */
+    uint32_t x = bench_random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    bench_random_state = x;
+    return x;
+}
+
+void bench_shuffle_buffers(signal_buffer **buffers, size_t count)
+{
+    size_t i;
+    if(count < 2) {
+        return;
+    }
+    for(i = count - 1; i > 0; i--) {
+        size_t j = bench_random() % (i + 1);
+        signal_buffer *tmp = buffers[i];
+        buffers[i] = buffers[j];
+        buffers[j] = tmp;
+    }
+}
+
+/*------------------------------------------------------------------------*/
+
+int bench_create_store(signal_protocol_store_context **store)
+{
+    setup_test_store_context(store, bench_context);
+    return *store ? 0 : SG_ERR_NOMEM;
+}
+
+int bench_create_pre_key_bundle(session_pre_key_bundle **bundle, signal_protocol_store_context *store, uint32_t pre_key_id)
+{
+    int result = 0;
+    uint32_t registration_id = 0;
+    ec_key_pair *pre_key_pair = 0;
+    ec_key_pair *signed_pre_key_pair = 0;
+    ratchet_identity_key_pair *identity_key_pair = 0;
+    signal_buffer *signed_pre_key_public = 0;
+    signal_buffer *signature = 0;
+    session_pre_key *pre_key = 0;
+    session_signed_pre_key *signed_pre_key = 0;
+
+    result = signal_protocol_identity_get_local_registration_id(store, &registration_id);
+    if(result < 0) {
+        goto complete;
+    }
+    result = signal_protocol_identity_get_key_pair(store, &identity_key_pair);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = curve_generate_key_pair(bench_context, &pre_key_pair);
+    if(result < 0) {
+        goto complete;
+    }
+    result = curve_generate_key_pair(bench_context, &signed_pre_key_pair);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = ec_public_key_serialize(&signed_pre_key_public, ec_key_pair_get_public(signed_pre_key_pair));
+    if(result < 0) {
+        goto complete;
+    }
+    result = curve_calculate_signature(bench_context, &signature,
+            ratchet_identity_key_pair_get_private(identity_key_pair),
+            signal_buffer_data(signed_pre_key_public), signal_buffer_len(signed_pre_key_public));
+    if(result < 0) {
+        goto complete;
+    }
+
+    /* The owner of the bundle needs the private keys to accept a session */
+    result = session_pre_key_create(&pre_key, pre_key_id, pre_key_pair);
+    if(result < 0) {
+        goto complete;
+    }
+    result = signal_protocol_pre_key_store_key(store, pre_key);
+    if(result < 0) {
+        goto complete;
+    }
+    result = session_signed_pre_key_create(&signed_pre_key, BENCH_SIGNED_PRE_KEY_ID, (uint64_t)time(0),
+            signed_pre_key_pair, signal_buffer_data(signature), signal_buffer_len(signature));
+    if(result < 0) {
+        goto complete;
+    }
+    result = signal_protocol_signed_pre_key_store_key(store, signed_pre_key);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = session_pre_key_bundle_create(bundle, registration_id, 1, pre_key_id,
+            ec_key_pair_get_public(pre_key_pair),
+            BENCH_SIGNED_PRE_KEY_ID, ec_key_pair_get_public(signed_pre_key_pair),
+            signal_buffer_data(signature), signal_buffer_len(signature),
+            ratchet_identity_key_pair_get_public(identity_key_pair));
+
+complete:
+    SIGNAL_UNREF(pre_key);
+    SIGNAL_UNREF(signed_pre_key);
+    SIGNAL_UNREF(pre_key_pair);
+    SIGNAL_UNREF(signed_pre_key_pair);
+    SIGNAL_UNREF(identity_key_pair);
+    signal_buffer_free(signed_pre_key_public);
+    signal_buffer_free(signature);
+    return result;
+}
+
+int bench_establish_session(
+        signal_protocol_store_context *alice_store, const signal_protocol_address *alice_address,
+        signal_protocol_store_context *bob_store, const signal_protocol_address *bob_address)
+{
+    static const uint8_t hello[] = "hello";
+    int result = 0;
+    session_pre_key_bundle *bundle = 0;
+    session_builder *builder = 0;
+    session_cipher *alice_cipher = 0;
+    session_cipher *bob_cipher = 0;
+    ciphertext_message *outgoing = 0;
+    pre_key_signal_message *incoming_pre_key = 0;
+    signal_message *incoming = 0;
+    signal_buffer *plaintext = 0;
+    signal_buffer *serialized = 0;
+
+    result = bench_create_pre_key_bundle(&bundle, bob_store, 31337);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = session_builder_create(&builder, alice_store, bob_address, bench_context);
+    if(result < 0) {
+        goto complete;
+    }
+    result = session_builder_process_pre_key_bundle(builder, bundle);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = session_cipher_create(&alice_cipher, alice_store, bob_address, bench_context);
+    if(result < 0) {
+        goto complete;
+    }
+    result = session_cipher_create(&bob_cipher, bob_store, alice_address, bench_context);
+    if(result < 0) {
+        goto complete;
+    }
+
+    /* Alice to Bob, setting up Bob's session */
+    result = session_cipher_encrypt(alice_cipher, hello, sizeof(hello), &outgoing);
+    if(result < 0) {
+        goto complete;
+    }
+    serialized = ciphertext_message_get_serialized(outgoing);
+    result = pre_key_signal_message_deserialize(&incoming_pre_key,
+            signal_buffer_data(serialized), signal_buffer_len(serialized), bench_context);
+    if(result < 0) {
+        goto complete;
+    }
+    result = session_cipher_decrypt_pre_key_signal_message(bob_cipher, incoming_pre_key, 0, &plaintext);
+    if(result < 0) {
+        goto complete;
+    }
+    signal_buffer_free(plaintext);
+    plaintext = 0;
+    SIGNAL_UNREF(outgoing);
+
+    /* Bob to Alice, so that Alice stops sending pre key messages */
+    result = session_cipher_encrypt(bob_cipher, hello, sizeof(hello), &outgoing);
+    if(result < 0) {
+        goto complete;
+    }
+    serialized = ciphertext_message_get_serialized(outgoing);
+    result = signal_message_deserialize(&incoming,
+            signal_buffer_data(serialized), signal_buffer_len(serialized), bench_context);
+    if(result < 0) {
+        goto complete;
+    }
+    result = session_cipher_decrypt_signal_message(alice_cipher, incoming, 0, &plaintext);
+
+complete:
+    signal_buffer_free(plaintext);
+    SIGNAL_UNREF(outgoing);
+    SIGNAL_UNREF(incoming_pre_key);
+    SIGNAL_UNREF(incoming);
+    SIGNAL_UNREF(bundle);
+    session_builder_free(builder);
+    session_cipher_free(alice_cipher);
+    session_cipher_free(bob_cipher);
+    return result;
+}
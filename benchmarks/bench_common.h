@@ -0,0 +1,57 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../src/signal_protocol.h"
+
+/*
+ * A benchmark runs one operation per call to run(). Work that should not be
+ * measured, such as producing the messages for a decrypt benchmark, can be
+ * excluded with bench_pause_timing() and bench_resume_timing(). When run()
+ * performs several logical operations, ops_per_run divides the results.
+ */
+typedef struct bench_definition {
+    const char *name;
+    uint64_t iterations;
+    uint32_t ops_per_run;
+    int (*setup)(void **fixture);
+    int (*run)(void *fixture);
+    void (*teardown)(void *fixture);
+} bench_definition;
+
+/* Benchmarks in each file, terminated by an entry with a null name */
+extern const bench_definition bench_session_cipher_definitions[];
+extern const bench_definition bench_session_builder_definitions[];
+extern const bench_definition bench_group_cipher_definitions[];
+extern const bench_definition bench_ratchet_definitions[];
+extern const bench_definition bench_session_record_definitions[];
+extern const bench_definition bench_fingerprint_definitions[];
+extern const bench_definition bench_curve_definitions[];
+
+/* Context shared by all benchmarks, created by the runner */
+extern signal_context *bench_context;
+
+void bench_pause_timing(void);
+void bench_resume_timing(void);
+
+/* Allocation counting, only available with the wrapped allocator */
+int bench_alloc_counting_supported(void);
+void bench_alloc_set_counting(int enabled);
+void bench_alloc_get_counts(uint64_t *count, uint64_t *bytes);
+
+/* Deterministic generator for shuffles, so that runs are comparable */
+uint32_t bench_random(void);
+void bench_shuffle_buffers(signal_buffer **buffers, size_t count);
+
+/*
+ * Create a store context with every store set up, and establish a session
+ * between two of them through a pre key bundle and one message each way.
+ */
+int bench_create_store(signal_protocol_store_context **store);
+int bench_create_pre_key_bundle(session_pre_key_bundle **bundle, signal_protocol_store_context *store, uint32_t pre_key_id);
+int bench_establish_session(
+        signal_protocol_store_context *alice_store, const signal_protocol_address *alice_address,
+        signal_protocol_store_context *bob_store, const signal_protocol_address *bob_address);
+
+#endif /* BENCH_COMMON_H */
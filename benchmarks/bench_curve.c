@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "curve.h"
+#include "signal_protocol_internal.h"
+
+#define SIGNATURE_BATCH 64
+
+typedef struct {
+    ec_key_pair *local_key_pair;
+    ec_key_pair *remote_key_pair;
+    ec_key_pair *signing_key_pairs[SIGNATURE_BATCH];
+    signal_buffer *signatures[SIGNATURE_BATCH];
+    curve_signature_batch_entry entries[SIGNATURE_BATCH];
+} curve_fixture;
+
+static void curve_fixture_teardown(void *fixture)
+{
+    curve_fixture *f = fixture;
+    int i;
+    SIGNAL_UNREF(f->local_key_pair);
+    SIGNAL_UNREF(f->remote_key_pair);
+    for(i = 0; i < SIGNATURE_BATCH; i++) {
+        SIGNAL_UNREF(f->signing_key_pairs[i]);
+        signal_buffer_free(f->signatures[i]);
+    }
+    free(f);
+}
+
+static int curve_fixture_setup(void **fixture)
+{
+    int result = 0;
+    int i;
+    curve_fixture *f = malloc(sizeof(curve_fixture));
+    if(!f) {
+        return SG_ERR_NOMEM;
+    }
+    memset(f, 0, sizeof(curve_fixture));
+
+    result = curve_generate_key_pair(bench_context, &f->local_key_pair);
+    if(result >= 0) {
+        result = curve_generate_key_pair(bench_context, &f->remote_key_pair);
+    }
+
+    /* Signed pre-key style signatures: one identity key signing another public key */
+    for(i = 0; i < SIGNATURE_BATCH && result >= 0; i++) {
+        ec_public_key *signed_key = ec_key_pair_get_public(f->remote_key_pair);
+        result = curve_generate_key_pair(bench_context, &f->signing_key_pairs[i]);
+        if(result >= 0) {
+            result = curve_calculate_signature(bench_context, &f->signatures[i],
+                    ec_key_pair_get_private(f->signing_key_pairs[i]),
+                    ec_public_key_get_serialized(signed_key), EC_PUBLIC_KEY_SERIALIZED_LENGTH);
+        }
+        if(result >= 0) {
+            f->entries[i].signing_key = ec_key_pair_get_public(f->signing_key_pairs[i]);
+            f->entries[i].message_data = ec_public_key_get_serialized(signed_key);
+            f->entries[i].message_len = EC_PUBLIC_KEY_SERIALIZED_LENGTH;
+            f->entries[i].signature_data = signal_buffer_data(f->signatures[i]);
+            f->entries[i].signature_len = signal_buffer_len(f->signatures[i]);
+        }
+    }
+
+    if(result < 0) {
+        curve_fixture_teardown(f);
+    }
+    else {
+        *fixture = f;
+    }
+    return result;
+}
+
+static void curve_buffered_fixture_teardown(void *fixture)
+{
+    curve_fixture_teardown(fixture);
+    signal_context_set_random_buffering(bench_context, 0);
+}
+
+static int curve_buffered_fixture_setup(void **fixture)
+{
+    int result = signal_context_set_random_buffering(bench_context, 1);
+    if(result < 0) {
+        return result;
+    }
+    result = curve_fixture_setup(fixture);
+    if(result < 0) {
+        signal_context_set_random_buffering(bench_context, 0);
+    }
+    return result;
+}
+
+static int run_generate_key_pair(void *fixture)
+{
+    ec_key_pair *key_pair = 0;
+    int result;
+
+    (void)fixture;
+    result = curve_generate_key_pair(bench_context, &key_pair);
+    SIGNAL_UNREF(key_pair);
+    return result;
+}
+
+static int run_calculate_agreement(void *fixture)
+{
+    curve_fixture *f = fixture;
+    uint8_t *shared_key = 0;
+    int result;
+
+    result = curve_calculate_agreement(&shared_key,
+            ec_key_pair_get_public(f->remote_key_pair),
+            ec_key_pair_get_private(f->local_key_pair));
+    free(shared_key);
+    return result;
+}
+
+static int run_calculate_signature(void *fixture)
+{
+    curve_fixture *f = fixture;
+    signal_buffer *signature = 0;
+    int result;
+
+    result = curve_calculate_signature(bench_context, &signature,
+            ec_key_pair_get_private(f->local_key_pair),
+            ec_public_key_get_serialized(ec_key_pair_get_public(f->remote_key_pair)),
+            EC_PUBLIC_KEY_SERIALIZED_LENGTH);
+    signal_buffer_free(signature);
+    return result;
+}
+
+static int run_verify_signature(void *fixture)
+{
+    curve_fixture *f = fixture;
+    int result = 0;
+    int i;
+
+    for(i = 0; i < SIGNATURE_BATCH && result >= 0; i++) {
+        curve_signature_batch_entry *entry = &f->entries[i];
+        result = curve_verify_signature(entry->signing_key,
+                entry->message_data, entry->message_len,
+                entry->signature_data, entry->signature_len);
+        result = result == 1 ? 0 : SG_ERR_INVALID_MESSAGE;
+    }
+    return result;
+}
+
+static int run_verify_signature_batch(void *fixture)
+{
+    curve_fixture *f = fixture;
+    int result;
+
+    result = curve_verify_signature_batch(bench_context, f->entries, SIGNATURE_BATCH);
+    return result == 1 ? 0 : SG_ERR_INVALID_MESSAGE;
+}
+
+const bench_definition bench_curve_definitions[] = {
+    {"curve/generate_key_pair", 500, 1, curve_fixture_setup, run_generate_key_pair, curve_fixture_teardown},
+    {"curve/generate_key_pair_buffered", 500, 1, curve_buffered_fixture_setup, run_generate_key_pair, curve_buffered_fixture_teardown},
+    {"curve/calculate_agreement", 500, 1, curve_fixture_setup, run_calculate_agreement, curve_fixture_teardown},
+    {"curve/calculate_signature", 500, 1, curve_fixture_setup, run_calculate_signature, curve_fixture_teardown},
+    {"curve/calculate_signature_buffered", 500, 1, curve_buffered_fixture_setup, run_calculate_signature, curve_buffered_fixture_teardown},
+    {"curve/verify_signature", 20, SIGNATURE_BATCH, curve_fixture_setup, run_verify_signature, curve_fixture_teardown},
+    {"curve/verify_signature_batch", 20, SIGNATURE_BATCH, curve_fixture_setup, run_verify_signature_batch, curve_fixture_teardown},
+    {0, 0, 0, 0, 0, 0}
+};
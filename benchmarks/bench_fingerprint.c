@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "curve.h"
+#include "fingerprint.h"
+
+typedef struct {
+    fingerprint_generator *generator;
+    ec_key_pair *local_key_pair;
+    ec_key_pair *remote_key_pair;
+} fingerprint_fixture;
+
+static void fingerprint_fixture_teardown(void *fixture)
+{
+    fingerprint_fixture *f = fixture;
+    fingerprint_generator_free(f->generator);
+    SIGNAL_UNREF(f->local_key_pair);
+    SIGNAL_UNREF(f->remote_key_pair);
+    free(f);
+}
+
+static int fingerprint_fixture_setup(void **fixture)
+{
+    int result = 0;
+    fingerprint_fixture *f = malloc(sizeof(fingerprint_fixture));
+    if(!f) {
+        return SG_ERR_NOMEM;
+    }
+    memset(f, 0, sizeof(fingerprint_fixture));
+
+    result = fingerprint_generator_create(&f->generator, 5200, 1, bench_context);
+    if(result >= 0) {
+        result = curve_generate_key_pair(bench_context, &f->local_key_pair);
+    }
+    if(result >= 0) {
+        result = curve_generate_key_pair(bench_context, &f->remote_key_pair);
+    }
+
+    if(result < 0) {
+        fingerprint_fixture_teardown(f);
+    }
+    else {
+        *fixture = f;
+    }
+    return result;
+}
+
+static int run_create_for(void *fixture)
+{
+    fingerprint_fixture *f = fixture;
+    fingerprint *result_fingerprint = 0;
+    int result;
+
+    result = fingerprint_generator_create_for(f->generator,
+            "+14152222222", ec_key_pair_get_public(f->local_key_pair),
+            "+14153333333", ec_key_pair_get_public(f->remote_key_pair),
+            &result_fingerprint);
+    SIGNAL_UNREF(result_fingerprint);
+    return result;
+}
+
+const bench_definition bench_fingerprint_definitions[] = {
+    {"fingerprint/create_for", 50, 1, fingerprint_fixture_setup, run_create_for, fingerprint_fixture_teardown},
+    {0, 0, 0, 0, 0, 0}
+};
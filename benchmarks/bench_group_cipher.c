@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "protocol.h"
+#include "group_cipher.h"
+#include "group_session_builder.h"
+
+#define ITERATION_GAP 1000
+#define SKIPPED_KEY_CHECKPOINT_INTERVAL 32
+#define QUEUE_LENGTH 32
+
+typedef struct {
+    signal_protocol_store_context *alice_store;
+    signal_protocol_store_context *bob_store;
+    group_cipher *alice_cipher;
+    group_cipher *bob_cipher;
+} group_cipher_fixture;
+
+static const signal_protocol_sender_key_name sender_key_name = {
+    "nihilist history reading group", 30,
+    {"+14150001111", 12, 1}
+};
+
+static const uint8_t message[160] = {0};
+
+static void group_cipher_fixture_teardown(void *fixture)
+{
+    group_cipher_fixture *f = fixture;
+    group_cipher_free(f->alice_cipher);
+    group_cipher_free(f->bob_cipher);
+    signal_protocol_store_context_destroy(f->alice_store);
+    signal_protocol_store_context_destroy(f->bob_store);
+    free(f);
+}
+
+static int group_cipher_fixture_setup(void **fixture)
+{
+    int result = 0;
+    group_session_builder *alice_builder = 0;
+    group_session_builder *bob_builder = 0;
+    sender_key_distribution_message *sent = 0;
+    sender_key_distribution_message *received = 0;
+    signal_buffer *serialized = 0;
+    group_cipher_fixture *f = malloc(sizeof(group_cipher_fixture));
+    if(!f) {
+        return SG_ERR_NOMEM;
+    }
+    memset(f, 0, sizeof(group_cipher_fixture));
+
+    result = bench_create_store(&f->alice_store);
+    if(result < 0) {
+        goto complete;
+    }
+    result = bench_create_store(&f->bob_store);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = group_session_builder_create(&alice_builder, f->alice_store, bench_context);
+    if(result < 0) {
+        goto complete;
+    }
+    result = group_session_builder_create(&bob_builder, f->bob_store, bench_context);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = group_session_builder_create_session(alice_builder, &sent, &sender_key_name);
+    if(result < 0) {
+        goto complete;
+    }
+    serialized = ciphertext_message_get_serialized((ciphertext_message *)sent);
+    result = sender_key_distribution_message_deserialize(&received,
+            signal_buffer_data(serialized), signal_buffer_len(serialized), bench_context);
+    if(result < 0) {
+        goto complete;
+    }
+    result = group_session_builder_process_session(bob_builder, &sender_key_name, received);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = group_cipher_create(&f->alice_cipher, f->alice_store, &sender_key_name, bench_context);
+    if(result < 0) {
+        goto complete;
+    }
+    result = group_cipher_create(&f->bob_cipher, f->bob_store, &sender_key_name, bench_context);
+
+complete:
+    SIGNAL_UNREF(sent);
+    SIGNAL_UNREF(received);
+    group_session_builder_free(alice_builder);
+    group_session_builder_free(bob_builder);
+    if(result < 0) {
+        group_cipher_fixture_teardown(f);
+    }
+    else {
+        *fixture = f;
+    }
+    return result;
+}
+
+static int encrypt_serialized(group_cipher *cipher, signal_buffer **serialized)
+{
+    int result;
+    ciphertext_message *encrypted = 0;
+
+    result = group_cipher_encrypt(cipher, message, sizeof(message), &encrypted);
+    if(result < 0) {
+        return result;
+    }
+    *serialized = signal_buffer_copy(ciphertext_message_get_serialized(encrypted));
+    SIGNAL_UNREF(encrypted);
+    return *serialized ? 0 : SG_ERR_NOMEM;
+}
+
+static int decrypt_serialized(group_cipher *cipher, const signal_buffer *serialized)
+{
+    int result;
+    sender_key_message *incoming = 0;
+    signal_buffer *plaintext = 0;
+
+    result = sender_key_message_deserialize(&incoming,
+            signal_buffer_const_data(serialized), signal_buffer_len(serialized), bench_context);
+    if(result < 0) {
+        return result;
+    }
+    result = group_cipher_decrypt(cipher, incoming, 0, &plaintext);
+    signal_buffer_free(plaintext);
+    SIGNAL_UNREF(incoming);
+    return result;
+}
+
+static int run_round_trip(void *fixture)
+{
+    group_cipher_fixture *f = fixture;
+    signal_buffer *serialized = 0;
+    int result;
+
+    result = encrypt_serialized(f->alice_cipher, &serialized);
+    if(result >= 0) {
+        result = decrypt_serialized(f->bob_cipher, serialized);
+    }
+    signal_buffer_free(serialized);
+    return result;
+}
+
+static int run_iteration_gap(void *fixture)
+{
+    group_cipher_fixture *f = fixture;
+    signal_buffer *serialized = 0;
+    int result = 0;
+    int i;
+
+    /* Only the last message is delivered, so the receiver derives every key in between */
+    bench_pause_timing();
+    for(i = 0; i < ITERATION_GAP && result >= 0; i++) {
+        signal_buffer_free(serialized);
+        serialized = 0;
+        result = encrypt_serialized(f->alice_cipher, &serialized);
+    }
+    bench_resume_timing();
+
+    if(result >= 0) {
+        result = decrypt_serialized(f->bob_cipher, serialized);
+    }
+    signal_buffer_free(serialized);
+    return result;
+}
+
+static int decrypt_queue(void *fixture, int batch)
+{
+    group_cipher_fixture *f = fixture;
+    sender_key_message *incoming[QUEUE_LENGTH];
+    signal_buffer *plaintexts[QUEUE_LENGTH];
+    int result = 0;
+    int count;
+    int i;
+
+    /* A backlog of messages from one sender, as after coming back online */
+    bench_pause_timing();
+    for(count = 0; count < QUEUE_LENGTH && result >= 0; count++) {
+        signal_buffer *serialized = 0;
+        result = encrypt_serialized(f->alice_cipher, &serialized);
+        if(result >= 0) {
+            result = sender_key_message_deserialize(&incoming[count],
+                    signal_buffer_const_data(serialized), signal_buffer_len(serialized), bench_context);
+        }
+        signal_buffer_free(serialized);
+        if(result < 0) {
+            break;
+        }
+    }
+    bench_resume_timing();
+
+    memset(plaintexts, 0, sizeof(plaintexts));
+    if(result >= 0 && batch) {
+        result = group_cipher_decrypt_batch(f->bob_cipher, incoming, count, 0, plaintexts);
+    }
+    for(i = 0; result >= 0 && !batch && i < count; i++) {
+        result = group_cipher_decrypt(f->bob_cipher, incoming[i], 0, &plaintexts[i]);
+    }
+
+    for(i = 0; i < count; i++) {
+        signal_buffer_free(plaintexts[i]);
+        SIGNAL_UNREF(incoming[i]);
+    }
+    return result;
+}
+
+static int run_decrypt_queue(void *fixture)
+{
+    return decrypt_queue(fixture, 0);
+}
+
+static int run_decrypt_queue_batch(void *fixture)
+{
+    return decrypt_queue(fixture, 1);
+}
+
+static void group_cipher_checkpoints_fixture_teardown(void *fixture)
+{
+    group_cipher_fixture_teardown(fixture);
+    signal_context_set_skipped_key_checkpoint_interval(bench_context, 0);
+}
+
+static int group_cipher_checkpoints_fixture_setup(void **fixture)
+{
+    int result = signal_context_set_skipped_key_checkpoint_interval(bench_context, SKIPPED_KEY_CHECKPOINT_INTERVAL);
+    if(result < 0) {
+        return result;
+    }
+    result = group_cipher_fixture_setup(fixture);
+    if(result < 0) {
+        signal_context_set_skipped_key_checkpoint_interval(bench_context, 0);
+    }
+    return result;
+}
+
+const bench_definition bench_group_cipher_definitions[] = {
+    {"group_cipher/round_trip", 20000, 1, group_cipher_fixture_setup, run_round_trip, group_cipher_fixture_teardown},
+    {"group_cipher/decrypt_queue", 50, QUEUE_LENGTH, group_cipher_fixture_setup, run_decrypt_queue, group_cipher_fixture_teardown},
+    {"group_cipher/decrypt_queue_batch", 50, QUEUE_LENGTH, group_cipher_fixture_setup, run_decrypt_queue_batch, group_cipher_fixture_teardown},
+    {"group_cipher/iteration_gap", 50, 1, group_cipher_fixture_setup, run_iteration_gap, group_cipher_fixture_teardown},
+    {"group_cipher/iteration_gap_checkpoints", 50, 1, group_cipher_checkpoints_fixture_setup, run_iteration_gap, group_cipher_checkpoints_fixture_teardown},
+    {0, 0, 0, 0, 0, 0}
+};
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench_common.h"
+#include "test_common.h"
+
+#ifdef BENCH_CRYPTO_BUILTIN
+#include "signal_crypto_builtin.h"
+#endif
+
+static const bench_definition *bench_suites[] = {
+    bench_session_cipher_definitions,
+    bench_session_builder_definitions,
+    bench_group_cipher_definitions,
+    bench_ratchet_definitions,
+    bench_session_record_definitions,
+    bench_fingerprint_definitions,
+    bench_curve_definitions,
+    0
+};
+
+typedef struct bench_result {
+    const char *name;
+    uint64_t iterations;
+    uint32_t ops_per_run;
+    double ns_per_op;
+    double min_ns;
+    double p50_ns;
+    double p90_ns;
+    double p99_ns;
+    double max_ns;
+    double allocs_per_op;
+    double bytes_per_op;
+} bench_result;
+
+static uint64_t bench_paused_at = 0;
+static uint64_t bench_paused_ns = 0;
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void bench_pause_timing(void)
+{
+    bench_alloc_set_counting(0);
+    bench_paused_at = bench_now_ns();
+}
+
+void bench_resume_timing(void)
+{
+    bench_paused_ns += bench_now_ns() - bench_paused_at;
+    bench_alloc_set_counting(1);
+}
+
+static int bench_compare_samples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double bench_percentile(const uint64_t *sorted, uint64_t count, double fraction)
+{
+    uint64_t index = (uint64_t)(fraction * (double)(count - 1) + 0.5);
+    return (double)sorted[index];
+}
+
+static int bench_run(const bench_definition *definition, uint64_t iterations, bench_result *result)
+{
+    int ret = 0;
+    void *fixture = 0;
+    uint64_t *samples = 0;
+    uint64_t warmup;
+    uint64_t total_ns = 0;
+    uint64_t alloc_count_start, alloc_bytes_start;
+    uint64_t alloc_count_end, alloc_bytes_end;
+    double ops = (double)definition->ops_per_run;
+    uint64_t i;
+
+    samples = malloc(sizeof(uint64_t) * iterations);
+    if(!samples) {
+        return SG_ERR_NOMEM;
+    }
+
+    ret = definition->setup(&fixture);
+    if(ret < 0) {
+        fprintf(stderr, "%s: setup failed (%d)\n", definition->name, ret);
+        free(samples);
+        return ret;
+    }
+
+    warmup = iterations / 10 > 0 ? iterations / 10 : 1;
+    for(i = 0; i < warmup && ret >= 0; i++) {
+        ret = definition->run(fixture);
+    }
+    bench_alloc_set_counting(0);
+
+    bench_alloc_get_counts(&alloc_count_start, &alloc_bytes_start);
+    for(i = 0; i < iterations && ret >= 0; i++) {
+        uint64_t start;
+        bench_paused_ns = 0;
+        bench_alloc_set_counting(1);
+        start = bench_now_ns();
+        ret = definition->run(fixture);
+        samples[i] = bench_now_ns() - start - bench_paused_ns;
+        bench_alloc_set_counting(0);
+        total_ns += samples[i];
+    }
+    bench_alloc_get_counts(&alloc_count_end, &alloc_bytes_end);
+
+    definition->teardown(fixture);
+
+    if(ret < 0) {
+        fprintf(stderr, "%s: run failed (%d)\n", definition->name, ret);
+        free(samples);
+        return ret;
+    }
+
+    qsort(samples, iterations, sizeof(uint64_t), bench_compare_samples);
+
+    result->name = definition->name;
+    result->iterations = iterations;
+    result->ops_per_run = definition->ops_per_run;
+    result->ns_per_op = (double)total_ns / (double)iterations / ops;
+    result->min_ns = (double)samples[0] / ops;
+    result->p50_ns = bench_percentile(samples, iterations, 0.50) / ops;
+    result->p90_ns = bench_percentile(samples, iterations, 0.90) / ops;
+    result->p99_ns = bench_percentile(samples, iterations, 0.99) / ops;
+    result->max_ns = (double)samples[iterations - 1] / ops;
+    if(bench_alloc_counting_supported()) {
+        result->allocs_per_op = (double)(alloc_count_end - alloc_count_start) / (double)iterations / ops;
+        result->bytes_per_op = (double)(alloc_bytes_end - alloc_bytes_start) / (double)iterations / ops;
+    }
+    else {
+        result->allocs_per_op = -1;
+        result->bytes_per_op = -1;
+    }
+
+    free(samples);
+    return 0;
+}
+
+static void bench_write_json(FILE *out, const bench_result *results, size_t count, const char *crypto)
+{
+    size_t i;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"crypto_provider\": \"%s\",\n", crypto);
+    fprintf(out, "  \"allocation_counting\": %s,\n", bench_alloc_counting_supported() ? "true" : "false");
+    fprintf(out, "  \"benchmarks\": [\n");
+    for(i = 0; i < count; i++) {
+        const bench_result *r = &results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"iterations\": %llu, \"ops_per_iteration\": %u, "
+                "\"ns_per_op\": %.1f, \"ops_per_sec\": %.1f, "
+                "\"min_ns\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, \"max_ns\": %.1f, ",
+                r->name, (unsigned long long)r->iterations, r->ops_per_run,
+                r->ns_per_op, r->ns_per_op > 0 ? 1e9 / r->ns_per_op : 0.0,
+                r->min_ns, r->p50_ns, r->p90_ns, r->p99_ns, r->max_ns);
+        if(r->allocs_per_op >= 0) {
+            fprintf(out, "\"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f}", r->allocs_per_op, r->bytes_per_op);
+        }
+        else {
+            fprintf(out, "\"allocs_per_op\": null, \"bytes_per_op\": null}");
+        }
+        fprintf(out, "%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+static void bench_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  --filter TEXT     only run benchmarks whose name contains TEXT\n");
+    fprintf(stderr, "  --iterations N    override the iteration count of every benchmark\n");
+    fprintf(stderr, "  --json FILE       write the results as JSON to FILE instead of stdout\n");
+#ifdef BENCH_CRYPTO_BUILTIN
+    fprintf(stderr, "  --crypto NAME     crypto provider to use, \"test\" or \"builtin\"\n");
+#endif
+    fprintf(stderr, "  --list            list the benchmarks and exit\n");
+}
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+    const char *filter = 0;
+    const char *json_path = 0;
+    const char *crypto = "test";
+    uint64_t iterations_override = 0;
+    int list_only = 0;
+    bench_result *results = 0;
+    size_t result_count = 0;
+    size_t definition_count = 0;
+    FILE *json_out = stdout;
+    int i;
+    size_t suite, n;
+
+    for(i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        }
+        else if(strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations_override = strtoull(argv[++i], 0, 10);
+        }
+        else if(strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        }
+#ifdef BENCH_CRYPTO_BUILTIN
+        else if(strcmp(argv[i], "--crypto") == 0 && i + 1 < argc) {
+            crypto = argv[++i];
+        }
+#endif
+        else if(strcmp(argv[i], "--list") == 0) {
+            list_only = 1;
+        }
+        else if(strcmp(argv[i], "--help") == 0) {
+            bench_usage(argv[0]);
+            return EXIT_SUCCESS;
+        }
+        else {
+            bench_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for(suite = 0; bench_suites[suite]; suite++) {
+        for(n = 0; bench_suites[suite][n].name; n++) {
+            definition_count++;
+        }
+    }
+
+    if(list_only) {
+        for(suite = 0; bench_suites[suite]; suite++) {
+            for(n = 0; bench_suites[suite][n].name; n++) {
+                printf("%s\n", bench_suites[suite][n].name);
+            }
+        }
+        return EXIT_SUCCESS;
+    }
+
+    result = signal_context_create(&bench_context, 0);
+    if(result < 0) {
+        return EXIT_FAILURE;
+    }
+    if(strcmp(crypto, "test") == 0) {
+        setup_test_crypto_provider(bench_context);
+    }
+#ifdef BENCH_CRYPTO_BUILTIN
+    else if(strcmp(crypto, "builtin") == 0) {
+        signal_context_set_builtin_crypto_provider(bench_context);
+    }
+#endif
+    else {
+        bench_usage(argv[0]);
+        signal_context_destroy(bench_context);
+        return EXIT_FAILURE;
+    }
+
+    results = malloc(sizeof(bench_result) * definition_count);
+    if(!results) {
+        signal_context_destroy(bench_context);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "%-44s %12s %12s %12s %10s %12s\n", "benchmark", "ns/op", "p50 ns", "p99 ns", "allocs/op", "bytes/op");
+    for(suite = 0; bench_suites[suite] && result >= 0; suite++) {
+        for(n = 0; bench_suites[suite][n].name && result >= 0; n++) {
+            const bench_definition *definition = &bench_suites[suite][n];
+            bench_result *r = &results[result_count];
+
+            if(filter && !strstr(definition->name, filter)) {
+                continue;
+            }
+
+            result = bench_run(definition, iterations_override ? iterations_override : definition->iterations, r);
+            if(result < 0) {
+                break;
+            }
+            result_count++;
+
+            fprintf(stderr, "%-44s %12.0f %12.0f %12.0f %10.1f %12.0f\n",
+                    r->name, r->ns_per_op, r->p50_ns, r->p99_ns, r->allocs_per_op, r->bytes_per_op);
+        }
+    }
+
+    if(result >= 0) {
+        if(json_path) {
+            json_out = fopen(json_path, "w");
+            if(!json_out) {
+                fprintf(stderr, "Unable to open %s\n", json_path);
+                result = -1;
+            }
+        }
+        if(json_out) {
+            bench_write_json(json_out, results, result_count, crypto);
+            if(json_out != stdout) {
+                fclose(json_out);
+            }
+        }
+    }
+
+    free(results);
+    signal_context_destroy(bench_context);
+    return result >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "hkdf.h"
+#include "ratchet.h"
+
+#define CHAIN_STEPS 100
+
+typedef struct {
+    hkdf_context *kdf;
+    ratchet_chain_key *chain_key;
+} ratchet_fixture;
+
+static void ratchet_fixture_teardown(void *fixture)
+{
+    ratchet_fixture *f = fixture;
+    SIGNAL_UNREF(f->chain_key);
+    SIGNAL_UNREF(f->kdf);
+    free(f);
+}
+
+static int ratchet_fixture_setup(void **fixture)
+{
+    static const uint8_t seed[32] = {
+            0x8a, 0xb7, 0x2d, 0x6f, 0x4c, 0xc5, 0xac, 0x0d,
+            0x38, 0x7e, 0xaf, 0x46, 0x33, 0x78, 0xdd, 0xb2,
+            0x8e, 0xdd, 0x07, 0x38, 0x5b, 0x1c, 0xb0, 0x12,
+            0x50, 0xc7, 0x15, 0x98, 0x2e, 0x7a, 0xd4, 0x8f};
+    int result = 0;
+    ratchet_fixture *f = malloc(sizeof(ratchet_fixture));
+    if(!f) {
+        return SG_ERR_NOMEM;
+    }
+    memset(f, 0, sizeof(ratchet_fixture));
+
+    result = hkdf_create(&f->kdf, 3, bench_context);
+    if(result >= 0) {
+        result = ratchet_chain_key_create(&f->chain_key, f->kdf, seed, sizeof(seed), 0, bench_context);
+    }
+
+    if(result < 0) {
+        ratchet_fixture_teardown(f);
+    }
+    else {
+        *fixture = f;
+    }
+    return result;
+}
+
+static int run_chain_key_create_next(void *fixture)
+{
+    ratchet_fixture *f = fixture;
+    int result = 0;
+    int i;
+
+    for(i = 0; i < CHAIN_STEPS; i++) {
+        ratchet_chain_key *next = 0;
+        result = ratchet_chain_key_create_next(f->chain_key, &next);
+        if(result < 0) {
+            break;
+        }
+        SIGNAL_UNREF(f->chain_key);
+        f->chain_key = next;
+    }
+    return result;
+}
+
+const bench_definition bench_ratchet_definitions[] = {
+    {"ratchet/chain_key_create_next", 2000, CHAIN_STEPS, ratchet_fixture_setup, run_chain_key_create_next, ratchet_fixture_teardown},
+    {0, 0, 0, 0, 0, 0}
+};
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "session_pre_key.h"
+#include "session_builder.h"
+
+typedef struct {
+    signal_protocol_store_context *alice_store;
+    signal_protocol_store_context *bob_store;
+    session_builder *builder;
+    session_pre_key_bundle *bundle;
+} session_builder_fixture;
+
+static const signal_protocol_address bob_address = {"+14158888888", 12, 1};
+
+static void session_builder_fixture_teardown(void *fixture)
+{
+    session_builder_fixture *f = fixture;
+    SIGNAL_UNREF(f->bundle);
+    session_builder_free(f->builder);
+    signal_protocol_store_context_destroy(f->alice_store);
+    signal_protocol_store_context_destroy(f->bob_store);
+    free(f);
+}
+
+static int session_builder_fixture_setup(void **fixture)
+{
+    int result = 0;
+    session_builder_fixture *f = malloc(sizeof(session_builder_fixture));
+    if(!f) {
+        return SG_ERR_NOMEM;
+    }
+    memset(f, 0, sizeof(session_builder_fixture));
+
+    result = bench_create_store(&f->alice_store);
+    if(result < 0) {
+        goto complete;
+    }
+    result = bench_create_store(&f->bob_store);
+    if(result < 0) {
+        goto complete;
+    }
+    result = bench_create_pre_key_bundle(&f->bundle, f->bob_store, 31337);
+    if(result < 0) {
+        goto complete;
+    }
+    result = session_builder_create(&f->builder, f->alice_store, &bob_address, bench_context);
+
+complete:
+    if(result < 0) {
+        session_builder_fixture_teardown(f);
+    }
+    else {
+        *fixture = f;
+    }
+    return result;
+}
+
+static int run_process_pre_key_bundle(void *fixture)
+{
+    session_builder_fixture *f = fixture;
+
+    /* Each run archives the previous state, so the record stays at its maximum size */
+    return session_builder_process_pre_key_bundle(f->builder, f->bundle);
+}
+
+const bench_definition bench_session_builder_definitions[] = {
+    {"session_builder/process_pre_key_bundle", 2000, 1, session_builder_fixture_setup, run_process_pre_key_bundle, session_builder_fixture_teardown},
+    {0, 0, 0, 0, 0, 0}
+};
@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "protocol.h"
+#include "session_cipher.h"
+
+#define OUT_OF_ORDER_BURST 32
+#define SKIPPED_KEY_BURST 1000
+#define SKIPPED_KEY_CHECKPOINT_INTERVAL 32
+#define ARCHIVED_SESSIONS 40
+
+typedef struct {
+    signal_protocol_store_context *alice_store;
+    signal_protocol_store_context *bob_store;
+    session_cipher *alice_cipher;
+    session_cipher *bob_cipher;
+    signal_buffer *burst[SKIPPED_KEY_BURST];
+    session_record *bob_record;
+    signal_buffer *archived_message;
+} session_cipher_fixture;
+
+static const signal_protocol_address alice_address = {"+14159999999", 12, 1};
+static const signal_protocol_address bob_address = {"+14158888888", 12, 1};
+
+/* A typical padded message body */
+static const uint8_t message[160] = {0};
+
+static void session_cipher_fixture_teardown(void *fixture)
+{
+    session_cipher_fixture *f = fixture;
+    SIGNAL_UNREF(f->bob_record);
+    signal_buffer_free(f->archived_message);
+    session_cipher_free(f->alice_cipher);
+    session_cipher_free(f->bob_cipher);
+    signal_protocol_store_context_destroy(f->alice_store);
+    signal_protocol_store_context_destroy(f->bob_store);
+    free(f);
+}
+
+static int session_cipher_fixture_setup(void **fixture)
+{
+    int result = 0;
+    session_cipher_fixture *f = malloc(sizeof(session_cipher_fixture));
+    if(!f) {
+        return SG_ERR_NOMEM;
+    }
+    memset(f, 0, sizeof(session_cipher_fixture));
+
+    result = bench_create_store(&f->alice_store);
+    if(result < 0) {
+        goto complete;
+    }
+    result = bench_create_store(&f->bob_store);
+    if(result < 0) {
+        goto complete;
+    }
+    result = bench_establish_session(f->alice_store, &alice_address, f->bob_store, &bob_address);
+    if(result < 0) {
+        goto complete;
+    }
+    result = session_cipher_create(&f->alice_cipher, f->alice_store, &bob_address, bench_context);
+    if(result < 0) {
+        goto complete;
+    }
+    result = session_cipher_create(&f->bob_cipher, f->bob_store, &alice_address, bench_context);
+
+complete:
+    if(result < 0) {
+        session_cipher_fixture_teardown(f);
+    }
+    else {
+        *fixture = f;
+    }
+    return result;
+}
+
+static void session_cipher_checkpoints_fixture_teardown(void *fixture)
+{
+    session_cipher_fixture_teardown(fixture);
+    signal_context_set_skipped_key_checkpoint_interval(bench_context, 0);
+}
+
+static int session_cipher_checkpoints_fixture_setup(void **fixture)
+{
+    int result = signal_context_set_skipped_key_checkpoint_interval(bench_context, SKIPPED_KEY_CHECKPOINT_INTERVAL);
+    if(result < 0) {
+        return result;
+    }
+    result = session_cipher_fixture_setup(fixture);
+    if(result < 0) {
+        signal_context_set_skipped_key_checkpoint_interval(bench_context, 0);
+    }
+    return result;
+}
+
+static int encrypt_serialized(session_cipher *cipher, signal_buffer **serialized);
+static int decrypt_serialized(session_cipher *cipher, const signal_buffer *serialized);
+
+static int session_cipher_archived_fixture_setup(void **fixture)
+{
+    int result = 0;
+    int i;
+    session_record *alice_record = 0;
+    session_cipher_fixture *f = 0;
+
+    result = session_cipher_fixture_setup(fixture);
+    if(result < 0) {
+        return result;
+    }
+    f = *fixture;
+
+    /* Let Bob receive on Alice's current ratchet key, so that the archived session has a chain for it */
+    result = encrypt_serialized(f->alice_cipher, &f->archived_message);
+    if(result >= 0) {
+        result = decrypt_serialized(f->bob_cipher, f->archived_message);
+    }
+    signal_buffer_free(f->archived_message);
+    f->archived_message = 0;
+    if(result < 0) {
+        goto complete;
+    }
+
+    /* Keep Alice's side of the first session, then replace it on both sides */
+    result = signal_protocol_session_load_session(f->alice_store, &alice_record, &bob_address);
+    if(result < 0) {
+        goto complete;
+    }
+    for(i = 1; i < ARCHIVED_SESSIONS; i++) {
+        result = bench_establish_session(f->alice_store, &alice_address, f->bob_store, &bob_address);
+        if(result < 0) {
+            goto complete;
+        }
+    }
+
+    /* Alice sends on the first session, which Bob has archived behind all of the others */
+    result = signal_protocol_session_store_session(f->alice_store, &bob_address, alice_record);
+    if(result < 0) {
+        goto complete;
+    }
+    result = encrypt_serialized(f->alice_cipher, &f->archived_message);
+    if(result < 0) {
+        goto complete;
+    }
+    result = signal_protocol_session_load_session(f->bob_store, &f->bob_record, &alice_address);
+
+complete:
+    SIGNAL_UNREF(alice_record);
+    if(result < 0) {
+        session_cipher_fixture_teardown(f);
+        *fixture = 0;
+    }
+    return result;
+}
+
+static int encrypt_serialized(session_cipher *cipher, signal_buffer **serialized)
+{
+    int result;
+    ciphertext_message *encrypted = 0;
+
+    result = session_cipher_encrypt(cipher, message, sizeof(message), &encrypted);
+    if(result < 0) {
+        return result;
+    }
+    *serialized = signal_buffer_copy(ciphertext_message_get_serialized(encrypted));
+    SIGNAL_UNREF(encrypted);
+    return *serialized ? 0 : SG_ERR_NOMEM;
+}
+
+static int decrypt_serialized(session_cipher *cipher, const signal_buffer *serialized)
+{
+    int result;
+    signal_message *incoming = 0;
+    signal_buffer *plaintext = 0;
+
+    result = signal_message_deserialize(&incoming,
+            signal_buffer_const_data(serialized), signal_buffer_len(serialized), bench_context);
+    if(result < 0) {
+        return result;
+    }
+    result = session_cipher_decrypt_signal_message(cipher, incoming, 0, &plaintext);
+    signal_buffer_free(plaintext);
+    SIGNAL_UNREF(incoming);
+    return result;
+}
+
+static int run_encrypt(void *fixture)
+{
+    session_cipher_fixture *f = fixture;
+    ciphertext_message *encrypted = 0;
+    int result;
+
+    result = session_cipher_encrypt(f->alice_cipher, message, sizeof(message), &encrypted);
+    SIGNAL_UNREF(encrypted);
+    return result;
+}
+
+static int run_decrypt(void *fixture)
+{
+    session_cipher_fixture *f = fixture;
+    signal_buffer *serialized = 0;
+    int result;
+
+    bench_pause_timing();
+    result = encrypt_serialized(f->alice_cipher, &serialized);
+    bench_resume_timing();
+    if(result < 0) {
+        return result;
+    }
+
+    result = decrypt_serialized(f->bob_cipher, serialized);
+    signal_buffer_free(serialized);
+    return result;
+}
+
+static int run_decrypt_archived(void *fixture)
+{
+    session_cipher_fixture *f = fixture;
+    int result;
+
+    /* Decrypting promotes the archived state, so start from the same record every time */
+    bench_pause_timing();
+    result = signal_protocol_session_store_session(f->bob_store, &alice_address, f->bob_record);
+    bench_resume_timing();
+    if(result < 0) {
+        return result;
+    }
+
+    return decrypt_serialized(f->bob_cipher, f->archived_message);
+}
+
+static int run_round_trip(void *fixture)
+{
+    session_cipher_fixture *f = fixture;
+    signal_buffer *serialized = 0;
+    int result;
+
+    /* Replying in both directions steps the DH ratchet every time */
+    result = encrypt_serialized(f->alice_cipher, &serialized);
+    if(result >= 0) {
+        result = decrypt_serialized(f->bob_cipher, serialized);
+        signal_buffer_free(serialized);
+        serialized = 0;
+    }
+    if(result >= 0) {
+        result = encrypt_serialized(f->bob_cipher, &serialized);
+    }
+    if(result >= 0) {
+        result = decrypt_serialized(f->alice_cipher, serialized);
+        signal_buffer_free(serialized);
+    }
+    return result;
+}
+
+static int run_burst(session_cipher_fixture *f, size_t count, int skip_to_last)
+{
+    int result = 0;
+    size_t i;
+
+    bench_pause_timing();
+    for(i = 0; i < count && result >= 0; i++) {
+        result = encrypt_serialized(f->alice_cipher, &f->burst[i]);
+    }
+    if(result >= 0) {
+        if(skip_to_last) {
+            /* The newest message first, leaving a skipped key for every other one */
+            signal_buffer *last = f->burst[count - 1];
+            memmove(&f->burst[1], &f->burst[0], sizeof(signal_buffer *) * (count - 1));
+            f->burst[0] = last;
+            bench_shuffle_buffers(&f->burst[1], count - 1);
+        }
+        else {
+            bench_shuffle_buffers(f->burst, count);
+        }
+    }
+    bench_resume_timing();
+
+    for(i = 0; i < count && result >= 0; i++) {
+        result = decrypt_serialized(f->bob_cipher, f->burst[i]);
+    }
+
+    for(i = 0; i < count; i++) {
+        signal_buffer_free(f->burst[i]);
+        f->burst[i] = 0;
+    }
+    return result;
+}
+
+static int run_out_of_order(void *fixture)
+{
+    return run_burst(fixture, OUT_OF_ORDER_BURST, 0);
+}
+
+static int run_skipped_key_burst(void *fixture)
+{
+    return run_burst(fixture, SKIPPED_KEY_BURST, 1);
+}
+
+const bench_definition bench_session_cipher_definitions[] = {
+    {"session_cipher/encrypt", 20000, 1, session_cipher_fixture_setup, run_encrypt, session_cipher_fixture_teardown},
+    {"session_cipher/decrypt", 20000, 1, session_cipher_fixture_setup, run_decrypt, session_cipher_fixture_teardown},
+    {"session_cipher/decrypt_archived", 500, 1, session_cipher_archived_fixture_setup, run_decrypt_archived, session_cipher_fixture_teardown},
+    {"session_cipher/round_trip", 2000, 2, session_cipher_fixture_setup, run_round_trip, session_cipher_fixture_teardown},
+    {"session_cipher/out_of_order", 300, OUT_OF_ORDER_BURST, session_cipher_fixture_setup, run_out_of_order, session_cipher_fixture_teardown},
+    {"session_cipher/skipped_key_burst", 20, SKIPPED_KEY_BURST, session_cipher_fixture_setup, run_skipped_key_burst, session_cipher_fixture_teardown},
+    {"session_cipher/skipped_key_burst_checkpoints", 20, SKIPPED_KEY_BURST, session_cipher_checkpoints_fixture_setup, run_skipped_key_burst, session_cipher_checkpoints_fixture_teardown},
+    {0, 0, 0, 0, 0, 0}
+};
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_common.h"
+#include "session_record.h"
+#include "session_state.h"
+
+#define ARCHIVED_STATES 40
+
+typedef struct {
+    session_record *record;
+    signal_buffer *serialized;
+} session_record_fixture;
+
+static const signal_protocol_address alice_address = {"+14159999999", 12, 1};
+static const signal_protocol_address bob_address = {"+14158888888", 12, 1};
+
+static void session_record_fixture_teardown(void *fixture)
+{
+    session_record_fixture *f = fixture;
+    SIGNAL_UNREF(f->record);
+    signal_buffer_free(f->serialized);
+    free(f);
+}
+
+static int session_record_fixture_setup(void **fixture)
+{
+    int result = 0;
+    int i;
+    signal_protocol_store_context *alice_store = 0;
+    signal_protocol_store_context *bob_store = 0;
+    session_record_fixture *f = malloc(sizeof(session_record_fixture));
+    if(!f) {
+        return SG_ERR_NOMEM;
+    }
+    memset(f, 0, sizeof(session_record_fixture));
+
+    result = bench_create_store(&alice_store);
+    if(result < 0) {
+        goto complete;
+    }
+    result = bench_create_store(&bob_store);
+    if(result < 0) {
+        goto complete;
+    }
+    result = bench_establish_session(alice_store, &alice_address, bob_store, &bob_address);
+    if(result < 0) {
+        goto complete;
+    }
+    result = signal_protocol_session_load_session(alice_store, &f->record, &bob_address);
+    if(result < 0) {
+        goto complete;
+    }
+
+    /* Fill the archive with copies of the live state, the worst case for a record */
+    for(i = 0; i < ARCHIVED_STATES; i++) {
+        session_state *state_copy = 0;
+        result = session_state_copy(&state_copy, session_record_get_state(f->record), bench_context);
+        if(result < 0) {
+            goto complete;
+        }
+        result = session_record_archive_current_state(f->record);
+        if(result >= 0) {
+            result = session_record_promote_state(f->record, state_copy);
+        }
+        SIGNAL_UNREF(state_copy);
+        if(result < 0) {
+            goto complete;
+        }
+    }
+
+    result = session_record_serialize(&f->serialized, f->record);
+
+complete:
+    signal_protocol_store_context_destroy(alice_store);
+    signal_protocol_store_context_destroy(bob_store);
+    if(result < 0) {
+        session_record_fixture_teardown(f);
+    }
+    else {
+        *fixture = f;
+    }
+    return result;
+}
+
+static int run_serialize(void *fixture)
+{
+    session_record_fixture *f = fixture;
+    signal_buffer *serialized = 0;
+    int result;
+
+    result = session_record_serialize(&serialized, f->record);
+    signal_buffer_free(serialized);
+    return result;
+}
+
+static int run_deserialize(void *fixture)
+{
+    session_record_fixture *f = fixture;
+    session_record *record = 0;
+    int result;
+
+    result = session_record_deserialize(&record,
+            signal_buffer_data(f->serialized), signal_buffer_len(f->serialized), bench_context);
+    SIGNAL_UNREF(record);
+    return result;
+}
+
+const bench_definition bench_session_record_definitions[] = {
+    {"session_record/serialize_40_archived", 2000, 1, session_record_fixture_setup, run_serialize, session_record_fixture_teardown},
+    {"session_record/deserialize_40_archived", 2000, 1, session_record_fixture_setup, run_deserialize, session_record_fixture_teardown},
+    {0, 0, 0, 0, 0, 0}
+};
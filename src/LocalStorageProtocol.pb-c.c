@@ -484,7 +484,7 @@ const ProtobufCMessageDescriptor textsecure__session_structure__chain__message_k
   (ProtobufCMessageInit) textsecure__session_structure__chain__message_key__init,
   NULL,NULL,NULL    /* reserved[123] */
 };
-static const ProtobufCFieldDescriptor textsecure__session_structure__chain__field_descriptors[4] =
+static const ProtobufCFieldDescriptor textsecure__session_structure__chain__field_descriptors[6] =
 {
   {
     "senderRatchetKey",
@@ -534,17 +534,43 @@ static const ProtobufCFieldDescriptor textsecure__session_structure__chain__fiel
     0,             /* flags */
     0,NULL,NULL    /* reserved1,reserved2, etc */
   },
+  {
+    "messageKeyCheckpoints",
+    5,
+    PROTOBUF_C_LABEL_REPEATED,
+    PROTOBUF_C_TYPE_MESSAGE,
+    offsetof(Textsecure__SessionStructure__Chain, n_messagekeycheckpoints),
+    offsetof(Textsecure__SessionStructure__Chain, messagekeycheckpoints),
+    &textsecure__session_structure__chain__chain_key__descriptor,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "skippedMessageKeys",
+    6,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_BYTES,
+    offsetof(Textsecure__SessionStructure__Chain, has_skippedmessagekeys),
+    offsetof(Textsecure__SessionStructure__Chain, skippedmessagekeys),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
 };
 static const unsigned textsecure__session_structure__chain__field_indices_by_name[] = {
   2,   /* field[2] = chainKey */
+  4,   /* field[4] = messageKeyCheckpoints */
   3,   /* field[3] = messageKeys */
   0,   /* field[0] = senderRatchetKey */
   1,   /* field[1] = senderRatchetKeyPrivate */
+  5,   /* field[5] = skippedMessageKeys */
 };
 static const ProtobufCIntRange textsecure__session_structure__chain__number_ranges[1 + 1] =
 {
   { 1, 0 },
-  { 0, 4 }
+  { 0, 6 }
 };
 const ProtobufCMessageDescriptor textsecure__session_structure__chain__descriptor =
 {
@@ -554,7 +580,7 @@ const ProtobufCMessageDescriptor textsecure__session_structure__chain__descripto
   "Textsecure__SessionStructure__Chain",
   "textsecure",
   sizeof(Textsecure__SessionStructure__Chain),
-  4,
+  6,
   textsecure__session_structure__chain__field_descriptors,
   textsecure__session_structure__chain__field_indices_by_name,
   1,  textsecure__session_structure__chain__number_ranges,
@@ -1345,7 +1371,7 @@ const ProtobufCMessageDescriptor textsecure__sender_key_state_structure__sender_
   (ProtobufCMessageInit) textsecure__sender_key_state_structure__sender_signing_key__init,
   NULL,NULL,NULL    /* reserved[123] */
 };
-static const ProtobufCFieldDescriptor textsecure__sender_key_state_structure__field_descriptors[4] =
+static const ProtobufCFieldDescriptor textsecure__sender_key_state_structure__field_descriptors[6] =
 {
   {
     "senderKeyId",
@@ -1395,17 +1421,43 @@ static const ProtobufCFieldDescriptor textsecure__sender_key_state_structure__fi
     0,             /* flags */
     0,NULL,NULL    /* reserved1,reserved2, etc */
   },
+  {
+    "senderChainKeyCheckpoints",
+    5,
+    PROTOBUF_C_LABEL_REPEATED,
+    PROTOBUF_C_TYPE_MESSAGE,
+    offsetof(Textsecure__SenderKeyStateStructure, n_senderchainkeycheckpoints),
+    offsetof(Textsecure__SenderKeyStateStructure, senderchainkeycheckpoints),
+    &textsecure__sender_key_state_structure__sender_chain_key__descriptor,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "skippedMessageKeys",
+    6,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_BYTES,
+    offsetof(Textsecure__SenderKeyStateStructure, has_skippedmessagekeys),
+    offsetof(Textsecure__SenderKeyStateStructure, skippedmessagekeys),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
 };
 static const unsigned textsecure__sender_key_state_structure__field_indices_by_name[] = {
   1,   /* field[1] = senderChainKey */
+  4,   /* field[4] = senderChainKeyCheckpoints */
   0,   /* field[0] = senderKeyId */
   3,   /* field[3] = senderMessageKeys */
   2,   /* field[2] = senderSigningKey */
+  5,   /* field[5] = skippedMessageKeys */
 };
 static const ProtobufCIntRange textsecure__sender_key_state_structure__number_ranges[1 + 1] =
 {
   { 1, 0 },
-  { 0, 4 }
+  { 0, 6 }
 };
 const ProtobufCMessageDescriptor textsecure__sender_key_state_structure__descriptor =
 {
@@ -1415,7 +1467,7 @@ const ProtobufCMessageDescriptor textsecure__sender_key_state_structure__descrip
   "Textsecure__SenderKeyStateStructure",
   "textsecure",
   sizeof(Textsecure__SenderKeyStateStructure),
-  4,
+  6,
   textsecure__sender_key_state_structure__field_descriptors,
   textsecure__sender_key_state_structure__field_indices_by_name,
   1,  textsecure__sender_key_state_structure__number_ranges,
@@ -77,10 +77,14 @@ struct  _Textsecure__SessionStructure__Chain
   Textsecure__SessionStructure__Chain__ChainKey *chainkey;
   size_t n_messagekeys;
   Textsecure__SessionStructure__Chain__MessageKey **messagekeys;
+  size_t n_messagekeycheckpoints;
+  Textsecure__SessionStructure__Chain__ChainKey **messagekeycheckpoints;
+  protobuf_c_boolean has_skippedmessagekeys;
+  ProtobufCBinaryData skippedmessagekeys;
 };
 #define TEXTSECURE__SESSION_STRUCTURE__CHAIN__INIT \
  { PROTOBUF_C_MESSAGE_INIT (&textsecure__session_structure__chain__descriptor) \
-    , 0,{0,NULL}, 0,{0,NULL}, NULL, 0,NULL }
+    , 0,{0,NULL}, 0,{0,NULL}, NULL, 0,NULL, 0,NULL, 0,{0,NULL} }
 
 
 struct  _Textsecure__SessionStructure__PendingKeyExchange
@@ -260,10 +264,14 @@ struct  _Textsecure__SenderKeyStateStructure
   Textsecure__SenderKeyStateStructure__SenderSigningKey *sendersigningkey;
   size_t n_sendermessagekeys;
   Textsecure__SenderKeyStateStructure__SenderMessageKey **sendermessagekeys;
+  size_t n_senderchainkeycheckpoints;
+  Textsecure__SenderKeyStateStructure__SenderChainKey **senderchainkeycheckpoints;
+  protobuf_c_boolean has_skippedmessagekeys;
+  ProtobufCBinaryData skippedmessagekeys;
 };
 #define TEXTSECURE__SENDER_KEY_STATE_STRUCTURE__INIT \
  { PROTOBUF_C_MESSAGE_INIT (&textsecure__sender_key_state_structure__descriptor) \
-    , 0,0, NULL, NULL, 0,NULL }
+    , 0,0, NULL, NULL, 0,NULL, 0,NULL, 0,{0,NULL} }
 
 
 struct  _Textsecure__SenderKeyRecordStructure
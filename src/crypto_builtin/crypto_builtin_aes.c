@@ -0,0 +1,451 @@
+#include "crypto_builtin_aes.h"
+
+#include <string.h>
+
+#include "crypto_builtin_cpu.h"
+
+#ifdef CRYPTO_BUILTIN_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * The portable implementation avoids lookup tables entirely: S-box values
+ * are computed as the GF(2^8) inverse followed by the affine transform, on
+ * eight bytes at a time packed into a 64-bit word. There are no secret
+ * dependent memory accesses or branches, at the cost of speed compared to
+ * table driven code. Hardware with AES-NI takes the accelerated path.
+ */
+
+#define LANES_LSB 0x0101010101010101ULL
+
+static uint64_t lanes_xtime(uint64_t a)
+{
+    return ((a & 0x7f7f7f7f7f7f7f7fULL) << 1) ^ (((a >> 7) & LANES_LSB) * 0x1b);
+}
+
+static uint64_t lanes_mul(uint64_t a, uint64_t b)
+{
+    uint64_t r = 0;
+    int i;
+    for(i = 0; i < 8; i++) {
+        r ^= a & (((b >> i) & LANES_LSB) * 0xff);
+        a = lanes_xtime(a);
+    }
+    return r;
+}
+
+static uint64_t lanes_inverse(uint64_t x)
+{
+    /* x^254, with 0 mapping to 0 */
+    uint64_t x3, x7, x15, x31, x63, x127;
+    x3 = lanes_mul(lanes_mul(x, x), x);
+    x7 = lanes_mul(lanes_mul(x3, x3), x);
+    x15 = lanes_mul(lanes_mul(x7, x7), x);
+    x31 = lanes_mul(lanes_mul(x15, x15), x);
+    x63 = lanes_mul(lanes_mul(x31, x31), x);
+    x127 = lanes_mul(lanes_mul(x63, x63), x);
+    return lanes_mul(x127, x127);
+}
+
+static uint64_t lanes_rotl(uint64_t x, unsigned int n)
+{
+    uint64_t hi = LANES_LSB * ((0xffU << n) & 0xff);
+    uint64_t lo = LANES_LSB * ((1U << n) - 1);
+    return ((x << n) & hi) | ((x >> (8 - n)) & lo);
+}
+
+static uint64_t lanes_sub(uint64_t x)
+{
+    x = lanes_inverse(x);
+    return x ^ lanes_rotl(x, 1) ^ lanes_rotl(x, 2) ^ lanes_rotl(x, 3) ^ lanes_rotl(x, 4) ^ (LANES_LSB * 0x63);
+}
+
+static uint64_t lanes_inv_sub(uint64_t x)
+{
+    x = lanes_rotl(x, 1) ^ lanes_rotl(x, 3) ^ lanes_rotl(x, 6) ^ (LANES_LSB * 0x05);
+    return lanes_inverse(x);
+}
+
+static uint8_t xtime(uint8_t x)
+{
+    return (uint8_t)(((unsigned int)x << 1) ^ (0x1bU & (0U - ((unsigned int)x >> 7))));
+}
+
+static void sub_bytes(uint8_t *state)
+{
+    uint64_t half;
+    memcpy(&half, state, 8);
+    half = lanes_sub(half);
+    memcpy(state, &half, 8);
+    memcpy(&half, state + 8, 8);
+    half = lanes_sub(half);
+    memcpy(state + 8, &half, 8);
+}
+
+static void inv_sub_bytes(uint8_t *state)
+{
+    uint64_t half;
+    memcpy(&half, state, 8);
+    half = lanes_inv_sub(half);
+    memcpy(state, &half, 8);
+    memcpy(&half, state + 8, 8);
+    half = lanes_inv_sub(half);
+    memcpy(state + 8, &half, 8);
+}
+
+static void shift_rows(uint8_t *s)
+{
+    uint8_t t;
+    t = s[1]; s[1] = s[5]; s[5] = s[9]; s[9] = s[13]; s[13] = t;
+    t = s[2]; s[2] = s[10]; s[10] = t;
+    t = s[6]; s[6] = s[14]; s[14] = t;
+    t = s[15]; s[15] = s[11]; s[11] = s[7]; s[7] = s[3]; s[3] = t;
+}
+
+static void inv_shift_rows(uint8_t *s)
+{
+    uint8_t t;
+    t = s[13]; s[13] = s[9]; s[9] = s[5]; s[5] = s[1]; s[1] = t;
+    t = s[2]; s[2] = s[10]; s[10] = t;
+    t = s[6]; s[6] = s[14]; s[14] = t;
+    t = s[3]; s[3] = s[7]; s[7] = s[11]; s[11] = s[15]; s[15] = t;
+}
+
+static void mix_columns(uint8_t *s)
+{
+    int c;
+    for(c = 0; c < 16; c += 4) {
+        uint8_t a0 = s[c], a1 = s[c + 1], a2 = s[c + 2], a3 = s[c + 3];
+        uint8_t t = a0 ^ a1 ^ a2 ^ a3;
+        s[c] = a0 ^ t ^ xtime(a0 ^ a1);
+        s[c + 1] = a1 ^ t ^ xtime(a1 ^ a2);
+        s[c + 2] = a2 ^ t ^ xtime(a2 ^ a3);
+        s[c + 3] = a3 ^ t ^ xtime(a3 ^ a0);
+    }
+}
+
+static void inv_mix_columns(uint8_t *s)
+{
+    int c;
+    for(c = 0; c < 16; c += 4) {
+        uint8_t u = xtime(xtime(s[c] ^ s[c + 2]));
+        uint8_t v = xtime(xtime(s[c + 1] ^ s[c + 3]));
+        s[c] ^= u;
+        s[c + 1] ^= v;
+        s[c + 2] ^= u;
+        s[c + 3] ^= v;
+    }
+    mix_columns(s);
+}
+
+static void add_round_key(uint8_t *s, const uint8_t *rk)
+{
+    int i;
+    for(i = 0; i < 16; i++) {
+        s[i] ^= rk[i];
+    }
+}
+
+static void encrypt_block_portable(const crypto_builtin_aes_key *aes_key, const uint8_t *in, uint8_t *out)
+{
+    uint8_t s[CRYPTO_BUILTIN_AES_BLOCK_SIZE];
+    unsigned int round;
+
+    memcpy(s, in, sizeof(s));
+    add_round_key(s, aes_key->round_keys);
+    for(round = 1; round < aes_key->rounds; round++) {
+        sub_bytes(s);
+        shift_rows(s);
+        mix_columns(s);
+        add_round_key(s, aes_key->round_keys + (round * 16));
+    }
+    sub_bytes(s);
+    shift_rows(s);
+    add_round_key(s, aes_key->round_keys + (aes_key->rounds * 16));
+    memcpy(out, s, sizeof(s));
+    memset(s, 0, sizeof(s));
+}
+
+static void decrypt_block_portable(const crypto_builtin_aes_key *aes_key, const uint8_t *in, uint8_t *out)
+{
+    uint8_t s[CRYPTO_BUILTIN_AES_BLOCK_SIZE];
+    unsigned int round;
+
+    memcpy(s, in, sizeof(s));
+    add_round_key(s, aes_key->round_keys + (aes_key->rounds * 16));
+    for(round = aes_key->rounds - 1; round > 0; round--) {
+        inv_shift_rows(s);
+        inv_sub_bytes(s);
+        add_round_key(s, aes_key->round_keys + (round * 16));
+        inv_mix_columns(s);
+    }
+    inv_shift_rows(s);
+    inv_sub_bytes(s);
+    add_round_key(s, aes_key->round_keys);
+    memcpy(out, s, sizeof(s));
+    memset(s, 0, sizeof(s));
+}
+
+static void counter_increment(uint8_t *counter)
+{
+    unsigned int carry = 1;
+    int i;
+    for(i = CRYPTO_BUILTIN_AES_BLOCK_SIZE - 1; i >= 0; i--) {
+        carry += counter[i];
+        counter[i] = (uint8_t)carry;
+        carry >>= 8;
+    }
+}
+
+static void xor_block(uint8_t *out, const uint8_t *a, const uint8_t *b, size_t len)
+{
+    size_t i;
+    for(i = 0; i < len; i++) {
+        out[i] = a[i] ^ b[i];
+    }
+}
+
+#ifdef CRYPTO_BUILTIN_X86
+#define AESNI_TARGET __attribute__((target("aes,sse4.1,ssse3")))
+
+AESNI_TARGET
+static void aesni_load_keys(const crypto_builtin_aes_key *aes_key, __m128i *rk)
+{
+    unsigned int i;
+    for(i = 0; i <= aes_key->rounds; i++) {
+        rk[i] = _mm_loadu_si128((const __m128i *)(aes_key->round_keys + (i * 16)));
+    }
+}
+
+AESNI_TARGET
+static void aesni_load_decrypt_keys(const crypto_builtin_aes_key *aes_key, __m128i *dk)
+{
+    unsigned int i;
+    unsigned int rounds = aes_key->rounds;
+    dk[0] = _mm_loadu_si128((const __m128i *)(aes_key->round_keys + (rounds * 16)));
+    for(i = 1; i < rounds; i++) {
+        dk[i] = _mm_aesimc_si128(_mm_loadu_si128((const __m128i *)(aes_key->round_keys + ((rounds - i) * 16))));
+    }
+    dk[rounds] = _mm_loadu_si128((const __m128i *)aes_key->round_keys);
+}
+
+AESNI_TARGET
+static __m128i aesni_encrypt(const __m128i *rk, unsigned int rounds, __m128i x)
+{
+    unsigned int i;
+    x = _mm_xor_si128(x, rk[0]);
+    for(i = 1; i < rounds; i++) {
+        x = _mm_aesenc_si128(x, rk[i]);
+    }
+    return _mm_aesenclast_si128(x, rk[rounds]);
+}
+
+AESNI_TARGET
+static void aesni_cbc_encrypt(const crypto_builtin_aes_key *aes_key, uint8_t *iv,
+        const uint8_t *in, uint8_t *out, size_t blocks)
+{
+    __m128i rk[CRYPTO_BUILTIN_AES_MAX_ROUNDS + 1];
+    __m128i x = _mm_loadu_si128((const __m128i *)iv);
+
+    aesni_load_keys(aes_key, rk);
+    while(blocks--) {
+        x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)in));
+        x = aesni_encrypt(rk, aes_key->rounds, x);
+        _mm_storeu_si128((__m128i *)out, x);
+        in += 16;
+        out += 16;
+    }
+    _mm_storeu_si128((__m128i *)iv, x);
+}
+
+AESNI_TARGET
+static void aesni_cbc_decrypt(const crypto_builtin_aes_key *aes_key, uint8_t *iv,
+        const uint8_t *in, uint8_t *out, size_t blocks)
+{
+    __m128i dk[CRYPTO_BUILTIN_AES_MAX_ROUNDS + 1];
+    __m128i prev = _mm_loadu_si128((const __m128i *)iv);
+    __m128i c[4];
+    __m128i x[4];
+    unsigned int rounds = aes_key->rounds;
+    unsigned int i;
+    size_t j;
+    size_t n;
+
+    aesni_load_decrypt_keys(aes_key, dk);
+    while(blocks > 0) {
+        /* Blocks decrypt independently, interleave up to four of them */
+        n = blocks < 4 ? blocks : 4;
+        for(j = 0; j < n; j++) {
+            c[j] = _mm_loadu_si128((const __m128i *)(in + (j * 16)));
+            x[j] = _mm_xor_si128(c[j], dk[0]);
+        }
+        for(i = 1; i < rounds; i++) {
+            for(j = 0; j < n; j++) {
+                x[j] = _mm_aesdec_si128(x[j], dk[i]);
+            }
+        }
+        for(j = 0; j < n; j++) {
+            x[j] = _mm_aesdeclast_si128(x[j], dk[rounds]);
+            _mm_storeu_si128((__m128i *)(out + (j * 16)), _mm_xor_si128(x[j], prev));
+            prev = c[j];
+        }
+        in += n * 16;
+        out += n * 16;
+        blocks -= n;
+    }
+    _mm_storeu_si128((__m128i *)iv, prev);
+}
+
+AESNI_TARGET
+static void aesni_ctr(const crypto_builtin_aes_key *aes_key, uint8_t *counter,
+        const uint8_t *in, uint8_t *out, size_t len)
+{
+    __m128i rk[CRYPTO_BUILTIN_AES_MAX_ROUNDS + 1];
+    __m128i x[4];
+    uint8_t keystream[4 * CRYPTO_BUILTIN_AES_BLOCK_SIZE];
+    unsigned int rounds = aes_key->rounds;
+    unsigned int i;
+    size_t j;
+    size_t n;
+    size_t chunk;
+
+    aesni_load_keys(aes_key, rk);
+    while(len > 0) {
+        n = (len + 15) / 16;
+        if(n > 4) {
+            n = 4;
+        }
+        for(j = 0; j < n; j++) {
+            x[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)counter), rk[0]);
+            counter_increment(counter);
+        }
+        for(i = 1; i < rounds; i++) {
+            for(j = 0; j < n; j++) {
+                x[j] = _mm_aesenc_si128(x[j], rk[i]);
+            }
+        }
+        for(j = 0; j < n; j++) {
+            _mm_storeu_si128((__m128i *)(keystream + (j * 16)), _mm_aesenclast_si128(x[j], rk[rounds]));
+        }
+        chunk = len < n * 16 ? len : n * 16;
+        xor_block(out, in, keystream, chunk);
+        in += chunk;
+        out += chunk;
+        len -= chunk;
+    }
+    memset(keystream, 0, sizeof(keystream));
+}
+#endif
+
+int crypto_builtin_aes_set_key(crypto_builtin_aes_key *aes_key, const uint8_t *key, size_t key_len)
+{
+    uint8_t *w = aes_key->round_keys;
+    uint8_t temp[8];
+    uint8_t rcon = 0x01;
+    uint64_t lanes;
+    size_t nk = key_len / 4;
+    size_t total;
+    size_t i;
+
+    if(key_len != 16 && key_len != 24 && key_len != 32) {
+        return -1;
+    }
+
+    aes_key->rounds = (unsigned int)(nk + 6);
+    total = 4 * (aes_key->rounds + 1);
+    memcpy(w, key, key_len);
+
+    for(i = nk; i < total; i++) {
+        memset(temp, 0, sizeof(temp));
+        memcpy(temp, w + ((i - 1) * 4), 4);
+        if(i % nk == 0) {
+            uint8_t t = temp[0];
+            temp[0] = temp[1];
+            temp[1] = temp[2];
+            temp[2] = temp[3];
+            temp[3] = t;
+        }
+        if(i % nk == 0 || (nk > 6 && i % nk == 4)) {
+            memcpy(&lanes, temp, 8);
+            lanes = lanes_sub(lanes);
+            memcpy(temp, &lanes, 8);
+        }
+        if(i % nk == 0) {
+            temp[0] ^= rcon;
+            rcon = xtime(rcon);
+        }
+        xor_block(w + (i * 4), w + ((i - nk) * 4), temp, 4);
+    }
+
+    memset(temp, 0, sizeof(temp));
+    return 0;
+}
+
+void crypto_builtin_aes_cbc_encrypt(const crypto_builtin_aes_key *aes_key, uint8_t *iv,
+        const uint8_t *in, uint8_t *out, size_t blocks)
+{
+    uint8_t block[CRYPTO_BUILTIN_AES_BLOCK_SIZE];
+
+#ifdef CRYPTO_BUILTIN_X86
+    if(crypto_builtin_cpu_features() & CRYPTO_BUILTIN_CPU_AES) {
+        aesni_cbc_encrypt(aes_key, iv, in, out, blocks);
+        return;
+    }
+#endif
+
+    while(blocks--) {
+        xor_block(block, in, iv, sizeof(block));
+        encrypt_block_portable(aes_key, block, out);
+        memcpy(iv, out, CRYPTO_BUILTIN_AES_BLOCK_SIZE);
+        in += CRYPTO_BUILTIN_AES_BLOCK_SIZE;
+        out += CRYPTO_BUILTIN_AES_BLOCK_SIZE;
+    }
+    memset(block, 0, sizeof(block));
+}
+
+void crypto_builtin_aes_cbc_decrypt(const crypto_builtin_aes_key *aes_key, uint8_t *iv,
+        const uint8_t *in, uint8_t *out, size_t blocks)
+{
+    uint8_t ciphertext[CRYPTO_BUILTIN_AES_BLOCK_SIZE];
+
+#ifdef CRYPTO_BUILTIN_X86
+    if(crypto_builtin_cpu_features() & CRYPTO_BUILTIN_CPU_AES) {
+        aesni_cbc_decrypt(aes_key, iv, in, out, blocks);
+        return;
+    }
+#endif
+
+    while(blocks--) {
+        memcpy(ciphertext, in, sizeof(ciphertext));
+        decrypt_block_portable(aes_key, ciphertext, out);
+        xor_block(out, out, iv, CRYPTO_BUILTIN_AES_BLOCK_SIZE);
+        memcpy(iv, ciphertext, sizeof(ciphertext));
+        in += CRYPTO_BUILTIN_AES_BLOCK_SIZE;
+        out += CRYPTO_BUILTIN_AES_BLOCK_SIZE;
+    }
+}
+
+void crypto_builtin_aes_ctr(const crypto_builtin_aes_key *aes_key, uint8_t *counter,
+        const uint8_t *in, uint8_t *out, size_t len)
+{
+    uint8_t keystream[CRYPTO_BUILTIN_AES_BLOCK_SIZE];
+    size_t chunk;
+
+#ifdef CRYPTO_BUILTIN_X86
+    if(crypto_builtin_cpu_features() & CRYPTO_BUILTIN_CPU_AES) {
+        aesni_ctr(aes_key, counter, in, out, len);
+        return;
+    }
+#endif
+
+    while(len > 0) {
+        encrypt_block_portable(aes_key, counter, keystream);
+        counter_increment(counter);
+        chunk = len < sizeof(keystream) ? len : sizeof(keystream);
+        xor_block(out, in, keystream, chunk);
+        in += chunk;
+        out += chunk;
+        len -= chunk;
+    }
+    memset(keystream, 0, sizeof(keystream));
+}
@@ -0,0 +1,52 @@
+#ifndef CRYPTO_BUILTIN_AES_H
+#define CRYPTO_BUILTIN_AES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CRYPTO_BUILTIN_AES_BLOCK_SIZE 16
+#define CRYPTO_BUILTIN_AES_MAX_ROUNDS 14
+
+typedef struct crypto_builtin_aes_key {
+    uint8_t round_keys[(CRYPTO_BUILTIN_AES_MAX_ROUNDS + 1) * CRYPTO_BUILTIN_AES_BLOCK_SIZE];
+    unsigned int rounds;
+} crypto_builtin_aes_key;
+
+/**
+ * Expand an AES key.
+ *
+ * @param key_len 16, 24 or 32
+ * @return 0 on success, negative if the key length is not supported
+ */
+int crypto_builtin_aes_set_key(crypto_builtin_aes_key *aes_key, const uint8_t *key, size_t key_len);
+
+/**
+ * Encrypt whole blocks in CBC mode, in may equal out.
+ * On return iv holds the last ciphertext block.
+ */
+void crypto_builtin_aes_cbc_encrypt(const crypto_builtin_aes_key *aes_key, uint8_t *iv,
+        const uint8_t *in, uint8_t *out, size_t blocks);
+
+/**
+ * Decrypt whole blocks in CBC mode, in may equal out.
+ * On return iv holds the last ciphertext block.
+ */
+void crypto_builtin_aes_cbc_decrypt(const crypto_builtin_aes_key *aes_key, uint8_t *iv,
+        const uint8_t *in, uint8_t *out, size_t blocks);
+
+/**
+ * Encrypt or decrypt in CTR mode with a 128-bit big-endian counter,
+ * in may equal out. The counter is advanced past every block started.
+ */
+void crypto_builtin_aes_ctr(const crypto_builtin_aes_key *aes_key, uint8_t *counter,
+        const uint8_t *in, uint8_t *out, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CRYPTO_BUILTIN_AES_H */
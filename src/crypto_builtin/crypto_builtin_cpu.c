@@ -0,0 +1,50 @@
+#include "crypto_builtin_cpu.h"
+
+#ifdef CRYPTO_BUILTIN_X86
+#include <cpuid.h>
+#endif
+
+#define CRYPTO_BUILTIN_CPU_DETECTED 0x80000000U
+
+static volatile unsigned int cpu_features = 0;
+static volatile unsigned int cpu_mask = ~0U;
+
+static unsigned int crypto_builtin_cpu_detect(void)
+{
+    unsigned int features = 0;
+#ifdef CRYPTO_BUILTIN_X86
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int max_leaf = __get_cpuid_max(0, 0);
+
+    if(max_leaf >= 1) {
+        __cpuid(1, eax, ebx, ecx, edx);
+        /* SSSE3 and SSE4.1 are required by the accelerated code paths */
+        if((ecx & bit_AES) && (ecx & bit_SSSE3) && (ecx & bit_SSE4_1)) {
+            features |= CRYPTO_BUILTIN_CPU_AES;
+        }
+        if(max_leaf >= 7 && (ecx & bit_SSSE3) && (ecx & bit_SSE4_1)) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            if(ebx & (1U << 29)) {
+                features |= CRYPTO_BUILTIN_CPU_SHA;
+            }
+        }
+    }
+#endif
+    return features;
+}
+
+unsigned int crypto_builtin_cpu_features(void)
+{
+    unsigned int features = cpu_features;
+    if(!(features & CRYPTO_BUILTIN_CPU_DETECTED)) {
+        /* Racing threads compute and store the same value */
+        features = crypto_builtin_cpu_detect() | CRYPTO_BUILTIN_CPU_DETECTED;
+        cpu_features = features;
+    }
+    return features & cpu_mask;
+}
+
+void crypto_builtin_cpu_set_mask(unsigned int mask)
+{
+    cpu_mask = mask;
+}
@@ -0,0 +1,36 @@
+#ifndef CRYPTO_BUILTIN_CPU_H
+#define CRYPTO_BUILTIN_CPU_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CRYPTO_BUILTIN_X86 1
+#endif
+
+#define CRYPTO_BUILTIN_CPU_AES 0x01
+#define CRYPTO_BUILTIN_CPU_SHA 0x02
+
+/**
+ * Get the instruction set extensions the built-in primitives may use.
+ * Detection runs once, the result is cached for the life of the process.
+ *
+ * @return bitmask of CRYPTO_BUILTIN_CPU_* flags
+ */
+unsigned int crypto_builtin_cpu_features(void);
+
+/**
+ * Restrict the instruction set extensions the built-in primitives may use,
+ * mainly so that tests can exercise the portable implementations on hardware
+ * that supports the accelerated ones.
+ *
+ * @param mask bitmask of CRYPTO_BUILTIN_CPU_* flags to allow
+ */
+void crypto_builtin_cpu_set_mask(unsigned int mask);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CRYPTO_BUILTIN_CPU_H */
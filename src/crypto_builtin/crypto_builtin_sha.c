@@ -0,0 +1,335 @@
+#include "crypto_builtin_sha.h"
+
+#include <string.h>
+
+#include "crypto_builtin_cpu.h"
+
+#ifdef CRYPTO_BUILTIN_X86
+#include <immintrin.h>
+#endif
+
+extern int crypto_hashblocks_sha512(unsigned char *statebytes, const unsigned char *in, unsigned long long inlen);
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint8_t sha512_iv[64] = {
+    0x6a, 0x09, 0xe6, 0x67, 0xf3, 0xbc, 0xc9, 0x08, 0xbb, 0x67, 0xae, 0x85, 0x84, 0xca, 0xa7, 0x3b,
+    0x3c, 0x6e, 0xf3, 0x72, 0xfe, 0x94, 0xf8, 0x2b, 0xa5, 0x4f, 0xf5, 0x3a, 0x5f, 0x1d, 0x36, 0xf1,
+    0x51, 0x0e, 0x52, 0x7f, 0xad, 0xe6, 0x82, 0xd1, 0x9b, 0x05, 0x68, 0x8c, 0x2b, 0x3e, 0x6c, 0x1f,
+    0x1f, 0x83, 0xd9, 0xab, 0xfb, 0x41, 0xbd, 0x6b, 0x5b, 0xe0, 0xcd, 0x19, 0x13, 0x7e, 0x21, 0x79
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static uint32_t load_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void store_be64(uint8_t *p, uint64_t v)
+{
+    store_be32(p, (uint32_t)(v >> 32));
+    store_be32(p + 4, (uint32_t)v);
+}
+
+static void sha256_blocks_portable(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    while(blocks--) {
+        for(i = 0; i < 16; i++) {
+            w[i] = load_be32(data + (i * 4));
+        }
+        for(i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+        for(i = 0; i < 64; i++) {
+            t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+
+        data += CRYPTO_BUILTIN_SHA256_BLOCK_SIZE;
+    }
+
+    memset(w, 0, sizeof(w));
+}
+
+#ifdef CRYPTO_BUILTIN_X86
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, msg, tmp, abef_save, cdgh_save;
+    __m128i w[4];
+    int i;
+
+    /* Rearrange the state into the ABEF/CDGH layout the instructions use */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while(blocks--) {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        for(i = 0; i < 16; i++) {
+            if(i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + (i * 16))), byte_swap);
+            }
+            else {
+                tmp = _mm_sha256msg1_epu32(w[(i - 4) & 3], w[(i - 3) & 3]);
+                tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(i - 1) & 3], w[(i - 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i - 1) & 3]);
+            }
+            msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+
+        data += CRYPTO_BUILTIN_SHA256_BLOCK_SIZE;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif
+
+static void sha256_blocks(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+#ifdef CRYPTO_BUILTIN_X86
+    if(crypto_builtin_cpu_features() & CRYPTO_BUILTIN_CPU_SHA) {
+        sha256_blocks_shani(state, data, blocks);
+        return;
+    }
+#endif
+    sha256_blocks_portable(state, data, blocks);
+}
+
+void crypto_builtin_sha256_init(crypto_builtin_sha256_ctx *ctx)
+{
+    memcpy(ctx->state, sha256_iv, sizeof(ctx->state));
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void crypto_builtin_sha256_update(crypto_builtin_sha256_ctx *ctx, const uint8_t *data, size_t len)
+{
+    size_t n;
+
+    ctx->length += len;
+
+    if(ctx->block_len > 0) {
+        n = CRYPTO_BUILTIN_SHA256_BLOCK_SIZE - ctx->block_len;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(ctx->block + ctx->block_len, data, n);
+        ctx->block_len += n;
+        data += n;
+        len -= n;
+        if(ctx->block_len < CRYPTO_BUILTIN_SHA256_BLOCK_SIZE) {
+            return;
+        }
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+
+    n = len / CRYPTO_BUILTIN_SHA256_BLOCK_SIZE;
+    if(n > 0) {
+        sha256_blocks(ctx->state, data, n);
+        data += n * CRYPTO_BUILTIN_SHA256_BLOCK_SIZE;
+        len -= n * CRYPTO_BUILTIN_SHA256_BLOCK_SIZE;
+    }
+
+    if(len > 0) {
+        memcpy(ctx->block, data, len);
+        ctx->block_len = len;
+    }
+}
+
+void crypto_builtin_sha256_final(crypto_builtin_sha256_ctx *ctx, uint8_t *output)
+{
+    uint64_t bit_length = ctx->length << 3;
+    int i;
+
+    ctx->block[ctx->block_len++] = 0x80;
+    if(ctx->block_len > CRYPTO_BUILTIN_SHA256_BLOCK_SIZE - 8) {
+        memset(ctx->block + ctx->block_len, 0, CRYPTO_BUILTIN_SHA256_BLOCK_SIZE - ctx->block_len);
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+    memset(ctx->block + ctx->block_len, 0, CRYPTO_BUILTIN_SHA256_BLOCK_SIZE - 8 - ctx->block_len);
+    store_be64(ctx->block + CRYPTO_BUILTIN_SHA256_BLOCK_SIZE - 8, bit_length);
+    sha256_blocks(ctx->state, ctx->block, 1);
+
+    for(i = 0; i < 8; i++) {
+        store_be32(output + (i * 4), ctx->state[i]);
+    }
+    memset(ctx->block, 0, sizeof(ctx->block));
+    ctx->block_len = 0;
+}
+
+void crypto_builtin_hmac_sha256_init(crypto_builtin_hmac_sha256_ctx *ctx, const uint8_t *key, size_t key_len)
+{
+    uint8_t pad[CRYPTO_BUILTIN_SHA256_BLOCK_SIZE];
+    size_t i;
+
+    memset(pad, 0, sizeof(pad));
+    if(key_len > CRYPTO_BUILTIN_SHA256_BLOCK_SIZE) {
+        crypto_builtin_sha256_init(&ctx->inner);
+        crypto_builtin_sha256_update(&ctx->inner, key, key_len);
+        crypto_builtin_sha256_final(&ctx->inner, pad);
+    }
+    else if(key_len > 0) {
+        memcpy(pad, key, key_len);
+    }
+
+    for(i = 0; i < sizeof(pad); i++) {
+        pad[i] ^= 0x36;
+    }
+    memcpy(ctx->inner_state, sha256_iv, sizeof(ctx->inner_state));
+    sha256_blocks(ctx->inner_state, pad, 1);
+
+    for(i = 0; i < sizeof(pad); i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    memcpy(ctx->outer_state, sha256_iv, sizeof(ctx->outer_state));
+    sha256_blocks(ctx->outer_state, pad, 1);
+
+    memset(pad, 0, sizeof(pad));
+
+    memcpy(ctx->inner.state, ctx->inner_state, sizeof(ctx->inner.state));
+    ctx->inner.length = CRYPTO_BUILTIN_SHA256_BLOCK_SIZE;
+    ctx->inner.block_len = 0;
+}
+
+void crypto_builtin_hmac_sha256_update(crypto_builtin_hmac_sha256_ctx *ctx, const uint8_t *data, size_t len)
+{
+    crypto_builtin_sha256_update(&ctx->inner, data, len);
+}
+
+void crypto_builtin_hmac_sha256_final(crypto_builtin_hmac_sha256_ctx *ctx, uint8_t *output)
+{
+    uint8_t inner_digest[CRYPTO_BUILTIN_SHA256_DIGEST_SIZE];
+
+    crypto_builtin_sha256_final(&ctx->inner, inner_digest);
+
+    memcpy(ctx->outer.state, ctx->outer_state, sizeof(ctx->outer.state));
+    ctx->outer.length = CRYPTO_BUILTIN_SHA256_BLOCK_SIZE;
+    ctx->outer.block_len = 0;
+    crypto_builtin_sha256_update(&ctx->outer, inner_digest, sizeof(inner_digest));
+    crypto_builtin_sha256_final(&ctx->outer, output);
+
+    memset(inner_digest, 0, sizeof(inner_digest));
+
+    memcpy(ctx->inner.state, ctx->inner_state, sizeof(ctx->inner.state));
+    ctx->inner.length = CRYPTO_BUILTIN_SHA256_BLOCK_SIZE;
+    ctx->inner.block_len = 0;
+}
+
+void crypto_builtin_sha512_init(crypto_builtin_sha512_ctx *ctx)
+{
+    memcpy(ctx->state, sha512_iv, sizeof(ctx->state));
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+void crypto_builtin_sha512_update(crypto_builtin_sha512_ctx *ctx, const uint8_t *data, size_t len)
+{
+    size_t n;
+
+    ctx->length += len;
+
+    if(ctx->block_len > 0) {
+        n = CRYPTO_BUILTIN_SHA512_BLOCK_SIZE - ctx->block_len;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(ctx->block + ctx->block_len, data, n);
+        ctx->block_len += n;
+        data += n;
+        len -= n;
+        if(ctx->block_len < CRYPTO_BUILTIN_SHA512_BLOCK_SIZE) {
+            return;
+        }
+        crypto_hashblocks_sha512(ctx->state, ctx->block, CRYPTO_BUILTIN_SHA512_BLOCK_SIZE);
+        ctx->block_len = 0;
+    }
+
+    n = len - (len % CRYPTO_BUILTIN_SHA512_BLOCK_SIZE);
+    if(n > 0) {
+        crypto_hashblocks_sha512(ctx->state, data, n);
+        data += n;
+        len -= n;
+    }
+
+    if(len > 0) {
+        memcpy(ctx->block, data, len);
+        ctx->block_len = len;
+    }
+}
+
+void crypto_builtin_sha512_final(crypto_builtin_sha512_ctx *ctx, uint8_t *output)
+{
+    size_t pad_len;
+
+    ctx->block[ctx->block_len++] = 0x80;
+    if(ctx->block_len > CRYPTO_BUILTIN_SHA512_BLOCK_SIZE - 16) {
+        memset(ctx->block + ctx->block_len, 0, CRYPTO_BUILTIN_SHA512_BLOCK_SIZE - ctx->block_len);
+        crypto_hashblocks_sha512(ctx->state, ctx->block, CRYPTO_BUILTIN_SHA512_BLOCK_SIZE);
+        ctx->block_len = 0;
+    }
+    pad_len = CRYPTO_BUILTIN_SHA512_BLOCK_SIZE - 16 - ctx->block_len;
+    memset(ctx->block + ctx->block_len, 0, pad_len + 8);
+    /* The upper half of the 128-bit length is zero for any size_t input */
+    store_be64(ctx->block + CRYPTO_BUILTIN_SHA512_BLOCK_SIZE - 8, ctx->length << 3);
+    crypto_hashblocks_sha512(ctx->state, ctx->block, CRYPTO_BUILTIN_SHA512_BLOCK_SIZE);
+
+    memcpy(output, ctx->state, CRYPTO_BUILTIN_SHA512_DIGEST_SIZE);
+    memset(ctx->block, 0, sizeof(ctx->block));
+    ctx->block_len = 0;
+}
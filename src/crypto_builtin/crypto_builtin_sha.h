@@ -0,0 +1,64 @@
+#ifndef CRYPTO_BUILTIN_SHA_H
+#define CRYPTO_BUILTIN_SHA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CRYPTO_BUILTIN_SHA256_BLOCK_SIZE 64
+#define CRYPTO_BUILTIN_SHA256_DIGEST_SIZE 32
+#define CRYPTO_BUILTIN_SHA512_BLOCK_SIZE 128
+#define CRYPTO_BUILTIN_SHA512_DIGEST_SIZE 64
+
+typedef struct crypto_builtin_sha256_ctx {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[CRYPTO_BUILTIN_SHA256_BLOCK_SIZE];
+    size_t block_len;
+} crypto_builtin_sha256_ctx;
+
+typedef struct crypto_builtin_hmac_sha256_ctx {
+    crypto_builtin_sha256_ctx inner;
+    crypto_builtin_sha256_ctx outer;
+    /* Chaining values after the padded key blocks, restored on reset */
+    uint32_t inner_state[8];
+    uint32_t outer_state[8];
+} crypto_builtin_hmac_sha256_ctx;
+
+typedef struct crypto_builtin_sha512_ctx {
+    uint8_t state[CRYPTO_BUILTIN_SHA512_DIGEST_SIZE];
+    uint64_t length;
+    uint8_t block[CRYPTO_BUILTIN_SHA512_BLOCK_SIZE];
+    size_t block_len;
+} crypto_builtin_sha512_ctx;
+
+void crypto_builtin_sha256_init(crypto_builtin_sha256_ctx *ctx);
+void crypto_builtin_sha256_update(crypto_builtin_sha256_ctx *ctx, const uint8_t *data, size_t len);
+void crypto_builtin_sha256_final(crypto_builtin_sha256_ctx *ctx, uint8_t *output);
+
+void crypto_builtin_hmac_sha256_init(crypto_builtin_hmac_sha256_ctx *ctx, const uint8_t *key, size_t key_len);
+void crypto_builtin_hmac_sha256_update(crypto_builtin_hmac_sha256_ctx *ctx, const uint8_t *data, size_t len);
+
+/**
+ * Write the MAC to output and reset the context to the state it had right
+ * after crypto_builtin_hmac_sha256_init(), ready for another message under
+ * the same key.
+ */
+void crypto_builtin_hmac_sha256_final(crypto_builtin_hmac_sha256_ctx *ctx, uint8_t *output);
+
+/*
+ * SHA-512 is layered over the block function that ships with the vendored
+ * ed25519 code, so there is only one implementation in the library.
+ */
+void crypto_builtin_sha512_init(crypto_builtin_sha512_ctx *ctx);
+void crypto_builtin_sha512_update(crypto_builtin_sha512_ctx *ctx, const uint8_t *data, size_t len);
+void crypto_builtin_sha512_final(crypto_builtin_sha512_ctx *ctx, uint8_t *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CRYPTO_BUILTIN_SHA_H */
@@ -0,0 +1,349 @@
+#include "signal_crypto_builtin.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <bcrypt.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#define HAVE_ARC4RANDOM_BUF 1
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+#include <sys/random.h>
+#define HAVE_GETRANDOM 1
+#endif
+#endif
+
+#include "signal_protocol_internal.h"
+#include "crypto_builtin_aes.h"
+#include "crypto_builtin_sha.h"
+
+static int builtin_random(uint8_t *data, size_t len, void *user_data)
+{
+#if defined(_WIN32)
+    while(len > 0) {
+        ULONG chunk = len > 0x10000000 ? 0x10000000 : (ULONG)len;
+        if(!BCRYPT_SUCCESS(BCryptGenRandom(0, data, chunk, BCRYPT_USE_SYSTEM_PREFERRED_RNG))) {
+            return SG_ERR_UNKNOWN;
+        }
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+#elif defined(HAVE_ARC4RANDOM_BUF)
+    arc4random_buf(data, len);
+    return 0;
+#else
+    ssize_t n;
+#ifdef HAVE_GETRANDOM
+    while(len > 0) {
+        n = getrandom(data, len, 0);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    if(len == 0) {
+        return 0;
+    }
+#endif
+    {
+        int fd = open("/dev/urandom", O_RDONLY);
+        if(fd < 0) {
+            return SG_ERR_UNKNOWN;
+        }
+        while(len > 0) {
+            n = read(fd, data, len);
+            if(n <= 0) {
+                if(n < 0 && errno == EINTR) {
+                    continue;
+                }
+                close(fd);
+                return SG_ERR_UNKNOWN;
+            }
+            data += n;
+            len -= (size_t)n;
+        }
+        close(fd);
+    }
+    return 0;
+#endif
+}
+
+static int builtin_hmac_sha256_init(void **hmac_context, const uint8_t *key, size_t key_len, void *user_data)
+{
+    crypto_builtin_hmac_sha256_ctx *ctx = malloc(sizeof(crypto_builtin_hmac_sha256_ctx));
+    if(!ctx) {
+        return SG_ERR_NOMEM;
+    }
+    crypto_builtin_hmac_sha256_init(ctx, key, key_len);
+    *hmac_context = ctx;
+    return 0;
+}
+
+static int builtin_hmac_sha256_update(void *hmac_context, const uint8_t *data, size_t data_len, void *user_data)
+{
+    crypto_builtin_hmac_sha256_update(hmac_context, data, data_len);
+    return 0;
+}
+
+static int builtin_hmac_sha256_final(void *hmac_context, signal_buffer **output, void *user_data)
+{
+    signal_buffer *output_buffer = signal_buffer_alloc(CRYPTO_BUILTIN_SHA256_DIGEST_SIZE);
+    if(!output_buffer) {
+        return SG_ERR_NOMEM;
+    }
+    crypto_builtin_hmac_sha256_final(hmac_context, signal_buffer_data(output_buffer));
+    *output = output_buffer;
+    return 0;
+}
+
+static void builtin_hmac_sha256_cleanup(void *hmac_context, void *user_data)
+{
+    if(hmac_context) {
+        signal_explicit_bzero(hmac_context, sizeof(crypto_builtin_hmac_sha256_ctx));
+        free(hmac_context);
+    }
+}
+
+static int builtin_hmac_sha256_final_reset(void *hmac_context, uint8_t *output, void *user_data)
+{
+    crypto_builtin_hmac_sha256_final(hmac_context, output);
+    return 0;
+}
+
+static int builtin_hmac_sha256_oneshot(const uint8_t *key, size_t key_len,
+        const signal_iovec *iov, size_t iov_count,
+        uint8_t *output, void *user_data)
+{
+    crypto_builtin_hmac_sha256_ctx ctx;
+    size_t i;
+
+    crypto_builtin_hmac_sha256_init(&ctx, key, key_len);
+    for(i = 0; i < iov_count; i++) {
+        crypto_builtin_hmac_sha256_update(&ctx, iov[i].data, iov[i].len);
+    }
+    crypto_builtin_hmac_sha256_final(&ctx, output);
+    signal_explicit_bzero(&ctx, sizeof(ctx));
+    return 0;
+}
+
+static int builtin_sha512_digest_init(void **digest_context, void *user_data)
+{
+    crypto_builtin_sha512_ctx *ctx = malloc(sizeof(crypto_builtin_sha512_ctx));
+    if(!ctx) {
+        return SG_ERR_NOMEM;
+    }
+    crypto_builtin_sha512_init(ctx);
+    *digest_context = ctx;
+    return 0;
+}
+
+static int builtin_sha512_digest_update(void *digest_context, const uint8_t *data, size_t data_len, void *user_data)
+{
+    crypto_builtin_sha512_update(digest_context, data, data_len);
+    return 0;
+}
+
+static int builtin_sha512_digest_final(void *digest_context, signal_buffer **output, void *user_data)
+{
+    signal_buffer *output_buffer = signal_buffer_alloc(CRYPTO_BUILTIN_SHA512_DIGEST_SIZE);
+    if(!output_buffer) {
+        return SG_ERR_NOMEM;
+    }
+    crypto_builtin_sha512_final(digest_context, signal_buffer_data(output_buffer));
+    /* Callers reuse the context for the next digest */
+    crypto_builtin_sha512_init(digest_context);
+    *output = output_buffer;
+    return 0;
+}
+
+static void builtin_sha512_digest_cleanup(void *digest_context, void *user_data)
+{
+    if(digest_context) {
+        signal_explicit_bzero(digest_context, sizeof(crypto_builtin_sha512_ctx));
+        free(digest_context);
+    }
+}
+
+static int builtin_encrypt(signal_buffer **output,
+        int cipher,
+        const uint8_t *key, size_t key_len,
+        const uint8_t *iv, size_t iv_len,
+        const uint8_t *plaintext, size_t plaintext_len,
+        void *user_data)
+{
+    int result = 0;
+    crypto_builtin_aes_key aes_key;
+    uint8_t chain[CRYPTO_BUILTIN_AES_BLOCK_SIZE];
+    signal_buffer *output_buffer = 0;
+    uint8_t *data;
+    size_t full_len;
+    size_t pad_len;
+
+    if(iv_len != CRYPTO_BUILTIN_AES_BLOCK_SIZE
+            || (cipher != SG_CIPHER_AES_CTR_NOPADDING && cipher != SG_CIPHER_AES_CBC_PKCS5)) {
+        return SG_ERR_UNKNOWN;
+    }
+    if(crypto_builtin_aes_set_key(&aes_key, key, key_len) < 0) {
+        return SG_ERR_UNKNOWN;
+    }
+    memcpy(chain, iv, sizeof(chain));
+
+    if(cipher == SG_CIPHER_AES_CTR_NOPADDING) {
+        output_buffer = signal_buffer_alloc(plaintext_len);
+        if(!output_buffer) {
+            result = SG_ERR_NOMEM;
+            goto complete;
+        }
+        crypto_builtin_aes_ctr(&aes_key, chain, plaintext, signal_buffer_data(output_buffer), plaintext_len);
+    }
+    else {
+        pad_len = CRYPTO_BUILTIN_AES_BLOCK_SIZE - (plaintext_len % CRYPTO_BUILTIN_AES_BLOCK_SIZE);
+        if(plaintext_len > SIZE_MAX - pad_len) {
+            result = SG_ERR_UNKNOWN;
+            goto complete;
+        }
+        output_buffer = signal_buffer_alloc(plaintext_len + pad_len);
+        if(!output_buffer) {
+            result = SG_ERR_NOMEM;
+            goto complete;
+        }
+        data = signal_buffer_data(output_buffer);
+        full_len = plaintext_len - (plaintext_len % CRYPTO_BUILTIN_AES_BLOCK_SIZE);
+        memcpy(data, plaintext, plaintext_len);
+        memset(data + plaintext_len, (int)pad_len, pad_len);
+        crypto_builtin_aes_cbc_encrypt(&aes_key, chain, data, data,
+                (full_len / CRYPTO_BUILTIN_AES_BLOCK_SIZE) + 1);
+    }
+
+complete:
+    signal_explicit_bzero(&aes_key, sizeof(aes_key));
+    if(result >= 0) {
+        *output = output_buffer;
+    }
+    else {
+        signal_buffer_free(output_buffer);
+    }
+    return result;
+}
+
+static int builtin_decrypt(signal_buffer **output,
+        int cipher,
+        const uint8_t *key, size_t key_len,
+        const uint8_t *iv, size_t iv_len,
+        const uint8_t *ciphertext, size_t ciphertext_len,
+        void *user_data)
+{
+    int result = 0;
+    crypto_builtin_aes_key aes_key;
+    uint8_t chain[CRYPTO_BUILTIN_AES_BLOCK_SIZE];
+    uint8_t last[CRYPTO_BUILTIN_AES_BLOCK_SIZE];
+    signal_buffer *output_buffer = 0;
+    size_t last_offset;
+    size_t full_blocks;
+    unsigned int pad_len;
+    unsigned int bad;
+    unsigned int i;
+
+    if(iv_len != CRYPTO_BUILTIN_AES_BLOCK_SIZE
+            || (cipher != SG_CIPHER_AES_CTR_NOPADDING && cipher != SG_CIPHER_AES_CBC_PKCS5)) {
+        return SG_ERR_UNKNOWN;
+    }
+    if(crypto_builtin_aes_set_key(&aes_key, key, key_len) < 0) {
+        return SG_ERR_UNKNOWN;
+    }
+
+    if(cipher == SG_CIPHER_AES_CTR_NOPADDING) {
+        memcpy(chain, iv, sizeof(chain));
+        output_buffer = signal_buffer_alloc(ciphertext_len);
+        if(!output_buffer) {
+            result = SG_ERR_NOMEM;
+            goto complete;
+        }
+        crypto_builtin_aes_ctr(&aes_key, chain, ciphertext, signal_buffer_data(output_buffer), ciphertext_len);
+        goto complete;
+    }
+
+    if(ciphertext_len == 0 || ciphertext_len % CRYPTO_BUILTIN_AES_BLOCK_SIZE != 0) {
+        result = SG_ERR_UNKNOWN;
+        goto complete;
+    }
+
+    /*
+     * Decrypt the final block first, so that the padding length is known
+     * and the plaintext can go straight into an exactly sized buffer.
+     */
+    last_offset = ciphertext_len - CRYPTO_BUILTIN_AES_BLOCK_SIZE;
+    memcpy(chain, last_offset > 0 ? ciphertext + last_offset - CRYPTO_BUILTIN_AES_BLOCK_SIZE : iv, sizeof(chain));
+    crypto_builtin_aes_cbc_decrypt(&aes_key, chain, ciphertext + last_offset, last, 1);
+
+    pad_len = last[CRYPTO_BUILTIN_AES_BLOCK_SIZE - 1];
+    bad = ((pad_len - 1) >> 8) | ((CRYPTO_BUILTIN_AES_BLOCK_SIZE - pad_len) >> 8);
+    for(i = 0; i < CRYPTO_BUILTIN_AES_BLOCK_SIZE; i++) {
+        /* in_pad is all ones for the trailing pad_len bytes */
+        unsigned int in_pad = 0U - (((CRYPTO_BUILTIN_AES_BLOCK_SIZE - 1 - i - pad_len) >> 8) & 1);
+        bad |= in_pad & (last[i] ^ pad_len);
+    }
+    if(bad) {
+        result = SG_ERR_UNKNOWN;
+        goto complete;
+    }
+
+    output_buffer = signal_buffer_alloc(ciphertext_len - pad_len);
+    if(!output_buffer) {
+        result = SG_ERR_NOMEM;
+        goto complete;
+    }
+
+    full_blocks = last_offset / CRYPTO_BUILTIN_AES_BLOCK_SIZE;
+    if(full_blocks > 0) {
+        memcpy(chain, iv, sizeof(chain));
+        crypto_builtin_aes_cbc_decrypt(&aes_key, chain, ciphertext, signal_buffer_data(output_buffer), full_blocks);
+    }
+    memcpy(signal_buffer_data(output_buffer) + last_offset, last, CRYPTO_BUILTIN_AES_BLOCK_SIZE - pad_len);
+
+complete:
+    signal_explicit_bzero(&aes_key, sizeof(aes_key));
+    signal_explicit_bzero(last, sizeof(last));
+    if(result >= 0) {
+        *output = output_buffer;
+    }
+    else {
+        signal_buffer_bzero_free(output_buffer);
+    }
+    return result;
+}
+
+void signal_crypto_builtin_provider(signal_crypto_provider *provider)
+{
+    memset(provider, 0, sizeof(signal_crypto_provider));
+    provider->random_func = builtin_random;
+    provider->hmac_sha256_init_func = builtin_hmac_sha256_init;
+    provider->hmac_sha256_update_func = builtin_hmac_sha256_update;
+    provider->hmac_sha256_final_func = builtin_hmac_sha256_final;
+    provider->hmac_sha256_cleanup_func = builtin_hmac_sha256_cleanup;
+    provider->sha512_digest_init_func = builtin_sha512_digest_init;
+    provider->sha512_digest_update_func = builtin_sha512_digest_update;
+    provider->sha512_digest_final_func = builtin_sha512_digest_final;
+    provider->sha512_digest_cleanup_func = builtin_sha512_digest_cleanup;
+    provider->encrypt_func = builtin_encrypt;
+    provider->decrypt_func = builtin_decrypt;
+    provider->hmac_sha256_oneshot_func = builtin_hmac_sha256_oneshot;
+    provider->hmac_sha256_final_reset_func = builtin_hmac_sha256_final_reset;
+}
+
+int signal_context_set_builtin_crypto_provider(signal_context *context)
+{
+    signal_crypto_provider provider;
+    signal_crypto_builtin_provider(&provider);
+    return signal_context_set_crypto_provider(context, &provider);
+}
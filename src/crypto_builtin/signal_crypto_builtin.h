@@ -0,0 +1,41 @@
+#ifndef SIGNAL_CRYPTO_BUILTIN_H
+#define SIGNAL_CRYPTO_BUILTIN_H
+
+#include "signal_protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Fill in a crypto provider backed by the implementations in the
+ * signal-protocol-c-crypto-builtin library.
+ *
+ * SHA-256, HMAC-SHA256 and AES-CBC/CTR are implemented without secret
+ * dependent table lookups or branches, and use the AES-NI and SHA
+ * extensions when the CPU supports them. SHA-512 reuses the implementation
+ * vendored for ed25519. Randomness comes from the operating system.
+ *
+ * The optional one-shot and final-reset HMAC callbacks are provided, so
+ * the HMAC calculations done by the library itself need no heap allocated
+ * context.
+ *
+ * @param provider the provider structure to fill in
+ */
+void signal_crypto_builtin_provider(signal_crypto_provider *provider);
+
+/**
+ * Install the built-in crypto provider on a global context.
+ * Shorthand for signal_crypto_builtin_provider() followed by
+ * signal_context_set_crypto_provider().
+ *
+ * @param context global context for the library
+ * @return 0 on success, negative on failure
+ */
+int signal_context_set_builtin_crypto_provider(signal_context *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SIGNAL_CRYPTO_BUILTIN_H */
@@ -7,6 +7,7 @@
 
 #include "curve25519/curve25519-donna.h"
 #include "curve25519/ed25519/additions/curve_sigs.h"
+#include "curve25519/ed25519/additions/keygen.h"
 #include "curve25519/ed25519/additions/generalized/gen_x.h"
 #include "curve25519/ed25519/tests/internal_fast_tests.h"
 #include "signal_protocol_internal.h"
@@ -14,18 +15,36 @@
 
 #define DJB_TYPE 0x05
 #define DJB_KEY_LEN 32
+#define CURVE_SIGNING_PUBLIC_LEN 32
 #define VRF_VERIFY_LEN 32
+#define VERIFY_BATCH_SIZE 64
+#define VERIFY_BATCH_RANDOM_LEN 16
 
 struct ec_public_key
 {
     signal_type_base base;
-    uint8_t data[DJB_KEY_LEN];
+    /* The key type byte followed by the key, which is also its serialized form */
+    uint8_t serialized[EC_PUBLIC_KEY_SERIALIZED_LENGTH];
+    signal_context *global_context;
+    /* The decoded Edwards point for each signature sign bit, created on first use */
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    curve25519_verify_key *_Atomic verify_keys[2];
+#else
+    curve25519_verify_key *verify_keys[2];
+#endif
 };
 
 struct ec_private_key
 {
     signal_type_base base;
     uint8_t data[DJB_KEY_LEN];
+    signal_context *global_context;
+    /* The Edwards public key signatures are made with, computed on first use */
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    uint8_t *_Atomic signing_public;
+#else
+    uint8_t *signing_public;
+#endif
 };
 
 struct ec_key_pair
@@ -33,6 +52,7 @@ struct ec_key_pair
     signal_type_base base;
     ec_public_key *public_key;
     ec_private_key *private_key;
+    signal_context *global_context;
 };
 
 struct ec_public_key_list
@@ -47,6 +67,58 @@ int curve_internal_fast_tests(int silent)
     return 0;
 }
 
+static void ec_public_key_init_verify_keys(ec_public_key *key)
+{
+    int i;
+    for(i = 0; i < 2; i++) {
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+        atomic_init(&key->verify_keys[i], 0);
+#else
+        key->verify_keys[i] = 0;
+#endif
+    }
+}
+
+/*
+ * Returns the decoded form of the key for signatures with the given sign
+ * bit, decoding it on first use. Returns 0 if it could not be allocated.
+ */
+static const curve25519_verify_key *ec_public_key_get_verify_key(const ec_public_key *key, uint8_t sign_bit)
+{
+    ec_public_key *mutable_key = (ec_public_key *)key;
+    int index = (sign_bit & 0x80) ? 1 : 0;
+    curve25519_verify_key *verify_key;
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    curve25519_verify_key *expected = 0;
+
+    /* Acquire pairs with the release below, so the decoded key is visible */
+    verify_key = atomic_load_explicit(&mutable_key->verify_keys[index], memory_order_acquire);
+#else
+    verify_key = key->verify_keys[index];
+#endif
+    if(verify_key) {
+        return verify_key;
+    }
+
+    verify_key = signal_malloc(key->global_context, curve25519_verify_key_size());
+    if(!verify_key) {
+        return 0;
+    }
+    curve25519_verify_key_init(verify_key, key->serialized + 1, sign_bit & 0x80);
+
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    /* Another thread may have decoded it first, in which case use theirs */
+    if(!atomic_compare_exchange_strong_explicit(&mutable_key->verify_keys[index],
+            &expected, verify_key, memory_order_acq_rel, memory_order_acquire)) {
+        signal_free(key->global_context, verify_key);
+        verify_key = expected;
+    }
+#else
+    mutable_key->verify_keys[index] = verify_key;
+#endif
+    return verify_key;
+}
+
 int curve_decode_point(ec_public_key **public_key, const uint8_t *key_data, size_t key_len, signal_context *global_context)
 {
     ec_public_key *key = 0;
@@ -61,14 +133,16 @@ int curve_decode_point(ec_public_key **public_key, const uint8_t *key_data, size
         return SG_ERR_INVALID_KEY;
     }
 
-    key = malloc(sizeof(ec_public_key));
+    key = signal_malloc(global_context, sizeof(ec_public_key));
     if(!key) {
         return SG_ERR_NOMEM;
     }
 
     SIGNAL_INIT(key, ec_public_key_destroy);
+    key->global_context = global_context;
+    ec_public_key_init_verify_keys(key);
 
-    memcpy(key->data, key_data + 1, DJB_KEY_LEN);
+    memcpy(key->serialized, key_data, EC_PUBLIC_KEY_SERIALIZED_LENGTH);
 
     *public_key = key;
 
@@ -87,7 +161,7 @@ int ec_public_key_compare(const ec_public_key *key1, const ec_public_key *key2)
         return 1;
     }
     else {
-        return signal_constant_memcmp(key1->data, key2->data, DJB_KEY_LEN);
+        return signal_constant_memcmp(key1->serialized + 1, key2->serialized + 1, DJB_KEY_LEN);
     }
 }
 
@@ -103,7 +177,7 @@ int ec_public_key_memcmp(const ec_public_key *key1, const ec_public_key *key2)
         return 1;
     }
     else {
-        return memcmp(key1->data, key2->data, DJB_KEY_LEN);
+        return memcmp(key1->serialized + 1, key2->serialized + 1, DJB_KEY_LEN);
     }
 }
 
@@ -116,21 +190,34 @@ int ec_public_key_serialize(signal_buffer **buffer, const ec_public_key *key)
         return SG_ERR_INVAL;
     }
 
-    buf = signal_buffer_alloc(sizeof(uint8_t) * (DJB_KEY_LEN + 1));
+    buf = signal_buffer_context_alloc(key->global_context, sizeof(uint8_t) * (DJB_KEY_LEN + 1));
     if(!buf) {
         return SG_ERR_NOMEM;
     }
 
     data = signal_buffer_data(buf);
-    data[0] = DJB_TYPE;
-    memcpy(data + 1, key->data, DJB_KEY_LEN);
+    memcpy(data, key->serialized, EC_PUBLIC_KEY_SERIALIZED_LENGTH);
 
     *buffer = buf;
 
     return 0;
 }
 
-int ec_public_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_public_key *key)
+void ec_public_key_serialize_into(uint8_t *data, const ec_public_key *key)
+{
+    assert(data);
+    assert(key);
+
+    memcpy(data, key->serialized, EC_PUBLIC_KEY_SERIALIZED_LENGTH);
+}
+
+const uint8_t *ec_public_key_get_serialized(const ec_public_key *key)
+{
+    assert(key);
+    return key->serialized;
+}
+
+int ec_public_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_public_key *key, signal_arena *arena)
 {
     size_t len = 0;
     uint8_t *data = 0;
@@ -138,15 +225,12 @@ int ec_public_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_publi
     assert(buffer);
     assert(key);
 
-    len = sizeof(uint8_t) * (DJB_KEY_LEN + 1);
-    data = malloc(len);
+    len = sizeof(uint8_t) * EC_PUBLIC_KEY_SERIALIZED_LENGTH;
+    data = signal_arena_memdup(arena, key->serialized, len);
     if(!data) {
         return SG_ERR_NOMEM;
     }
 
-    data[0] = DJB_TYPE;
-    memcpy(data + 1, key->data, DJB_KEY_LEN);
-
     buffer->data = data;
     buffer->len = len;
     return 0;
@@ -155,7 +239,13 @@ int ec_public_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_publi
 void ec_public_key_destroy(signal_type_base *type)
 {
     ec_public_key *public_key = (ec_public_key *)type;
-    free(public_key);
+    int i;
+    for(i = 0; i < 2; i++) {
+        if(public_key->verify_keys[i]) {
+            signal_free(public_key->global_context, public_key->verify_keys[i]);
+        }
+    }
+    signal_free(public_key->global_context, public_key);
 }
 
 int curve_decode_private_point(ec_private_key **private_key, const uint8_t *key_data, size_t key_len, signal_context *global_context)
@@ -167,12 +257,18 @@ int curve_decode_private_point(ec_private_key **private_key, const uint8_t *key_
         return SG_ERR_INVALID_KEY;
     }
 
-    key = malloc(sizeof(ec_private_key));
+    key = signal_malloc(global_context, sizeof(ec_private_key));
     if(!key) {
         return SG_ERR_NOMEM;
     }
 
     SIGNAL_INIT(key, ec_private_key_destroy);
+    key->global_context = global_context;
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    atomic_init(&key->signing_public, 0);
+#else
+    key->signing_public = 0;
+#endif
 
     memcpy(key->data, key_data, DJB_KEY_LEN);
 
@@ -202,7 +298,7 @@ int ec_private_key_serialize(signal_buffer **buffer, const ec_private_key *key)
     signal_buffer *buf = 0;
     uint8_t *data = 0 ;
     
-    buf = signal_buffer_alloc(sizeof(uint8_t) * DJB_KEY_LEN);
+    buf = signal_buffer_context_alloc(key->global_context, sizeof(uint8_t) * DJB_KEY_LEN);
     if(!buf) {
         return SG_ERR_NOMEM;
     }
@@ -215,7 +311,7 @@ int ec_private_key_serialize(signal_buffer **buffer, const ec_private_key *key)
     return 0;
 }
 
-int ec_private_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_private_key *key)
+int ec_private_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_private_key *key, signal_arena *arena)
 {
     size_t len = 0;
     uint8_t *data = 0;
@@ -224,13 +320,11 @@ int ec_private_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_priv
     assert(key);
 
     len = sizeof(uint8_t) * DJB_KEY_LEN;
-    data = malloc(len);
+    data = signal_arena_memdup(arena, key->data, len);
     if(!data) {
         return SG_ERR_NOMEM;
     }
 
-    memcpy(data, key->data, DJB_KEY_LEN);
-
     buffer->data = data;
     buffer->len = len;
     return 0;
@@ -239,18 +333,24 @@ int ec_private_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_priv
 void ec_private_key_destroy(signal_type_base *type)
 {
     ec_private_key *private_key = (ec_private_key *)type;
+    signal_context *global_context = private_key->global_context;
+    if(private_key->signing_public) {
+        signal_explicit_bzero(private_key->signing_public, CURVE_SIGNING_PUBLIC_LEN);
+        signal_free(global_context, private_key->signing_public);
+    }
     signal_explicit_bzero(private_key, sizeof(ec_private_key));
-    free(private_key);
+    signal_free(global_context, private_key);
 }
 
 int ec_key_pair_create(ec_key_pair **key_pair, ec_public_key *public_key, ec_private_key *private_key)
 {
-    ec_key_pair *result = malloc(sizeof(ec_key_pair));
+    ec_key_pair *result = signal_malloc(public_key->global_context, sizeof(ec_key_pair));
     if(!result) {
         return SG_ERR_NOMEM;
     }
 
     SIGNAL_INIT(result, ec_key_pair_destroy);
+    result->global_context = public_key->global_context;
     result->public_key = public_key;
     SIGNAL_REF(public_key);
     result->private_key = private_key;
@@ -276,7 +376,7 @@ void ec_key_pair_destroy(signal_type_base *type)
     ec_key_pair *key_pair = (ec_key_pair *)type;
     SIGNAL_UNREF(key_pair->public_key);
     SIGNAL_UNREF(key_pair->private_key);
-    free(key_pair);
+    signal_free(key_pair->global_context, key_pair);
 }
 
 int curve_generate_private_key(signal_context *context, ec_private_key **private_key)
@@ -286,13 +386,19 @@ int curve_generate_private_key(signal_context *context, ec_private_key **private
 
     assert(context);
 
-    key = malloc(sizeof(ec_private_key));
+    key = signal_malloc(context, sizeof(ec_private_key));
     if(!key) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
 
     SIGNAL_INIT(key, ec_private_key_destroy);
+    key->global_context = context;
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    atomic_init(&key->signing_public, 0);
+#else
+    key->signing_public = 0;
+#endif
 
     result = signal_crypto_random(context, key->data, DJB_KEY_LEN);
     if(result < 0) {
@@ -321,14 +427,28 @@ int curve_generate_public_key(ec_public_key **public_key, const ec_private_key *
     static const uint8_t basepoint[32] = {9};
     int result = 0;
 
-    ec_public_key *key = malloc(sizeof(ec_public_key));
+    ec_public_key *key = signal_malloc(private_key->global_context, sizeof(ec_public_key));
     if(!key) {
         return SG_ERR_NOMEM;
     }
 
     SIGNAL_INIT(key, ec_public_key_destroy);
-
-    result = curve25519_donna(key->data, private_key->data, basepoint);
+    key->global_context = private_key->global_context;
+    ec_public_key_init_verify_keys(key);
+
+    key->serialized[0] = DJB_TYPE;
+    if(!(private_key->data[31] & 0x80)) {
+        /*
+         * Multiply the Edwards base point using its precomputed tables and
+         * map the result to Montgomery form, which matches the ladder for
+         * any scalar below 2^255. Keys decoded from elsewhere may not be
+         * clamped, so the ladder still handles the top bit being set.
+         */
+        curve25519_keygen(key->serialized + 1, private_key->data);
+    }
+    else {
+        result = curve25519_donna(key->serialized + 1, private_key->data, basepoint);
+    }
 
     if(result == 0) {
         *public_key = key;
@@ -525,7 +645,7 @@ int curve_calculate_agreement(uint8_t **shared_key_data, const ec_public_key *pu
         return SG_ERR_NOMEM;
     }
 
-    result = curve25519_donna(key, private_key->data, public_key->data);
+    result = curve25519_donna(key, private_key->data, public_key->serialized + 1);
 
     if(result == 0) {
         *shared_key_data = key;
@@ -543,11 +663,147 @@ int curve_verify_signature(const ec_public_key *signing_key,
         const uint8_t *message_data, size_t message_len,
         const uint8_t *signature_data, size_t signature_len)
 {
+    const curve25519_verify_key *verify_key = 0;
+
     if(signature_len != CURVE_SIGNATURE_LEN) {
         return SG_ERR_INVAL;
     }
 
-    return curve25519_verify(signature_data, signing_key->data, message_data, message_len) == 0;
+    verify_key = ec_public_key_get_verify_key(signing_key, signature_data[63]);
+    if(!verify_key) {
+        return curve25519_verify(signature_data, signing_key->serialized + 1, message_data, message_len) == 0;
+    }
+    return curve25519_verify_with_key(signature_data, verify_key, message_data, message_len) == 0;
+}
+
+int curve_verify_signature_batch(signal_context *context,
+        curve_signature_batch_entry *entries, size_t count)
+{
+    int result = 0;
+    int all_valid = 1;
+    uint8_t *scratch = 0;
+    size_t max_message_len = 0;
+    size_t batch_len = 0;
+    size_t i = 0;
+    size_t j;
+    curve_signature_batch_entry *batch[VERIFY_BATCH_SIZE];
+    const unsigned char *signatures[VERIFY_BATCH_SIZE];
+    const unsigned char *public_keys[VERIFY_BATCH_SIZE];
+    const curve25519_verify_key *verify_keys[VERIFY_BATCH_SIZE];
+    const unsigned char *messages[VERIFY_BATCH_SIZE];
+    unsigned long message_lens[VERIFY_BATCH_SIZE];
+    uint8_t random_data[VERIFY_BATCH_SIZE * VERIFY_BATCH_RANDOM_LEN];
+
+    for(j = 0; j < count; j++) {
+        if(entries[j].message_len > max_message_len) {
+            max_message_len = entries[j].message_len;
+        }
+    }
+
+    while(i < count) {
+        /* Gather the next batch, settling malformed entries as we go */
+        batch_len = 0;
+        for(; i < count && batch_len < VERIFY_BATCH_SIZE; i++) {
+            if(entries[i].signature_len != CURVE_SIGNATURE_LEN) {
+                entries[i].result = SG_ERR_INVAL;
+                all_valid = 0;
+                continue;
+            }
+            batch[batch_len] = &entries[i];
+            signatures[batch_len] = entries[i].signature_data;
+            public_keys[batch_len] = entries[i].signing_key->serialized + 1;
+            verify_keys[batch_len] = ec_public_key_get_verify_key(
+                    entries[i].signing_key, entries[i].signature_data[63]);
+            messages[batch_len] = entries[i].message_data;
+            message_lens[batch_len] = entries[i].message_len;
+            batch_len++;
+        }
+
+        if(batch_len > 1) {
+            if(!scratch) {
+                scratch = signal_malloc(context, curve25519_verify_batch_scratch_size(
+                        count < VERIFY_BATCH_SIZE ? count : VERIFY_BATCH_SIZE, max_message_len));
+                if(!scratch) {
+                    result = SG_ERR_NOMEM;
+                    goto complete;
+                }
+            }
+
+            result = signal_crypto_random(context, random_data, batch_len * VERIFY_BATCH_RANDOM_LEN);
+            if(result < 0) {
+                goto complete;
+            }
+
+            if(curve25519_verify_batch(scratch, signatures, public_keys, verify_keys,
+                    messages, message_lens, batch_len, random_data) == 0) {
+                for(j = 0; j < batch_len; j++) {
+                    batch[j]->result = 1;
+                }
+                continue;
+            }
+        }
+
+        for(j = 0; j < batch_len; j++) {
+            if(verify_keys[j]) {
+                batch[j]->result = curve25519_verify_with_key(signatures[j], verify_keys[j], messages[j], message_lens[j]) == 0;
+            }
+            else {
+                batch[j]->result = curve25519_verify(signatures[j], public_keys[j], messages[j], message_lens[j]) == 0;
+            }
+            if(!batch[j]->result) {
+                all_valid = 0;
+            }
+        }
+    }
+
+complete:
+    if(scratch) {
+        signal_free(context, scratch);
+    }
+    if(result < 0) {
+        return result;
+    }
+    return all_valid;
+}
+
+/*
+ * Returns the Edwards public key for signing with the key, computing it on
+ * first use. Returns 0 if it could not be allocated.
+ */
+static const uint8_t *ec_private_key_get_signing_public(const ec_private_key *key)
+{
+    ec_private_key *mutable_key = (ec_private_key *)key;
+    uint8_t *signing_public;
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    uint8_t *expected = 0;
+
+    /* Acquire pairs with the release below, so the computed key is visible */
+    signing_public = atomic_load_explicit(&mutable_key->signing_public, memory_order_acquire);
+#else
+    signing_public = key->signing_public;
+#endif
+    if(signing_public) {
+        return signing_public;
+    }
+
+    signing_public = signal_malloc(key->global_context, CURVE_SIGNING_PUBLIC_LEN);
+    if(!signing_public) {
+        return 0;
+    }
+    curve25519_sign_pubkey(signing_public, key->data);
+
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    /* Another thread may have computed it first, in which case use theirs */
+    if(!atomic_compare_exchange_strong_explicit(&mutable_key->signing_public,
+            &expected, signing_public, memory_order_acq_rel, memory_order_acquire)) {
+        signal_explicit_bzero(signing_public, CURVE_SIGNING_PUBLIC_LEN);
+        signal_free(key->global_context, signing_public);
+        signing_public = expected;
+    }
+#else
+    mutable_key->signing_public = signing_public;
+#endif
+    return signing_public;
 }
 
 int curve_calculate_signature(signal_context *context,
@@ -558,19 +814,27 @@ int curve_calculate_signature(signal_context *context,
     int result = 0;
     uint8_t random_data[CURVE_SIGNATURE_LEN];
     signal_buffer *buffer = 0;
+    const uint8_t *signing_public = 0;
 
     result = signal_crypto_random(context, random_data, sizeof(random_data));
     if(result < 0) {
         goto complete;
     }
 
-    buffer = signal_buffer_alloc(CURVE_SIGNATURE_LEN);
+    buffer = signal_buffer_context_alloc(context, CURVE_SIGNATURE_LEN);
     if(!buffer) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
 
-    result = curve25519_sign(signal_buffer_data(buffer), signing_key->data, message_data, message_len, random_data);
+    signing_public = ec_private_key_get_signing_public(signing_key);
+    if(signing_public) {
+        result = curve25519_sign_with_pubkey(signal_buffer_data(buffer), signing_key->data, signing_public,
+                message_data, message_len, random_data);
+    }
+    else {
+        result = curve25519_sign(signal_buffer_data(buffer), signing_key->data, message_data, message_len, random_data);
+    }
 
 complete:
     if(result < 0) {
@@ -602,14 +866,14 @@ int curve_verify_vrf_signature(signal_context *context,
         return SG_ERR_VRF_SIG_VERIF_FAILED;
     }
 
-    buffer = signal_buffer_alloc(VRF_VERIFY_LEN);
+    buffer = signal_buffer_context_alloc(context, VRF_VERIFY_LEN);
     if(!buffer) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
 
     result = generalized_xveddsa_25519_verify(signal_buffer_data(buffer),
-            signature_data, signing_key->data,
+            signature_data, signing_key->serialized + 1,
             message_data, message_len, NULL, 0);
     if(result != 0) {
         signal_log(context, SG_LOG_ERROR, "Invalid signature");
@@ -640,7 +904,7 @@ int curve_calculate_vrf_signature(signal_context *context,
         goto complete;
     }
 
-    buffer = signal_buffer_alloc(VRF_SIGNATURE_LEN);
+    buffer = signal_buffer_context_alloc(context, VRF_SIGNATURE_LEN);
     if(!buffer) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -14,6 +14,11 @@ extern "C" {
 
 int curve_internal_fast_tests(int silent);
 
+/*
+ * Keys and key pairs are immutable once created. With SIGNAL_ATOMIC_REFCOUNT
+ * they may be shared between threads and used concurrently without locking.
+ */
+
 int curve_decode_point(ec_public_key **public_key, const uint8_t *key_data, size_t key_len, signal_context *global_context);
 int ec_public_key_compare(const ec_public_key *key1, const ec_public_key *key2);
 int ec_public_key_memcmp(const ec_public_key *key1, const ec_public_key *key2);
@@ -144,6 +149,37 @@ int curve_verify_signature(const ec_public_key *signing_key,
         const uint8_t *message_data, size_t message_len,
         const uint8_t *signature_data, size_t signature_len);
 
+/**
+ * One signature to check with curve_verify_signature_batch().
+ */
+typedef struct curve_signature_batch_entry {
+    const ec_public_key *signing_key;
+    const uint8_t *message_data;
+    size_t message_len;
+    const uint8_t *signature_data;
+    size_t signature_len;
+    /** Set to what curve_verify_signature() returns for this entry */
+    int result;
+} curve_signature_batch_entry;
+
+/**
+ * Verify several Curve25519 signatures at once.
+ *
+ * The signatures are checked together with a random linear combination,
+ * which costs much less than checking them one at a time. If that check
+ * fails, the entries are checked one at a time to find the invalid ones.
+ *
+ * A batch can accept a signature that curve_verify_signature() rejects
+ * only if its signer crafted it with a small-order component, which never
+ * lets anyone else forge a signature.
+ *
+ * @param entries The signatures to verify, each result is set on return.
+ * @param count The number of entries.
+ * @return 1 if all are valid, 0 if any is not, negative on failure
+ */
+int curve_verify_signature_batch(signal_context *context,
+        curve_signature_batch_entry *entries, size_t count);
+
 /**
  * Calculates a Curve25519 signature.
  *
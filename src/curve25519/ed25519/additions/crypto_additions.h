@@ -23,6 +23,11 @@ void ge_montx_to_p3(ge_p3* p, const fe u, const unsigned char ed_sign_bit);
 void ge_p3_to_montx(fe u, const ge_p3 *p);
 void ge_scalarmult(ge_p3 *h, const unsigned char *a, const ge_p3 *A);
 void ge_scalarmult_cofactor(ge_p3 *q, const ge_p3 *p);
+void ge_multi_scalarmult_slide(signed char *aslide, const unsigned char *a);
+void ge_multi_scalarmult_table(ge_cached *table, const ge_p3 *A);
+void ge_multi_scalarmult_vartime(ge_p2 *r, const unsigned char *b,
+                                 const ge_cached *tables, const signed char *slides,
+                                 unsigned long count);
 
 void elligator(fe u, const fe r);
 void hash_to_point(ge_p3* p, const unsigned char* msg, const unsigned long in_len);
@@ -4,14 +4,40 @@
 #include "curve_sigs.h"
 #include "crypto_sign.h"
 #include "crypto_additions.h"
+#include "crypto_hash_sha512.h"
+#include "sc.h"
+#include "crypto_verify_32.h"
+
+#define VERIFY_KEY_STACK_MSG_LEN 256
+
+void curve25519_sign_pubkey(unsigned char* ed_pubkey_out,
+                            const unsigned char* curve25519_privkey)
+{
+  ge_p3 ed_pubkey_point; /* Ed25519 pubkey point */
+
+  /* Convert the Curve25519 privkey to an Ed25519 public key */
+  ge_scalarmult_base(&ed_pubkey_point, curve25519_privkey);
+  ge_p3_tobytes(ed_pubkey_out, &ed_pubkey_point);
+}
 
 int curve25519_sign(unsigned char* signature_out,
                     const unsigned char* curve25519_privkey,
                     const unsigned char* msg, const unsigned long msg_len,
                     const unsigned char* random)
 {
-  ge_p3 ed_pubkey_point; /* Ed25519 pubkey point */
   unsigned char ed_pubkey[32]; /* Ed25519 encoded pubkey */
+
+  curve25519_sign_pubkey(ed_pubkey, curve25519_privkey);
+  return curve25519_sign_with_pubkey(signature_out, curve25519_privkey, ed_pubkey,
+                                     msg, msg_len, random);
+}
+
+int curve25519_sign_with_pubkey(unsigned char* signature_out,
+                                const unsigned char* curve25519_privkey,
+                                const unsigned char* ed_pubkey,
+                                const unsigned char* msg, const unsigned long msg_len,
+                                const unsigned char* random)
+{
   unsigned char *sigbuf; /* working buffer */
   unsigned char sign_bit = 0;
 
@@ -20,9 +46,6 @@ int curve25519_sign(unsigned char* signature_out,
     return -1;
   }
 
-  /* Convert the Curve25519 privkey to an Ed25519 public key */
-  ge_scalarmult_base(&ed_pubkey_point, curve25519_privkey);
-  ge_p3_tobytes(ed_pubkey, &ed_pubkey_point);
   sign_bit = ed_pubkey[31] & 0x80;
 
   /* Perform an Ed25519 signature with explicit private key */
@@ -100,3 +123,181 @@ int curve25519_verify(const unsigned char* signature,
 
   return result;
 }
+
+struct curve25519_verify_key {
+  unsigned char ed_pubkey[32]; /* Ed25519 encoding, sign bit included */
+  int valid;
+  ge_cached table[8]; /* -A,-3A,...,-15A */
+};
+
+/* Converts a Curve25519 public key as curve25519_verify() does, and decodes
+   the negated Edwards point, returns 0 on success */
+static int curve25519_decode_verify_key(unsigned char* ed_pubkey, ge_p3* A,
+                                        const unsigned char* curve25519_pubkey,
+                                        unsigned char sign_bit)
+{
+  fe u;
+  fe y;
+
+  fe_frombytes(u, curve25519_pubkey);
+  fe_montx_to_edy(y, u);
+  fe_tobytes(ed_pubkey, y);
+  ed_pubkey[31] &= 0x7F;
+  ed_pubkey[31] |= (sign_bit & 0x80);
+
+  return ge_frombytes_negate_vartime(A, ed_pubkey);
+}
+
+unsigned long curve25519_verify_key_size(void)
+{
+  return sizeof(curve25519_verify_key);
+}
+
+int curve25519_verify_key_init(curve25519_verify_key* key,
+                               const unsigned char* curve25519_pubkey,
+                               unsigned char sign_bit)
+{
+  ge_p3 A;
+
+  memset(key, 0, sizeof(curve25519_verify_key));
+  if (curve25519_decode_verify_key(key->ed_pubkey, &A, curve25519_pubkey, sign_bit) != 0) {
+    /* Keep the encoding so the key still rejects every signature */
+    return 0;
+  }
+  ge_multi_scalarmult_table(key->table, &A);
+  key->valid = 1;
+  return 0;
+}
+
+int curve25519_verify_with_key(const unsigned char* signature,
+                               const curve25519_verify_key* key,
+                               const unsigned char* msg, const unsigned long msg_len)
+{
+  unsigned char stackbuf[64 + VERIFY_KEY_STACK_MSG_LEN];
+  unsigned char *hashbuf = stackbuf;
+  unsigned char h[64];
+  unsigned char s[32];
+  unsigned char rcheck[32];
+  signed char hslide[256];
+  ge_p2 R;
+  int result = -1;
+
+  /* Same checks as crypto_sign_open_modified() */
+  if (!key->valid || (key->ed_pubkey[31] & 0x80) != (signature[63] & 0x80))
+    return -1;
+  memmove(s, signature + 32, 32);
+  s[31] &= 0x7F;
+  if (s[31] & 224)
+    return -1;
+
+  if (msg_len > VERIFY_KEY_STACK_MSG_LEN && (hashbuf = malloc(msg_len + 64)) == 0)
+    return -1;
+
+  memmove(hashbuf, signature, 32);
+  memmove(hashbuf + 32, key->ed_pubkey, 32);
+  memmove(hashbuf + 64, msg, msg_len);
+  crypto_hash_sha512(h, hashbuf, 64 + msg_len);
+  sc_reduce(h);
+
+  /* R = h*(-A) + s*B */
+  ge_multi_scalarmult_slide(hslide, h);
+  ge_multi_scalarmult_vartime(&R, s, key->table, hslide, 1);
+  ge_tobytes(rcheck, &R);
+  if (crypto_verify_32(rcheck, signature) == 0)
+    result = 0;
+
+  if (hashbuf != stackbuf)
+    free(hashbuf);
+  return result;
+}
+
+unsigned long curve25519_verify_batch_scratch_size(unsigned long count,
+                                                   unsigned long max_msg_len)
+{
+  /* Two window tables and two sliding window forms per signature, for
+     z*h*(-A) and z*(-R), followed by the R || A || msg hash input */
+  return 2 * count * (8 * sizeof(ge_cached) + 256) + 64 + max_msg_len;
+}
+
+int curve25519_verify_batch(unsigned char* scratch,
+                            const unsigned char* const* signatures,
+                            const unsigned char* const* curve25519_pubkeys,
+                            const curve25519_verify_key* const* keys,
+                            const unsigned char* const* msgs,
+                            const unsigned long* msg_lens,
+                            unsigned long count,
+                            const unsigned char* random)
+{
+  ge_cached *tables = (ge_cached *)scratch;
+  signed char *slides = (signed char *)(tables + 2 * count * 8);
+  unsigned char *hashbuf = (unsigned char *)(slides + 2 * count * 256);
+  unsigned char zero[32];
+  unsigned char b[32]; /* sum of z*s */
+  unsigned char z[32];
+  unsigned char zh[32];
+  unsigned char h[64];
+  unsigned char s[32];
+  unsigned char ed_pubkey[32];
+  unsigned char rcopy[32];
+  ge_p3 A;
+  ge_p3 R;
+  ge_p2 sum;
+  unsigned long i;
+
+  memset(zero, 0, 32);
+  memset(b, 0, 32);
+  memset(z, 0, 32);
+
+  for (i = 0; i < count; i++) {
+    const unsigned char *signature = signatures[i];
+
+    memmove(s, signature + 32, 32);
+    s[31] &= 0x7F;
+    if (s[31] & 224)
+      return -1;
+
+    if (keys && keys[i]) {
+      if (!keys[i]->valid || (keys[i]->ed_pubkey[31] & 0x80) != (signature[63] & 0x80))
+        return -1;
+      memmove(ed_pubkey, keys[i]->ed_pubkey, 32);
+      memmove(tables + 16 * i, keys[i]->table, sizeof(keys[i]->table));
+    }
+    else {
+      if (curve25519_decode_verify_key(ed_pubkey, &A, curve25519_pubkeys[i], signature[63]) != 0)
+        return -1;
+      ge_multi_scalarmult_table(tables + 16 * i, &A);
+    }
+
+    /* The single check compares R byte for byte with an encoded point,
+       so only canonical encodings of points can pass it */
+    memmove(rcopy, signature, 32);
+    rcopy[31] &= 0x7F;
+    if (!fe_isreduced(rcopy))
+      return -1;
+    if (ge_frombytes_negate_vartime(&R, signature) != 0)
+      return -1;
+    if ((signature[31] & 0x80) && !fe_isnonzero(R.X))
+      return -1;
+
+    memmove(hashbuf, signature, 32);
+    memmove(hashbuf + 32, ed_pubkey, 32);
+    memmove(hashbuf + 64, msgs[i], msg_lens[i]);
+    crypto_hash_sha512(h, hashbuf, 64 + msg_lens[i]);
+    sc_reduce(h);
+
+    /* Weight each equation R = s*B - h*A by a random 128-bit z */
+    memmove(z, random + 16 * i, 16);
+    sc_muladd(zh, z, h, zero);
+    sc_muladd(b, z, s, b);
+
+    ge_multi_scalarmult_slide(slides + 512 * i, zh);
+    ge_multi_scalarmult_table(tables + 16 * i + 8, &R);
+    ge_multi_scalarmult_slide(slides + 512 * i + 256, z);
+  }
+
+  /* sum(z*s)*B - sum(z*h*A) - sum(z*R) is neutral if every equation holds */
+  ge_multi_scalarmult_vartime(&sum, b, tables, slides, 2 * count);
+  if (fe_isnonzero(sum.X) || !fe_isequal(sum.Y, sum.Z))
+    return -1;
+  return 0;
+}
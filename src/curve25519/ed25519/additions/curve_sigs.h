@@ -8,10 +8,55 @@ int curve25519_sign(unsigned char* signature_out, /* 64 bytes */
                      const unsigned char* msg, const unsigned long msg_len, /* <= 256 bytes */
                      const unsigned char* random); /* 64 bytes */
 
+/* computes the Ed25519 public key curve25519_sign() signs with */
+void curve25519_sign_pubkey(unsigned char* ed_pubkey_out, /* 32 bytes */
+                            const unsigned char* curve25519_privkey); /* 32 bytes */
+
+/* returns 0 on success, same as curve25519_sign() given the key from
+   curve25519_sign_pubkey() */
+int curve25519_sign_with_pubkey(unsigned char* signature_out, /* 64 bytes */
+                                const unsigned char* curve25519_privkey, /* 32 bytes */
+                                const unsigned char* ed_pubkey, /* 32 bytes */
+                                const unsigned char* msg, const unsigned long msg_len,
+                                const unsigned char* random); /* 64 bytes */
+
 /* returns 0 on success */
 int curve25519_verify(const unsigned char* signature, /* 64 bytes */
                       const unsigned char* curve25519_pubkey, /* 32 bytes */
                       const unsigned char* msg, const unsigned long msg_len); /* <= 256 bytes */
 
+/* A public key decoded for repeated verification */
+typedef struct curve25519_verify_key curve25519_verify_key;
+
+/* bytes of memory a curve25519_verify_key needs */
+unsigned long curve25519_verify_key_size(void);
+
+/* returns 0; a key that does not decode rejects every signature */
+int curve25519_verify_key_init(curve25519_verify_key* key,
+                               const unsigned char* curve25519_pubkey, /* 32 bytes */
+                               unsigned char sign_bit); /* 0 or 0x80 */
+
+/* returns 0 on success, same result as curve25519_verify() for signatures
+   whose sign bit matches the key */
+int curve25519_verify_with_key(const unsigned char* signature, /* 64 bytes */
+                               const curve25519_verify_key* key,
+                               const unsigned char* msg, const unsigned long msg_len);
+
+/* bytes of scratch space curve25519_verify_batch() needs */
+unsigned long curve25519_verify_batch_scratch_size(unsigned long count,
+                                                   unsigned long max_msg_len);
+
+/* returns 0 if the signatures pass together, -1 if any may not, in which
+   case they must be checked one at a time. The check is cofactorless, so
+   a signature whose R has a small-order component can pass here and still
+   fail curve25519_verify(); only its signer can make one */
+int curve25519_verify_batch(unsigned char* scratch, /* 4-byte aligned */
+                            const unsigned char* const* signatures, /* 64 bytes each */
+                            const unsigned char* const* curve25519_pubkeys, /* 32 bytes each */
+                            const curve25519_verify_key* const* keys, /* optional, entries may be null */
+                            const unsigned char* const* msgs,
+                            const unsigned long* msg_lens, /* each <= max_msg_len */
+                            unsigned long count,
+                            const unsigned char* random); /* 16 bytes per signature */
 
 #endif
@@ -0,0 +1,117 @@
+#include "ge.h"
+#include "crypto_additions.h"
+
+/*
+r = the 256 signed window digits of a, for ge_multi_scalarmult_vartime()
+*/
+
+void ge_multi_scalarmult_slide(signed char *r,const unsigned char *a)
+{
+  int i;
+  int b;
+  int k;
+
+  for (i = 0;i < 256;++i)
+    r[i] = 1 & (a[i >> 3] >> (i & 7));
+
+  for (i = 0;i < 256;++i)
+    if (r[i]) {
+      for (b = 1;b <= 6 && i + b < 256;++b) {
+        if (r[i + b]) {
+          if (r[i] + (r[i + b] << b) <= 15) {
+            r[i] += r[i + b] << b; r[i + b] = 0;
+          } else if (r[i] - (r[i + b] << b) >= -15) {
+            r[i] -= r[i + b] << b;
+            for (k = i + b;k < 256;++k) {
+              if (!r[k]) {
+                r[k] = 1;
+                break;
+              }
+              r[k] = 0;
+            }
+          } else
+            break;
+        }
+      }
+    }
+
+}
+
+static ge_precomp Bi[8] = {
+#include "base2.h"
+} ;
+
+/*
+table = A,3A,5A,7A,9A,11A,13A,15A, for ge_multi_scalarmult_vartime()
+*/
+
+void ge_multi_scalarmult_table(ge_cached *table, const ge_p3 *A)
+{
+  ge_p1p1 t;
+  ge_p3 u;
+  ge_p3 A2;
+  int i;
+
+  ge_p3_to_cached(&table[0],A);
+  ge_p3_dbl(&t,A); ge_p1p1_to_p3(&A2,&t);
+  for (i = 1;i < 8;++i) {
+    ge_add(&t,&A2,&table[i - 1]); ge_p1p1_to_p3(&u,&t); ge_p3_to_cached(&table[i],&u);
+  }
+}
+
+/*
+r = b * B + a_0 * A_0 + ... + a_(count-1) * A_(count-1)
+where tables[8*j..8*j+7] is the table of A_j and slides[256*j..256*j+255]
+the window digits of a_j.
+B is the Ed25519 base point (x,4/5) with x positive.
+
+All points share one chain of doublings, which is what makes this cheaper
+than count calls to ge_double_scalarmult_vartime().
+*/
+
+void ge_multi_scalarmult_vartime(ge_p2 *r, const unsigned char *b,
+                                 const ge_cached *tables, const signed char *slides,
+                                 unsigned long count)
+{
+  signed char bslide[256];
+  ge_p1p1 t;
+  ge_p3 u;
+  unsigned long j;
+  int i;
+
+  ge_multi_scalarmult_slide(bslide,b);
+
+  ge_p2_0(r);
+
+  for (i = 255;i >= 0;--i) {
+    if (bslide[i]) break;
+    for (j = 0;j < count;++j)
+      if (slides[j * 256 + i]) break;
+    if (j < count) break;
+  }
+
+  for (;i >= 0;--i) {
+    ge_p2_dbl(&t,r);
+
+    for (j = 0;j < count;++j) {
+      const signed char d = slides[j * 256 + i];
+      if (d > 0) {
+        ge_p1p1_to_p3(&u,&t);
+        ge_add(&t,&u,&tables[j * 8 + d/2]);
+      } else if (d < 0) {
+        ge_p1p1_to_p3(&u,&t);
+        ge_sub(&t,&u,&tables[j * 8 + (-d)/2]);
+      }
+    }
+
+    if (bslide[i] > 0) {
+      ge_p1p1_to_p3(&u,&t);
+      ge_madd(&t,&u,&Bi[bslide[i]/2]);
+    } else if (bslide[i] < 0) {
+      ge_p1p1_to_p3(&u,&t);
+      ge_msub(&t,&u,&Bi[(-bslide[i])/2]);
+    }
+
+    ge_p1p1_to_p2(r,&t);
+  }
+}
@@ -22,6 +22,7 @@ struct device_consistency_commitment
     signal_type_base base;
     uint32_t generation;
     signal_buffer *serialized;
+    signal_context *global_context;
 };
 
 struct device_consistency_message
@@ -114,13 +115,14 @@ int device_consistency_commitment_create(device_consistency_commitment **commitm
     unsigned int list_size;
     unsigned int i;
 
-    result_commitment = malloc(sizeof(device_consistency_commitment));
+    result_commitment = signal_malloc(global_context, sizeof(device_consistency_commitment));
     if(!result_commitment) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
     memset(result_commitment, 0, sizeof(device_consistency_commitment));
     SIGNAL_INIT(result_commitment, device_consistency_commitment_destroy);
+    result_commitment->global_context = global_context;
 
     sorted_list = ec_public_key_list_copy(identity_key_list);
     if(!sorted_list) {
@@ -154,17 +156,10 @@ int device_consistency_commitment_create(device_consistency_commitment **commitm
 
     list_size = ec_public_key_list_size(sorted_list);
     for(i = 0; i < list_size; i++) {
-        signal_buffer *key_buffer = 0;
         ec_public_key *key = ec_public_key_list_at(sorted_list, i);
 
-        result = ec_public_key_serialize(&key_buffer, key);
-        if(result < 0) {
-            goto complete;
-        }
-
         result = signal_sha512_digest_update(global_context, digest_context,
-                signal_buffer_data(key_buffer), signal_buffer_len(key_buffer));
-        signal_buffer_free(key_buffer);
+                ec_public_key_get_serialized(key), EC_PUBLIC_KEY_SERIALIZED_LENGTH);
         if(result < 0) {
             goto complete;
         }
@@ -205,7 +200,7 @@ void device_consistency_commitment_destroy(signal_type_base *type)
 {
     device_consistency_commitment *commitment = (device_consistency_commitment *)type;
     signal_buffer_free(commitment->serialized);
-    free(commitment);
+    signal_free(commitment->global_context, commitment);
 }
 
 /*------------------------------------------------------------------------*/
@@ -338,7 +333,7 @@ int device_consistency_message_create_from_serialized(device_consistency_message
     }
 
     /* Deserialize the message */
-    message_structure = textsecure__device_consistency_code_message__unpack(0, serialized_len, serialized_data);
+    message_structure = textsecure__device_consistency_code_message__unpack(signal_protobuf_allocator(global_context), serialized_len, serialized_data);
     if(!message_structure) {
         result = SG_ERR_INVALID_PROTO_BUF;
         goto complete;
@@ -376,7 +371,7 @@ int device_consistency_message_create_from_serialized(device_consistency_message
 
 complete:
     if(message_structure) {
-        textsecure__device_consistency_code_message__free_unpacked(message_structure, 0);
+        textsecure__device_consistency_code_message__free_unpacked(message_structure, signal_protobuf_allocator(global_context));
     }
     signal_buffer_free(vrf_output_buffer);
     if(result >= 0) {
@@ -495,7 +490,7 @@ int device_consistency_code_generate_for(device_consistency_commitment *commitme
         goto complete;
     }
 
-    encoded_string = malloc(11);
+    encoded_string = signal_malloc(global_context, 11);
     if(!encoded_string) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -531,7 +526,7 @@ complete:
         signal_sha512_digest_cleanup(global_context, digest_context);
     }
     signal_buffer_free(hash_buffer);
-    free(encoded_string);
+    signal_free(global_context, encoded_string);
     if(result >= 0) {
         *code_string = result_string;
     }
@@ -70,7 +70,7 @@ int fingerprint_generator_create(fingerprint_generator **generator,
         return SG_ERR_INVAL;
     }
 
-    result_generator = malloc(sizeof(fingerprint_generator));
+    result_generator = signal_malloc(global_context, sizeof(fingerprint_generator));
     if(!result_generator) {
         return SG_ERR_NOMEM;
     }
@@ -210,10 +210,10 @@ complete:
     signal_buffer_free(local_fingerprint_buffer);
     signal_buffer_free(remote_fingerprint_buffer);
     if(displayable_local) {
-        free(displayable_local);
+        signal_free(generator->global_context, displayable_local);
     }
     if(displayable_remote) {
-        free(displayable_remote);
+        signal_free(generator->global_context, displayable_remote);
     }
     SIGNAL_UNREF(displayable);
     SIGNAL_UNREF(scannable);
@@ -248,19 +248,11 @@ int fingerprint_generator_get_logical_key_bytes(signal_buffer **key_bytes,
     for(i = 0; i < list_size; i++) {
         key_element = ec_public_key_list_at(sorted_key_list, i);
 
-        result = ec_public_key_serialize(&buffer, key_element);
-        if (result < 0) {
-            goto complete;
-        }
-
         if(!vpool_insert(&vp, vpool_get_length(&vp),
-                signal_buffer_data(buffer), signal_buffer_len(buffer))) {
+                (void *)ec_public_key_get_serialized(key_element), EC_PUBLIC_KEY_SERIALIZED_LENGTH)) {
             result = SG_ERR_NOMEM;
             goto complete;
         }
-
-        signal_buffer_free(buffer);
-        buffer = 0;
     }
 
     buffer = signal_buffer_create(vpool_get_buf(&vp), vpool_get_length(&vp));
@@ -303,7 +295,7 @@ int fingerprint_generator_get_fingerprint(fingerprint_generator *generator, sign
 
     len = 2 + signal_buffer_len(identity_buffer) + strlen(stable_identifier);
 
-    hash_buffer = signal_buffer_alloc(len);
+    hash_buffer = signal_buffer_context_alloc(generator->global_context, len);
     if(!hash_buffer) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -387,7 +379,7 @@ int fingerprint_generator_create_display_string(fingerprint_generator *generator
         goto complete;
     }
 
-    result_string = malloc(FINGERPRINT_LENGTH+1);
+    result_string = signal_malloc(generator->global_context, FINGERPRINT_LENGTH+1);
     if(!result_string) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -416,7 +408,7 @@ complete:
 void fingerprint_generator_free(fingerprint_generator *generator)
 {
     if(generator) {
-        free(generator);
+        signal_free(generator->global_context, generator);
     }
 }
 
@@ -708,7 +700,7 @@ int scannable_fingerprint_deserialize(scannable_fingerprint **scannable, const u
     char *remote_stable_identifier = 0;
     signal_buffer *remote_fingerprint = 0;
 
-    combined_fingerprint = textsecure__combined_fingerprints__unpack(0, len, data);
+    combined_fingerprint = textsecure__combined_fingerprints__unpack(signal_protobuf_allocator(global_context), len, data);
     if(!combined_fingerprint) {
         result = SG_ERR_INVALID_PROTO_BUF;
         goto complete;
@@ -720,14 +712,14 @@ int scannable_fingerprint_deserialize(scannable_fingerprint **scannable, const u
 
     if(combined_fingerprint->localfingerprint) {
         if(combined_fingerprint->localfingerprint->has_identifier) {
-            local_stable_identifier = signal_protocol_str_deserialize_protobuf(&combined_fingerprint->localfingerprint->identifier);
+            local_stable_identifier = signal_protocol_str_deserialize_protobuf(&combined_fingerprint->localfingerprint->identifier, global_context);
             if(!local_stable_identifier) {
                 result = SG_ERR_NOMEM;
                 goto complete;
             }
         }
         if(combined_fingerprint->localfingerprint->has_content) {
-            local_fingerprint = signal_buffer_create(
+            local_fingerprint = signal_buffer_context_create(global_context,
                     combined_fingerprint->localfingerprint->content.data,
                     combined_fingerprint->localfingerprint->content.len);
             if(!local_fingerprint) {
@@ -739,14 +731,14 @@ int scannable_fingerprint_deserialize(scannable_fingerprint **scannable, const u
 
     if(combined_fingerprint->remotefingerprint) {
         if(combined_fingerprint->remotefingerprint->has_identifier) {
-            remote_stable_identifier = signal_protocol_str_deserialize_protobuf(&combined_fingerprint->remotefingerprint->identifier);
+            remote_stable_identifier = signal_protocol_str_deserialize_protobuf(&combined_fingerprint->remotefingerprint->identifier, global_context);
             if(!remote_stable_identifier) {
                 result = SG_ERR_NOMEM;
                 goto complete;
             }
         }
         if(combined_fingerprint->remotefingerprint->has_content) {
-            remote_fingerprint = signal_buffer_create(
+            remote_fingerprint = signal_buffer_context_create(global_context,
                     combined_fingerprint->remotefingerprint->content.data,
                     combined_fingerprint->remotefingerprint->content.len);
             if(!remote_fingerprint) {
@@ -762,13 +754,13 @@ int scannable_fingerprint_deserialize(scannable_fingerprint **scannable, const u
 
 complete:
     if(combined_fingerprint) {
-        textsecure__combined_fingerprints__free_unpacked(combined_fingerprint, 0);
+        textsecure__combined_fingerprints__free_unpacked(combined_fingerprint, signal_protobuf_allocator(global_context));
     }
     if(local_stable_identifier) {
-        free(local_stable_identifier);
+        signal_free(global_context, local_stable_identifier);
     }
     if(remote_stable_identifier) {
-        free(remote_stable_identifier);
+        signal_free(global_context, remote_stable_identifier);
     }
     signal_buffer_free(local_fingerprint);
     signal_buffer_free(remote_fingerprint);
@@ -16,8 +16,17 @@ struct group_cipher
     int (*decrypt_callback)(group_cipher *cipher, signal_buffer *plaintext, void *decrypt_context);
     int inside_callback;
     void *user_data;
+    /* The last signing keys used, which cache their decoded forms */
+    ec_public_key *signing_key_public;
+    ec_private_key *signing_key_private;
 };
 
+static int group_cipher_load_record(group_cipher *cipher, sender_key_record **record);
+static int group_cipher_decrypt_message(group_cipher *cipher, sender_key_state *state,
+        sender_key_message *ciphertext, signal_buffer **plaintext);
+static ec_public_key *group_cipher_get_signing_key_public(group_cipher *cipher, sender_key_state *state);
+static void group_cipher_set_signing_key_public(group_cipher *cipher, ec_public_key *signing_key);
+static ec_private_key *group_cipher_get_signing_key_private(group_cipher *cipher, sender_key_state *state);
 static int group_cipher_get_sender_key(group_cipher *cipher, sender_message_key **sender_key, sender_key_state *state, uint32_t iteration);
 static int group_cipher_decrypt_callback(group_cipher *cipher, signal_buffer *plaintext, void *decrypt_context);
 
@@ -30,7 +39,7 @@ int group_cipher_create(group_cipher **cipher,
     assert(store);
     assert(global_context);
 
-    result_cipher = malloc(sizeof(group_cipher));
+    result_cipher = signal_malloc(global_context, sizeof(group_cipher));
     if(!result_cipher) {
         return SG_ERR_NOMEM;
     }
@@ -79,7 +88,7 @@ int group_cipher_encrypt(group_cipher *cipher,
     signal_buffer *ciphertext = 0;
 
     assert(cipher);
-    signal_lock(cipher->global_context);
+    signal_lock_sender_key(cipher->global_context, cipher->sender_key_id, SG_LOCK_WRITE);
 
     if(cipher->inside_callback == 1) {
         result = SG_ERR_INVAL;
@@ -96,7 +105,7 @@ int group_cipher_encrypt(group_cipher *cipher,
         goto complete;
     }
 
-    signing_key_private = sender_key_state_get_signing_key_private(state);
+    signing_key_private = group_cipher_get_signing_key_private(cipher, state);
     if(!signing_key_private) {
         result = SG_ERR_INVALID_KEY;
         goto complete;
@@ -151,7 +160,7 @@ complete:
     SIGNAL_UNREF(next_chain_key);
     SIGNAL_UNREF(sender_key);
     SIGNAL_UNREF(record);
-    signal_unlock(cipher->global_context);
+    signal_unlock_sender_key(cipher->global_context, cipher->sender_key_id, SG_LOCK_WRITE);
     return result;
 }
 
@@ -163,56 +172,34 @@ int group_cipher_decrypt(group_cipher *cipher,
     signal_buffer *result_buf = 0;
     sender_key_record *record = 0;
     sender_key_state *state = 0;
-    sender_message_key *sender_key = 0;
-    signal_buffer *sender_cipher_key = 0;
-    signal_buffer *sender_cipher_iv = 0;
-    signal_buffer *ciphertext_body = 0;
+    ec_public_key *signing_key = 0;
 
     assert(cipher);
-    signal_lock(cipher->global_context);
+    signal_lock_sender_key(cipher->global_context, cipher->sender_key_id, SG_LOCK_WRITE);
 
     if(cipher->inside_callback == 1) {
         result = SG_ERR_INVAL;
         goto complete;
     }
 
-    result = signal_protocol_sender_key_load_key(cipher->store, &record, cipher->sender_key_id);
+    result = group_cipher_load_record(cipher, &record);
     if(result < 0) {
         goto complete;
     }
 
-    if(sender_key_record_is_empty(record)) {
-        result = SG_ERR_NO_SESSION;
-        signal_log(cipher->global_context, SG_LOG_WARNING, "No sender key for: %s::%s::%d",
-                cipher->sender_key_id->group_id,
-                cipher->sender_key_id->sender.name,
-                cipher->sender_key_id->sender.device_id);
-        goto complete;
-    }
-
     result = sender_key_record_get_sender_key_state_by_id(record, &state, sender_key_message_get_key_id(ciphertext));
     if(result < 0) {
         goto complete;
     }
 
-    result = sender_key_message_verify_signature(ciphertext, sender_key_state_get_signing_key_public(state));
+    signing_key = group_cipher_get_signing_key_public(cipher, state);
+    result = sender_key_message_verify_signature(ciphertext, signing_key);
     if(result < 0) {
         goto complete;
     }
+    group_cipher_set_signing_key_public(cipher, signing_key);
 
-    result = group_cipher_get_sender_key(cipher, &sender_key, state, sender_key_message_get_iteration(ciphertext));
-    if(result < 0) {
-        goto complete;
-    }
-
-    sender_cipher_key = sender_message_key_get_cipher_key(sender_key);
-    sender_cipher_iv = sender_message_key_get_iv(sender_key);
-    ciphertext_body = sender_key_message_get_ciphertext(ciphertext);
-
-    result = signal_decrypt(cipher->global_context, &result_buf, SG_CIPHER_AES_CBC_PKCS5,
-            signal_buffer_data(sender_cipher_key), signal_buffer_len(sender_cipher_key),
-            signal_buffer_data(sender_cipher_iv), signal_buffer_len(sender_cipher_iv),
-            signal_buffer_data(ciphertext_body), signal_buffer_len(ciphertext_body));
+    result = group_cipher_decrypt_message(cipher, state, ciphertext, &result_buf);
     if(result < 0) {
         goto complete;
     }
@@ -225,7 +212,6 @@ int group_cipher_decrypt(group_cipher *cipher,
     result = signal_protocol_sender_key_store_key(cipher->store, cipher->sender_key_id, record);
 
 complete:
-    SIGNAL_UNREF(sender_key);
     SIGNAL_UNREF(record);
     if(result >= 0) {
         *plaintext = result_buf;
@@ -236,7 +222,186 @@ complete:
         }
         signal_buffer_free(result_buf);
     }
-    signal_unlock(cipher->global_context);
+    signal_unlock_sender_key(cipher->global_context, cipher->sender_key_id, SG_LOCK_WRITE);
+    return result;
+}
+
+int group_cipher_decrypt_batch(group_cipher *cipher,
+        sender_key_message **ciphertexts, size_t count, void **decrypt_contexts,
+        signal_buffer **plaintexts)
+{
+    int result = 0;
+    sender_key_record *record = 0;
+    sender_key_state **states = 0;
+    ec_public_key **signature_keys = 0;
+    size_t decrypted = 0;
+    size_t i;
+
+    assert(cipher);
+    signal_lock_sender_key(cipher->global_context, cipher->sender_key_id, SG_LOCK_WRITE);
+
+    if(cipher->inside_callback == 1) {
+        result = SG_ERR_INVAL;
+        goto complete;
+    }
+
+    if(count == 0) {
+        goto complete;
+    }
+
+    result = group_cipher_load_record(cipher, &record);
+    if(result < 0) {
+        goto complete;
+    }
+
+    states = signal_malloc(cipher->global_context, sizeof(sender_key_state *) * count);
+    signature_keys = signal_malloc(cipher->global_context, sizeof(ec_public_key *) * count);
+    if(!states || !signature_keys) {
+        result = SG_ERR_NOMEM;
+        goto complete;
+    }
+
+    for(i = 0; i < count; i++) {
+        result = sender_key_record_get_sender_key_state_by_id(record, &states[i],
+                sender_key_message_get_key_id(ciphertexts[i]));
+        if(result < 0) {
+            goto complete;
+        }
+        signature_keys[i] = group_cipher_get_signing_key_public(cipher, states[i]);
+    }
+
+    result = sender_key_message_verify_signature_batch(ciphertexts, signature_keys, count);
+    if(result < 0) {
+        goto complete;
+    }
+    group_cipher_set_signing_key_public(cipher, signature_keys[count - 1]);
+
+    /* In order, so that each message sees the chain left by the one before */
+    for(decrypted = 0; decrypted < count; decrypted++) {
+        result = group_cipher_decrypt_message(cipher, states[decrypted], ciphertexts[decrypted],
+                &plaintexts[decrypted]);
+        if(result < 0) {
+            goto complete;
+        }
+    }
+
+    for(i = 0; i < count; i++) {
+        result = group_cipher_decrypt_callback(cipher, plaintexts[i],
+                decrypt_contexts ? decrypt_contexts[i] : 0);
+        if(result < 0) {
+            goto complete;
+        }
+    }
+
+    result = signal_protocol_sender_key_store_key(cipher->store, cipher->sender_key_id, record);
+
+complete:
+    if(result < 0) {
+        for(i = 0; i < decrypted; i++) {
+            signal_buffer_free(plaintexts[i]);
+            plaintexts[i] = 0;
+        }
+        if(result == SG_ERR_INVALID_KEY || result == SG_ERR_INVALID_KEY_ID) {
+            result = SG_ERR_INVALID_MESSAGE;
+        }
+    }
+    signal_free(cipher->global_context, states);
+    signal_free(cipher->global_context, signature_keys);
+    SIGNAL_UNREF(record);
+    signal_unlock_sender_key(cipher->global_context, cipher->sender_key_id, SG_LOCK_WRITE);
+    return result;
+}
+
+static int group_cipher_load_record(group_cipher *cipher, sender_key_record **record)
+{
+    int result = 0;
+    sender_key_record *result_record = 0;
+
+    result = signal_protocol_sender_key_load_key(cipher->store, &result_record, cipher->sender_key_id);
+    if(result < 0) {
+        return result;
+    }
+
+    if(sender_key_record_is_empty(result_record)) {
+        signal_log(cipher->global_context, SG_LOG_WARNING, "No sender key for: %s::%s::%d",
+                cipher->sender_key_id->group_id,
+                cipher->sender_key_id->sender.name,
+                cipher->sender_key_id->sender.device_id);
+        SIGNAL_UNREF(result_record);
+        return SG_ERR_NO_SESSION;
+    }
+
+    *record = result_record;
+    return 0;
+}
+
+/*
+ * Sender key records are deserialized on every load, so each one brings new
+ * copies of the signing keys. Using the copies kept from the last message
+ * instead lets repeated messages skip decoding the keys again.
+ */
+static ec_public_key *group_cipher_get_signing_key_public(group_cipher *cipher, sender_key_state *state)
+{
+    ec_public_key *signing_key = sender_key_state_get_signing_key_public(state);
+    if(cipher->signing_key_public && ec_public_key_memcmp(cipher->signing_key_public, signing_key) == 0) {
+        return cipher->signing_key_public;
+    }
+    return signing_key;
+}
+
+static void group_cipher_set_signing_key_public(group_cipher *cipher, ec_public_key *signing_key)
+{
+    if(cipher->signing_key_public != signing_key) {
+        SIGNAL_REF(signing_key);
+        SIGNAL_UNREF(cipher->signing_key_public);
+        cipher->signing_key_public = signing_key;
+    }
+}
+
+static ec_private_key *group_cipher_get_signing_key_private(group_cipher *cipher, sender_key_state *state)
+{
+    ec_private_key *signing_key = sender_key_state_get_signing_key_private(state);
+    if(!signing_key) {
+        return 0;
+    }
+    if(ec_private_key_compare(cipher->signing_key_private, signing_key) != 0) {
+        SIGNAL_REF(signing_key);
+        SIGNAL_UNREF(cipher->signing_key_private);
+        cipher->signing_key_private = signing_key;
+    }
+    return cipher->signing_key_private;
+}
+
+static int group_cipher_decrypt_message(group_cipher *cipher, sender_key_state *state,
+        sender_key_message *ciphertext, signal_buffer **plaintext)
+{
+    int result = 0;
+    signal_buffer *result_buf = 0;
+    sender_message_key *sender_key = 0;
+    signal_buffer *sender_cipher_key = 0;
+    signal_buffer *sender_cipher_iv = 0;
+    const uint8_t *ciphertext_body = 0;
+    size_t ciphertext_body_len = 0;
+
+    result = group_cipher_get_sender_key(cipher, &sender_key, state, sender_key_message_get_iteration(ciphertext));
+    if(result < 0) {
+        goto complete;
+    }
+
+    sender_cipher_key = sender_message_key_get_cipher_key(sender_key);
+    sender_cipher_iv = sender_message_key_get_iv(sender_key);
+    ciphertext_body = sender_key_message_get_ciphertext_data(ciphertext, &ciphertext_body_len);
+
+    result = signal_decrypt(cipher->global_context, &result_buf, SG_CIPHER_AES_CBC_PKCS5,
+            signal_buffer_data(sender_cipher_key), signal_buffer_len(sender_cipher_key),
+            signal_buffer_data(sender_cipher_iv), signal_buffer_len(sender_cipher_iv),
+            ciphertext_body, ciphertext_body_len);
+
+complete:
+    SIGNAL_UNREF(sender_key);
+    if(result >= 0) {
+        *plaintext = result_buf;
+    }
     return result;
 }
 
@@ -246,7 +411,7 @@ int group_cipher_get_sender_key(group_cipher *cipher, sender_message_key **sende
     sender_message_key *result_key = 0;
     sender_chain_key *chain_key = 0;
     sender_chain_key *next_chain_key = 0;
-    sender_message_key *message_key = 0;
+    uint8_t message_key_seed[SENDER_MESSAGE_KEY_SEED_LEN];
 
     chain_key = sender_key_state_get_chain_key(state);
     SIGNAL_REF(chain_key);
@@ -274,17 +439,29 @@ int group_cipher_get_sender_key(group_cipher *cipher, sender_message_key **sende
         goto complete;
     }
 
+    if(cipher->global_context->skipped_key_checkpoint_interval > 0 &&
+            sender_chain_key_get_iteration(chain_key) < iteration) {
+        result = sender_key_state_skip_sender_message_keys(state, iteration);
+        if(result < 0) {
+            goto complete;
+        }
+        SIGNAL_UNREF(chain_key);
+        chain_key = sender_key_state_get_chain_key(state);
+        SIGNAL_REF(chain_key);
+    }
+
     while(sender_chain_key_get_iteration(chain_key) < iteration) {
-        result = sender_chain_key_create_message_key(chain_key, &message_key);
+        result = sender_chain_key_get_message_key_seed(chain_key, message_key_seed);
         if(result < 0) {
             goto complete;
         }
 
-        result = sender_key_state_add_sender_message_key(state, message_key);
+        result = sender_key_state_add_sender_message_key_seed(state,
+                sender_chain_key_get_iteration(chain_key),
+                message_key_seed, sizeof(message_key_seed));
         if(result < 0) {
             goto complete;
         }
-        SIGNAL_UNREF(message_key);
 
         result = sender_chain_key_create_next(chain_key, &next_chain_key);
         if(result < 0) {
@@ -305,7 +482,7 @@ int group_cipher_get_sender_key(group_cipher *cipher, sender_message_key **sende
     result = sender_chain_key_create_message_key(chain_key, &result_key);
 
 complete:
-    SIGNAL_UNREF(message_key);
+    signal_explicit_bzero(message_key_seed, sizeof(message_key_seed));
     SIGNAL_UNREF(chain_key);
     SIGNAL_UNREF(next_chain_key);
     if(result >= 0) {
@@ -328,6 +505,8 @@ static int group_cipher_decrypt_callback(group_cipher *cipher, signal_buffer *pl
 void group_cipher_free(group_cipher *cipher)
 {
     if(cipher) {
-        free(cipher);
+        SIGNAL_UNREF(cipher->signing_key_public);
+        SIGNAL_UNREF(cipher->signing_key_private);
+        signal_free(cipher->global_context, cipher);
     }
 }
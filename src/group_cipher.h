@@ -105,6 +105,37 @@ int group_cipher_decrypt(group_cipher *cipher,
         sender_key_message *ciphertext, void *decrypt_context,
         signal_buffer **plaintext);
 
+/**
+ * Decrypt a queue of messages from this sender.
+ *
+ * The sender key record is loaded and stored once, and the signatures of
+ * all messages are verified together, which is considerably cheaper than
+ * verifying them one at a time. Messages are then decrypted in order, and
+ * the decryption callback, if any, is called for each of them only once
+ * all have been decrypted.
+ *
+ * The batch either succeeds or fails as a whole. On failure the updated
+ * record is not stored and no plaintexts are returned, so the messages can
+ * be passed to group_cipher_decrypt() one at a time to find the one at fault.
+ *
+ * This includes a failing decryption callback: if the callback fails for
+ * one message, it has already been called for every message before it,
+ * and those messages still decrypt if passed again. Callbacks used with
+ * batches must therefore tolerate being called again for the same message.
+ *
+ * @param ciphertexts array of count sender_key_message to decrypt
+ * @param count number of messages
+ * @param decrypt_contexts Optional array of count context pointers, each
+ *   passed to the decryption callback with the message at the same index
+ * @param plaintexts Caller provided array of count entries, each set to a
+ *   newly allocated buffer with the plaintext of the message at the same index
+ *
+ * @return SG_SUCCESS on success, or any error group_cipher_decrypt() returns
+ */
+int group_cipher_decrypt_batch(group_cipher *cipher,
+        sender_key_message **ciphertexts, size_t count, void **decrypt_contexts,
+        signal_buffer **plaintexts);
+
 void group_cipher_free(group_cipher *cipher);
 
 #ifdef __cplusplus
@@ -23,7 +23,7 @@ int group_session_builder_create(group_session_builder **builder,
     assert(store);
     assert(global_context);
 
-    result = malloc(sizeof(group_session_builder));
+    result = signal_malloc(global_context, sizeof(group_session_builder));
     if(!result) {
         return SG_ERR_NOMEM;
     }
@@ -45,7 +45,7 @@ int group_session_builder_process_session(group_session_builder *builder,
 
     assert(builder);
     assert(builder->store);
-    signal_lock(builder->global_context);
+    signal_lock_sender_key(builder->global_context, sender_key_name, SG_LOCK_WRITE);
 
     result = signal_protocol_sender_key_load_key(builder->store, &record, sender_key_name);
     if(result < 0) {
@@ -65,7 +65,7 @@ int group_session_builder_process_session(group_session_builder *builder,
 
 complete:
     SIGNAL_UNREF(record);
-    signal_unlock(builder->global_context);
+    signal_unlock_sender_key(builder->global_context, sender_key_name, SG_LOCK_WRITE);
     return result;
 }
 
@@ -84,7 +84,7 @@ int group_session_builder_create_session(group_session_builder *builder,
 
     assert(builder);
     assert(builder->store);
-    signal_lock(builder->global_context);
+    signal_lock_sender_key(builder->global_context, sender_key_name, SG_LOCK_WRITE);
 
     result = signal_protocol_sender_key_load_key(builder->store, &record, sender_key_name);
     if(result < 0) {
@@ -137,13 +137,13 @@ complete:
     signal_buffer_free(sender_key);
     SIGNAL_UNREF(sender_signing_key);
     SIGNAL_UNREF(record);
-    signal_unlock(builder->global_context);
+    signal_unlock_sender_key(builder->global_context, sender_key_name, SG_LOCK_WRITE);
     return result;
 }
 
 void group_session_builder_free(group_session_builder *builder)
 {
     if(builder) {
-        free(builder);
+        signal_free(builder->global_context, builder);
     }
 }
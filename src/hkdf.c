@@ -3,15 +3,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 #include <assert.h>
 
 #include "signal_protocol_internal.h"
 
-#define HASH_OUTPUT_SIZE 32
+#define HASH_OUTPUT_SIZE SIGNAL_HMAC_SHA256_LENGTH
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
-#define MAX(a,b) (((a)>(b))?(a):(b))
 
 struct hkdf_context
 {
@@ -23,7 +21,7 @@ struct hkdf_context
 int hkdf_create(hkdf_context **context, int message_version, signal_context *global_context)
 {
     assert(global_context);
-    *context = malloc(sizeof(hkdf_context));
+    *context = signal_malloc(global_context, sizeof(hkdf_context));
     if(!(*context)) {
         return SG_ERR_NOMEM;
     }
@@ -40,163 +38,131 @@ int hkdf_create(hkdf_context **context, int message_version, signal_context *glo
         (*context)->iteration_start_offset = 1;
     }
     else {
-        free(*context);
+        signal_free(global_context, *context);
         return SG_ERR_INVAL;
     }
 
     return 0;
 }
 
-ssize_t hkdf_extract(hkdf_context *context,
-        uint8_t **output,
+static int hkdf_extract(hkdf_context *context,
+        uint8_t *output,
         const uint8_t *salt, size_t salt_len,
         const uint8_t *input_key_material, size_t input_key_material_len)
 {
-    int result = 0;
-    signal_buffer *mac_buffer = 0;
-    uint8_t *mac = 0;
-    size_t mac_len = 0;
-    void *hmac_context;
+    signal_iovec iov[1];
 
     assert(context);
 
-    result = signal_hmac_sha256_init(context->global_context,
-            &hmac_context, salt, salt_len);
-    if(result < 0) {
-        goto complete;
-    }
-
-    result = signal_hmac_sha256_update(context->global_context,
-            hmac_context, input_key_material, input_key_material_len);
-    if(result < 0) {
-        goto complete;
-    }
-
-    result = signal_hmac_sha256_final(context->global_context,
-            hmac_context, &mac_buffer);
-    if(result < 0) {
-        goto complete;
-    }
-
-    mac_len = signal_buffer_len(mac_buffer);
-    mac = malloc(mac_len);
-    if(!mac) {
-        result = SG_ERR_NOMEM;
-        goto complete;
-    }
-
-    memcpy(mac, signal_buffer_data(mac_buffer), mac_len);
-
-complete:
-    signal_hmac_sha256_cleanup(context->global_context, hmac_context);
-    signal_buffer_free(mac_buffer);
+    iov[0].data = input_key_material;
+    iov[0].len = input_key_material_len;
 
-    if(result >= 0) {
-        *output = mac;
-        return (ssize_t)mac_len;
-    }
-    else {
-        return result;
-    }
+    return signal_hmac_sha256(context->global_context, salt, salt_len, iov, 1, output);
 }
 
-ssize_t hkdf_expand(hkdf_context *context,
-        uint8_t **output,
+static int hkdf_expand(hkdf_context *context,
+        uint8_t *output, size_t output_len,
         const uint8_t *prk, size_t prk_len,
-        const uint8_t *info, size_t info_len,
-        size_t output_len)
+        const uint8_t *info, size_t info_len)
 {
-    int iterations = (int)ceil((double)output_len / (double)HASH_OUTPUT_SIZE);
-    size_t remaining_len = output_len;
-    signal_buffer *step_buffer = 0;
+    uint8_t step[HASH_OUTPUT_SIZE];
+    size_t iterations = (output_len + HASH_OUTPUT_SIZE - 1) / HASH_OUTPUT_SIZE;
+    size_t offset = 0;
     size_t step_size = 0;
-    uint8_t *result_buf = 0;
-    size_t result_buf_len = 0;
+    signal_iovec iov[3];
+    size_t iov_count = 0;
+    size_t j;
     void *hmac_context = 0;
     int result = 0;
     uint8_t i;
 
     assert(context);
 
-    for(i = context->iteration_start_offset; i < iterations + context->iteration_start_offset; i++) {
+    /* The block counter is a single byte */
+    if(iterations + (size_t)context->iteration_start_offset > 256) {
+        return SG_ERR_INVAL;
+    }
+
+    /* Every block is keyed with the PRK, so reuse one context if the provider can reset it */
+    if(output_len > 0 && signal_hmac_sha256_can_reset(context->global_context)) {
         result = signal_hmac_sha256_init(context->global_context,
                 &hmac_context, prk, prk_len);
         if(result < 0) {
             goto complete;
         }
+    }
 
-        if(step_buffer) {
-            result = signal_hmac_sha256_update(context->global_context,
-                    hmac_context,
-                    signal_buffer_data(step_buffer),
-                    signal_buffer_len(step_buffer));
-            if(result < 0) {
-                goto complete;
-            }
-            signal_buffer_free(step_buffer);
-            step_buffer = 0;
+    for(i = context->iteration_start_offset; offset < output_len; i++) {
+        iov_count = 0;
+        if(offset > 0) {
+            iov[iov_count].data = step;
+            iov[iov_count].len = sizeof(step);
+            iov_count++;
         }
-
         if(info) {
-            result = signal_hmac_sha256_update(context->global_context,
-                    hmac_context, info, info_len);
-            if(result < 0) {
-                goto complete;
+            iov[iov_count].data = info;
+            iov[iov_count].len = info_len;
+            iov_count++;
+        }
+        iov[iov_count].data = &i;
+        iov[iov_count].len = sizeof(uint8_t);
+        iov_count++;
+
+        if(hmac_context) {
+            for(j = 0; j < iov_count; j++) {
+                result = signal_hmac_sha256_update(context->global_context,
+                        hmac_context, iov[j].data, iov[j].len);
+                if(result < 0) {
+                    goto complete;
+                }
             }
+            result = signal_hmac_sha256_final_into(context->global_context,
+                    hmac_context, step);
         }
-
-        result = signal_hmac_sha256_update(context->global_context,
-                hmac_context, &i, sizeof(uint8_t));
-        if(result < 0) {
-            goto complete;
+        else {
+            result = signal_hmac_sha256(context->global_context,
+                    prk, prk_len, iov, iov_count, step);
         }
-
-        result = signal_hmac_sha256_final(context->global_context,
-                hmac_context, &step_buffer);
         if(result < 0) {
             goto complete;
         }
 
-        signal_hmac_sha256_cleanup(context->global_context, hmac_context);
-        hmac_context = 0;
-
-        step_size = MIN(remaining_len, signal_buffer_len(step_buffer));
-
-        if(!result_buf) {
-            result_buf = malloc(step_size);
-            if(!result_buf) {
-                result = SG_ERR_NOMEM;
-                goto complete;
-            }
-            memcpy(result_buf, signal_buffer_data(step_buffer), step_size);
-            result_buf_len = step_size;
-        }
-        else {
-            uint8_t *tmp_buf = realloc(result_buf, result_buf_len + step_size);
-            if(!tmp_buf) {
-                result = SG_ERR_NOMEM;
-                goto complete;
-            }
-            result_buf = tmp_buf;
-            memcpy(result_buf + result_buf_len, signal_buffer_data(step_buffer), step_size);
-            result_buf_len += step_size;
-        }
-        remaining_len -= step_size;
+        step_size = MIN(output_len - offset, sizeof(step));
+        memcpy(output + offset, step, step_size);
+        offset += step_size;
     }
 
 complete:
     if(hmac_context) {
         signal_hmac_sha256_cleanup(context->global_context, hmac_context);
     }
-    signal_buffer_free(step_buffer);
+    signal_explicit_bzero(step, sizeof(step));
+    return result;
+}
+
+int hkdf_derive_secrets_into(hkdf_context *context,
+        uint8_t *output, size_t output_len,
+        const uint8_t *input_key_material, size_t input_key_material_len,
+        const uint8_t *salt, size_t salt_len,
+        const uint8_t *info, size_t info_len)
+{
+    int result = 0;
+    uint8_t prk[HASH_OUTPUT_SIZE];
+
+    assert(context);
+    assert(output);
+
+    result = hkdf_extract(context, prk, salt, salt_len, input_key_material, input_key_material_len);
     if(result < 0) {
-        free(result_buf);
-        return result;
-    }
-    else {
-        *output = result_buf;
-        return (ssize_t)result_buf_len;
+        signal_log(context->global_context, SG_LOG_ERROR, "hkdf_extract error: %d", result);
+        goto complete;
     }
+
+    result = hkdf_expand(context, output, output_len, prk, sizeof(prk), info, info_len);
+
+complete:
+    signal_explicit_bzero(prk, sizeof(prk));
+    return result;
 }
 
 ssize_t hkdf_derive_secrets(hkdf_context *context,
@@ -206,25 +172,27 @@ ssize_t hkdf_derive_secrets(hkdf_context *context,
         const uint8_t *info, size_t info_len,
         size_t output_len)
 {
-    ssize_t result = 0;
-    uint8_t *prk = 0;
-    ssize_t prk_len = 0;
+    int result = 0;
+    uint8_t *result_buf = 0;
 
     assert(context);
 
-    prk_len = hkdf_extract(context, &prk, salt, salt_len, input_key_material, input_key_material_len);
-    if(prk_len < 0) {
-        signal_log(context->global_context, SG_LOG_ERROR, "hkdf_extract error: %d", prk_len);
-        return prk_len;
+    result_buf = malloc(output_len > 0 ? output_len : 1);
+    if(!result_buf) {
+        return SG_ERR_NOMEM;
     }
 
-    result = hkdf_expand(context, output, prk, (size_t)prk_len, info, info_len, output_len);
-
-    if(prk) {
-        free(prk);
+    result = hkdf_derive_secrets_into(context, result_buf, output_len,
+            input_key_material, input_key_material_len,
+            salt, salt_len,
+            info, info_len);
+    if(result < 0) {
+        free(result_buf);
+        return result;
     }
 
-    return result;
+    *output = result_buf;
+    return (ssize_t)output_len;
 }
 
 int hkdf_compare(const hkdf_context *context1, const hkdf_context *context2)
@@ -252,5 +220,5 @@ int hkdf_compare(const hkdf_context *context1, const hkdf_context *context2)
 void hkdf_destroy(signal_type_base *type)
 {
     hkdf_context *context = (hkdf_context *)type;
-    free(context);
+    signal_free(context->global_context, context);
 }
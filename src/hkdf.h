@@ -18,6 +18,19 @@ ssize_t hkdf_derive_secrets(hkdf_context *context,
         const uint8_t *info, size_t info_len,
         size_t output_len);
 
+/**
+ * Derive key material into a caller provided buffer, without any
+ * intermediate heap allocations.
+ *
+ * @param output buffer receiving output_len bytes of key material
+ * @return 0 on success, negative on failure
+ */
+int hkdf_derive_secrets_into(hkdf_context *context,
+        uint8_t *output, size_t output_len,
+        const uint8_t *input_key_material, size_t input_key_material_len,
+        const uint8_t *salt, size_t salt_len,
+        const uint8_t *info, size_t info_len);
+
 int hkdf_compare(const hkdf_context *context1, const hkdf_context *context2);
 
 void hkdf_destroy(signal_type_base *type);
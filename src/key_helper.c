@@ -62,9 +62,7 @@ int signal_protocol_key_helper_generate_registration_id(uint32_t *registration_i
         return SG_ERR_INVAL;
     }
 
-    result = global_context->crypto_provider.random_func(
-            (uint8_t *)(&id_value), sizeof(id_value),
-            global_context->crypto_provider.user_data);
+    result = signal_crypto_random(global_context, (uint8_t *)(&id_value), sizeof(id_value));
     if(result < 0) {
         return result;
     }
@@ -84,9 +82,7 @@ int signal_protocol_key_helper_get_random_sequence(int *value, int max, signal_c
     assert(global_context);
     assert(global_context->crypto_provider.random_func);
 
-    result = global_context->crypto_provider.random_func(
-            (uint8_t *)(&result_value), sizeof(result_value),
-            global_context->crypto_provider.user_data);
+    result = signal_crypto_random(global_context, (uint8_t *)(&result_value), sizeof(result_value));
     if(result < 0) {
         return result;
     }
@@ -272,7 +268,7 @@ int signal_protocol_key_helper_generate_sender_key(signal_buffer **key_buffer, s
 
     assert(global_context);
 
-    result_buffer = signal_buffer_alloc(32);
+    result_buffer = signal_buffer_context_alloc(global_context, 32);
     if(!result_buffer) {
         result = SG_ERR_NOMEM;
         goto complete;
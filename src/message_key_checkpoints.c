@@ -0,0 +1,630 @@
+#include "message_key_checkpoints.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "signal_protocol.h"
+#include "signal_protocol_internal.h"
+
+#define MESSAGE_KEY_CHECKPOINTS_INITIAL_CAPACITY 4
+
+struct message_key_checkpoints
+{
+    signal_type_base base;
+    signal_context *global_context;
+
+    uint32_t interval;
+    uint32_t max_span;
+
+    /* Chain keys at ascending positions */
+    size_t count;
+    size_t capacity;
+    uint32_t *counters;
+    uint8_t *keys;
+
+    /* One bit per position in [bitmap_base, end), set while the key is unused */
+    uint32_t bitmap_base;
+    uint32_t end;
+    size_t bitmap_capacity;
+    uint8_t *bitmap;
+    size_t available;
+};
+
+static uint8_t *message_key_checkpoints_key(const message_key_checkpoints *checkpoints, size_t i)
+{
+    return checkpoints->keys + (i * MESSAGE_KEY_CHECKPOINT_KEY_LENGTH);
+}
+
+static int message_key_checkpoints_bit(const message_key_checkpoints *checkpoints, uint32_t counter)
+{
+    uint32_t offset = counter - checkpoints->bitmap_base;
+    return (checkpoints->bitmap[offset >> 3] >> (offset & 7)) & 1;
+}
+
+static void message_key_checkpoints_set_bit(message_key_checkpoints *checkpoints, uint32_t counter)
+{
+    uint32_t offset = counter - checkpoints->bitmap_base;
+    checkpoints->bitmap[offset >> 3] |= (uint8_t)(1 << (offset & 7));
+}
+
+static void message_key_checkpoints_clear_bit(message_key_checkpoints *checkpoints, uint32_t counter)
+{
+    uint32_t offset = counter - checkpoints->bitmap_base;
+    checkpoints->bitmap[offset >> 3] &= (uint8_t)~(1 << (offset & 7));
+}
+
+static size_t message_key_checkpoints_bitmap_len(const message_key_checkpoints *checkpoints)
+{
+    return ((size_t)(checkpoints->end - checkpoints->bitmap_base) + 7) / 8;
+}
+
+static int message_key_checkpoints_chain_step(const message_key_checkpoints *checkpoints, uint8_t *chain_key)
+{
+    static const uint8_t chain_key_seed = 0x02;
+    int result = 0;
+    uint8_t next_key[MESSAGE_KEY_CHECKPOINT_KEY_LENGTH];
+    signal_iovec iov[1];
+
+    iov[0].data = &chain_key_seed;
+    iov[0].len = sizeof(chain_key_seed);
+
+    result = signal_hmac_sha256(checkpoints->global_context,
+            chain_key, MESSAGE_KEY_CHECKPOINT_KEY_LENGTH, iov, 1, next_key);
+    if(result >= 0) {
+        memcpy(chain_key, next_key, sizeof(next_key));
+        result = 0;
+    }
+    signal_explicit_bzero(next_key, sizeof(next_key));
+    return result;
+}
+
+static void message_key_checkpoints_reset(message_key_checkpoints *checkpoints)
+{
+    if(checkpoints->keys) {
+        signal_explicit_bzero(checkpoints->keys, checkpoints->count * MESSAGE_KEY_CHECKPOINT_KEY_LENGTH);
+    }
+    if(checkpoints->bitmap) {
+        memset(checkpoints->bitmap, 0, checkpoints->bitmap_capacity);
+    }
+    checkpoints->count = 0;
+    checkpoints->bitmap_base = 0;
+    checkpoints->end = 0;
+    checkpoints->available = 0;
+}
+
+static int message_key_checkpoints_reserve_bitmap(message_key_checkpoints *checkpoints, uint32_t end)
+{
+    size_t needed = ((size_t)(end - checkpoints->bitmap_base) + 7) / 8;
+    size_t capacity;
+    uint8_t *bitmap;
+
+    if(needed <= checkpoints->bitmap_capacity) {
+        return 0;
+    }
+
+    capacity = checkpoints->bitmap_capacity * 2;
+    if(capacity < needed) {
+        capacity = needed;
+    }
+
+    bitmap = signal_malloc(checkpoints->global_context, capacity);
+    if(!bitmap) {
+        return SG_ERR_NOMEM;
+    }
+    memset(bitmap, 0, capacity);
+    if(checkpoints->bitmap) {
+        memcpy(bitmap, checkpoints->bitmap, checkpoints->bitmap_capacity);
+        signal_free(checkpoints->global_context, checkpoints->bitmap);
+    }
+    checkpoints->bitmap = bitmap;
+    checkpoints->bitmap_capacity = capacity;
+    return 0;
+}
+
+static int message_key_checkpoints_append(message_key_checkpoints *checkpoints, uint32_t counter, const uint8_t *chain_key)
+{
+    if(checkpoints->count == checkpoints->capacity) {
+        size_t capacity = checkpoints->capacity > 0 ? checkpoints->capacity * 2 : MESSAGE_KEY_CHECKPOINTS_INITIAL_CAPACITY;
+        uint32_t *counters;
+        uint8_t *keys;
+
+        if(capacity > SIZE_MAX / MESSAGE_KEY_CHECKPOINT_KEY_LENGTH) {
+            return SG_ERR_NOMEM;
+        }
+
+        counters = signal_malloc(checkpoints->global_context, sizeof(uint32_t) * capacity);
+        keys = signal_malloc(checkpoints->global_context, MESSAGE_KEY_CHECKPOINT_KEY_LENGTH * capacity);
+        if(!counters || !keys) {
+            signal_free(checkpoints->global_context, counters);
+            signal_free(checkpoints->global_context, keys);
+            return SG_ERR_NOMEM;
+        }
+
+        if(checkpoints->count > 0) {
+            memcpy(counters, checkpoints->counters, sizeof(uint32_t) * checkpoints->count);
+            memcpy(keys, checkpoints->keys, MESSAGE_KEY_CHECKPOINT_KEY_LENGTH * checkpoints->count);
+            signal_explicit_bzero(checkpoints->keys, MESSAGE_KEY_CHECKPOINT_KEY_LENGTH * checkpoints->count);
+        }
+        signal_free(checkpoints->global_context, checkpoints->counters);
+        signal_free(checkpoints->global_context, checkpoints->keys);
+
+        checkpoints->counters = counters;
+        checkpoints->keys = keys;
+        checkpoints->capacity = capacity;
+    }
+
+    checkpoints->counters[checkpoints->count] = counter;
+    memcpy(message_key_checkpoints_key(checkpoints, checkpoints->count), chain_key, MESSAGE_KEY_CHECKPOINT_KEY_LENGTH);
+    checkpoints->count++;
+    return 0;
+}
+
+/* Move the start of the bitmap forward to the byte holding the first checkpoint */
+static void message_key_checkpoints_rebase(message_key_checkpoints *checkpoints)
+{
+    uint32_t bitmap_base = checkpoints->counters[0] & ~(uint32_t)7;
+    size_t shift = (bitmap_base - checkpoints->bitmap_base) / 8;
+
+    if(shift > 0) {
+        memmove(checkpoints->bitmap, checkpoints->bitmap + shift, checkpoints->bitmap_capacity - shift);
+        memset(checkpoints->bitmap + checkpoints->bitmap_capacity - shift, 0, shift);
+        checkpoints->bitmap_base = bitmap_base;
+    }
+}
+
+static void message_key_checkpoints_remove(message_key_checkpoints *checkpoints, size_t i)
+{
+    size_t tail = checkpoints->count - i - 1;
+
+    memmove(&checkpoints->counters[i], &checkpoints->counters[i + 1], sizeof(uint32_t) * tail);
+    memmove(message_key_checkpoints_key(checkpoints, i), message_key_checkpoints_key(checkpoints, i + 1),
+            MESSAGE_KEY_CHECKPOINT_KEY_LENGTH * tail);
+    checkpoints->count--;
+    signal_explicit_bzero(message_key_checkpoints_key(checkpoints, checkpoints->count), MESSAGE_KEY_CHECKPOINT_KEY_LENGTH);
+
+    if(checkpoints->count == 0) {
+        message_key_checkpoints_reset(checkpoints);
+    }
+    else if(i == 0) {
+        message_key_checkpoints_rebase(checkpoints);
+    }
+}
+
+/* A checkpoint is only needed while a position it covers is still available */
+static int message_key_checkpoints_is_used(const message_key_checkpoints *checkpoints, size_t i)
+{
+    uint32_t range_end = i + 1 < checkpoints->count ? checkpoints->counters[i + 1] : checkpoints->end;
+    uint32_t counter;
+
+    for(counter = checkpoints->counters[i]; counter < range_end; counter++) {
+        if(message_key_checkpoints_bit(checkpoints, counter)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void message_key_checkpoints_truncate(message_key_checkpoints *checkpoints, uint32_t end)
+{
+    uint32_t counter;
+
+    for(counter = end; counter < checkpoints->end; counter++) {
+        if(message_key_checkpoints_bit(checkpoints, counter)) {
+            message_key_checkpoints_clear_bit(checkpoints, counter);
+            checkpoints->available--;
+        }
+    }
+    checkpoints->end = end;
+
+    while(checkpoints->count > 0 && checkpoints->counters[checkpoints->count - 1] >= end) {
+        message_key_checkpoints_remove(checkpoints, checkpoints->count - 1);
+    }
+}
+
+static void message_key_checkpoints_evict(message_key_checkpoints *checkpoints, uint32_t start)
+{
+    uint32_t counter;
+    uint32_t limit = start < checkpoints->end ? start : checkpoints->end;
+
+    for(counter = checkpoints->counters[0]; counter < limit; counter++) {
+        if(message_key_checkpoints_bit(checkpoints, counter)) {
+            message_key_checkpoints_clear_bit(checkpoints, counter);
+            checkpoints->available--;
+        }
+    }
+
+    if(checkpoints->available == 0) {
+        message_key_checkpoints_reset(checkpoints);
+        return;
+    }
+
+    while(!message_key_checkpoints_is_used(checkpoints, 0)) {
+        message_key_checkpoints_remove(checkpoints, 0);
+    }
+}
+
+/* Move checkpoint i forward to the next position still available in its range */
+static int message_key_checkpoints_advance(message_key_checkpoints *checkpoints, size_t i)
+{
+    int result = 0;
+    uint32_t range_end = i + 1 < checkpoints->count ? checkpoints->counters[i + 1] : checkpoints->end;
+    uint32_t next;
+    uint32_t cur;
+    uint8_t next_key[MESSAGE_KEY_CHECKPOINT_KEY_LENGTH];
+
+    for(next = checkpoints->counters[i] + 1; next < range_end; next++) {
+        if(message_key_checkpoints_bit(checkpoints, next)) {
+            break;
+        }
+    }
+    if(next == range_end) {
+        return 0;
+    }
+
+    memcpy(next_key, message_key_checkpoints_key(checkpoints, i), sizeof(next_key));
+    for(cur = checkpoints->counters[i]; cur < next; cur++) {
+        result = message_key_checkpoints_chain_step(checkpoints, next_key);
+        if(result < 0) {
+            goto complete;
+        }
+    }
+
+    memcpy(message_key_checkpoints_key(checkpoints, i), next_key, sizeof(next_key));
+    checkpoints->counters[i] = next;
+
+complete:
+    signal_explicit_bzero(next_key, sizeof(next_key));
+    return result;
+}
+
+static size_t message_key_checkpoints_find(const message_key_checkpoints *checkpoints, uint32_t counter)
+{
+    size_t low = 0;
+    size_t high = checkpoints->count;
+
+    /* Last checkpoint at or before the counter */
+    while(high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if(checkpoints->counters[mid] <= counter) {
+            low = mid;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+int message_key_checkpoints_create(message_key_checkpoints **checkpoints,
+        uint32_t interval, uint32_t max_span, signal_context *global_context)
+{
+    message_key_checkpoints *result = 0;
+
+    assert(interval > 0);
+    assert(max_span > 0);
+    assert(global_context);
+
+    result = signal_malloc(global_context, sizeof(message_key_checkpoints));
+    if(!result) {
+        return SG_ERR_NOMEM;
+    }
+    memset(result, 0, sizeof(message_key_checkpoints));
+    SIGNAL_INIT(result, message_key_checkpoints_destroy);
+    result->global_context = global_context;
+    result->interval = interval;
+    result->max_span = max_span;
+
+    *checkpoints = result;
+    return 0;
+}
+
+int message_key_checkpoints_copy(message_key_checkpoints **checkpoints, const message_key_checkpoints *other_checkpoints)
+{
+    int result = 0;
+    message_key_checkpoints *result_checkpoints = 0;
+
+    assert(other_checkpoints);
+
+    result = message_key_checkpoints_create(&result_checkpoints,
+            other_checkpoints->interval, other_checkpoints->max_span,
+            other_checkpoints->global_context);
+    if(result < 0) {
+        goto complete;
+    }
+
+    if(other_checkpoints->capacity > 0) {
+        result_checkpoints->counters = signal_malloc(other_checkpoints->global_context, sizeof(uint32_t) * other_checkpoints->capacity);
+        result_checkpoints->keys = signal_malloc(other_checkpoints->global_context, MESSAGE_KEY_CHECKPOINT_KEY_LENGTH * other_checkpoints->capacity);
+        if(!result_checkpoints->counters || !result_checkpoints->keys) {
+            result = SG_ERR_NOMEM;
+            goto complete;
+        }
+        memcpy(result_checkpoints->counters, other_checkpoints->counters, sizeof(uint32_t) * other_checkpoints->count);
+        memcpy(result_checkpoints->keys, other_checkpoints->keys, MESSAGE_KEY_CHECKPOINT_KEY_LENGTH * other_checkpoints->count);
+        result_checkpoints->capacity = other_checkpoints->capacity;
+        result_checkpoints->count = other_checkpoints->count;
+    }
+
+    if(other_checkpoints->bitmap_capacity > 0) {
+        result_checkpoints->bitmap = signal_malloc(other_checkpoints->global_context, other_checkpoints->bitmap_capacity);
+        if(!result_checkpoints->bitmap) {
+            result = SG_ERR_NOMEM;
+            goto complete;
+        }
+        memcpy(result_checkpoints->bitmap, other_checkpoints->bitmap, other_checkpoints->bitmap_capacity);
+        result_checkpoints->bitmap_capacity = other_checkpoints->bitmap_capacity;
+    }
+
+    result_checkpoints->bitmap_base = other_checkpoints->bitmap_base;
+    result_checkpoints->end = other_checkpoints->end;
+    result_checkpoints->available = other_checkpoints->available;
+
+complete:
+    if(result >= 0) {
+        *checkpoints = result_checkpoints;
+    }
+    else {
+        SIGNAL_UNREF(result_checkpoints);
+    }
+    return result;
+}
+
+int message_key_checkpoints_unshare(message_key_checkpoints **checkpoints)
+{
+    int result = 0;
+    message_key_checkpoints *checkpoints_copy = 0;
+
+    assert(checkpoints);
+    assert(*checkpoints);
+
+    if(!signal_type_is_unique(&(*checkpoints)->base)) {
+        result = message_key_checkpoints_copy(&checkpoints_copy, *checkpoints);
+        if(result < 0) {
+            return result;
+        }
+        SIGNAL_UNREF(*checkpoints);
+        *checkpoints = checkpoints_copy;
+    }
+    return 0;
+}
+
+int message_key_checkpoints_skip(message_key_checkpoints *checkpoints,
+        uint8_t *chain_key, uint32_t counter, uint32_t end)
+{
+    int result = 0;
+    uint32_t first = counter;
+    uint32_t cur;
+
+    assert(checkpoints);
+    assert(chain_key);
+
+    if(end <= counter) {
+        return 0;
+    }
+
+    /* Positions that would be evicted right away are never recorded */
+    if(end - counter > checkpoints->max_span) {
+        first = end - checkpoints->max_span;
+    }
+
+    if(checkpoints->available == 0) {
+        message_key_checkpoints_reset(checkpoints);
+    }
+    if(checkpoints->count > 0) {
+        if(counter < checkpoints->end) {
+            message_key_checkpoints_truncate(checkpoints, counter);
+        }
+        if(checkpoints->count > 0 && end - checkpoints->counters[0] > checkpoints->max_span) {
+            message_key_checkpoints_evict(checkpoints, end - checkpoints->max_span);
+        }
+    }
+    if(checkpoints->count == 0) {
+        message_key_checkpoints_reset(checkpoints);
+        checkpoints->bitmap_base = first & ~(uint32_t)7;
+        checkpoints->end = first;
+    }
+
+    result = message_key_checkpoints_reserve_bitmap(checkpoints, end);
+    if(result < 0) {
+        return result;
+    }
+
+    for(cur = counter; cur < end; cur++) {
+        if(cur >= first) {
+            if((cur - first) % checkpoints->interval == 0) {
+                result = message_key_checkpoints_append(checkpoints, cur, chain_key);
+                if(result < 0) {
+                    break;
+                }
+            }
+            message_key_checkpoints_set_bit(checkpoints, cur);
+            checkpoints->available++;
+            checkpoints->end = cur + 1;
+        }
+
+        result = message_key_checkpoints_chain_step(checkpoints, chain_key);
+        if(result < 0) {
+            break;
+        }
+    }
+
+    return result;
+}
+
+int message_key_checkpoints_contains(const message_key_checkpoints *checkpoints, uint32_t counter)
+{
+    assert(checkpoints);
+
+    if(checkpoints->available == 0 || counter < checkpoints->counters[0] || counter >= checkpoints->end) {
+        return 0;
+    }
+    return message_key_checkpoints_bit(checkpoints, counter);
+}
+
+int message_key_checkpoints_take(message_key_checkpoints *checkpoints,
+        uint32_t counter, uint8_t *chain_key)
+{
+    int result = 0;
+    size_t i;
+    uint32_t cur;
+
+    assert(checkpoints);
+    assert(chain_key);
+
+    if(!message_key_checkpoints_contains(checkpoints, counter)) {
+        return 0;
+    }
+
+    i = message_key_checkpoints_find(checkpoints, counter);
+    memcpy(chain_key, message_key_checkpoints_key(checkpoints, i), MESSAGE_KEY_CHECKPOINT_KEY_LENGTH);
+    for(cur = checkpoints->counters[i]; cur < counter; cur++) {
+        result = message_key_checkpoints_chain_step(checkpoints, chain_key);
+        if(result < 0) {
+            signal_explicit_bzero(chain_key, MESSAGE_KEY_CHECKPOINT_KEY_LENGTH);
+            return result;
+        }
+    }
+
+    /* Otherwise the checkpoint would still hold the key of the consumed position */
+    if(counter == checkpoints->counters[i]) {
+        result = message_key_checkpoints_advance(checkpoints, i);
+        if(result < 0) {
+            signal_explicit_bzero(chain_key, MESSAGE_KEY_CHECKPOINT_KEY_LENGTH);
+            return result;
+        }
+    }
+
+    message_key_checkpoints_clear_bit(checkpoints, counter);
+    checkpoints->available--;
+
+    if(checkpoints->available == 0) {
+        message_key_checkpoints_reset(checkpoints);
+    }
+    else if(!message_key_checkpoints_is_used(checkpoints, i)) {
+        message_key_checkpoints_remove(checkpoints, i);
+    }
+    else if(i == 0) {
+        message_key_checkpoints_rebase(checkpoints);
+    }
+
+    return 1;
+}
+
+size_t message_key_checkpoints_count(const message_key_checkpoints *checkpoints)
+{
+    assert(checkpoints);
+    return checkpoints->available;
+}
+
+size_t message_key_checkpoints_get_checkpoint_count(const message_key_checkpoints *checkpoints)
+{
+    assert(checkpoints);
+    return checkpoints->count;
+}
+
+const uint8_t *message_key_checkpoints_get_checkpoint(const message_key_checkpoints *checkpoints,
+        size_t i, uint32_t *counter)
+{
+    assert(checkpoints);
+    assert(i < checkpoints->count);
+
+    if(counter) {
+        *counter = checkpoints->counters[i];
+    }
+    return message_key_checkpoints_key(checkpoints, i);
+}
+
+const uint8_t *message_key_checkpoints_get_bitmap(const message_key_checkpoints *checkpoints, size_t *len)
+{
+    assert(checkpoints);
+    assert(len);
+
+    *len = checkpoints->count > 0 ? message_key_checkpoints_bitmap_len(checkpoints) : 0;
+    return checkpoints->bitmap;
+}
+
+int message_key_checkpoints_load_checkpoint(message_key_checkpoints *checkpoints,
+        uint32_t counter, const uint8_t *chain_key, size_t chain_key_len)
+{
+    assert(checkpoints);
+
+    if(!chain_key || chain_key_len != MESSAGE_KEY_CHECKPOINT_KEY_LENGTH) {
+        return SG_ERR_INVALID_PROTO_BUF;
+    }
+    if(checkpoints->count > 0 && counter <= checkpoints->counters[checkpoints->count - 1]) {
+        return SG_ERR_INVALID_PROTO_BUF;
+    }
+    if(checkpoints->count >= checkpoints->max_span) {
+        return SG_ERR_INVALID_PROTO_BUF;
+    }
+
+    if(checkpoints->count == 0) {
+        checkpoints->bitmap_base = counter & ~(uint32_t)7;
+    }
+    return message_key_checkpoints_append(checkpoints, counter, chain_key);
+}
+
+int message_key_checkpoints_load_bitmap(message_key_checkpoints *checkpoints,
+        const uint8_t *bitmap, size_t len)
+{
+    int result = 0;
+    uint32_t counter;
+
+    assert(checkpoints);
+
+    if(checkpoints->count == 0) {
+        return 0;
+    }
+
+    /* Never more than max_span positions past the checkpoint covering the oldest one */
+    if(len > (size_t)checkpoints->max_span / 4 + 2 || (len > 0 && !bitmap)) {
+        return SG_ERR_INVALID_PROTO_BUF;
+    }
+    if((uint64_t)checkpoints->bitmap_base + (uint64_t)len * 8 > UINT32_MAX) {
+        return SG_ERR_INVALID_PROTO_BUF;
+    }
+
+    checkpoints->end = checkpoints->bitmap_base + (uint32_t)(len * 8);
+    result = message_key_checkpoints_reserve_bitmap(checkpoints, checkpoints->end);
+    if(result < 0) {
+        return result;
+    }
+    if(len > 0) {
+        memcpy(checkpoints->bitmap, bitmap, len);
+    }
+
+    /* Ignore positions before the first checkpoint, which cannot be recovered */
+    for(counter = checkpoints->bitmap_base; counter < checkpoints->counters[0]; counter++) {
+        message_key_checkpoints_clear_bit(checkpoints, counter);
+    }
+
+    checkpoints->available = 0;
+    for(counter = checkpoints->counters[0]; counter < checkpoints->end; counter++) {
+        if(message_key_checkpoints_bit(checkpoints, counter)) {
+            checkpoints->available++;
+        }
+    }
+
+    while(checkpoints->count > 0 && checkpoints->counters[checkpoints->count - 1] >= checkpoints->end) {
+        message_key_checkpoints_remove(checkpoints, checkpoints->count - 1);
+    }
+    if(checkpoints->available == 0) {
+        message_key_checkpoints_reset(checkpoints);
+    }
+
+    return 0;
+}
+
+void message_key_checkpoints_destroy(signal_type_base *type)
+{
+    message_key_checkpoints *checkpoints = (message_key_checkpoints *)type;
+
+    if(checkpoints->keys) {
+        signal_explicit_bzero(checkpoints->keys, MESSAGE_KEY_CHECKPOINT_KEY_LENGTH * checkpoints->capacity);
+    }
+    signal_free(checkpoints->global_context, checkpoints->counters);
+    signal_free(checkpoints->global_context, checkpoints->keys);
+    signal_free(checkpoints->global_context, checkpoints->bitmap);
+    signal_free(checkpoints->global_context, checkpoints);
+}
@@ -0,0 +1,109 @@
+#ifndef MESSAGE_KEY_CHECKPOINTS_H
+#define MESSAGE_KEY_CHECKPOINTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "signal_protocol_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MESSAGE_KEY_CHECKPOINT_KEY_LENGTH 32
+#define MESSAGE_KEY_CHECKPOINTS_MAX_INTERVAL 2000
+
+/*
+ * Skipped message keys of a symmetric chain, stored as chain key checkpoints
+ * instead of as derived keys.
+ *
+ * Both the session ratchet and sender key chains advance with
+ * HMAC-SHA256(chain_key, 0x02). Rather than deriving and storing the message
+ * key for every skipped position, the chain key is recorded once every
+ * interval positions, along with a bitmap of the positions whose key has not
+ * been used yet. A late message then costs at most interval - 1 chain steps
+ * to recover its chain key, from which the owner derives the message key.
+ *
+ * Positions more than max_span behind the newest skipped position are
+ * dropped, bounding both memory and the serialized size of a chain.
+ *
+ * Checkpoints are reference counted so that copies of a session state can
+ * share them until one side modifies its skipped keys. All key memory is
+ * zeroed before it is released.
+ */
+typedef struct message_key_checkpoints message_key_checkpoints;
+
+int message_key_checkpoints_create(message_key_checkpoints **checkpoints,
+        uint32_t interval, uint32_t max_span, signal_context *global_context);
+int message_key_checkpoints_copy(message_key_checkpoints **checkpoints, const message_key_checkpoints *other_checkpoints);
+
+/**
+ * Ensure the caller holds the only reference, replacing the checkpoints
+ * with a private copy if they are currently shared.
+ *
+ * @return 0 on success, negative on failure
+ */
+int message_key_checkpoints_unshare(message_key_checkpoints **checkpoints);
+
+/**
+ * Record the positions from counter up to, but not including, end as
+ * skipped, and advance the chain key in place to position end.
+ *
+ * @param chain_key chain key for position counter, replaced by the chain key for position end
+ * @return 0 on success, negative on failure
+ */
+int message_key_checkpoints_skip(message_key_checkpoints *checkpoints,
+        uint8_t *chain_key, uint32_t counter, uint32_t end);
+
+/**
+ * @return 1 if the key for the position is still available, 0 otherwise
+ */
+int message_key_checkpoints_contains(const message_key_checkpoints *checkpoints, uint32_t counter);
+
+/**
+ * Recover the chain key for a skipped position and mark it as used.
+ *
+ * @param chain_key set to the chain key for the position
+ * @return 1 if the position was available, 0 if not, negative on failure
+ */
+int message_key_checkpoints_take(message_key_checkpoints *checkpoints,
+        uint32_t counter, uint8_t *chain_key);
+
+/**
+ * @return number of skipped positions whose key is still available
+ */
+size_t message_key_checkpoints_count(const message_key_checkpoints *checkpoints);
+
+/*
+ * Serialization. The bitmap holds one bit per position, least significant
+ * bit first, starting at the position of the first checkpoint rounded down
+ * to a multiple of eight.
+ */
+size_t message_key_checkpoints_get_checkpoint_count(const message_key_checkpoints *checkpoints);
+const uint8_t *message_key_checkpoints_get_checkpoint(const message_key_checkpoints *checkpoints,
+        size_t i, uint32_t *counter);
+const uint8_t *message_key_checkpoints_get_bitmap(const message_key_checkpoints *checkpoints, size_t *len);
+
+/**
+ * Append a checkpoint read from a serialized chain. Checkpoints must be
+ * loaded in ascending order, before the bitmap.
+ *
+ * @return 0 on success, negative on failure
+ */
+int message_key_checkpoints_load_checkpoint(message_key_checkpoints *checkpoints,
+        uint32_t counter, const uint8_t *chain_key, size_t chain_key_len);
+
+/**
+ * Load the bitmap of a serialized chain, after its checkpoints.
+ *
+ * @return 0 on success, negative on failure
+ */
+int message_key_checkpoints_load_bitmap(message_key_checkpoints *checkpoints,
+        const uint8_t *bitmap, size_t len);
+
+void message_key_checkpoints_destroy(signal_type_base *type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MESSAGE_KEY_CHECKPOINTS_H */
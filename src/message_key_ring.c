@@ -0,0 +1,383 @@
+#include "message_key_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "signal_protocol.h"
+#include "signal_protocol_internal.h"
+
+#define MESSAGE_KEY_RING_INITIAL_CAPACITY 16
+
+struct message_key_ring
+{
+    signal_type_base base;
+    signal_context *global_context;
+
+    size_t element_size;
+    size_t max_count;
+
+    /* Ring of slots in insertion order, capacity is a power of two */
+    size_t capacity;
+    size_t head;
+    size_t span;
+    size_t count;
+    uint32_t *counters;
+    uint8_t *occupied;
+    uint8_t *elements;
+
+    /* Linear probing table of (slot + 1), or 0 for an empty bucket */
+    size_t index_capacity;
+    uint32_t *index;
+};
+
+static size_t message_key_ring_hash(const message_key_ring *ring, uint32_t counter)
+{
+    return (size_t)(counter * 2654435761U) & (ring->index_capacity - 1);
+}
+
+static uint8_t *message_key_ring_element(const message_key_ring *ring, size_t slot)
+{
+    return ring->elements + (slot * ring->element_size);
+}
+
+static size_t message_key_ring_index_lookup(const message_key_ring *ring, uint32_t counter)
+{
+    size_t bucket;
+
+    if(ring->count == 0) {
+        return ring->index_capacity;
+    }
+
+    bucket = message_key_ring_hash(ring, counter);
+    while(ring->index[bucket] != 0) {
+        if(ring->counters[ring->index[bucket] - 1] == counter) {
+            return bucket;
+        }
+        bucket = (bucket + 1) & (ring->index_capacity - 1);
+    }
+    return ring->index_capacity;
+}
+
+static void message_key_ring_index_insert(message_key_ring *ring, size_t slot)
+{
+    size_t bucket = message_key_ring_hash(ring, ring->counters[slot]);
+    while(ring->index[bucket] != 0) {
+        bucket = (bucket + 1) & (ring->index_capacity - 1);
+    }
+    ring->index[bucket] = (uint32_t)(slot + 1);
+}
+
+static void message_key_ring_index_delete(message_key_ring *ring, size_t bucket)
+{
+    size_t mask = ring->index_capacity - 1;
+    size_t hole = bucket;
+    size_t cur = bucket;
+    size_t home;
+
+    /* Backward shift deletion keeps probe sequences intact without tombstones */
+    for(;;) {
+        cur = (cur + 1) & mask;
+        if(ring->index[cur] == 0) {
+            break;
+        }
+        home = message_key_ring_hash(ring, ring->counters[ring->index[cur] - 1]);
+        if(hole <= cur ? (hole < home && home <= cur) : (hole < home || home <= cur)) {
+            continue;
+        }
+        ring->index[hole] = ring->index[cur];
+        hole = cur;
+    }
+    ring->index[hole] = 0;
+}
+
+static void message_key_ring_release_slot(message_key_ring *ring, size_t slot)
+{
+    signal_explicit_bzero(message_key_ring_element(ring, slot), ring->element_size);
+    ring->occupied[slot] = 0;
+    ring->count--;
+
+    /* Trim holes from both ends so that head always refers to a live entry */
+    while(ring->span > 0 && !ring->occupied[ring->head]) {
+        ring->head = (ring->head + 1) & (ring->capacity - 1);
+        ring->span--;
+    }
+    while(ring->span > 0 && !ring->occupied[(ring->head + ring->span - 1) & (ring->capacity - 1)]) {
+        ring->span--;
+    }
+    if(ring->span == 0) {
+        ring->head = 0;
+    }
+}
+
+static int message_key_ring_rebuild(message_key_ring *ring, size_t capacity)
+{
+    uint32_t *counters = 0;
+    uint8_t *occupied = 0;
+    uint8_t *elements = 0;
+    uint32_t *index = 0;
+    size_t i;
+    size_t n = 0;
+
+    if(capacity > SIZE_MAX / 2 / sizeof(uint32_t) || capacity > SIZE_MAX / ring->element_size || capacity > UINT32_MAX) {
+        return SG_ERR_NOMEM;
+    }
+
+    counters = signal_malloc(ring->global_context, sizeof(uint32_t) * capacity);
+    occupied = signal_malloc(ring->global_context, capacity);
+    elements = signal_malloc(ring->global_context, ring->element_size * capacity);
+    index = signal_malloc(ring->global_context, sizeof(uint32_t) * capacity * 2);
+    if(!counters || !occupied || !elements || !index) {
+        signal_free(ring->global_context, counters);
+        signal_free(ring->global_context, occupied);
+        signal_free(ring->global_context, elements);
+        signal_free(ring->global_context, index);
+        return SG_ERR_NOMEM;
+    }
+    memset(occupied, 0, capacity);
+    memset(index, 0, sizeof(uint32_t) * capacity * 2);
+
+    for(i = 0; i < ring->span; i++) {
+        size_t slot = (ring->head + i) & (ring->capacity - 1);
+        if(ring->occupied[slot]) {
+            counters[n] = ring->counters[slot];
+            occupied[n] = 1;
+            memcpy(elements + (n * ring->element_size), message_key_ring_element(ring, slot), ring->element_size);
+            n++;
+        }
+    }
+    assert(n == ring->count);
+
+    if(ring->elements) {
+        signal_explicit_bzero(ring->elements, ring->element_size * ring->capacity);
+    }
+    signal_free(ring->global_context, ring->counters);
+    signal_free(ring->global_context, ring->occupied);
+    signal_free(ring->global_context, ring->elements);
+    signal_free(ring->global_context, ring->index);
+
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->span = n;
+    ring->counters = counters;
+    ring->occupied = occupied;
+    ring->elements = elements;
+    ring->index_capacity = capacity * 2;
+    ring->index = index;
+
+    for(i = 0; i < n; i++) {
+        message_key_ring_index_insert(ring, i);
+    }
+
+    return 0;
+}
+
+int message_key_ring_create(message_key_ring **ring, size_t element_size, size_t max_count,
+        signal_context *global_context)
+{
+    message_key_ring *result = 0;
+
+    assert(element_size > 0);
+    assert(max_count > 0);
+
+    result = signal_malloc(global_context, sizeof(message_key_ring));
+    if(!result) {
+        return SG_ERR_NOMEM;
+    }
+    memset(result, 0, sizeof(message_key_ring));
+    SIGNAL_INIT(result, message_key_ring_destroy);
+    result->global_context = global_context;
+    result->element_size = element_size;
+    result->max_count = max_count;
+
+    *ring = result;
+    return 0;
+}
+
+int message_key_ring_copy(message_key_ring **ring, const message_key_ring *other_ring)
+{
+    int result = 0;
+    message_key_ring *result_ring = 0;
+
+    assert(other_ring);
+
+    result = message_key_ring_create(&result_ring, other_ring->element_size, other_ring->max_count,
+            other_ring->global_context);
+    if(result < 0) {
+        goto complete;
+    }
+
+    if(other_ring->capacity > 0) {
+        result_ring->counters = signal_malloc(other_ring->global_context, sizeof(uint32_t) * other_ring->capacity);
+        result_ring->occupied = signal_malloc(other_ring->global_context, other_ring->capacity);
+        result_ring->elements = signal_malloc(other_ring->global_context, other_ring->element_size * other_ring->capacity);
+        result_ring->index = signal_malloc(other_ring->global_context, sizeof(uint32_t) * other_ring->index_capacity);
+        if(!result_ring->counters || !result_ring->occupied || !result_ring->elements || !result_ring->index) {
+            result = SG_ERR_NOMEM;
+            goto complete;
+        }
+        memcpy(result_ring->counters, other_ring->counters, sizeof(uint32_t) * other_ring->capacity);
+        memcpy(result_ring->occupied, other_ring->occupied, other_ring->capacity);
+        memcpy(result_ring->elements, other_ring->elements, other_ring->element_size * other_ring->capacity);
+        memcpy(result_ring->index, other_ring->index, sizeof(uint32_t) * other_ring->index_capacity);
+
+        result_ring->capacity = other_ring->capacity;
+        result_ring->head = other_ring->head;
+        result_ring->span = other_ring->span;
+        result_ring->count = other_ring->count;
+        result_ring->index_capacity = other_ring->index_capacity;
+    }
+
+complete:
+    if(result >= 0) {
+        *ring = result_ring;
+    }
+    else {
+        SIGNAL_UNREF(result_ring);
+    }
+    return result;
+}
+
+int message_key_ring_unshare(message_key_ring **ring)
+{
+    int result = 0;
+    message_key_ring *ring_copy = 0;
+
+    assert(ring);
+    assert(*ring);
+
+    if(!signal_type_is_unique(&(*ring)->base)) {
+        result = message_key_ring_copy(&ring_copy, *ring);
+        if(result < 0) {
+            return result;
+        }
+        SIGNAL_UNREF(*ring);
+        *ring = ring_copy;
+    }
+    return 0;
+}
+
+int message_key_ring_push(message_key_ring *ring, uint32_t counter, const void *element)
+{
+    int result = 0;
+    size_t bucket;
+    size_t slot;
+
+    assert(ring);
+    assert(element);
+
+    bucket = message_key_ring_index_lookup(ring, counter);
+    if(bucket < ring->index_capacity) {
+        slot = ring->index[bucket] - 1;
+        memcpy(message_key_ring_element(ring, slot), element, ring->element_size);
+        return 0;
+    }
+
+    if(ring->count >= ring->max_count) {
+        slot = ring->head;
+        message_key_ring_index_delete(ring, message_key_ring_index_lookup(ring, ring->counters[slot]));
+        message_key_ring_release_slot(ring, slot);
+    }
+
+    if(ring->span == ring->capacity) {
+        size_t capacity;
+        if(ring->capacity == 0) {
+            capacity = MESSAGE_KEY_RING_INITIAL_CAPACITY;
+        }
+        else if(ring->capacity >= ring->max_count || ring->count <= (ring->capacity / 4) * 3) {
+            /* Enough holes to reclaim, compact in place */
+            capacity = ring->capacity;
+        }
+        else {
+            capacity = ring->capacity * 2;
+        }
+        result = message_key_ring_rebuild(ring, capacity);
+        if(result < 0) {
+            return result;
+        }
+    }
+
+    slot = (ring->head + ring->span) & (ring->capacity - 1);
+    ring->counters[slot] = counter;
+    ring->occupied[slot] = 1;
+    memcpy(message_key_ring_element(ring, slot), element, ring->element_size);
+    ring->span++;
+    ring->count++;
+    message_key_ring_index_insert(ring, slot);
+
+    return 0;
+}
+
+void *message_key_ring_find(const message_key_ring *ring, uint32_t counter)
+{
+    size_t bucket;
+
+    assert(ring);
+
+    bucket = message_key_ring_index_lookup(ring, counter);
+    if(bucket >= ring->index_capacity) {
+        return 0;
+    }
+    return message_key_ring_element(ring, ring->index[bucket] - 1);
+}
+
+int message_key_ring_remove(message_key_ring *ring, uint32_t counter, void *element)
+{
+    size_t bucket;
+    size_t slot;
+
+    assert(ring);
+
+    bucket = message_key_ring_index_lookup(ring, counter);
+    if(bucket >= ring->index_capacity) {
+        return 0;
+    }
+
+    slot = ring->index[bucket] - 1;
+    if(element) {
+        memcpy(element, message_key_ring_element(ring, slot), ring->element_size);
+    }
+    message_key_ring_index_delete(ring, bucket);
+    message_key_ring_release_slot(ring, slot);
+    return 1;
+}
+
+size_t message_key_ring_count(const message_key_ring *ring)
+{
+    assert(ring);
+    return ring->count;
+}
+
+void *message_key_ring_next(const message_key_ring *ring, size_t *iterator, uint32_t *counter)
+{
+    size_t slot;
+
+    assert(ring);
+    assert(iterator);
+
+    while(*iterator < ring->span) {
+        slot = (ring->head + *iterator) & (ring->capacity - 1);
+        (*iterator)++;
+        if(ring->occupied[slot]) {
+            if(counter) {
+                *counter = ring->counters[slot];
+            }
+            return message_key_ring_element(ring, slot);
+        }
+    }
+    return 0;
+}
+
+void message_key_ring_destroy(signal_type_base *type)
+{
+    message_key_ring *ring = (message_key_ring *)type;
+
+    if(ring->elements) {
+        signal_explicit_bzero(ring->elements, ring->element_size * ring->capacity);
+    }
+    signal_free(ring->global_context, ring->counters);
+    signal_free(ring->global_context, ring->occupied);
+    signal_free(ring->global_context, ring->elements);
+    signal_free(ring->global_context, ring->index);
+    signal_free(ring->global_context, ring);
+}
@@ -0,0 +1,76 @@
+#ifndef MESSAGE_KEY_RING_H
+#define MESSAGE_KEY_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "signal_protocol_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bounded FIFO of fixed-size skipped message key entries, indexed by their
+ * message counter.
+ *
+ * Entries live in a power-of-two ring buffer in insertion order. A linear
+ * probing hash table maps each counter to its slot, so lookup and removal
+ * are O(1). Removing an entry from the middle leaves a hole that is skipped
+ * by iteration and reclaimed by eviction or compaction. Once max_count
+ * entries are held, pushing a new entry evicts the oldest one.
+ *
+ * Rings are reference counted so that copies of a session state can share
+ * them until one side modifies its skipped keys. All entry memory is zeroed
+ * before it is released.
+ */
+typedef struct message_key_ring message_key_ring;
+
+int message_key_ring_create(message_key_ring **ring, size_t element_size, size_t max_count,
+        signal_context *global_context);
+int message_key_ring_copy(message_key_ring **ring, const message_key_ring *other_ring);
+
+/**
+ * Ensure the caller holds the only reference to the ring, replacing it
+ * with a private copy if it is currently shared.
+ *
+ * @return 0 on success, negative on failure
+ */
+int message_key_ring_unshare(message_key_ring **ring);
+
+/**
+ * Append an entry to the ring, evicting the oldest entry if the ring is full.
+ * If an entry with the same counter already exists, it is overwritten in place.
+ *
+ * @return 0 on success, negative on failure
+ */
+int message_key_ring_push(message_key_ring *ring, uint32_t counter, const void *element);
+
+/**
+ * @return pointer to the entry for the counter, or 0 if it is not present
+ */
+void *message_key_ring_find(const message_key_ring *ring, uint32_t counter);
+
+/**
+ * Remove the entry for the counter, copying it into element if provided.
+ *
+ * @return 1 if the entry was found and removed, 0 otherwise
+ */
+int message_key_ring_remove(message_key_ring *ring, uint32_t counter, void *element);
+
+size_t message_key_ring_count(const message_key_ring *ring);
+
+/**
+ * Iterate over the entries from oldest to newest.
+ * The iterator must be initialized to 0 before the first call.
+ *
+ * @return pointer to the next entry, or 0 when there are no more entries
+ */
+void *message_key_ring_next(const message_key_ring *ring, size_t *iterator, uint32_t *counter);
+
+void message_key_ring_destroy(signal_type_base *type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MESSAGE_KEY_RING_H */
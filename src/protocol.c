@@ -5,6 +5,7 @@
 
 #include "curve.h"
 #include "signal_protocol_internal.h"
+#include "protocol_wire.h"
 #include "WhisperTextProtocol.pb-c.h"
 
 #define SIGNAL_MESSAGE_MAC_LENGTH 8
@@ -25,7 +26,9 @@ struct signal_message
     ec_public_key *sender_ratchet_key;
     uint32_t counter;
     uint32_t previous_counter;
-    signal_buffer *ciphertext;
+    const uint8_t *ciphertext;
+    size_t ciphertext_len;
+    signal_buffer *body;
 };
 
 struct pre_key_signal_message
@@ -47,7 +50,9 @@ struct sender_key_message
     uint8_t message_version;
     uint32_t key_id;
     uint32_t iteration;
-    signal_buffer *ciphertext;
+    const uint8_t *ciphertext;
+    size_t ciphertext_len;
+    signal_buffer *ciphertext_buffer;
 };
 
 struct sender_key_distribution_message
@@ -59,8 +64,7 @@ struct sender_key_distribution_message
     ec_public_key *signature_key;
 };
 
-static int signal_message_serialize(signal_buffer **buffer, const signal_message *message);
-static int signal_message_get_mac(signal_buffer **buffer,
+static int signal_message_get_mac(uint8_t *mac,
         uint8_t message_version,
         ec_public_key *sender_identity_key,
         ec_public_key *receiver_identity_key,
@@ -97,13 +101,15 @@ int signal_message_create(signal_message **message, uint8_t message_version,
         signal_context *global_context)
 {
     int result = 0;
-    signal_buffer *message_buf = 0;
-    signal_buffer *mac_buf = 0;
+    uint8_t ratchet_key_data[EC_PUBLIC_KEY_SERIALIZED_LENGTH];
+    protocol_wire_signal_message message_structure;
+    size_t len = 0;
+    uint8_t *data = 0;
     signal_message *result_message = 0;
 
     assert(global_context);
 
-    result_message = malloc(sizeof(signal_message));
+    result_message = signal_malloc(global_context, sizeof(signal_message));
     if(!result_message) {
         return SG_ERR_NOMEM;
     }
@@ -118,48 +124,44 @@ int signal_message_create(signal_message **message, uint8_t message_version,
 
     result_message->counter = counter;
     result_message->previous_counter = previous_counter;
+    result_message->message_version = message_version;
+
+    memset(&message_structure, 0, sizeof(message_structure));
+    ec_public_key_serialize_into(ratchet_key_data, sender_ratchet_key);
+    message_structure.ratchet_key.data = ratchet_key_data;
+    message_structure.ratchet_key.len = sizeof(ratchet_key_data);
+    message_structure.has_ratchet_key = 1;
+    message_structure.counter = counter;
+    message_structure.has_counter = 1;
+    message_structure.previous_counter = previous_counter;
+    message_structure.has_previous_counter = 1;
+    message_structure.ciphertext.data = ciphertext;
+    message_structure.ciphertext.len = ciphertext_len;
+    message_structure.has_ciphertext = 1;
 
-    result_message->ciphertext = signal_buffer_create(ciphertext, ciphertext_len);
-    if(!result_message->ciphertext) {
+    /* Version byte, message body and MAC, written into one buffer */
+    len = 1 + protocol_wire_signal_message_get_size(&message_structure);
+    result_message->base_message.serialized = signal_buffer_context_alloc(global_context, len + SIGNAL_MESSAGE_MAC_LENGTH);
+    if(!result_message->base_message.serialized) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
 
-    result_message->message_version = message_version;
+    data = signal_buffer_data(result_message->base_message.serialized);
+    data[0] = (message_version << 4) | CIPHERTEXT_CURRENT_VERSION;
+    protocol_wire_write_signal_message(data + 1, &message_structure);
 
-    result = signal_message_serialize(&message_buf, result_message);
-    if(result < 0) {
-        goto complete;
-    }
+    /* The ciphertext is the last field of the body */
+    result_message->ciphertext = data + len - ciphertext_len;
+    result_message->ciphertext_len = ciphertext_len;
 
-    result = signal_message_get_mac(&mac_buf,
+    result = signal_message_get_mac(data + len,
             message_version, sender_identity_key, receiver_identity_key,
             mac_key, mac_key_len,
-            signal_buffer_data(message_buf),
-            signal_buffer_len(message_buf),
+            data, len,
             global_context);
-    if(result < 0) {
-        goto complete;
-    }
-
-    result_message->base_message.serialized = signal_buffer_append(
-            message_buf,
-            signal_buffer_data(mac_buf),
-            signal_buffer_len(mac_buf));
-    if(result_message->base_message.serialized) {
-        message_buf = 0;
-    }
-    else {
-        result = SG_ERR_NOMEM;
-    }
 
 complete:
-    if(message_buf) {
-        signal_buffer_free(message_buf);
-    }
-    if(mac_buf) {
-        signal_buffer_free(mac_buf);
-    }
     if(result >= 0) {
         result = 0;
         *message = result_message;
@@ -172,70 +174,12 @@ complete:
     return result;
 }
 
-static int signal_message_serialize(signal_buffer **buffer, const signal_message *message)
-{
-    int result = 0;
-    size_t result_size = 0;
-    signal_buffer *result_buf = 0;
-    Textsecure__SignalMessage message_structure = TEXTSECURE__SIGNAL_MESSAGE__INIT;
-    size_t len = 0;
-    uint8_t *data = 0;
-
-    uint8_t version = (message->message_version << 4) | CIPHERTEXT_CURRENT_VERSION;
-
-    result = ec_public_key_serialize_protobuf(&message_structure.ratchetkey, message->sender_ratchet_key);
-    if(result < 0) {
-        goto complete;
-    }
-    message_structure.has_ratchetkey = 1;
-
-    message_structure.counter = message->counter;
-    message_structure.has_counter = 1;
-
-    message_structure.previouscounter = message->previous_counter;
-    message_structure.has_previouscounter = 1;
-
-    message_structure.ciphertext.data = signal_buffer_data(message->ciphertext);
-    message_structure.ciphertext.len = signal_buffer_len(message->ciphertext);
-    message_structure.has_ciphertext = 1;
-
-    len = textsecure__signal_message__get_packed_size(&message_structure);
-
-    result_buf = signal_buffer_alloc(len + 1);
-    if(!result_buf) {
-        result = SG_ERR_NOMEM;
-        goto complete;
-    }
-
-    data = signal_buffer_data(result_buf);
-    data[0] = version;
-
-    result_size = textsecure__signal_message__pack(&message_structure, data + 1);
-    if(result_size != len) {
-        signal_buffer_free(result_buf);
-        result = SG_ERR_INVALID_PROTO_BUF;
-        result_buf = 0;
-        goto complete;
-    }
-
-complete:
-    if(message_structure.ratchetkey.data) {
-        free(message_structure.ratchetkey.data);
-    }
-    if(result >= 0) {
-        *buffer = result_buf;
-    }
-    return result;
-}
-
 int signal_message_deserialize(signal_message **message, const uint8_t *data, size_t len, signal_context *global_context)
 {
     int result = 0;
     signal_message *result_message = 0;
-    Textsecure__SignalMessage *message_structure = 0;
+    protocol_wire_signal_message message_structure;
     uint8_t version = 0;
-    uint8_t *ciphertext_data = 0;
-    uint8_t *serialized_data = 0;
     const uint8_t *message_data = 0;
     size_t message_len = 0;
 
@@ -264,21 +208,20 @@ int signal_message_deserialize(signal_message **message, const uint8_t *data, si
         goto complete;
     }
 
-    message_structure = textsecure__signal_message__unpack(0, message_len, message_data);
-    if(!message_structure) {
-        result = SG_ERR_INVALID_PROTO_BUF;
+    result = protocol_wire_parse_signal_message(&message_structure, message_data, message_len);
+    if(result < 0) {
         goto complete;
     }
 
-    if(!message_structure->has_ciphertext
-            || !message_structure->has_counter
-            || !message_structure->has_ratchetkey) {
+    if(!message_structure.has_ciphertext
+            || !message_structure.has_counter
+            || !message_structure.has_ratchet_key) {
         signal_log(global_context, SG_LOG_WARNING, "Incomplete message");
         result = SG_ERR_INVALID_MESSAGE;
         goto complete;
     }
 
-    result_message = malloc(sizeof(signal_message));
+    result_message = signal_malloc(global_context, sizeof(signal_message));
     if(!result_message) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -290,35 +233,27 @@ int signal_message_deserialize(signal_message **message, const uint8_t *data, si
     result_message->base_message.global_context = global_context;
 
     result = curve_decode_point(&result_message->sender_ratchet_key,
-            message_structure->ratchetkey.data, message_structure->ratchetkey.len, global_context);
+            message_structure.ratchet_key.data, message_structure.ratchet_key.len, global_context);
     if(result < 0) {
         goto complete;
     }
 
     result_message->message_version = version;
-    result_message->counter = message_structure->counter;
-    result_message->previous_counter = message_structure->previouscounter;
-
-    result_message->ciphertext = signal_buffer_alloc(message_structure->ciphertext.len);
-    if(!result_message->ciphertext) {
-        result = SG_ERR_NOMEM;
-        goto complete;
-    }
-    ciphertext_data = signal_buffer_data(result_message->ciphertext);
-    memcpy(ciphertext_data, message_structure->ciphertext.data, message_structure->ciphertext.len);
+    result_message->counter = message_structure.counter;
+    result_message->previous_counter = message_structure.previous_counter;
 
-    result_message->base_message.serialized = signal_buffer_alloc(len);
+    result_message->base_message.serialized = signal_buffer_context_create(global_context, data, len);
     if(!result_message->base_message.serialized) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
-    serialized_data = signal_buffer_data(result_message->base_message.serialized);
-    memcpy(serialized_data, data, len);
+
+    /* The ciphertext is a view into the serialized copy */
+    result_message->ciphertext = signal_buffer_data(result_message->base_message.serialized)
+            + (message_structure.ciphertext.data - data);
+    result_message->ciphertext_len = message_structure.ciphertext.len;
 
 complete:
-    if(message_structure) {
-        textsecure__signal_message__free_unpacked(message_structure, 0);
-    }
     if(result >= 0) {
         *message = result_message;
     }
@@ -369,8 +304,21 @@ uint32_t signal_message_get_counter(const signal_message *message)
 }
 
 signal_buffer *signal_message_get_body(const signal_message *message)
+{
+    signal_message *mutable_message = (signal_message *)message;
+
+    assert(message);
+    if(!mutable_message->body) {
+        mutable_message->body = signal_buffer_context_create(message->base_message.global_context, message->ciphertext, message->ciphertext_len);
+    }
+    return mutable_message->body;
+}
+
+const uint8_t *signal_message_get_body_data(const signal_message *message, size_t *len)
 {
     assert(message);
+    assert(len);
+    *len = message->ciphertext_len;
     return message->ciphertext;
 }
 
@@ -381,15 +329,12 @@ int signal_message_verify_mac(signal_message *message,
         signal_context *global_context)
 {
     int result = 0;
-    signal_buffer *our_mac_buffer = 0;
+    uint8_t our_mac_data[SIGNAL_MESSAGE_MAC_LENGTH];
     uint8_t *serialized_data = 0;
     size_t serialized_len = 0;
     uint8_t *serialized_message_data = 0;
     size_t serialized_message_len = 0;
     uint8_t *their_mac_data = 0;
-    const size_t their_mac_len = SIGNAL_MESSAGE_MAC_LENGTH;
-    uint8_t *our_mac_data = 0;
-    size_t our_mac_len = 0;
 
     assert(message);
     assert(message->base_message.serialized);
@@ -401,7 +346,7 @@ int signal_message_verify_mac(signal_message *message,
     serialized_message_len = serialized_len - SIGNAL_MESSAGE_MAC_LENGTH;
     their_mac_data = serialized_data + serialized_message_len;
 
-    result = signal_message_get_mac(&our_mac_buffer,
+    result = signal_message_get_mac(our_mac_data,
             message->message_version,
             sender_identity_key, receiver_identity_key,
             mac_key, mac_key_len,
@@ -411,15 +356,7 @@ int signal_message_verify_mac(signal_message *message,
         goto complete;
     }
 
-    our_mac_data = signal_buffer_data(our_mac_buffer);
-    our_mac_len = signal_buffer_len(our_mac_buffer);
-    if(our_mac_len != their_mac_len) {
-        signal_log(global_context, SG_LOG_WARNING, "MAC length mismatch: %d != %d", our_mac_len, their_mac_len);
-        result = SG_ERR_UNKNOWN;
-        goto complete;
-    }
-
-    if(signal_constant_memcmp(our_mac_data, their_mac_data, our_mac_len) == 0) {
+    if(signal_constant_memcmp(our_mac_data, their_mac_data, sizeof(our_mac_data)) == 0) {
         result = 1;
     }
     else {
@@ -428,13 +365,10 @@ int signal_message_verify_mac(signal_message *message,
     }
 
 complete:
-    if(our_mac_buffer) {
-        signal_buffer_free(our_mac_buffer);
-    }
     return result;
 }
 
-static int signal_message_get_mac(signal_buffer **buffer,
+static int signal_message_get_mac(uint8_t *mac,
         uint8_t message_version,
         ec_public_key *sender_identity_key,
         ec_public_key *receiver_identity_key,
@@ -443,77 +377,40 @@ static int signal_message_get_mac(signal_buffer **buffer,
         signal_context *global_context)
 {
     int result = 0;
-    void *hmac_context;
-    signal_buffer *sender_key_buffer = 0;
-    signal_buffer *receiver_key_buffer = 0;
-    signal_buffer *full_mac_buffer = 0;
-    signal_buffer *result_buf = 0;
-    uint8_t *result_data = 0;
+    signal_iovec iov[3];
+    size_t iov_count = 0;
+    uint8_t full_mac[SIGNAL_HMAC_SHA256_LENGTH];
 
     assert(global_context);
 
-    result = signal_hmac_sha256_init(global_context,
-            &hmac_context, mac_key, mac_key_len);
-    if(result < 0) {
-        goto complete;
-    }
-
+    /* The identity keys are read from their serialized form kept in each key */
     if(message_version >= 3) {
-        result = ec_public_key_serialize(&sender_key_buffer, sender_identity_key);
-        if(result < 0) {
-            goto complete;
-        }
-
-        result = signal_hmac_sha256_update(global_context, hmac_context,
-                signal_buffer_data(sender_key_buffer),
-                signal_buffer_len(sender_key_buffer));
-        if(result < 0) {
-            goto complete;
-        }
-
-        result = ec_public_key_serialize(&receiver_key_buffer, receiver_identity_key);
-        if(result < 0) {
-            goto complete;
-        }
-
-        result = signal_hmac_sha256_update(global_context, hmac_context,
-                signal_buffer_data(receiver_key_buffer),
-                signal_buffer_len(receiver_key_buffer));
-        if(result < 0) {
+        if(!sender_identity_key || !receiver_identity_key) {
+            result = SG_ERR_INVAL;
             goto complete;
         }
+        iov[iov_count].data = ec_public_key_get_serialized(sender_identity_key);
+        iov[iov_count].len = EC_PUBLIC_KEY_SERIALIZED_LENGTH;
+        iov_count++;
+        iov[iov_count].data = ec_public_key_get_serialized(receiver_identity_key);
+        iov[iov_count].len = EC_PUBLIC_KEY_SERIALIZED_LENGTH;
+        iov_count++;
     }
 
-    result = signal_hmac_sha256_update(global_context, hmac_context,
-        serialized, serialized_len);
-    if(result < 0) {
-        goto complete;
-    }
-
-    result = signal_hmac_sha256_final(global_context,
-            hmac_context, &full_mac_buffer);
-    if(result < 0 || signal_buffer_len(full_mac_buffer) < SIGNAL_MESSAGE_MAC_LENGTH) {
-        if(result >= 0) { result = SG_ERR_UNKNOWN; }
-        goto complete;
-    }
+    iov[iov_count].data = serialized;
+    iov[iov_count].len = serialized_len;
+    iov_count++;
 
-    result_buf = signal_buffer_alloc(SIGNAL_MESSAGE_MAC_LENGTH);
-    if(!result_buf) {
-        result = SG_ERR_NOMEM;
+    result = signal_hmac_sha256(global_context,
+            mac_key, mac_key_len, iov, iov_count, full_mac);
+    if(result < 0) {
         goto complete;
     }
 
-    result_data = signal_buffer_data(result_buf);
-    memcpy(result_data, signal_buffer_data(full_mac_buffer), SIGNAL_MESSAGE_MAC_LENGTH);
+    memcpy(mac, full_mac, SIGNAL_MESSAGE_MAC_LENGTH);
 
 complete:
-    signal_hmac_sha256_cleanup(global_context, hmac_context);
-    signal_buffer_free(sender_key_buffer);
-    signal_buffer_free(receiver_key_buffer);
-    signal_buffer_free(full_mac_buffer);
-    if(result >= 0) {
-        *buffer = result_buf;
-    }
+    signal_explicit_bzero(full_mac, sizeof(full_mac));
     return result;
 }
 
@@ -530,10 +427,8 @@ void signal_message_destroy(signal_type_base *type)
         signal_buffer_free(message->base_message.serialized);
     }
     SIGNAL_UNREF(message->sender_ratchet_key);
-    if(message->ciphertext) {
-        signal_buffer_free(message->ciphertext);
-    }
-    free(message);
+    signal_buffer_free(message->body);
+    signal_free(message->base_message.global_context, message);
 }
 
 /*------------------------------------------------------------------------*/
@@ -549,7 +444,7 @@ int pre_key_signal_message_create(pre_key_signal_message **pre_key_message,
 
     assert(global_context);
 
-    result_message = malloc(sizeof(pre_key_signal_message));
+    result_message = signal_malloc(global_context, sizeof(pre_key_signal_message));
 
     if(!result_message) {
         return SG_ERR_NOMEM;
@@ -593,74 +488,57 @@ int pre_key_signal_message_create(pre_key_signal_message **pre_key_message,
 
 static int pre_key_signal_message_serialize(signal_buffer **buffer, const pre_key_signal_message *message)
 {
-    int result = 0;
-    size_t result_size = 0;
     signal_buffer *result_buf = 0;
-    Textsecure__PreKeySignalMessage message_structure = TEXTSECURE__PRE_KEY_SIGNAL_MESSAGE__INIT;
+    protocol_wire_pre_key_signal_message message_structure;
+    uint8_t base_key_data[EC_PUBLIC_KEY_SERIALIZED_LENGTH];
+    uint8_t identity_key_data[EC_PUBLIC_KEY_SERIALIZED_LENGTH];
     signal_buffer *inner_message_buffer = 0;
     size_t len = 0;
     uint8_t *data = 0;
 
     uint8_t version = (message->version << 4) | CIPHERTEXT_CURRENT_VERSION;
 
-    message_structure.registrationid = message->registration_id;
-    message_structure.has_registrationid = 1;
+    memset(&message_structure, 0, sizeof(message_structure));
+
+    message_structure.registration_id = message->registration_id;
+    message_structure.has_registration_id = 1;
 
     if(message->has_pre_key_id) {
-        message_structure.prekeyid = message->pre_key_id;
-        message_structure.has_prekeyid = 1;
+        message_structure.pre_key_id = message->pre_key_id;
+        message_structure.has_pre_key_id = 1;
     }
 
-    message_structure.signedprekeyid = message->signed_pre_key_id;
-    message_structure.has_signedprekeyid = 1;
+    message_structure.signed_pre_key_id = message->signed_pre_key_id;
+    message_structure.has_signed_pre_key_id = 1;
 
-    result = ec_public_key_serialize_protobuf(&message_structure.basekey, message->base_key);
-    if(result < 0) {
-        goto complete;
-    }
-    message_structure.has_basekey = 1;
+    ec_public_key_serialize_into(base_key_data, message->base_key);
+    message_structure.base_key.data = base_key_data;
+    message_structure.base_key.len = sizeof(base_key_data);
+    message_structure.has_base_key = 1;
 
-    result = ec_public_key_serialize_protobuf(&message_structure.identitykey, message->identity_key);
-    if(result < 0) {
-        goto complete;
-    }
-    message_structure.has_identitykey = 1;
+    ec_public_key_serialize_into(identity_key_data, message->identity_key);
+    message_structure.identity_key.data = identity_key_data;
+    message_structure.identity_key.len = sizeof(identity_key_data);
+    message_structure.has_identity_key = 1;
 
     inner_message_buffer = message->message->base_message.serialized;
     message_structure.message.data = signal_buffer_data(inner_message_buffer);
     message_structure.message.len = signal_buffer_len(inner_message_buffer);
     message_structure.has_message = 1;
 
-    len = textsecure__pre_key_signal_message__get_packed_size(&message_structure);
+    len = protocol_wire_pre_key_signal_message_get_size(&message_structure);
 
-    result_buf = signal_buffer_alloc(len + 1);
+    result_buf = signal_buffer_context_alloc(message->base_message.global_context, len + 1);
     if(!result_buf) {
-        result = SG_ERR_NOMEM;
-        goto complete;
+        return SG_ERR_NOMEM;
     }
 
     data = signal_buffer_data(result_buf);
     data[0] = version;
+    protocol_wire_write_pre_key_signal_message(data + 1, &message_structure);
 
-    result_size = textsecure__pre_key_signal_message__pack(&message_structure, data + 1);
-    if(result_size != len) {
-        signal_buffer_free(result_buf);
-        result = SG_ERR_INVALID_PROTO_BUF;
-        result_buf = 0;
-        goto complete;
-    }
-
-complete:
-    if(message_structure.basekey.data) {
-        free(message_structure.basekey.data);
-    }
-    if(message_structure.identitykey.data) {
-        free(message_structure.identitykey.data);
-    }
-    if(result >= 0) {
-        *buffer = result_buf;
-    }
-    return result;
+    *buffer = result_buf;
+    return 0;
 }
 
 int pre_key_signal_message_deserialize(pre_key_signal_message **message,
@@ -669,11 +547,10 @@ int pre_key_signal_message_deserialize(pre_key_signal_message **message,
 {
     int result = 0;
     pre_key_signal_message *result_message = 0;
-    Textsecure__PreKeySignalMessage *message_structure = 0;
+    protocol_wire_pre_key_signal_message message_structure;
     uint8_t version = 0;
     const uint8_t *message_data = 0;
     size_t message_len = 0;
-    uint8_t *serialized_data = 0;
 
     assert(global_context);
 
@@ -700,22 +577,21 @@ int pre_key_signal_message_deserialize(pre_key_signal_message **message,
         goto complete;
     }
 
-    message_structure = textsecure__pre_key_signal_message__unpack(0, message_len, message_data);
-    if(!message_structure) {
-        result = SG_ERR_INVALID_PROTO_BUF;
+    result = protocol_wire_parse_pre_key_signal_message(&message_structure, message_data, message_len);
+    if(result < 0) {
         goto complete;
     }
 
-    if(!message_structure->has_signedprekeyid ||
-            !message_structure->has_basekey ||
-            !message_structure->has_identitykey ||
-            !message_structure->has_message) {
+    if(!message_structure.has_signed_pre_key_id ||
+            !message_structure.has_base_key ||
+            !message_structure.has_identity_key ||
+            !message_structure.has_message) {
         signal_log(global_context, SG_LOG_WARNING, "Incomplete message");
         result = SG_ERR_INVALID_MESSAGE;
         goto complete;
     }
 
-    result_message = malloc(sizeof(pre_key_signal_message));
+    result_message = signal_malloc(global_context, sizeof(pre_key_signal_message));
     if(!result_message) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -728,63 +604,50 @@ int pre_key_signal_message_deserialize(pre_key_signal_message **message,
 
     result_message->version = version;
 
-    if(message_structure->has_registrationid) {
-        result_message->registration_id = message_structure->registrationid;
+    if(message_structure.has_registration_id) {
+        result_message->registration_id = message_structure.registration_id;
     }
 
-    if(message_structure->has_prekeyid) {
-        result_message->pre_key_id = message_structure->prekeyid;
+    if(message_structure.has_pre_key_id) {
+        result_message->pre_key_id = message_structure.pre_key_id;
         result_message->has_pre_key_id = 1;
     }
 
-    if(message_structure->has_signedprekeyid) {
-        result_message->signed_pre_key_id = message_structure->signedprekeyid;
-    }
+    result_message->signed_pre_key_id = message_structure.signed_pre_key_id;
 
-    if(message_structure->has_basekey) {
-        result = curve_decode_point(&result_message->base_key,
-                message_structure->basekey.data, message_structure->basekey.len, global_context);
-        if(result < 0) {
-            goto complete;
-        }
+    result = curve_decode_point(&result_message->base_key,
+            message_structure.base_key.data, message_structure.base_key.len, global_context);
+    if(result < 0) {
+        goto complete;
     }
 
-    if(message_structure->has_identitykey) {
-        result = curve_decode_point(&result_message->identity_key,
-                message_structure->identitykey.data, message_structure->identitykey.len, global_context);
-        if(result < 0) {
-            goto complete;
-        }
+    result = curve_decode_point(&result_message->identity_key,
+            message_structure.identity_key.data, message_structure.identity_key.len, global_context);
+    if(result < 0) {
+        goto complete;
     }
 
-    if(message_structure->has_message) {
-        result = signal_message_deserialize(&result_message->message,
-                message_structure->message.data,
-                message_structure->message.len,
-                global_context);
-        if(result < 0) {
-            goto complete;
-        }
-        if(result_message->message->message_version != version) {
-            signal_log(global_context, SG_LOG_WARNING, "Inner message version mismatch: %d != %d",
-                    result_message->message->message_version, version);
-            result = SG_ERR_INVALID_VERSION;
-            goto complete;
-        }
+    result = signal_message_deserialize(&result_message->message,
+            message_structure.message.data,
+            message_structure.message.len,
+            global_context);
+    if(result < 0) {
+        goto complete;
+    }
+    if(result_message->message->message_version != version) {
+        signal_log(global_context, SG_LOG_WARNING, "Inner message version mismatch: %d != %d",
+                result_message->message->message_version, version);
+        result = SG_ERR_INVALID_VERSION;
+        goto complete;
     }
 
-    result_message->base_message.serialized = signal_buffer_alloc(len);
+    result_message->base_message.serialized = signal_buffer_context_create(global_context, data, len);
     if(!result_message->base_message.serialized) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
-    serialized_data = signal_buffer_data(result_message->base_message.serialized);
-    memcpy(serialized_data, data, len);
 
 complete:
-    if(message_structure) {
-        textsecure__pre_key_signal_message__free_unpacked(message_structure, 0);
-    }
     if(result >= 0) {
         *message = result_message;
     }
@@ -875,7 +738,7 @@ void pre_key_signal_message_destroy(signal_type_base *type)
     SIGNAL_UNREF(message->base_key);
     SIGNAL_UNREF(message->identity_key);
     SIGNAL_UNREF(message->message);
-    free(message);
+    signal_free(message->base_message.global_context, message);
 }
 
 int sender_key_message_create(sender_key_message **message,
@@ -890,7 +753,7 @@ int sender_key_message_create(sender_key_message **message,
 
     assert(global_context);
 
-    result_message = malloc(sizeof(sender_key_message));
+    result_message = signal_malloc(global_context, sizeof(sender_key_message));
 
     if(!result_message) {
         return SG_ERR_NOMEM;
@@ -904,20 +767,21 @@ int sender_key_message_create(sender_key_message **message,
     result_message->message_version = CIPHERTEXT_CURRENT_VERSION;
     result_message->key_id = key_id;
     result_message->iteration = iteration;
-
-    result_message->ciphertext = signal_buffer_create(ciphertext, ciphertext_len);
-    if(!result_message->ciphertext) {
-        result = SG_ERR_NOMEM;
-        goto complete;
-    }
+    result_message->ciphertext = ciphertext;
+    result_message->ciphertext_len = ciphertext_len;
 
     result = sender_key_message_serialize(&message_buf, result_message, signature_key, global_context);
     if(result < 0) {
+        result_message->ciphertext = 0;
         goto complete;
     }
 
     result_message->base_message.serialized = message_buf;
 
+    /* The ciphertext is the last field of the body, followed by the signature */
+    result_message->ciphertext = signal_buffer_data(message_buf)
+            + signal_buffer_len(message_buf) - SIGNATURE_LENGTH - ciphertext_len;
+
 complete:
     if(result >= 0) {
         result = 0;
@@ -935,26 +799,27 @@ int sender_key_message_serialize(signal_buffer **buffer, const sender_key_messag
 {
     int result = 0;
     uint8_t version = (CIPHERTEXT_CURRENT_VERSION << 4) | CIPHERTEXT_CURRENT_VERSION;
-    size_t result_size = 0;
     signal_buffer *result_buf = 0;
     signal_buffer *signature_buf = 0;
-    Textsecure__SenderKeyMessage message_structure = TEXTSECURE__SENDER_KEY_MESSAGE__INIT;
+    protocol_wire_sender_key_message message_structure;
     size_t len = 0;
     uint8_t *data = 0;
 
+    memset(&message_structure, 0, sizeof(message_structure));
+
     message_structure.id = message->key_id;
     message_structure.has_id = 1;
 
     message_structure.iteration = message->iteration;
     message_structure.has_iteration = 1;
 
-    message_structure.ciphertext.data = signal_buffer_data(message->ciphertext);
-    message_structure.ciphertext.len = signal_buffer_len(message->ciphertext);
+    message_structure.ciphertext.data = message->ciphertext;
+    message_structure.ciphertext.len = message->ciphertext_len;
     message_structure.has_ciphertext = 1;
 
-    len = textsecure__sender_key_message__get_packed_size(&message_structure);
+    len = protocol_wire_sender_key_message_get_size(&message_structure);
 
-    result_buf = signal_buffer_alloc(sizeof(version) + len + SIGNATURE_LENGTH);
+    result_buf = signal_buffer_context_alloc(global_context, sizeof(version) + len + SIGNATURE_LENGTH);
     if(!result_buf) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -962,14 +827,7 @@ int sender_key_message_serialize(signal_buffer **buffer, const sender_key_messag
 
     data = signal_buffer_data(result_buf);
     data[0] = version;
-
-    result_size = textsecure__sender_key_message__pack(&message_structure, data + sizeof(version));
-    if(result_size != len) {
-        signal_buffer_free(result_buf);
-        result = SG_ERR_INVALID_PROTO_BUF;
-        result_buf = 0;
-        goto complete;
-    }
+    protocol_wire_write_sender_key_message(data + sizeof(version), &message_structure);
 
     result = curve_calculate_signature(global_context, &signature_buf, signature_key,
             data, len + sizeof(version));
@@ -1006,7 +864,7 @@ int sender_key_message_deserialize(sender_key_message **message,
     uint8_t version = 0;
     const uint8_t *message_data = 0;
     size_t message_len = 0;
-    Textsecure__SenderKeyMessage *message_structure = 0;
+    protocol_wire_sender_key_message message_structure;
 
     assert(global_context);
 
@@ -1031,21 +889,20 @@ int sender_key_message_deserialize(sender_key_message **message,
         goto complete;
     }
 
-    message_structure = textsecure__sender_key_message__unpack(0, message_len, message_data);
-    if(!message_structure) {
-        result = SG_ERR_INVALID_PROTO_BUF;
+    result = protocol_wire_parse_sender_key_message(&message_structure, message_data, message_len);
+    if(result < 0) {
         goto complete;
     }
 
-    if(!message_structure->has_id
-            || !message_structure->has_iteration
-            || !message_structure->has_ciphertext) {
+    if(!message_structure.has_id
+            || !message_structure.has_iteration
+            || !message_structure.has_ciphertext) {
         signal_log(global_context, SG_LOG_WARNING, "Incomplete message");
         result = SG_ERR_INVALID_MESSAGE;
         goto complete;
     }
 
-    result_message = malloc(sizeof(sender_key_message));
+    result_message = signal_malloc(global_context, sizeof(sender_key_message));
     if(!result_message) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -1056,28 +913,22 @@ int sender_key_message_deserialize(sender_key_message **message,
     result_message->base_message.message_type = CIPHERTEXT_SENDERKEY_TYPE;
     result_message->base_message.global_context = global_context;
 
-    result_message->key_id = message_structure->id;
-    result_message->iteration = message_structure->iteration;
+    result_message->key_id = message_structure.id;
+    result_message->iteration = message_structure.iteration;
     result_message->message_version = version;
 
-    result_message->ciphertext = signal_buffer_create(
-            message_structure->ciphertext.data,
-            message_structure->ciphertext.len);
-    if(!result_message->ciphertext) {
-        result = SG_ERR_NOMEM;
-        goto complete;
-    }
-
-    result_message->base_message.serialized = signal_buffer_create(data, len);
+    result_message->base_message.serialized = signal_buffer_context_create(global_context, data, len);
     if(!result_message->base_message.serialized) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
 
+    /* The ciphertext is a view into the serialized copy */
+    result_message->ciphertext = signal_buffer_data(result_message->base_message.serialized)
+            + (message_structure.ciphertext.data - data);
+    result_message->ciphertext_len = message_structure.ciphertext.len;
+
 complete:
-    if(message_structure) {
-        textsecure__sender_key_message__free_unpacked(message_structure, 0);
-    }
     if(result >= 0) {
         *message = result_message;
     }
@@ -1124,6 +975,17 @@ uint32_t sender_key_message_get_iteration(sender_key_message *message)
 signal_buffer *sender_key_message_get_ciphertext(sender_key_message *message)
 {
     assert(message);
+    if(!message->ciphertext_buffer) {
+        message->ciphertext_buffer = signal_buffer_context_create(message->base_message.global_context, message->ciphertext, message->ciphertext_len);
+    }
+    return message->ciphertext_buffer;
+}
+
+const uint8_t *sender_key_message_get_ciphertext_data(const sender_key_message *message, size_t *len)
+{
+    assert(message);
+    assert(len);
+    *len = message->ciphertext_len;
     return message->ciphertext;
 }
 
@@ -1154,6 +1016,51 @@ int sender_key_message_verify_signature(sender_key_message *message, ec_public_k
     return result;
 }
 
+int sender_key_message_verify_signature_batch(sender_key_message **messages,
+        ec_public_key **signature_keys, size_t count)
+{
+    int result = 0;
+    signal_context *global_context;
+    curve_signature_batch_entry *entries = 0;
+    size_t i;
+
+    if(count == 0) {
+        return 0;
+    }
+
+    global_context = messages[0]->base_message.global_context;
+
+    entries = signal_malloc(global_context, sizeof(curve_signature_batch_entry) * count);
+    if(!entries) {
+        result = SG_ERR_NOMEM;
+        goto complete;
+    }
+
+    for(i = 0; i < count; i++) {
+        signal_buffer *serialized = messages[i]->base_message.serialized;
+        size_t data_len = signal_buffer_len(serialized) - SIGNATURE_LENGTH;
+
+        entries[i].signing_key = signature_keys[i];
+        entries[i].message_data = signal_buffer_data(serialized);
+        entries[i].message_len = data_len;
+        entries[i].signature_data = signal_buffer_data(serialized) + data_len;
+        entries[i].signature_len = SIGNATURE_LENGTH;
+    }
+
+    result = curve_verify_signature_batch(global_context, entries, count);
+    if(result == 0) {
+        signal_log(global_context, SG_LOG_ERROR, "Invalid signature!");
+        result = SG_ERR_INVALID_MESSAGE;
+    }
+    else if(result > 0) {
+        result = 0;
+    }
+
+complete:
+    signal_free(global_context, entries);
+    return result;
+}
+
 void sender_key_message_destroy(signal_type_base *type)
 {
     sender_key_message *message = (sender_key_message *)type;
@@ -1161,10 +1068,8 @@ void sender_key_message_destroy(signal_type_base *type)
     if(message->base_message.serialized) {
         signal_buffer_free(message->base_message.serialized);
     }
-    if(message->ciphertext) {
-        signal_buffer_free(message->ciphertext);
-    }
-    free(message);
+    signal_buffer_free(message->ciphertext_buffer);
+    signal_free(message->base_message.global_context, message);
 }
 
 int sender_key_distribution_message_create(sender_key_distribution_message **message,
@@ -1180,7 +1085,7 @@ int sender_key_distribution_message_create(sender_key_distribution_message **mes
 
     assert(global_context);
 
-    result_message = malloc(sizeof(sender_key_distribution_message));
+    result_message = signal_malloc(global_context, sizeof(sender_key_distribution_message));
 
     if(!result_message) {
         return SG_ERR_NOMEM;
@@ -1194,7 +1099,7 @@ int sender_key_distribution_message_create(sender_key_distribution_message **mes
     result_message->id = id;
     result_message->iteration = iteration;
 
-    result_message->chain_key = signal_buffer_create(chain_key, chain_key_len);
+    result_message->chain_key = signal_buffer_context_create(global_context, chain_key, chain_key_len);
     if(!result_message->chain_key) {
         goto complete;
     }
@@ -1229,6 +1134,7 @@ int sender_key_distribution_message_serialize(signal_buffer **buffer, const send
     size_t result_size = 0;
     signal_buffer *result_buf = 0;
     Textsecure__SenderKeyDistributionMessage message_structure = TEXTSECURE__SENDER_KEY_DISTRIBUTION_MESSAGE__INIT;
+    uint8_t signing_key[EC_PUBLIC_KEY_SERIALIZED_LENGTH];
     size_t len = 0;
     uint8_t *data = 0;
 
@@ -1242,15 +1148,14 @@ int sender_key_distribution_message_serialize(signal_buffer **buffer, const send
     message_structure.chainkey.len = signal_buffer_len(message->chain_key);
     message_structure.has_chainkey = 1;
 
-    result = ec_public_key_serialize_protobuf(&message_structure.signingkey, message->signature_key);
-    if(result < 0) {
-        goto complete;
-    }
+    ec_public_key_serialize_into(signing_key, message->signature_key);
+    message_structure.signingkey.data = signing_key;
+    message_structure.signingkey.len = sizeof(signing_key);
     message_structure.has_signingkey = 1;
 
     len = textsecure__sender_key_distribution_message__get_packed_size(&message_structure);
 
-    result_buf = signal_buffer_alloc(sizeof(version) + len);
+    result_buf = signal_buffer_context_alloc(message->base_message.global_context, sizeof(version) + len);
     if(!result_buf) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -1268,9 +1173,6 @@ int sender_key_distribution_message_serialize(signal_buffer **buffer, const send
     }
 
 complete:
-    if(message_structure.has_signingkey) {
-        free(message_structure.signingkey.data);
-    }
     if(result >= 0) {
         *buffer = result_buf;
     }
@@ -1314,7 +1216,7 @@ int sender_key_distribution_message_deserialize(sender_key_distribution_message
         goto complete;
     }
 
-    message_structure = textsecure__sender_key_distribution_message__unpack(0, message_len, message_data);
+    message_structure = textsecure__sender_key_distribution_message__unpack(signal_protobuf_allocator(global_context), message_len, message_data);
     if(!message_structure) {
         result = SG_ERR_INVALID_PROTO_BUF;
         goto complete;
@@ -1329,7 +1231,7 @@ int sender_key_distribution_message_deserialize(sender_key_distribution_message
         goto complete;
     }
 
-    result_message = malloc(sizeof(sender_key_distribution_message));
+    result_message = signal_malloc(global_context, sizeof(sender_key_distribution_message));
     if(!result_message) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -1343,7 +1245,7 @@ int sender_key_distribution_message_deserialize(sender_key_distribution_message
     result_message->id = message_structure->id;
     result_message->iteration = message_structure->iteration;
 
-    result_message->chain_key = signal_buffer_create(
+    result_message->chain_key = signal_buffer_context_create(global_context,
             message_structure->chainkey.data,
             message_structure->chainkey.len);
     if(!result_message->chain_key) {
@@ -1359,7 +1261,7 @@ int sender_key_distribution_message_deserialize(sender_key_distribution_message
         goto complete;
     }
 
-    result_message->base_message.serialized = signal_buffer_create(data, len);
+    result_message->base_message.serialized = signal_buffer_context_create(global_context, data, len);
     if(!result_message->base_message.serialized) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -1367,7 +1269,7 @@ int sender_key_distribution_message_deserialize(sender_key_distribution_message
 
 complete:
     if(message_structure) {
-        textsecure__sender_key_distribution_message__free_unpacked(message_structure, 0);
+        textsecure__sender_key_distribution_message__free_unpacked(message_structure, signal_protobuf_allocator(global_context));
     }
     if(result >= 0) {
         *message = result_message;
@@ -1436,5 +1338,5 @@ void sender_key_distribution_message_destroy(signal_type_base *type)
         signal_buffer_free(message->chain_key);
     }
     SIGNAL_UNREF(message->signature_key);
-    free(message);
+    signal_free(message->base_message.global_context, message);
 }
@@ -45,8 +45,20 @@ uint8_t signal_message_get_message_version(const signal_message *message);
 
 uint32_t signal_message_get_counter(const signal_message *message);
 
+/**
+ * Get the ciphertext of the message as a buffer. The buffer is copied out
+ * of the serialized message on first use and owned by the message.
+ */
 signal_buffer *signal_message_get_body(const signal_message *message);
 
+/**
+ * Get the ciphertext of the message without copying it.
+ *
+ * @param len set to the length of the ciphertext
+ * @return pointer into the serialized message, valid for the lifetime of the message
+ */
+const uint8_t *signal_message_get_body_data(const signal_message *message, size_t *len);
+
 /**
  * Verify the MAC on the Signal message.
  *
@@ -98,8 +110,17 @@ int sender_key_message_copy(sender_key_message **message, sender_key_message *ot
 uint32_t sender_key_message_get_key_id(sender_key_message *message);
 uint32_t sender_key_message_get_iteration(sender_key_message *message);
 signal_buffer *sender_key_message_get_ciphertext(sender_key_message *message);
+const uint8_t *sender_key_message_get_ciphertext_data(const sender_key_message *message, size_t *len);
 int sender_key_message_verify_signature(sender_key_message *message, ec_public_key *signature_key);
 
+/**
+ * Verify the signatures of count messages together, each against the key at
+ * the same index. Returns 0 if all are valid, SG_ERR_INVALID_MESSAGE if any
+ * is not, or negative on failure.
+ */
+int sender_key_message_verify_signature_batch(sender_key_message **messages,
+        ec_public_key **signature_keys, size_t count);
+
 void sender_key_message_destroy(signal_type_base *type);
 
 int sender_key_distribution_message_create(sender_key_distribution_message **message,
@@ -0,0 +1,525 @@
+#include "protocol_wire.h"
+
+#include <string.h>
+#include <assert.h>
+
+#include "signal_protocol.h"
+
+#define WIRE_TYPE_VARINT 0
+#define WIRE_TYPE_64BIT 1
+#define WIRE_TYPE_LENGTH_PREFIXED 2
+#define WIRE_TYPE_32BIT 5
+
+#define MAX_VARINT_LENGTH 10
+#define MAX_VARINT32_LENGTH 5
+
+typedef struct protocol_wire_field
+{
+    uint32_t number;
+    int *has;
+    uint32_t *value;
+    protocol_wire_bytes *bytes;
+    /* Called for every occurrence of a bytes field instead of storing it */
+    protocol_wire_bytes_func bytes_func;
+    void *user_data;
+} protocol_wire_field;
+
+static int protocol_wire_parse(const uint8_t *data, size_t len,
+        const protocol_wire_field *fields, size_t field_count)
+{
+    size_t offset = 0;
+    size_t i;
+
+    while(offset < len) {
+        const uint8_t *at = data + offset;
+        size_t remaining = len - offset;
+        size_t max_len;
+        size_t used = 0;
+        uint32_t number;
+        uint32_t wire_type;
+        unsigned int shift;
+        const protocol_wire_field *field = 0;
+
+        /* Tag, with the same limits and truncation as protobuf-c */
+        wire_type = at[0] & 0x07;
+        number = (at[0] & 0x7F) >> 3;
+        if(at[0] & 0x80) {
+            max_len = remaining < MAX_VARINT32_LENGTH ? remaining : MAX_VARINT32_LENGTH;
+            shift = 4;
+            for(i = 1; i < max_len; i++) {
+                if(at[i] & 0x80) {
+                    number |= (uint32_t)(at[i] & 0x7F) << shift;
+                    shift += 7;
+                }
+                else {
+                    number |= (uint32_t)at[i] << shift;
+                    used = i + 1;
+                    break;
+                }
+            }
+            if(used == 0) {
+                return SG_ERR_INVALID_PROTO_BUF;
+            }
+        }
+        else {
+            used = 1;
+        }
+        at += used;
+        remaining -= used;
+
+        for(i = 0; i < field_count; i++) {
+            if(fields[i].number == number) {
+                field = &fields[i];
+                break;
+            }
+        }
+
+        switch(wire_type) {
+        case WIRE_TYPE_VARINT:
+            max_len = remaining < MAX_VARINT_LENGTH ? remaining : MAX_VARINT_LENGTH;
+            for(i = 0; i < max_len; i++) {
+                if((at[i] & 0x80) == 0) {
+                    break;
+                }
+            }
+            if(i == max_len) {
+                return SG_ERR_INVALID_PROTO_BUF;
+            }
+            if(field) {
+                uint32_t value = 0;
+                size_t j;
+                if(!field->value) {
+                    return SG_ERR_INVALID_PROTO_BUF;
+                }
+                /* Bits beyond the low 32 are dropped */
+                for(j = 0; j <= i && j < MAX_VARINT32_LENGTH; j++) {
+                    value |= (uint32_t)(at[j] & 0x7F) << (7 * j);
+                }
+                *field->value = value;
+                *field->has = 1;
+            }
+            used = i + 1;
+            break;
+        case WIRE_TYPE_LENGTH_PREFIXED: {
+            uint32_t value_len = 0;
+            max_len = remaining < MAX_VARINT32_LENGTH ? remaining : MAX_VARINT32_LENGTH;
+            for(i = 0; i < max_len; i++) {
+                value_len |= (uint32_t)(at[i] & 0x7F) << (7 * i);
+                if((at[i] & 0x80) == 0) {
+                    break;
+                }
+            }
+            if(i == max_len || value_len > remaining - (i + 1)) {
+                return SG_ERR_INVALID_PROTO_BUF;
+            }
+            if(field && field->bytes_func) {
+                protocol_wire_bytes bytes;
+                int result;
+                bytes.data = at + i + 1;
+                bytes.len = value_len;
+                result = field->bytes_func(&bytes, field->user_data);
+                if(result < 0) {
+                    return result;
+                }
+            }
+            else if(field) {
+                if(!field->bytes) {
+                    return SG_ERR_INVALID_PROTO_BUF;
+                }
+                field->bytes->data = at + i + 1;
+                field->bytes->len = value_len;
+                *field->has = 1;
+            }
+            used = i + 1 + value_len;
+            break;
+        }
+        case WIRE_TYPE_64BIT:
+        case WIRE_TYPE_32BIT:
+            used = wire_type == WIRE_TYPE_64BIT ? 8 : 4;
+            if(field || remaining < used) {
+                return SG_ERR_INVALID_PROTO_BUF;
+            }
+            break;
+        default:
+            return SG_ERR_INVALID_PROTO_BUF;
+        }
+
+        offset = len - remaining + used;
+    }
+
+    return 0;
+}
+
+static size_t protocol_wire_varint_size(uint32_t value)
+{
+    size_t size = 1;
+    while(value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static size_t protocol_wire_write_varint(uint8_t *out, uint32_t value)
+{
+    size_t i = 0;
+    while(value >= 0x80) {
+        out[i++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[i++] = (uint8_t)value;
+    return i;
+}
+
+static size_t protocol_wire_uint32_field_size(uint32_t number, uint32_t value)
+{
+    return protocol_wire_varint_size(number << 3) + protocol_wire_varint_size(value);
+}
+
+static size_t protocol_wire_bytes_field_size(uint32_t number, const protocol_wire_bytes *bytes)
+{
+    return protocol_wire_varint_size(number << 3) + protocol_wire_varint_size((uint32_t)bytes->len) + bytes->len;
+}
+
+static size_t protocol_wire_write_uint32_field(uint8_t *out, uint32_t number, uint32_t value)
+{
+    size_t len = protocol_wire_write_varint(out, (number << 3) | WIRE_TYPE_VARINT);
+    return len + protocol_wire_write_varint(out + len, value);
+}
+
+static size_t protocol_wire_write_bytes_field(uint8_t *out, uint32_t number, const protocol_wire_bytes *bytes)
+{
+    size_t len = protocol_wire_write_varint(out, (number << 3) | WIRE_TYPE_LENGTH_PREFIXED);
+    len += protocol_wire_write_varint(out + len, (uint32_t)bytes->len);
+    if(bytes->len > 0) {
+        memcpy(out + len, bytes->data, bytes->len);
+    }
+    return len + bytes->len;
+}
+
+/*------------------------------------------------------------------------*/
+
+int protocol_wire_parse_signal_message(protocol_wire_signal_message *message,
+        const uint8_t *data, size_t len)
+{
+    protocol_wire_field fields[4];
+
+    assert(message);
+    memset(message, 0, sizeof(protocol_wire_signal_message));
+    memset(fields, 0, sizeof(fields));
+
+    fields[0].number = 1;
+    fields[0].has = &message->has_ratchet_key;
+    fields[0].value = 0;
+    fields[0].bytes = &message->ratchet_key;
+    fields[1].number = 2;
+    fields[1].has = &message->has_counter;
+    fields[1].value = &message->counter;
+    fields[1].bytes = 0;
+    fields[2].number = 3;
+    fields[2].has = &message->has_previous_counter;
+    fields[2].value = &message->previous_counter;
+    fields[2].bytes = 0;
+    fields[3].number = 4;
+    fields[3].has = &message->has_ciphertext;
+    fields[3].value = 0;
+    fields[3].bytes = &message->ciphertext;
+
+    return protocol_wire_parse(data, len, fields, 4);
+}
+
+size_t protocol_wire_signal_message_get_size(const protocol_wire_signal_message *message)
+{
+    size_t size = 0;
+
+    assert(message);
+
+    if(message->has_ratchet_key) {
+        size += protocol_wire_bytes_field_size(1, &message->ratchet_key);
+    }
+    if(message->has_counter) {
+        size += protocol_wire_uint32_field_size(2, message->counter);
+    }
+    if(message->has_previous_counter) {
+        size += protocol_wire_uint32_field_size(3, message->previous_counter);
+    }
+    if(message->has_ciphertext) {
+        size += protocol_wire_bytes_field_size(4, &message->ciphertext);
+    }
+    return size;
+}
+
+size_t protocol_wire_write_signal_message(uint8_t *out, const protocol_wire_signal_message *message)
+{
+    size_t len = 0;
+
+    assert(message);
+
+    if(message->has_ratchet_key) {
+        len += protocol_wire_write_bytes_field(out + len, 1, &message->ratchet_key);
+    }
+    if(message->has_counter) {
+        len += protocol_wire_write_uint32_field(out + len, 2, message->counter);
+    }
+    if(message->has_previous_counter) {
+        len += protocol_wire_write_uint32_field(out + len, 3, message->previous_counter);
+    }
+    if(message->has_ciphertext) {
+        len += protocol_wire_write_bytes_field(out + len, 4, &message->ciphertext);
+    }
+    return len;
+}
+
+/*------------------------------------------------------------------------*/
+
+int protocol_wire_parse_pre_key_signal_message(protocol_wire_pre_key_signal_message *message,
+        const uint8_t *data, size_t len)
+{
+    protocol_wire_field fields[6];
+
+    assert(message);
+    memset(message, 0, sizeof(protocol_wire_pre_key_signal_message));
+    memset(fields, 0, sizeof(fields));
+
+    fields[0].number = 1;
+    fields[0].has = &message->has_pre_key_id;
+    fields[0].value = &message->pre_key_id;
+    fields[0].bytes = 0;
+    fields[1].number = 2;
+    fields[1].has = &message->has_base_key;
+    fields[1].value = 0;
+    fields[1].bytes = &message->base_key;
+    fields[2].number = 3;
+    fields[2].has = &message->has_identity_key;
+    fields[2].value = 0;
+    fields[2].bytes = &message->identity_key;
+    fields[3].number = 4;
+    fields[3].has = &message->has_message;
+    fields[3].value = 0;
+    fields[3].bytes = &message->message;
+    fields[4].number = 5;
+    fields[4].has = &message->has_registration_id;
+    fields[4].value = &message->registration_id;
+    fields[4].bytes = 0;
+    fields[5].number = 6;
+    fields[5].has = &message->has_signed_pre_key_id;
+    fields[5].value = &message->signed_pre_key_id;
+    fields[5].bytes = 0;
+
+    return protocol_wire_parse(data, len, fields, 6);
+}
+
+size_t protocol_wire_pre_key_signal_message_get_size(const protocol_wire_pre_key_signal_message *message)
+{
+    size_t size = 0;
+
+    assert(message);
+
+    if(message->has_pre_key_id) {
+        size += protocol_wire_uint32_field_size(1, message->pre_key_id);
+    }
+    if(message->has_base_key) {
+        size += protocol_wire_bytes_field_size(2, &message->base_key);
+    }
+    if(message->has_identity_key) {
+        size += protocol_wire_bytes_field_size(3, &message->identity_key);
+    }
+    if(message->has_message) {
+        size += protocol_wire_bytes_field_size(4, &message->message);
+    }
+    if(message->has_registration_id) {
+        size += protocol_wire_uint32_field_size(5, message->registration_id);
+    }
+    if(message->has_signed_pre_key_id) {
+        size += protocol_wire_uint32_field_size(6, message->signed_pre_key_id);
+    }
+    return size;
+}
+
+size_t protocol_wire_write_pre_key_signal_message(uint8_t *out, const protocol_wire_pre_key_signal_message *message)
+{
+    size_t len = 0;
+
+    assert(message);
+
+    if(message->has_pre_key_id) {
+        len += protocol_wire_write_uint32_field(out + len, 1, message->pre_key_id);
+    }
+    if(message->has_base_key) {
+        len += protocol_wire_write_bytes_field(out + len, 2, &message->base_key);
+    }
+    if(message->has_identity_key) {
+        len += protocol_wire_write_bytes_field(out + len, 3, &message->identity_key);
+    }
+    if(message->has_message) {
+        len += protocol_wire_write_bytes_field(out + len, 4, &message->message);
+    }
+    if(message->has_registration_id) {
+        len += protocol_wire_write_uint32_field(out + len, 5, message->registration_id);
+    }
+    if(message->has_signed_pre_key_id) {
+        len += protocol_wire_write_uint32_field(out + len, 6, message->signed_pre_key_id);
+    }
+    return len;
+}
+
+/*------------------------------------------------------------------------*/
+
+int protocol_wire_parse_sender_key_message(protocol_wire_sender_key_message *message,
+        const uint8_t *data, size_t len)
+{
+    protocol_wire_field fields[3];
+
+    assert(message);
+    memset(message, 0, sizeof(protocol_wire_sender_key_message));
+    memset(fields, 0, sizeof(fields));
+
+    fields[0].number = 1;
+    fields[0].has = &message->has_id;
+    fields[0].value = &message->id;
+    fields[0].bytes = 0;
+    fields[1].number = 2;
+    fields[1].has = &message->has_iteration;
+    fields[1].value = &message->iteration;
+    fields[1].bytes = 0;
+    fields[2].number = 3;
+    fields[2].has = &message->has_ciphertext;
+    fields[2].value = 0;
+    fields[2].bytes = &message->ciphertext;
+
+    return protocol_wire_parse(data, len, fields, 3);
+}
+
+size_t protocol_wire_sender_key_message_get_size(const protocol_wire_sender_key_message *message)
+{
+    size_t size = 0;
+
+    assert(message);
+
+    if(message->has_id) {
+        size += protocol_wire_uint32_field_size(1, message->id);
+    }
+    if(message->has_iteration) {
+        size += protocol_wire_uint32_field_size(2, message->iteration);
+    }
+    if(message->has_ciphertext) {
+        size += protocol_wire_bytes_field_size(3, &message->ciphertext);
+    }
+    return size;
+}
+
+size_t protocol_wire_write_sender_key_message(uint8_t *out, const protocol_wire_sender_key_message *message)
+{
+    size_t len = 0;
+
+    assert(message);
+
+    if(message->has_id) {
+        len += protocol_wire_write_uint32_field(out + len, 1, message->id);
+    }
+    if(message->has_iteration) {
+        len += protocol_wire_write_uint32_field(out + len, 2, message->iteration);
+    }
+    if(message->has_ciphertext) {
+        len += protocol_wire_write_bytes_field(out + len, 3, &message->ciphertext);
+    }
+    return len;
+}
+
+/*------------------------------------------------------------------------*/
+
+static int protocol_wire_record_current_session(const protocol_wire_bytes *bytes, void *user_data)
+{
+    protocol_wire_record *record = user_data;
+    record->current_session = *bytes;
+    record->current_session_count++;
+    return 0;
+}
+
+int protocol_wire_parse_record(protocol_wire_record *record, const uint8_t *data, size_t len,
+        protocol_wire_bytes_func previous_session_func, void *user_data)
+{
+    protocol_wire_field fields[2];
+
+    assert(record);
+    assert(previous_session_func);
+    memset(record, 0, sizeof(protocol_wire_record));
+    memset(fields, 0, sizeof(fields));
+
+    fields[0].number = PROTOCOL_WIRE_RECORD_CURRENT_SESSION;
+    fields[0].bytes_func = protocol_wire_record_current_session;
+    fields[0].user_data = record;
+    fields[1].number = PROTOCOL_WIRE_RECORD_PREVIOUS_SESSION;
+    fields[1].bytes_func = previous_session_func;
+    fields[1].user_data = user_data;
+
+    return protocol_wire_parse(data, len, fields, 2);
+}
+
+size_t protocol_wire_record_session_get_size(uint32_t number, size_t session_len)
+{
+    return protocol_wire_varint_size(number << 3) + protocol_wire_varint_size((uint32_t)session_len) + session_len;
+}
+
+size_t protocol_wire_write_record_session_header(uint8_t *out, uint32_t number, size_t session_len)
+{
+    size_t len = protocol_wire_write_varint(out, (number << 3) | WIRE_TYPE_LENGTH_PREFIXED);
+    return len + protocol_wire_write_varint(out + len, (uint32_t)session_len);
+}
+
+typedef struct protocol_wire_session_summary_context
+{
+    protocol_wire_bytes_func receiver_ratchet_key_func;
+    void *user_data;
+} protocol_wire_session_summary_context;
+
+static int protocol_wire_session_summary_receiver_chain(const protocol_wire_bytes *bytes, void *user_data)
+{
+    int result = 0;
+    protocol_wire_session_summary_context *context = user_data;
+    protocol_wire_field field;
+    int has_sender_ratchet_key = 0;
+    protocol_wire_bytes sender_ratchet_key;
+
+    memset(&field, 0, sizeof(field));
+    field.number = 1;
+    field.has = &has_sender_ratchet_key;
+    field.bytes = &sender_ratchet_key;
+
+    result = protocol_wire_parse(bytes->data, bytes->len, &field, 1);
+    if(result < 0 || !has_sender_ratchet_key) {
+        return result;
+    }
+    return context->receiver_ratchet_key_func(&sender_ratchet_key, context->user_data);
+}
+
+int protocol_wire_parse_session_summary(protocol_wire_session_summary *summary,
+        const uint8_t *data, size_t len,
+        protocol_wire_bytes_func receiver_ratchet_key_func, void *user_data)
+{
+    protocol_wire_field fields[3];
+    protocol_wire_session_summary_context context;
+
+    assert(summary);
+    memset(summary, 0, sizeof(protocol_wire_session_summary));
+    memset(fields, 0, sizeof(fields));
+
+    fields[0].number = 1;
+    fields[0].has = &summary->has_session_version;
+    fields[0].value = &summary->session_version;
+    fields[1].number = 13;
+    fields[1].has = &summary->has_alice_base_key;
+    fields[1].bytes = &summary->alice_base_key;
+
+    if(!receiver_ratchet_key_func) {
+        return protocol_wire_parse(data, len, fields, 2);
+    }
+
+    context.receiver_ratchet_key_func = receiver_ratchet_key_func;
+    context.user_data = user_data;
+    fields[2].number = 7;
+    fields[2].bytes_func = protocol_wire_session_summary_receiver_chain;
+    fields[2].user_data = &context;
+
+    return protocol_wire_parse(data, len, fields, 3);
+}
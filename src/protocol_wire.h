@@ -0,0 +1,167 @@
+#ifndef PROTOCOL_WIRE_H
+#define PROTOCOL_WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Parser and writer for the protobuf bodies of SignalMessage,
+ * PreKeySignalMessage and SenderKeyMessage, as defined in
+ * WhisperTextProtocol.proto.
+ *
+ * These messages are flat, so they are handled directly instead of through
+ * the generic protobuf-c unpacker. Parsing validates the input in place and
+ * never allocates: bytes fields are returned as views into the input.
+ * Inputs are accepted and rejected exactly as protobuf-c would, including
+ * unknown fields and repeated occurrences of a field, where the last one
+ * wins. Writing produces the same bytes as protobuf-c into a buffer of
+ * the size returned by the matching _get_size() function.
+ */
+
+typedef struct protocol_wire_bytes
+{
+    const uint8_t *data;
+    size_t len;
+} protocol_wire_bytes;
+
+/* Called with each occurrence of a bytes field. A negative result stops parsing and is returned. */
+typedef int (*protocol_wire_bytes_func)(const protocol_wire_bytes *bytes, void *user_data);
+
+typedef struct protocol_wire_signal_message
+{
+    int has_ratchet_key;
+    protocol_wire_bytes ratchet_key;
+    int has_counter;
+    uint32_t counter;
+    int has_previous_counter;
+    uint32_t previous_counter;
+    int has_ciphertext;
+    protocol_wire_bytes ciphertext;
+} protocol_wire_signal_message;
+
+typedef struct protocol_wire_pre_key_signal_message
+{
+    int has_pre_key_id;
+    uint32_t pre_key_id;
+    int has_base_key;
+    protocol_wire_bytes base_key;
+    int has_identity_key;
+    protocol_wire_bytes identity_key;
+    int has_message;
+    protocol_wire_bytes message;
+    int has_registration_id;
+    uint32_t registration_id;
+    int has_signed_pre_key_id;
+    uint32_t signed_pre_key_id;
+} protocol_wire_pre_key_signal_message;
+
+typedef struct protocol_wire_sender_key_message
+{
+    int has_id;
+    uint32_t id;
+    int has_iteration;
+    uint32_t iteration;
+    int has_ciphertext;
+    protocol_wire_bytes ciphertext;
+} protocol_wire_sender_key_message;
+
+/**
+ * Parse a message body.
+ *
+ * @return 0 on success, SG_ERR_INVALID_PROTO_BUF if the data is malformed
+ */
+int protocol_wire_parse_signal_message(protocol_wire_signal_message *message,
+        const uint8_t *data, size_t len);
+int protocol_wire_parse_pre_key_signal_message(protocol_wire_pre_key_signal_message *message,
+        const uint8_t *data, size_t len);
+int protocol_wire_parse_sender_key_message(protocol_wire_sender_key_message *message,
+        const uint8_t *data, size_t len);
+
+/**
+ * @return number of bytes the message body serializes to
+ */
+size_t protocol_wire_signal_message_get_size(const protocol_wire_signal_message *message);
+size_t protocol_wire_pre_key_signal_message_get_size(const protocol_wire_pre_key_signal_message *message);
+size_t protocol_wire_sender_key_message_get_size(const protocol_wire_sender_key_message *message);
+
+/**
+ * Serialize a message body into out, which must hold at least the number
+ * of bytes returned by the matching _get_size() function.
+ *
+ * @return number of bytes written
+ */
+size_t protocol_wire_write_signal_message(uint8_t *out, const protocol_wire_signal_message *message);
+size_t protocol_wire_write_pre_key_signal_message(uint8_t *out, const protocol_wire_pre_key_signal_message *message);
+size_t protocol_wire_write_sender_key_message(uint8_t *out, const protocol_wire_sender_key_message *message);
+
+/*
+ * Top level of a RecordStructure, as defined in LocalStorageProtocol.proto.
+ *
+ * Sessions are returned as views of their encoded SessionStructure, so that
+ * a record can be split and reassembled without decoding its sessions.
+ * Unlike the message parsers above, the sessions themselves are not
+ * validated.
+ */
+
+#define PROTOCOL_WIRE_RECORD_CURRENT_SESSION 1
+#define PROTOCOL_WIRE_RECORD_PREVIOUS_SESSION 2
+
+typedef struct protocol_wire_record
+{
+    /* Occurrences of the field, which protobuf-c would merge if more than one */
+    size_t current_session_count;
+    protocol_wire_bytes current_session;
+} protocol_wire_record;
+
+/**
+ * Parse the top level of a record.
+ *
+ * @param previous_session_func called for each previous session, in order,
+ *     returning negative to stop parsing with that result
+ * @return 0 on success, SG_ERR_INVALID_PROTO_BUF if the data is malformed
+ */
+int protocol_wire_parse_record(protocol_wire_record *record, const uint8_t *data, size_t len,
+        protocol_wire_bytes_func previous_session_func, void *user_data);
+
+/**
+ * @return number of bytes a session field of the record serializes to
+ */
+size_t protocol_wire_record_session_get_size(uint32_t number, size_t session_len);
+
+/**
+ * Write the tag and length of a session field of the record. The encoded
+ * session follows.
+ *
+ * @return number of bytes written
+ */
+size_t protocol_wire_write_record_session_header(uint8_t *out, uint32_t number, size_t session_len);
+
+/*
+ * The fields of an encoded SessionStructure needed to match it against an
+ * incoming message, read without decoding the rest.
+ */
+typedef struct protocol_wire_session_summary
+{
+    int has_session_version;
+    uint32_t session_version;
+    int has_alice_base_key;
+    protocol_wire_bytes alice_base_key;
+} protocol_wire_session_summary;
+
+/**
+ * @param receiver_ratchet_key_func if not 0, called with the sender ratchet
+ *     key of each receiver chain
+ */
+int protocol_wire_parse_session_summary(protocol_wire_session_summary *summary,
+        const uint8_t *data, size_t len,
+        protocol_wire_bytes_func receiver_ratchet_key_func, void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROTOCOL_WIRE_H */
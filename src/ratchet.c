@@ -49,7 +49,7 @@ int ratchet_chain_key_create(ratchet_chain_key **chain_key, hkdf_context *kdf, c
         return SG_ERR_INVAL;
     }
 
-    result = malloc(sizeof(ratchet_chain_key));
+    result = signal_malloc(global_context, sizeof(ratchet_chain_key));
     if(!result) {
         return SG_ERR_NOMEM;
     }
@@ -58,9 +58,9 @@ int ratchet_chain_key_create(ratchet_chain_key **chain_key, hkdf_context *kdf, c
     result->global_context = global_context;
     result->kdf = kdf;
 
-    result->key = malloc(key_len);
+    result->key = signal_malloc(global_context, key_len);
     if(!result->key) {
-        free(result);
+        signal_free(global_context, result);
         return SG_ERR_NOMEM;
     }
     memcpy(result->key, key, key_len);
@@ -78,7 +78,7 @@ int ratchet_chain_key_get_key(const ratchet_chain_key *chain_key, signal_buffer
     signal_buffer *buf = 0;
     uint8_t *data = 0;
     
-    buf = signal_buffer_alloc(chain_key->key_len);
+    buf = signal_buffer_context_alloc(chain_key->global_context, chain_key->key_len);
     if(!buf) {
         return SG_ERR_NOMEM;
     }
@@ -91,20 +91,18 @@ int ratchet_chain_key_get_key(const ratchet_chain_key *chain_key, signal_buffer
     return 0;
 }
 
-int ratchet_chain_key_get_key_protobuf(const ratchet_chain_key *chain_key, ProtobufCBinaryData *buffer)
+int ratchet_chain_key_get_key_protobuf(const ratchet_chain_key *chain_key, ProtobufCBinaryData *buffer, signal_arena *arena)
 {
     uint8_t *data = 0;
 
     assert(chain_key);
     assert(buffer);
 
-    data = malloc(chain_key->key_len);
+    data = signal_arena_memdup(arena, chain_key->key, chain_key->key_len);
     if(!data) {
         return SG_ERR_NOMEM;
     }
 
-    memcpy(data, chain_key->key, chain_key->key_len);
-
     buffer->data = data;
     buffer->len = chain_key->key_len;
     return 0;
@@ -115,49 +113,15 @@ uint32_t ratchet_chain_key_get_index(const ratchet_chain_key *chain_key)
     return chain_key->index;
 }
 
-ssize_t ratchet_chain_key_get_base_material(const ratchet_chain_key *chain_key, uint8_t **material, const uint8_t *seed, size_t seed_len)
+static int ratchet_chain_key_get_base_material(const ratchet_chain_key *chain_key, uint8_t *material, const uint8_t *seed, size_t seed_len)
 {
-    int result = 0;
-    signal_buffer *output_buffer = 0;
-    uint8_t *output = 0;
-    size_t output_len = 0;
+    signal_iovec iov[1];
 
-    void *hmac_context = 0;
-    result = signal_hmac_sha256_init(chain_key->global_context, &hmac_context, chain_key->key, chain_key->key_len);
-    if(result < 0) {
-        goto complete;
-    }
+    iov[0].data = seed;
+    iov[0].len = seed_len;
 
-    result = signal_hmac_sha256_update(chain_key->global_context, hmac_context, seed, seed_len);
-    if(result < 0) {
-        goto complete;
-    }
-
-    result = signal_hmac_sha256_final(chain_key->global_context, hmac_context, &output_buffer);
-    if(result < 0) {
-        goto complete;
-    }
-
-    output_len = signal_buffer_len(output_buffer);
-    output = malloc(output_len);
-    if(!output) {
-        result = SG_ERR_NOMEM;
-        goto complete;
-    }
-
-    memcpy(output, signal_buffer_data(output_buffer), output_len);
-
-complete:
-    signal_hmac_sha256_cleanup(chain_key->global_context, hmac_context);
-    signal_buffer_free(output_buffer);
-
-    if(result >= 0) {
-        *material = output;
-        return (ssize_t)output_len;
-    }
-    else {
-        return result;
-    }
+    return signal_hmac_sha256(chain_key->global_context,
+            chain_key->key, chain_key->key_len, iov, 1, material);
 }
 
 int ratchet_chain_key_get_message_keys(ratchet_chain_key *chain_key, ratchet_message_keys *message_keys)
@@ -165,45 +129,29 @@ int ratchet_chain_key_get_message_keys(ratchet_chain_key *chain_key, ratchet_mes
     static const uint8_t message_key_seed = 0x01;
     static const char key_material_seed[] = "WhisperMessageKeys";
     uint8_t salt[HASH_OUTPUT_SIZE];
+    uint8_t input_key_material[HASH_OUTPUT_SIZE];
+    uint8_t key_material_data[DERIVED_MESSAGE_SECRETS_SIZE];
     int result = 0;
-    ssize_t result_size = 0;
-    uint8_t *input_key_material = 0;
-    size_t input_key_material_len = 0;
-    uint8_t *key_material_data = 0;
-    size_t key_material_data_len = 0;
 
     memset(message_keys, 0, sizeof(ratchet_message_keys));
 
-    result_size = ratchet_chain_key_get_base_material(chain_key, &input_key_material, &message_key_seed, sizeof(message_key_seed));
-    if(result_size < 0) {
-        result = (int)result_size;
+    result = ratchet_chain_key_get_base_material(chain_key, input_key_material, &message_key_seed, sizeof(message_key_seed));
+    if(result < 0) {
         signal_log(chain_key->global_context, SG_LOG_WARNING, "ratchet_chain_key_get_base_material failed");
         goto complete;
     }
-    input_key_material_len = (size_t)result_size;
 
     memset(salt, 0, sizeof(salt));
 
-    result_size = hkdf_derive_secrets(chain_key->kdf,
-            &key_material_data,
-            input_key_material, input_key_material_len,
+    result = hkdf_derive_secrets_into(chain_key->kdf,
+            key_material_data, sizeof(key_material_data),
+            input_key_material, sizeof(input_key_material),
             salt, sizeof(salt),
-            (uint8_t *)key_material_seed, sizeof(key_material_seed) - 1,
-            DERIVED_MESSAGE_SECRETS_SIZE);
-    if(result_size < 0) {
-        result = (int)result_size;
+            (uint8_t *)key_material_seed, sizeof(key_material_seed) - 1);
+    if(result < 0) {
         signal_log(chain_key->global_context, SG_LOG_WARNING, "hkdf_derive_secrets failed");
         goto complete;
     }
-    key_material_data_len = (size_t)result_size;
-
-    if(key_material_data_len != RATCHET_CIPHER_KEY_LENGTH + RATCHET_MAC_KEY_LENGTH + RATCHET_IV_LENGTH) {
-        signal_log(chain_key->global_context, SG_LOG_WARNING,
-                "key_material_data length mismatch: %d != %d",
-                key_material_data_len, (RATCHET_CIPHER_KEY_LENGTH + RATCHET_MAC_KEY_LENGTH + RATCHET_IV_LENGTH));
-        result = SG_ERR_UNKNOWN;
-        goto complete;
-    }
 
     memcpy(message_keys->cipher_key, key_material_data, RATCHET_CIPHER_KEY_LENGTH);
     memcpy(message_keys->mac_key, key_material_data + RATCHET_CIPHER_KEY_LENGTH, RATCHET_MAC_KEY_LENGTH);
@@ -211,60 +159,137 @@ int ratchet_chain_key_get_message_keys(ratchet_chain_key *chain_key, ratchet_mes
     message_keys->counter = chain_key->index;
 
 complete:
-    if(input_key_material) {
-        free(input_key_material);
-    }
-    if(key_material_data) {
-        free(key_material_data);
-    }
-    if(result < 0) {
-        return result;
-    }
-    else {
-        return 0;
-    }
+    signal_explicit_bzero(input_key_material, sizeof(input_key_material));
+    signal_explicit_bzero(key_material_data, sizeof(key_material_data));
+    return result;
 }
 
 int ratchet_chain_key_create_next(const ratchet_chain_key *chain_key, ratchet_chain_key **next_chain_key)
 {
     static const uint8_t chain_key_seed = 0x02;
     int result = 0;
-    ssize_t result_size = 0;
-    uint8_t *next_key = 0;
-    size_t next_key_len = 0;
+    uint8_t next_key[HASH_OUTPUT_SIZE];
 
-    result_size = ratchet_chain_key_get_base_material(chain_key, &next_key, &chain_key_seed, sizeof(chain_key_seed));
-    if(result_size < 0) {
-        result = (int)result_size;
+    result = ratchet_chain_key_get_base_material(chain_key, next_key, &chain_key_seed, sizeof(chain_key_seed));
+    if(result < 0) {
         signal_log(chain_key->global_context, SG_LOG_WARNING, "ratchet_chain_key_get_base_material failed");
         goto complete;
     }
-    next_key_len = (size_t)result_size;
 
     result = ratchet_chain_key_create(
             next_chain_key,
             chain_key->kdf,
-            next_key, next_key_len,
+            next_key, sizeof(next_key),
             chain_key->index + 1,
             chain_key->global_context);
 
 complete:
-    if(next_key) {
-        free(next_key);
+    signal_explicit_bzero(next_key, sizeof(next_key));
+    return result;
+}
+
+int ratchet_chain_key_copy(ratchet_chain_key **chain_key, const ratchet_chain_key *other_chain_key)
+{
+    assert(other_chain_key);
+
+    return ratchet_chain_key_create(chain_key,
+            other_chain_key->kdf,
+            other_chain_key->key, other_chain_key->key_len,
+            other_chain_key->index,
+            other_chain_key->global_context);
+}
+
+int ratchet_chain_key_step(ratchet_chain_key *chain_key, ratchet_message_keys *message_keys)
+{
+    static const uint8_t chain_key_seed = 0x02;
+    int result = 0;
+    uint8_t next_key[HASH_OUTPUT_SIZE];
+
+    assert(chain_key);
+    assert(signal_type_is_unique(&chain_key->base));
+
+    result = ratchet_chain_key_get_message_keys(chain_key, message_keys);
+    if(result < 0) {
+        goto complete;
     }
 
+    result = ratchet_chain_key_get_base_material(chain_key, next_key, &chain_key_seed, sizeof(chain_key_seed));
+    if(result < 0) {
+        signal_log(chain_key->global_context, SG_LOG_WARNING, "ratchet_chain_key_get_base_material failed");
+        goto complete;
+    }
+
+    if(chain_key->key_len != sizeof(next_key)) {
+        uint8_t *key = signal_malloc(chain_key->global_context, sizeof(next_key));
+        if(!key) {
+            result = SG_ERR_NOMEM;
+            goto complete;
+        }
+        signal_explicit_bzero(chain_key->key, chain_key->key_len);
+        signal_free(chain_key->global_context, chain_key->key);
+        chain_key->key = key;
+        chain_key->key_len = sizeof(next_key);
+    }
+
+    memcpy(chain_key->key, next_key, sizeof(next_key));
+    chain_key->index++;
+
+complete:
+    signal_explicit_bzero(next_key, sizeof(next_key));
     return result;
 }
 
+int ratchet_chain_key_set_key(ratchet_chain_key *chain_key, const uint8_t *key, size_t key_len, uint32_t index)
+{
+    assert(chain_key);
+    assert(key);
+    assert(signal_type_is_unique(&chain_key->base));
+
+    if(chain_key->key_len != key_len) {
+        uint8_t *new_key = signal_malloc(chain_key->global_context, key_len);
+        if(!new_key) {
+            return SG_ERR_NOMEM;
+        }
+        signal_explicit_bzero(chain_key->key, chain_key->key_len);
+        signal_free(chain_key->global_context, chain_key->key);
+        chain_key->key = new_key;
+        chain_key->key_len = key_len;
+    }
+
+    memcpy(chain_key->key, key, key_len);
+    chain_key->index = index;
+    return 0;
+}
+
+int ratchet_chain_key_get_message_keys_at(const ratchet_chain_key *chain_key,
+        const uint8_t *key, size_t key_len, uint32_t index,
+        ratchet_message_keys *message_keys)
+{
+    ratchet_chain_key position;
+
+    assert(chain_key);
+    assert(key);
+
+    /* Borrows the KDF of the chain, so the copy is never reference counted */
+    memset(&position, 0, sizeof(position));
+    position.global_context = chain_key->global_context;
+    position.kdf = chain_key->kdf;
+    position.key = (uint8_t *)key;
+    position.key_len = key_len;
+    position.index = index;
+
+    return ratchet_chain_key_get_message_keys(&position, message_keys);
+}
+
 void ratchet_chain_key_destroy(signal_type_base *type)
 {
     ratchet_chain_key *chain_key = (ratchet_chain_key *)type;
     SIGNAL_UNREF(chain_key->kdf);
     if(chain_key->key) {
         signal_explicit_bzero(chain_key->key, chain_key->key_len);
-        free(chain_key->key);
+        signal_free(chain_key->global_context, chain_key->key);
     }
-    free(chain_key);
+    signal_free(chain_key->global_context, chain_key);
 }
 
 int ratchet_root_key_create(ratchet_root_key **root_key, hkdf_context *kdf, const uint8_t *key, size_t key_len, signal_context *global_context)
@@ -275,7 +300,7 @@ int ratchet_root_key_create(ratchet_root_key **root_key, hkdf_context *kdf, cons
         return SG_ERR_INVAL;
     }
 
-    result = malloc(sizeof(ratchet_root_key));
+    result = signal_malloc(global_context, sizeof(ratchet_root_key));
     if(!result) {
         return SG_ERR_NOMEM;
     }
@@ -284,9 +309,9 @@ int ratchet_root_key_create(ratchet_root_key **root_key, hkdf_context *kdf, cons
     result->global_context = global_context;
     result->kdf = kdf;
 
-    result->key = malloc(key_len);
+    result->key = signal_malloc(global_context, key_len);
     if(!result->key) {
-        free(result);
+        signal_free(global_context, result);
         return SG_ERR_NOMEM;
     }
     memcpy(result->key, key, key_len);
@@ -304,10 +329,9 @@ int ratchet_root_key_create_chain(ratchet_root_key *root_key,
 {
     static const char key_info[] = "WhisperRatchet";
     int result = 0;
-    ssize_t result_size = 0;
     uint8_t *shared_secret = 0;
     size_t shared_secret_len = 0;
-    uint8_t *derived_secret = 0;
+    uint8_t derived_secret[DERIVED_ROOT_SECRETS_SIZE];
     ratchet_root_key *new_root_key_result = 0;
     ratchet_chain_key *new_chain_key_result = 0;
 
@@ -322,21 +346,15 @@ int ratchet_root_key_create_chain(ratchet_root_key *root_key,
     }
     shared_secret_len = (size_t)result;
 
-    result_size = hkdf_derive_secrets(root_key->kdf, &derived_secret,
+    result = hkdf_derive_secrets_into(root_key->kdf,
+            derived_secret, sizeof(derived_secret),
             shared_secret, shared_secret_len,
             root_key->key, root_key->key_len,
-            (uint8_t *)key_info, sizeof(key_info) - 1,
-            DERIVED_ROOT_SECRETS_SIZE);
-    if(result_size < 0) {
-        result = (int)result_size;
+            (uint8_t *)key_info, sizeof(key_info) - 1);
+    if(result < 0) {
         signal_log(root_key->global_context, SG_LOG_WARNING, "hkdf_derive_secrets failed");
         goto complete;
     }
-    else if(result_size != DERIVED_ROOT_SECRETS_SIZE) {
-        result = SG_ERR_UNKNOWN;
-        signal_log(root_key->global_context, SG_LOG_WARNING, "hkdf_derive_secrets size mismatch");
-        goto complete;
-    }
 
     result = ratchet_root_key_create(&new_root_key_result, root_key->kdf,
             derived_secret, 32,
@@ -358,9 +376,7 @@ complete:
     if(shared_secret) {
         free(shared_secret);
     }
-    if(derived_secret) {
-        free(derived_secret);
-    }
+    signal_explicit_bzero(derived_secret, sizeof(derived_secret));
     if(result < 0) {
         if(new_root_key_result) {
             SIGNAL_UNREF(new_root_key_result);
@@ -384,7 +400,7 @@ int ratchet_root_key_get_key(ratchet_root_key *root_key, signal_buffer **buffer)
 
     assert(root_key);
     
-    buf = signal_buffer_alloc(root_key->key_len);
+    buf = signal_buffer_context_alloc(root_key->global_context, root_key->key_len);
     if(!buf) {
         return SG_ERR_NOMEM;
     }
@@ -397,20 +413,18 @@ int ratchet_root_key_get_key(ratchet_root_key *root_key, signal_buffer **buffer)
     return 0;
 }
 
-int ratchet_root_key_get_key_protobuf(const ratchet_root_key *root_key, ProtobufCBinaryData *buffer)
+int ratchet_root_key_get_key_protobuf(const ratchet_root_key *root_key, ProtobufCBinaryData *buffer, signal_arena *arena)
 {
     uint8_t *data = 0;
 
     assert(root_key);
     assert(buffer);
 
-    data = malloc(root_key->key_len);
+    data = signal_arena_memdup(arena, root_key->key, root_key->key_len);
     if(!data) {
         return SG_ERR_NOMEM;
     }
 
-    memcpy(data, root_key->key, root_key->key_len);
-
     buffer->data = data;
     buffer->len = root_key->key_len;
     return 0;
@@ -450,9 +464,9 @@ void ratchet_root_key_destroy(signal_type_base *type)
     SIGNAL_UNREF(root_key->kdf);
     if(root_key->key) {
         signal_explicit_bzero(root_key->key, root_key->key_len);
-        free(root_key->key);
+        signal_free(root_key->global_context, root_key->key);
     }
-    free(root_key);
+    signal_free(root_key->global_context, root_key);
 }
 
 int ratchet_identity_key_pair_create(
@@ -482,21 +496,24 @@ int ratchet_identity_key_pair_serialize(signal_buffer **buffer, const ratchet_id
     size_t result_size = 0;
     signal_buffer *result_buf = 0;
     Textsecure__IdentityKeyPairStructure key_structure = TEXTSECURE__IDENTITY_KEY_PAIR_STRUCTURE__INIT;
+    signal_arena arena;
     size_t len = 0;
     uint8_t *data = 0;
 
+    signal_arena_init(&arena, 0, 0);
+
     if(!key_pair) {
         result = SG_ERR_INVAL;
         goto complete;
     }
 
-    result = ec_public_key_serialize_protobuf(&key_structure.publickey, key_pair->public_key);
+    result = ec_public_key_serialize_protobuf(&key_structure.publickey, key_pair->public_key, &arena);
     if(result < 0) {
         goto complete;
     }
     key_structure.has_publickey = 1;
 
-    result = ec_private_key_serialize_protobuf(&key_structure.privatekey, key_pair->private_key);
+    result = ec_private_key_serialize_protobuf(&key_structure.privatekey, key_pair->private_key, &arena);
     if(result < 0) {
         goto complete;
     }
@@ -519,12 +536,7 @@ int ratchet_identity_key_pair_serialize(signal_buffer **buffer, const ratchet_id
     }
 
 complete:
-    if(key_structure.has_publickey) {
-        free(key_structure.publickey.data);
-    }
-    if(key_structure.has_privatekey) {
-        free(key_structure.privatekey.data);
-    }
+    signal_arena_release(&arena);
     if(result >= 0) {
         result = 0;
         *buffer = result_buf;
@@ -540,7 +552,7 @@ int ratchet_identity_key_pair_deserialize(ratchet_identity_key_pair **key_pair,
     ratchet_identity_key_pair *result_pair = 0;
     Textsecure__IdentityKeyPairStructure *key_structure = 0;
 
-    key_structure = textsecure__identity_key_pair_structure__unpack(0, len, data);
+    key_structure = textsecure__identity_key_pair_structure__unpack(signal_protobuf_allocator(global_context), len, data);
     if(!key_structure) {
         result = SG_ERR_INVALID_PROTO_BUF;
         goto complete;
@@ -576,7 +588,7 @@ complete:
     SIGNAL_UNREF(public_key);
     SIGNAL_UNREF(private_key);
     if(key_structure) {
-        textsecure__identity_key_pair_structure__free_unpacked(key_structure, 0);
+        textsecure__identity_key_pair_structure__free_unpacked(key_structure, signal_protobuf_allocator(global_context));
     }
     if(result >= 0) {
         *key_pair = result_pair;
@@ -858,11 +870,10 @@ int ratcheting_session_calculate_derived_keys(ratchet_root_key **root_key, ratch
         uint8_t *secret, size_t secret_len, signal_context *global_context)
 {
     int result = 0;
-    ssize_t result_size = 0;
     hkdf_context *kdf = 0;
     ratchet_root_key *root_key_result = 0;
     ratchet_chain_key *chain_key_result = 0;
-    uint8_t *output = 0;
+    uint8_t output[DERIVED_ROOT_SECRETS_SIZE];
     uint8_t salt[HASH_OUTPUT_SIZE];
     static const char key_info[] = "WhisperText";
 
@@ -873,12 +884,12 @@ int ratcheting_session_calculate_derived_keys(ratchet_root_key **root_key, ratch
 
     memset(salt, 0, sizeof(salt));
 
-    result_size = hkdf_derive_secrets(kdf, &output,
+    result = hkdf_derive_secrets_into(kdf,
+            output, sizeof(output),
             secret, secret_len,
             salt, sizeof(salt),
-            (uint8_t *)key_info, sizeof(key_info) - 1, 64);
-    if(result_size != 64) {
-        result = SG_ERR_UNKNOWN;
+            (uint8_t *)key_info, sizeof(key_info) - 1);
+    if(result < 0) {
         goto complete;
     }
 
@@ -896,9 +907,7 @@ complete:
     if(kdf) {
         SIGNAL_UNREF(kdf);
     }
-    if(output) {
-        free(output);
-    }
+    signal_explicit_bzero(output, sizeof(output));
 
     if(result < 0) {
         if(root_key_result) {
@@ -996,7 +1005,7 @@ int ratcheting_session_alice_initialize(
 
     vpool_init(&vp, 1024, 0);
 
-    result = curve_generate_key_pair(global_context, &sending_ratchet_key);
+    result = signal_generate_ephemeral_key_pair(global_context, &sending_ratchet_key);
     if(result < 0) {
         goto complete;
     }
@@ -16,6 +16,40 @@ int ratchet_chain_key_get_key(const ratchet_chain_key *chain_key, signal_buffer
 uint32_t ratchet_chain_key_get_index(const ratchet_chain_key *chain_key);
 int ratchet_chain_key_get_message_keys(ratchet_chain_key *chain_key, ratchet_message_keys *message_keys);
 int ratchet_chain_key_create_next(const ratchet_chain_key *chain_key, ratchet_chain_key **next_chain_key);
+int ratchet_chain_key_copy(ratchet_chain_key **chain_key, const ratchet_chain_key *other_chain_key);
+
+/**
+ * Derive the message keys for the current position of the chain, then
+ * advance the chain key in place to the next position. No heap memory is
+ * allocated, so this is the preferred way to walk a chain forward.
+ *
+ * The chain key must not be shared, as it is modified. Use
+ * ratchet_chain_key_copy() to obtain a private copy first.
+ *
+ * @param chain_key the chain key to advance
+ * @param message_keys set to the message keys of the current position
+ * @return 0 on success, negative on failure
+ */
+int ratchet_chain_key_step(ratchet_chain_key *chain_key, ratchet_message_keys *message_keys);
+
+/**
+ * Move the chain key in place to a later index, given the key material for
+ * that index, as when skipped positions are kept as checkpoints rather than
+ * as message keys. The chain key must not be shared.
+ *
+ * @return 0 on success, negative on failure
+ */
+int ratchet_chain_key_set_key(ratchet_chain_key *chain_key, const uint8_t *key, size_t key_len, uint32_t index);
+
+/**
+ * Derive the message keys for another index of the same chain, given the
+ * key material for that index.
+ *
+ * @return 0 on success, negative on failure
+ */
+int ratchet_chain_key_get_message_keys_at(const ratchet_chain_key *chain_key,
+        const uint8_t *key, size_t key_len, uint32_t index,
+        ratchet_message_keys *message_keys);
 void ratchet_chain_key_destroy(signal_type_base *type);
 
 int ratchet_root_key_create(ratchet_root_key **root_key, hkdf_context *kdf,
@@ -29,6 +63,10 @@ int ratchet_root_key_get_key(ratchet_root_key *root_key, signal_buffer **buffer)
 int ratchet_root_key_compare(const ratchet_root_key *key1, const ratchet_root_key *key2);
 void ratchet_root_key_destroy(signal_type_base *type);
 
+/*
+ * Identity key pairs are immutable once created. With SIGNAL_ATOMIC_REFCOUNT
+ * they may be shared between threads and used concurrently without locking.
+ */
 int ratchet_identity_key_pair_create(
         ratchet_identity_key_pair **key_pair,
         ec_public_key *public_key,
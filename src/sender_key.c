@@ -24,78 +24,70 @@ struct sender_chain_key {
     signal_context *global_context;
 };
 
-static int sender_chain_key_get_derivative(signal_buffer **derivative, uint8_t seed, signal_buffer *key,
-        signal_context *global_context);
+static int sender_chain_key_get_derivative(uint8_t *derivative, uint8_t seed,
+        const uint8_t *key, size_t key_len, signal_context *global_context);
 
-int sender_message_key_create(sender_message_key **key,
-        uint32_t iteration, signal_buffer *seed,
+int sender_message_key_create_from_seed(sender_message_key **key,
+        uint32_t iteration, const uint8_t *seed, size_t seed_len,
         signal_context *global_context)
 {
     sender_message_key *result = 0;
     int ret = 0;
-    ssize_t ret_size = 0;
     hkdf_context *kdf = 0;
     static const char info_material[] = "WhisperGroup";
     uint8_t salt[HASH_OUTPUT_SIZE];
-    uint8_t *derivative = 0;
+    uint8_t derivative[48];
 
     assert(global_context);
 
-    if(!seed) {
-        return SG_ERR_INVAL;
-    }
-
     memset(salt, 0, sizeof(salt));
 
-    result = malloc(sizeof(sender_message_key));
+    result = signal_malloc(global_context, sizeof(sender_message_key));
     if(!result) {
         return SG_ERR_NOMEM;
     }
 
     SIGNAL_INIT(result, sender_message_key_destroy);
+    result->global_context = global_context;
 
     ret = hkdf_create(&kdf, 3, global_context);
     if(ret < 0) {
         goto complete;
     }
 
-    ret_size = hkdf_derive_secrets(kdf, &derivative,
-            signal_buffer_data(seed), signal_buffer_len(seed),
+    ret = hkdf_derive_secrets_into(kdf,
+            derivative, sizeof(derivative),
+            seed, seed_len,
             salt, sizeof(salt),
-            (uint8_t *)info_material, sizeof(info_material) - 1, 48);
-    if(ret_size != 48) {
-        ret = (ret_size < 0) ? (int)ret_size : SG_ERR_UNKNOWN;
+            (uint8_t *)info_material, sizeof(info_material) - 1);
+    if(ret < 0) {
         signal_log(global_context, SG_LOG_WARNING, "hkdf_derive_secrets failed");
         goto complete;
     }
 
     result->iteration = iteration;
 
-    result->seed = signal_buffer_copy(seed);
+    result->seed = signal_buffer_context_create(global_context, seed, seed_len);
     if(!result->seed) {
         ret = SG_ERR_NOMEM;
         goto complete;
     }
 
-    result->iv = signal_buffer_create(derivative, 16);
+    result->iv = signal_buffer_context_create(global_context, derivative, 16);
     if(!result->iv) {
         ret = SG_ERR_NOMEM;
         goto complete;
     }
 
-    result->cipher_key = signal_buffer_create(derivative + 16, 32);
+    result->cipher_key = signal_buffer_context_create(global_context, derivative + 16, 32);
     if(!result->cipher_key) {
         ret = SG_ERR_NOMEM;
         goto complete;
     }
 
-    result->global_context = global_context;
-
 complete:
     SIGNAL_UNREF(kdf);
-    if(derivative) {
-        free(derivative);
-    }
+    signal_explicit_bzero(derivative, sizeof(derivative));
     if(ret < 0) {
         SIGNAL_UNREF(result);
     }
@@ -106,6 +98,37 @@ complete:
     return ret;
 }
 
+int sender_message_key_create(sender_message_key **key,
+        uint32_t iteration, signal_buffer *seed,
+        signal_context *global_context)
+{
+    if(!seed) {
+        return SG_ERR_INVAL;
+    }
+
+    return sender_message_key_create_from_seed(key, iteration,
+            signal_buffer_data(seed), signal_buffer_len(seed),
+            global_context);
+}
+
+int sender_message_key_create_from_chain_key(sender_message_key **key,
+        uint32_t iteration, const uint8_t *chain_key, size_t chain_key_len,
+        signal_context *global_context)
+{
+    static const uint8_t MESSAGE_KEY_SEED = 0x01;
+    int ret = 0;
+    uint8_t derivative[HASH_OUTPUT_SIZE];
+
+    ret = sender_chain_key_get_derivative(derivative, MESSAGE_KEY_SEED, chain_key, chain_key_len, global_context);
+    if(ret >= 0) {
+        ret = sender_message_key_create_from_seed(key, iteration,
+                derivative, sizeof(derivative), global_context);
+    }
+
+    signal_explicit_bzero(derivative, sizeof(derivative));
+    return ret;
+}
+
 uint32_t sender_message_key_get_iteration(sender_message_key *key)
 {
     assert(key);
@@ -136,11 +159,11 @@ void sender_message_key_destroy(signal_type_base *type)
     signal_buffer_bzero_free(key->iv);
     signal_buffer_bzero_free(key->cipher_key);
     signal_buffer_bzero_free(key->seed);
-    free(key);
+    signal_free(key->global_context, key);
 }
 
-int sender_chain_key_create(sender_chain_key **key,
-        uint32_t iteration, signal_buffer *chain_key,
+static int sender_chain_key_create_from_bytes(sender_chain_key **key,
+        uint32_t iteration, const uint8_t *chain_key, size_t chain_key_len,
         signal_context *global_context)
 {
     sender_chain_key *result = 0;
@@ -148,27 +171,22 @@ int sender_chain_key_create(sender_chain_key **key,
 
     assert(global_context);
 
-    if(!chain_key) {
-        return SG_ERR_INVAL;
-    }
-
-    result = malloc(sizeof(sender_chain_key));
+    result = signal_malloc(global_context, sizeof(sender_chain_key));
     if(!result) {
         return SG_ERR_NOMEM;
     }
 
     SIGNAL_INIT(result, sender_chain_key_destroy);
+    result->global_context = global_context;
 
     result->iteration = iteration;
 
-    result->chain_key = signal_buffer_copy(chain_key);
+    result->chain_key = signal_buffer_context_create(global_context, chain_key, chain_key_len);
     if(!result->chain_key) {
         ret = SG_ERR_NOMEM;
         goto complete;
     }
 
-    result->global_context = global_context;
-
 complete:
     if(ret < 0) {
         SIGNAL_UNREF(result);
@@ -180,6 +198,19 @@ complete:
     return ret;
 }
 
+int sender_chain_key_create(sender_chain_key **key,
+        uint32_t iteration, signal_buffer *chain_key,
+        signal_context *global_context)
+{
+    if(!chain_key) {
+        return SG_ERR_INVAL;
+    }
+
+    return sender_chain_key_create_from_bytes(key, iteration,
+            signal_buffer_data(chain_key), signal_buffer_len(chain_key),
+            global_context);
+}
+
 uint32_t sender_chain_key_get_iteration(sender_chain_key *key)
 {
     assert(key);
@@ -190,20 +221,22 @@ int sender_chain_key_create_message_key(sender_chain_key *key, sender_message_ke
 {
     static const uint8_t MESSAGE_KEY_SEED = 0x01;
     int ret = 0;
-    signal_buffer *derivative = 0;
+    uint8_t derivative[HASH_OUTPUT_SIZE];
     sender_message_key *result = 0;
 
     assert(key);
 
-    ret = sender_chain_key_get_derivative(&derivative, MESSAGE_KEY_SEED, key->chain_key, key->global_context);
+    ret = sender_chain_key_get_derivative(derivative, MESSAGE_KEY_SEED,
+            signal_buffer_data(key->chain_key), signal_buffer_len(key->chain_key), key->global_context);
     if(ret < 0) {
         goto complete;
     }
 
-    ret = sender_message_key_create(&result, key->iteration, derivative, key->global_context);
+    ret = sender_message_key_create_from_seed(&result, key->iteration,
+            derivative, sizeof(derivative), key->global_context);
 
 complete:
-    signal_buffer_free(derivative);
+    signal_explicit_bzero(derivative, sizeof(derivative));
     if(ret >= 0) {
         ret = 0;
         *message_key = result;
@@ -211,24 +244,35 @@ complete:
     return ret;
 }
 
+int sender_chain_key_get_message_key_seed(sender_chain_key *key, uint8_t *seed)
+{
+    static const uint8_t MESSAGE_KEY_SEED = 0x01;
+    assert(key);
+    assert(seed);
+    return sender_chain_key_get_derivative(seed, MESSAGE_KEY_SEED,
+            signal_buffer_data(key->chain_key), signal_buffer_len(key->chain_key), key->global_context);
+}
+
 int sender_chain_key_create_next(sender_chain_key *key, sender_chain_key **next_key)
 {
     static const uint8_t CHAIN_KEY_SEED = 0x02;
     int ret = 0;
-    signal_buffer *derivative = 0;
+    uint8_t derivative[HASH_OUTPUT_SIZE];
     sender_chain_key *result = 0;
 
     assert(key);
 
-    ret = sender_chain_key_get_derivative(&derivative, CHAIN_KEY_SEED, key->chain_key, key->global_context);
+    ret = sender_chain_key_get_derivative(derivative, CHAIN_KEY_SEED,
+            signal_buffer_data(key->chain_key), signal_buffer_len(key->chain_key), key->global_context);
     if(ret < 0) {
         goto complete;
     }
 
-    ret = sender_chain_key_create(&result, key->iteration + 1, derivative, key->global_context);
+    ret = sender_chain_key_create_from_bytes(&result, key->iteration + 1,
+            derivative, sizeof(derivative), key->global_context);
 
 complete:
-    signal_buffer_free(derivative);
+    signal_explicit_bzero(derivative, sizeof(derivative));
     if(ret >= 0) {
         ret = 0;
         *next_key = result;
@@ -246,40 +290,17 @@ void sender_chain_key_destroy(signal_type_base *type)
 {
     sender_chain_key *key = (sender_chain_key *)type;
     signal_buffer_bzero_free(key->chain_key);
-    free(key);
+    signal_free(key->global_context, key);
 }
 
-int sender_chain_key_get_derivative(signal_buffer **derivative, uint8_t seed, signal_buffer *key,
-        signal_context *global_context)
+static int sender_chain_key_get_derivative(uint8_t *derivative, uint8_t seed,
+        const uint8_t *key, size_t key_len, signal_context *global_context)
 {
-    int result = 0;
-    signal_buffer *output_buffer = 0;
-    void *hmac_context = 0;
-
-    result = signal_hmac_sha256_init(global_context, &hmac_context,
-            signal_buffer_data(key), signal_buffer_len(key));
-    if(result < 0) {
-        goto complete;
-    }
-
-    result = signal_hmac_sha256_update(global_context, hmac_context, &seed, sizeof(seed));
-    if(result < 0) {
-        goto complete;
-    }
+    signal_iovec iov[1];
 
-    result = signal_hmac_sha256_final(global_context, hmac_context, &output_buffer);
-    if(result < 0) {
-        goto complete;
-    }
+    iov[0].data = &seed;
+    iov[0].len = sizeof(seed);
 
-complete:
-    signal_hmac_sha256_cleanup(global_context, hmac_context);
-
-    if(result < 0) {
-        signal_buffer_free(output_buffer);
-    }
-    else {
-        *derivative = output_buffer;
-    }
-    return result;
+    return signal_hmac_sha256(global_context,
+            key, key_len, iov, 1, derivative);
 }
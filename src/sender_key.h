@@ -9,9 +9,22 @@
 extern "C" {
 #endif
 
+#define SENDER_MESSAGE_KEY_SEED_LEN 32
+
 int sender_message_key_create(sender_message_key **key,
         uint32_t iteration, signal_buffer *seed,
         signal_context *global_context);
+int sender_message_key_create_from_seed(sender_message_key **key,
+        uint32_t iteration, const uint8_t *seed, size_t seed_len,
+        signal_context *global_context);
+
+/**
+ * Create the message key for a position of a sender chain, given the chain
+ * key for that position.
+ */
+int sender_message_key_create_from_chain_key(sender_message_key **key,
+        uint32_t iteration, const uint8_t *chain_key, size_t chain_key_len,
+        signal_context *global_context);
 uint32_t sender_message_key_get_iteration(sender_message_key *key);
 signal_buffer *sender_message_key_get_iv(sender_message_key *key);
 signal_buffer *sender_message_key_get_cipher_key(sender_message_key *key);
@@ -23,6 +36,15 @@ int sender_chain_key_create(sender_chain_key **key,
         signal_context *global_context);
 uint32_t sender_chain_key_get_iteration(sender_chain_key *key);
 int sender_chain_key_create_message_key(sender_chain_key *key, sender_message_key **message_key);
+
+/**
+ * Derive only the seed of the message key for the current iteration, without
+ * expanding it into a sender_message_key.
+ *
+ * @param seed buffer of SENDER_MESSAGE_KEY_SEED_LEN bytes for the seed
+ * @return 0 on success, negative on failure
+ */
+int sender_chain_key_get_message_key_seed(sender_chain_key *key, uint8_t *seed);
 int sender_chain_key_create_next(sender_chain_key *key, sender_chain_key **next_key);
 signal_buffer *sender_chain_key_get_seed(sender_chain_key *key);
 void sender_chain_key_destroy(signal_type_base *type);
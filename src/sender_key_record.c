@@ -26,7 +26,7 @@ struct sender_key_record
 int sender_key_record_create(sender_key_record **record,
         signal_context *global_context)
 {
-    sender_key_record *result = malloc(sizeof(sender_key_record));
+    sender_key_record *result = signal_malloc(global_context, sizeof(sender_key_record));
     if(!result) {
         return SG_ERR_NOMEM;
     }
@@ -46,49 +46,47 @@ int sender_key_record_serialize(signal_buffer **buffer, sender_key_record *recor
     unsigned int i = 0;
     Textsecure__SenderKeyRecordStructure record_structure = TEXTSECURE__SENDER_KEY_RECORD_STRUCTURE__INIT;
     sender_key_state_node *cur_node = 0;
+    signal_arena arena;
     signal_buffer *result_buf = 0;
     uint8_t *data;
     size_t len;
 
+    signal_arena_init(&arena, record->global_context, 0);
+
     if(record->sender_key_states_head) {
         size_t count;
+        Textsecure__SenderKeyStateStructure *state_structures;
         DL_COUNT(record->sender_key_states_head, cur_node, count);
 
-        if(count > SIZE_MAX / sizeof(Textsecure__SenderKeyStateStructure *)) {
+        if(count > SIZE_MAX / sizeof(Textsecure__SenderKeyStateStructure)) {
             result = SG_ERR_NOMEM;
             goto complete;
         }
 
-        record_structure.senderkeystates = malloc(sizeof(Textsecure__SenderKeyStateStructure *) * count);
-        if(!record_structure.senderkeystates) {
+        record_structure.senderkeystates = signal_arena_alloc(&arena, sizeof(Textsecure__SenderKeyStateStructure *) * count);
+        state_structures = signal_arena_alloc(&arena, sizeof(Textsecure__SenderKeyStateStructure) * count);
+        if(!record_structure.senderkeystates || !state_structures) {
             result = SG_ERR_NOMEM;
             goto complete;
         }
 
         i = 0;
         DL_FOREACH(record->sender_key_states_head, cur_node) {
-            record_structure.senderkeystates[i] = malloc(sizeof(Textsecure__SenderKeyStateStructure));
-            if(!record_structure.senderkeystates[i]) {
-                result = SG_ERR_NOMEM;
-                break;
-            }
+            record_structure.senderkeystates[i] = &state_structures[i];
             textsecure__sender_key_state_structure__init(record_structure.senderkeystates[i]);
 
-            result = sender_key_state_serialize_prepare(cur_node->state, record_structure.senderkeystates[i]);
+            result = sender_key_state_serialize_prepare(cur_node->state, record_structure.senderkeystates[i], &arena);
             if(result < 0) {
-                break;
+                goto complete;
             }
             i++;
         }
         record_structure.n_senderkeystates = i;
-        if(result < 0) {
-            goto complete;
-        }
     }
 
     len = textsecure__sender_key_record_structure__get_packed_size(&record_structure);
 
-    result_buf = signal_buffer_alloc(len);
+    result_buf = signal_buffer_context_alloc(record->global_context, len);
     if(!result_buf) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -104,15 +102,7 @@ int sender_key_record_serialize(signal_buffer **buffer, sender_key_record *recor
     }
 
 complete:
-    if(record_structure.senderkeystates) {
-        for(i = 0; i < record_structure.n_senderkeystates; i++) {
-            if(record_structure.senderkeystates[i]) {
-                sender_key_state_serialize_prepare_free(record_structure.senderkeystates[i]);
-            }
-        }
-        free(record_structure.senderkeystates);
-    }
-
+    signal_arena_release(&arena);
     if(result >= 0) {
         *buffer = result_buf;
     }
@@ -124,8 +114,11 @@ int sender_key_record_deserialize(sender_key_record **record, const uint8_t *dat
     int result = 0;
     sender_key_record *result_record = 0;
     Textsecure__SenderKeyRecordStructure *record_structure = 0;
+    signal_arena arena;
+
+    signal_arena_init(&arena, global_context, len * SIGNAL_ARENA_UNPACK_SIZE_FACTOR);
 
-    record_structure = textsecure__sender_key_record_structure__unpack(0, len, data);
+    record_structure = textsecure__sender_key_record_structure__unpack(signal_arena_protobuf_allocator(&arena), len, data);
     if(!record_structure) {
         result = SG_ERR_INVALID_PROTO_BUF;
         goto complete;
@@ -146,7 +139,7 @@ int sender_key_record_deserialize(sender_key_record **record, const uint8_t *dat
                 goto complete;
             }
 
-            state_node = malloc(sizeof(sender_key_state_node));
+            state_node = signal_malloc(global_context, sizeof(sender_key_state_node));
             if(!state_node) {
                 result = SG_ERR_NOMEM;
                 goto complete;
@@ -158,9 +151,7 @@ int sender_key_record_deserialize(sender_key_record **record, const uint8_t *dat
     }
 
 complete:
-    if(record_structure) {
-        textsecure__sender_key_record_structure__free_unpacked(record_structure, 0);
-    }
+    signal_arena_release(&arena);
     if(result_record) {
         if(result < 0) {
             SIGNAL_UNREF(result_record);
@@ -279,7 +270,7 @@ static int sender_key_record_add_sender_key_state_impl(sender_key_record *record
         goto complete;
     }
 
-    state_node = malloc(sizeof(sender_key_state_node));
+    state_node = signal_malloc(record->global_context, sizeof(sender_key_state_node));
     if(!state_node) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -295,7 +286,7 @@ static int sender_key_record_add_sender_key_state_impl(sender_key_record *record
         if(state_node->state) {
             SIGNAL_UNREF(state_node->state);
         }
-        free(state_node);
+        signal_free(record->global_context, state_node);
         --count;
     }
 
@@ -328,7 +319,7 @@ int sender_key_record_set_sender_key_state(sender_key_record *record,
         if(cur_node->state) {
             SIGNAL_UNREF(cur_node->state);
         }
-        free(cur_node);
+        signal_free(record->global_context, cur_node);
     }
     record->sender_key_states_head = 0;
 
@@ -365,7 +356,7 @@ void sender_key_record_destroy(signal_type_base *type)
         if(cur_node->state) {
             SIGNAL_UNREF(cur_node->state);
         }
-        free(cur_node);
+        signal_free(record->global_context, cur_node);
     }
     record->sender_key_states_head = 0;
 
@@ -373,5 +364,5 @@ void sender_key_record_destroy(signal_type_base *type)
         signal_buffer_free(record->user_record);
     }
 
-    free(record);
+    signal_free(record->global_context, record);
 }
@@ -5,16 +5,18 @@
 #include <assert.h>
 
 #include "sender_key.h"
-#include "utlist.h"
+#include "message_key_ring.h"
+#include "message_key_checkpoints.h"
 #include "LocalStorageProtocol.pb-c.h"
 #include "signal_protocol_internal.h"
 
 #define MAX_MESSAGE_KEYS 2000
 
-typedef struct sender_message_key_node {
-    sender_message_key *key;
-    struct sender_message_key_node *prev, *next;
-} sender_message_key_node;
+/* Skipped message keys are kept as seeds, and only expanded when used */
+typedef struct sender_message_key_slot {
+    uint8_t seed_len;
+    uint8_t seed[SENDER_MESSAGE_KEY_SEED_LEN];
+} sender_message_key_slot;
 
 struct sender_key_state
 {
@@ -24,7 +26,8 @@ struct sender_key_state
     sender_chain_key *chain_key;
     ec_public_key *signature_public_key;
     ec_private_key *signature_private_key;
-    sender_message_key_node *message_keys_head;
+    message_key_ring *message_keys;
+    message_key_checkpoints *checkpoints;
 
     signal_context *global_context;
 };
@@ -40,7 +43,7 @@ int sender_key_state_create(sender_key_state **state,
         return SG_ERR_INVAL;
     }
 
-    result = malloc(sizeof(sender_key_state));
+    result = signal_malloc(global_context, sizeof(sender_key_state));
     if(!result) {
         return SG_ERR_NOMEM;
     }
@@ -72,31 +75,27 @@ int sender_key_state_serialize(signal_buffer **buffer, sender_key_state *state)
     size_t result_size = 0;
     uint8_t *data;
     size_t len;
-    Textsecure__SenderKeyStateStructure *state_structure = 0;
+    Textsecure__SenderKeyStateStructure state_structure = TEXTSECURE__SENDER_KEY_STATE_STRUCTURE__INIT;
+    signal_arena arena;
     signal_buffer *result_buf = 0;
 
-    state_structure = malloc(sizeof(Textsecure__SenderKeyStateStructure));
-    if(!state_structure) {
-        result = SG_ERR_NOMEM;
-        goto complete;
-    }
-    textsecure__sender_key_state_structure__init(state_structure);
+    signal_arena_init(&arena, state->global_context, 0);
 
-    result = sender_key_state_serialize_prepare(state, state_structure);
+    result = sender_key_state_serialize_prepare(state, &state_structure, &arena);
     if(result < 0) {
         goto complete;
     }
 
-    len = textsecure__sender_key_state_structure__get_packed_size(state_structure);
+    len = textsecure__sender_key_state_structure__get_packed_size(&state_structure);
 
-    result_buf = signal_buffer_alloc(len);
+    result_buf = signal_buffer_context_alloc(state->global_context, len);
     if(!result_buf) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
 
     data = signal_buffer_data(result_buf);
-    result_size = textsecure__sender_key_state_structure__pack(state_structure, data);
+    result_size = textsecure__sender_key_state_structure__pack(&state_structure, data);
     if(result_size != len) {
         signal_buffer_free(result_buf);
         result = SG_ERR_INVALID_PROTO_BUF;
@@ -105,9 +104,7 @@ int sender_key_state_serialize(signal_buffer **buffer, sender_key_state *state)
     }
 
 complete:
-    if(state_structure) {
-        sender_key_state_serialize_prepare_free(state_structure);
-    }
+    signal_arena_release(&arena);
     if(result >= 0) {
         *buffer = result_buf;
     }
@@ -119,8 +116,11 @@ int sender_key_state_deserialize(sender_key_state **state, const uint8_t *data,
     int result = 0;
     Textsecure__SenderKeyStateStructure *state_structure = 0;
     sender_key_state *result_state = 0;
+    signal_arena arena;
 
-    state_structure = textsecure__sender_key_state_structure__unpack(0, len, data);
+    signal_arena_init(&arena, global_context, len * SIGNAL_ARENA_UNPACK_SIZE_FACTOR);
+
+    state_structure = textsecure__sender_key_state_structure__unpack(signal_arena_protobuf_allocator(&arena), len, data);
     if(!state_structure) {
         result = SG_ERR_INVALID_PROTO_BUF;
         goto complete;
@@ -132,9 +132,7 @@ int sender_key_state_deserialize(sender_key_state **state, const uint8_t *data,
     }
 
 complete:
-    if(state_structure) {
-        textsecure__sender_key_state_structure__free_unpacked(state_structure, 0);
-    }
+    signal_arena_release(&arena);
     if(result_state) {
         if(result < 0) {
             SIGNAL_UNREF(result_state);
@@ -147,13 +145,12 @@ complete:
     return result;
 }
 
-int sender_key_state_serialize_prepare(sender_key_state *state, Textsecure__SenderKeyStateStructure *state_structure)
+int sender_key_state_serialize_prepare(sender_key_state *state, Textsecure__SenderKeyStateStructure *state_structure, signal_arena *arena)
 {
     int result = 0;
     size_t i = 0;
     Textsecure__SenderKeyStateStructure__SenderChainKey *chain_key_structure = 0;
     Textsecure__SenderKeyStateStructure__SenderSigningKey *signing_key_structure = 0;
-    sender_message_key_node *cur_node = 0;
     signal_buffer *chain_key_seed = 0;
 
     assert(state);
@@ -164,7 +161,7 @@ int sender_key_state_serialize_prepare(sender_key_state *state, Textsecure__Send
     state_structure->senderkeyid = state->key_id;
 
     /* Sender chain key */
-    chain_key_structure = malloc(sizeof(Textsecure__SenderKeyStateStructure__SenderChainKey));
+    chain_key_structure = signal_arena_alloc(arena, sizeof(Textsecure__SenderKeyStateStructure__SenderChainKey));
     if(!chain_key_structure) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -181,7 +178,7 @@ int sender_key_state_serialize_prepare(sender_key_state *state, Textsecure__Send
     chain_key_structure->has_seed = 1;
 
     /* Sender signing key */
-    signing_key_structure = malloc(sizeof(Textsecure__SenderKeyStateStructure__SenderSigningKey));
+    signing_key_structure = signal_arena_alloc(arena, sizeof(Textsecure__SenderKeyStateStructure__SenderSigningKey));
     if(!signing_key_structure) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -190,7 +187,7 @@ int sender_key_state_serialize_prepare(sender_key_state *state, Textsecure__Send
     state_structure->sendersigningkey = signing_key_structure;
 
     if(state->signature_public_key) {
-        result = ec_public_key_serialize_protobuf(&(signing_key_structure->public_), state->signature_public_key);
+        result = ec_public_key_serialize_protobuf(&(signing_key_structure->public_), state->signature_public_key, arena);
         if(result < 0) {
             goto complete;
         }
@@ -198,7 +195,7 @@ int sender_key_state_serialize_prepare(sender_key_state *state, Textsecure__Send
     }
 
     if(state->signature_private_key) {
-        result = ec_private_key_serialize_protobuf(&(signing_key_structure->private_), state->signature_private_key);
+        result = ec_private_key_serialize_protobuf(&(signing_key_structure->private_), state->signature_private_key, arena);
         if(result < 0) {
             goto complete;
         }
@@ -206,42 +203,38 @@ int sender_key_state_serialize_prepare(sender_key_state *state, Textsecure__Send
     }
 
     /* Sender message keys */
-    if(state->message_keys_head) {
-        size_t count;
-        DL_COUNT(state->message_keys_head, cur_node, count);
+    if(state->message_keys && message_key_ring_count(state->message_keys) > 0) {
+        size_t count = message_key_ring_count(state->message_keys);
+        size_t iterator = 0;
+        uint32_t iteration = 0;
+        sender_message_key_slot *slot;
 
         if(count > SIZE_MAX / sizeof(Textsecure__SenderKeyStateStructure__SenderMessageKey *)) {
             result = SG_ERR_NOMEM;
             goto complete;
         }
 
-        state_structure->sendermessagekeys = malloc(sizeof(Textsecure__SenderKeyStateStructure__SenderMessageKey *) * count);
+        state_structure->sendermessagekeys = signal_arena_alloc(arena, sizeof(Textsecure__SenderKeyStateStructure__SenderMessageKey *) * count);
         if(!state_structure->sendermessagekeys) {
             result = SG_ERR_NOMEM;
             goto complete;
         }
 
         i = 0;
-        DL_FOREACH(state->message_keys_head, cur_node) {
-            signal_buffer *seed = 0;
-            state_structure->sendermessagekeys[i] = malloc(sizeof(Textsecure__SenderKeyStateStructure__SenderMessageKey));
+        while((slot = message_key_ring_next(state->message_keys, &iterator, &iteration)) != 0) {
+            state_structure->sendermessagekeys[i] = signal_arena_alloc(arena, sizeof(Textsecure__SenderKeyStateStructure__SenderMessageKey));
             if(!state_structure->sendermessagekeys[i]) {
                 result = SG_ERR_NOMEM;
                 break;
             }
             textsecure__sender_key_state_structure__sender_message_key__init(state_structure->sendermessagekeys[i]);
 
-            state_structure->sendermessagekeys[i]->iteration = sender_message_key_get_iteration(cur_node->key);
+            state_structure->sendermessagekeys[i]->iteration = iteration;
             state_structure->sendermessagekeys[i]->has_iteration = 1;
 
-            seed = sender_message_key_get_seed(cur_node->key);
-            state_structure->sendermessagekeys[i]->seed.data = signal_buffer_data(seed);
-            state_structure->sendermessagekeys[i]->seed.len = signal_buffer_len(seed);
+            state_structure->sendermessagekeys[i]->seed.data = slot->seed;
+            state_structure->sendermessagekeys[i]->seed.len = slot->seed_len;
             state_structure->sendermessagekeys[i]->has_seed = 1;
-
-            if(result < 0) {
-                break;
-            }
             i++;
         }
         state_structure->n_sendermessagekeys = i;
@@ -250,35 +243,49 @@ int sender_key_state_serialize_prepare(sender_key_state *state, Textsecure__Send
         }
     }
 
-complete:
-    return result;
-}
+    /* Sender message key checkpoints, referenced rather than copied */
+    if(state->checkpoints && message_key_checkpoints_count(state->checkpoints) > 0) {
+        size_t count = message_key_checkpoints_get_checkpoint_count(state->checkpoints);
+        const uint8_t *bitmap;
+        size_t bitmap_len;
 
-void sender_key_state_serialize_prepare_free(Textsecure__SenderKeyStateStructure *state_structure)
-{
-    unsigned int i = 0;
-    if(state_structure->senderchainkey) {
-        free(state_structure->senderchainkey);
-    }
-    if(state_structure->sendersigningkey) {
-        if(state_structure->sendersigningkey->public_.data) {
-            free(state_structure->sendersigningkey->public_.data);
+        if(count > SIZE_MAX / sizeof(Textsecure__SenderKeyStateStructure__SenderChainKey *)) {
+            result = SG_ERR_NOMEM;
+            goto complete;
         }
-        if(state_structure->sendersigningkey->private_.data) {
-            free(state_structure->sendersigningkey->private_.data);
+
+        state_structure->senderchainkeycheckpoints = signal_arena_alloc(arena, sizeof(Textsecure__SenderKeyStateStructure__SenderChainKey *) * count);
+        if(!state_structure->senderchainkeycheckpoints) {
+            result = SG_ERR_NOMEM;
+            goto complete;
         }
-        free(state_structure->sendersigningkey);
-    }
 
-    if(state_structure->sendermessagekeys) {
-        for(i = 0; i < state_structure->n_sendermessagekeys; i++) {
-            if(state_structure->sendermessagekeys[i]) {
-                free(state_structure->sendermessagekeys[i]);
+        for(i = 0; i < count; i++) {
+            Textsecure__SenderKeyStateStructure__SenderChainKey *checkpoint_structure =
+                    signal_arena_alloc(arena, sizeof(Textsecure__SenderKeyStateStructure__SenderChainKey));
+            if(!checkpoint_structure) {
+                result = SG_ERR_NOMEM;
+                goto complete;
             }
+            textsecure__sender_key_state_structure__sender_chain_key__init(checkpoint_structure);
+            state_structure->senderchainkeycheckpoints[i] = checkpoint_structure;
+            state_structure->n_senderchainkeycheckpoints++;
+
+            checkpoint_structure->seed.data = (uint8_t *)message_key_checkpoints_get_checkpoint(
+                    state->checkpoints, i, &checkpoint_structure->iteration);
+            checkpoint_structure->seed.len = MESSAGE_KEY_CHECKPOINT_KEY_LENGTH;
+            checkpoint_structure->has_seed = 1;
+            checkpoint_structure->has_iteration = 1;
         }
-        free(state_structure->sendermessagekeys);
+
+        bitmap = message_key_checkpoints_get_bitmap(state->checkpoints, &bitmap_len);
+        state_structure->skippedmessagekeys.data = (uint8_t *)bitmap;
+        state_structure->skippedmessagekeys.len = bitmap_len;
+        state_structure->has_skippedmessagekeys = 1;
     }
-    free(state_structure);
+
+complete:
+    return result;
 }
 
 int sender_key_state_deserialize_protobuf(sender_key_state **state, Textsecure__SenderKeyStateStructure *state_structure, signal_context *global_context)
@@ -292,7 +299,7 @@ int sender_key_state_deserialize_protobuf(sender_key_state **state, Textsecure__
     if(state_structure->senderchainkey
             && state_structure->senderchainkey->has_iteration
             && state_structure->senderchainkey->has_seed) {
-        signal_buffer *seed_buffer = signal_buffer_create(
+        signal_buffer *seed_buffer = signal_buffer_context_create(global_context,
                 state_structure->senderchainkey->seed.data,
                 state_structure->senderchainkey->seed.len);
         if(!seed_buffer) {
@@ -343,8 +350,6 @@ int sender_key_state_deserialize_protobuf(sender_key_state **state, Textsecure__
 
         if(state_structure->n_sendermessagekeys > 0) {
             for(i = 0; i < state_structure->n_sendermessagekeys; i++) {
-                signal_buffer *seed_buffer;
-                sender_message_key *message_key;
                 Textsecure__SenderKeyStateStructure__SenderMessageKey *message_key_structure =
                         state_structure->sendermessagekeys[i];
 
@@ -352,27 +357,46 @@ int sender_key_state_deserialize_protobuf(sender_key_state **state, Textsecure__
                     continue;
                 }
 
-                seed_buffer = signal_buffer_create(
+                result = sender_key_state_add_sender_message_key_seed(result_state,
+                        message_key_structure->iteration,
                         message_key_structure->seed.data,
                         message_key_structure->seed.len);
-                if(!seed_buffer) {
-                    result = SG_ERR_NOMEM;
+                if(result < 0) {
                     goto complete;
                 }
+            }
+        }
 
-                result = sender_message_key_create(&message_key,
-                        message_key_structure->iteration, seed_buffer,
-                        global_context);
-                signal_buffer_free(seed_buffer);
+        if(state_structure->n_senderchainkeycheckpoints > 0) {
+            uint32_t interval = global_context->skipped_key_checkpoint_interval;
+            result = message_key_checkpoints_create(&result_state->checkpoints,
+                    interval > 0 ? interval : MESSAGE_KEY_CHECKPOINTS_MAX_INTERVAL,
+                    MAX_MESSAGE_KEYS, global_context);
+            if(result < 0) {
+                goto complete;
+            }
+            for(i = 0; i < state_structure->n_senderchainkeycheckpoints; i++) {
+                Textsecure__SenderKeyStateStructure__SenderChainKey *checkpoint_structure =
+                        state_structure->senderchainkeycheckpoints[i];
+
+                if(!checkpoint_structure->has_iteration || !checkpoint_structure->has_seed) {
+                    result = SG_ERR_INVALID_PROTO_BUF;
+                    goto complete;
+                }
+                result = message_key_checkpoints_load_checkpoint(result_state->checkpoints,
+                        checkpoint_structure->iteration,
+                        checkpoint_structure->seed.data, checkpoint_structure->seed.len);
                 if(result < 0) {
                     goto complete;
                 }
-
-                result = sender_key_state_add_sender_message_key(result_state, message_key);
+            }
+            if(state_structure->has_skippedmessagekeys) {
+                result = message_key_checkpoints_load_bitmap(result_state->checkpoints,
+                        state_structure->skippedmessagekeys.data,
+                        state_structure->skippedmessagekeys.len);
                 if(result < 0) {
                     goto complete;
                 }
-                SIGNAL_UNREF(message_key);
             }
         }
     }
@@ -469,88 +493,151 @@ ec_private_key *sender_key_state_get_signing_key_private(sender_key_state *state
 
 int sender_key_state_has_sender_message_key(sender_key_state *state, uint32_t iteration)
 {
-    sender_message_key_node *cur_node = 0;
     assert(state);
 
-    DL_FOREACH(state->message_keys_head, cur_node) {
-        if(sender_message_key_get_iteration(cur_node->key) == iteration) {
-            return 1;
-        }
+    if(state->message_keys && message_key_ring_find(state->message_keys, iteration)) {
+        return 1;
+    }
+    if(state->checkpoints && message_key_checkpoints_contains(state->checkpoints, iteration)) {
+        return 1;
     }
-
     return 0;
 }
 
 int sender_key_state_add_sender_message_key(sender_key_state *state, sender_message_key *message_key)
 {
-    int result = 0;
-    sender_message_key_node *node = 0;
-    int count;
+    signal_buffer *seed = 0;
     assert(state);
     assert(message_key);
 
-    node = malloc(sizeof(sender_message_key_node));
-    if(!node) {
-        result = SG_ERR_NOMEM;
-        goto complete;
-    }
+    seed = sender_message_key_get_seed(message_key);
+    return sender_key_state_add_sender_message_key_seed(state,
+            sender_message_key_get_iteration(message_key),
+            signal_buffer_data(seed), signal_buffer_len(seed));
+}
+
+int sender_key_state_add_sender_message_key_seed(sender_key_state *state,
+        uint32_t iteration, const uint8_t *seed, size_t seed_len)
+{
+    int result = 0;
+    sender_message_key_slot slot;
+    assert(state);
+    assert(seed);
 
-    SIGNAL_REF(message_key);
-    node->key = message_key;
-    DL_APPEND(state->message_keys_head, node);
+    if(seed_len > SENDER_MESSAGE_KEY_SEED_LEN) {
+        return SG_ERR_INVALID_KEY;
+    }
 
-    DL_COUNT(state->message_keys_head, node, count);
-    while(count > MAX_MESSAGE_KEYS) {
-        node = state->message_keys_head;
-        DL_DELETE(state->message_keys_head, node);
-        if(node->key) {
-            SIGNAL_UNREF(node->key);
+    if(!state->message_keys) {
+        result = message_key_ring_create(&state->message_keys,
+                sizeof(sender_message_key_slot), MAX_MESSAGE_KEYS, state->global_context);
+        if(result < 0) {
+            return result;
         }
-        free(node);
-        --count;
     }
 
-complete:
+    memset(&slot, 0, sizeof(slot));
+    slot.seed_len = (uint8_t)seed_len;
+    memcpy(slot.seed, seed, seed_len);
+
+    result = message_key_ring_push(state->message_keys, iteration, &slot);
+    signal_explicit_bzero(&slot, sizeof(slot));
     return result;
 }
 
 sender_message_key *sender_key_state_remove_sender_message_key(sender_key_state *state, uint32_t iteration)
 {
     sender_message_key *result = 0;
-    sender_message_key_node *cur_node = 0;
-    sender_message_key_node *tmp_node = 0;
+    sender_message_key_slot *slot = 0;
+    assert(state);
+
+    if(state->message_keys) {
+        slot = message_key_ring_find(state->message_keys, iteration);
+    }
+    if(!slot) {
+        if(state->checkpoints && message_key_checkpoints_contains(state->checkpoints, iteration)) {
+            uint8_t chain_key[MESSAGE_KEY_CHECKPOINT_KEY_LENGTH];
+            if(message_key_checkpoints_take(state->checkpoints, iteration, chain_key) == 1) {
+                sender_message_key_create_from_chain_key(&result, iteration,
+                        chain_key, sizeof(chain_key), state->global_context);
+            }
+            signal_explicit_bzero(chain_key, sizeof(chain_key));
+        }
+        return result;
+    }
+
+    /* Only drop the seed once the key has been expanded */
+    if(sender_message_key_create_from_seed(&result, iteration,
+            slot->seed, slot->seed_len, state->global_context) < 0) {
+        return 0;
+    }
+    message_key_ring_remove(state->message_keys, iteration, 0);
+
+    return result;
+}
+
+int sender_key_state_skip_sender_message_keys(sender_key_state *state, uint32_t iteration)
+{
+    int result = 0;
+    signal_buffer *seed = 0;
+    signal_buffer *next_seed = 0;
+    sender_chain_key *next_chain_key = 0;
+    uint8_t chain_key[MESSAGE_KEY_CHECKPOINT_KEY_LENGTH];
+
     assert(state);
+    assert(state->global_context->skipped_key_checkpoint_interval > 0);
+
+    seed = sender_chain_key_get_seed(state->chain_key);
+    if(signal_buffer_len(seed) != sizeof(chain_key)) {
+        result = SG_ERR_INVALID_KEY;
+        goto complete;
+    }
+    memcpy(chain_key, signal_buffer_data(seed), sizeof(chain_key));
 
-    DL_FOREACH_SAFE(state->message_keys_head, cur_node, tmp_node) {
-        if(sender_message_key_get_iteration(cur_node->key) == iteration) {
-            DL_DELETE(state->message_keys_head, cur_node);
-            result = cur_node->key;
-            free(cur_node);
-            break;
+    if(!state->checkpoints) {
+        result = message_key_checkpoints_create(&state->checkpoints,
+                state->global_context->skipped_key_checkpoint_interval,
+                MAX_MESSAGE_KEYS, state->global_context);
+        if(result < 0) {
+            goto complete;
         }
     }
 
+    result = message_key_checkpoints_skip(state->checkpoints, chain_key,
+            sender_chain_key_get_iteration(state->chain_key), iteration);
+    if(result < 0) {
+        goto complete;
+    }
+
+    next_seed = signal_buffer_context_create(state->global_context, chain_key, sizeof(chain_key));
+    if(!next_seed) {
+        result = SG_ERR_NOMEM;
+        goto complete;
+    }
+
+    result = sender_chain_key_create(&next_chain_key, iteration, next_seed, state->global_context);
+    if(result < 0) {
+        goto complete;
+    }
+    sender_key_state_set_chain_key(state, next_chain_key);
+
+complete:
+    signal_explicit_bzero(chain_key, sizeof(chain_key));
+    signal_buffer_bzero_free(next_seed);
+    SIGNAL_UNREF(next_chain_key);
     return result;
 }
 
 void sender_key_state_destroy(signal_type_base *type)
 {
     sender_key_state *state = (sender_key_state *)type;
-    sender_message_key_node *cur_node;
-    sender_message_key_node *tmp_node;
 
     SIGNAL_UNREF(state->chain_key);
     SIGNAL_UNREF(state->signature_public_key);
     SIGNAL_UNREF(state->signature_private_key);
 
-    DL_FOREACH_SAFE(state->message_keys_head, cur_node, tmp_node) {
-        DL_DELETE(state->message_keys_head, cur_node);
-        if(cur_node->key) {
-            SIGNAL_UNREF(cur_node->key);
-        }
-        free(cur_node);
-    }
-    state->message_keys_head = 0;
+    SIGNAL_UNREF(state->message_keys);
+    SIGNAL_UNREF(state->checkpoints);
 
-    free(state);
+    signal_free(state->global_context, state);
 }
@@ -23,6 +23,23 @@ ec_public_key *sender_key_state_get_signing_key_public(sender_key_state *state);
 ec_private_key *sender_key_state_get_signing_key_private(sender_key_state *state);
 int sender_key_state_has_sender_message_key(sender_key_state *state, uint32_t iteration);
 int sender_key_state_add_sender_message_key(sender_key_state *state, sender_message_key *message_key);
+
+/**
+ * Store the seed of a skipped message key, evicting the oldest stored key
+ * once the state holds the maximum number of skipped keys.
+ *
+ * @return 0 on success, negative on failure
+ */
+int sender_key_state_add_sender_message_key_seed(sender_key_state *state,
+        uint32_t iteration, const uint8_t *seed, size_t seed_len);
+
+/**
+ * Advance the chain key of the state to the given iteration, recording the
+ * skipped iterations as chain key checkpoints instead of storing their keys.
+ *
+ * @return 0 on success, negative on failure
+ */
+int sender_key_state_skip_sender_message_keys(sender_key_state *state, uint32_t iteration);
 sender_message_key *sender_key_state_remove_sender_message_key(sender_key_state *state, uint32_t iteration);
 
 void sender_key_state_destroy(signal_type_base *type);
@@ -20,6 +20,8 @@ struct session_builder
 
 static int session_builder_process_pre_key_signal_message_v3(session_builder *builder,
         session_record *record, pre_key_signal_message *message, uint32_t *unsigned_pre_key_id);
+static int session_builder_process_pre_key_bundle_verified(session_builder *builder,
+        session_pre_key_bundle *bundle, const int *signature_result);
 
 int session_builder_create(session_builder **builder,
         signal_protocol_store_context *store, const signal_protocol_address *remote_address,
@@ -30,7 +32,7 @@ int session_builder_create(session_builder **builder,
     assert(store);
     assert(global_context);
 
-    result = malloc(sizeof(session_builder));
+    result = signal_malloc(global_context, sizeof(session_builder));
     if(!result) {
         return SG_ERR_NOMEM;
     }
@@ -189,6 +191,81 @@ complete:
 }
 
 int session_builder_process_pre_key_bundle(session_builder *builder, session_pre_key_bundle *bundle)
+{
+    return session_builder_process_pre_key_bundle_verified(builder, bundle, 0);
+}
+
+int session_builder_process_pre_key_bundles(signal_protocol_store_context *store,
+        const signal_protocol_address *addresses, session_pre_key_bundle **bundles, size_t count,
+        int *results, signal_context *global_context)
+{
+    int result = 0;
+    curve_signature_batch_entry *entries = 0;
+    size_t entry_count = 0;
+    size_t i;
+
+    assert(store);
+    assert(global_context);
+
+    if(count == 0) {
+        return 0;
+    }
+
+    entries = signal_malloc(global_context, sizeof(curve_signature_batch_entry) * count);
+    if(!entries) {
+        return SG_ERR_NOMEM;
+    }
+
+    for(i = 0; i < count; i++) {
+        ec_public_key *signed_pre_key = session_pre_key_bundle_get_signed_pre_key(bundles[i]);
+        signal_buffer *signature = session_pre_key_bundle_get_signed_pre_key_signature(bundles[i]);
+        if(!signed_pre_key) {
+            continue;
+        }
+        entries[entry_count].signing_key = session_pre_key_bundle_get_identity_key(bundles[i]);
+        entries[entry_count].message_data = ec_public_key_get_serialized(signed_pre_key);
+        entries[entry_count].message_len = EC_PUBLIC_KEY_SERIALIZED_LENGTH;
+        entries[entry_count].signature_data = signal_buffer_data(signature);
+        entries[entry_count].signature_len = signal_buffer_len(signature);
+        entry_count++;
+    }
+
+    result = curve_verify_signature_batch(global_context, entries, entry_count);
+    if(result < 0) {
+        goto complete;
+    }
+    result = 0;
+
+    entry_count = 0;
+    for(i = 0; i < count; i++) {
+        session_builder builder;
+        const int *signature_result = 0;
+        int bundle_result;
+
+        builder.store = store;
+        builder.remote_address = &addresses[i];
+        builder.global_context = global_context;
+
+        if(session_pre_key_bundle_get_signed_pre_key(bundles[i])) {
+            signature_result = &entries[entry_count++].result;
+        }
+
+        bundle_result = session_builder_process_pre_key_bundle_verified(&builder, bundles[i], signature_result);
+        if(results) {
+            results[i] = bundle_result;
+        }
+        if(bundle_result < 0 && result == 0) {
+            result = bundle_result;
+        }
+    }
+
+complete:
+    signal_free(global_context, entries);
+    return result;
+}
+
+static int session_builder_process_pre_key_bundle_verified(session_builder *builder,
+        session_pre_key_bundle *bundle, const int *signature_result)
 {
     int result = 0;
     session_record *record = 0;
@@ -208,7 +285,7 @@ int session_builder_process_pre_key_bundle(session_builder *builder, session_pre
     assert(builder);
     assert(builder->store);
     assert(bundle);
-    signal_lock(builder->global_context);
+    signal_lock_address(builder->global_context, builder->remote_address, SG_LOCK_WRITE);
 
     result = signal_protocol_identity_is_trusted_identity(builder->store,
             builder->remote_address,
@@ -228,19 +305,16 @@ int session_builder_process_pre_key_bundle(session_builder *builder, session_pre
         ec_public_key *identity_key = session_pre_key_bundle_get_identity_key(bundle);
         signal_buffer *signature = session_pre_key_bundle_get_signed_pre_key_signature(bundle);
 
-        signal_buffer *serialized_signed_pre_key = 0;
-        result = ec_public_key_serialize(&serialized_signed_pre_key, signed_pre_key);
-        if(result < 0) {
-            goto complete;
+        if(signature_result) {
+            result = *signature_result;
+        }
+        else {
+            result = curve_verify_signature(identity_key,
+                    ec_public_key_get_serialized(signed_pre_key),
+                    EC_PUBLIC_KEY_SERIALIZED_LENGTH,
+                    signal_buffer_data(signature),
+                    signal_buffer_len(signature));
         }
-
-        result = curve_verify_signature(identity_key,
-                signal_buffer_data(serialized_signed_pre_key),
-                signal_buffer_len(serialized_signed_pre_key),
-                signal_buffer_data(signature),
-                signal_buffer_len(signature));
-
-        signal_buffer_free(serialized_signed_pre_key);
 
         if(result == 0) {
             signal_log(builder->global_context, SG_LOG_WARNING, "invalid signature on device key!");
@@ -262,7 +336,7 @@ int session_builder_process_pre_key_bundle(session_builder *builder, session_pre
         goto complete;
     }
 
-    result = curve_generate_key_pair(builder->global_context, &our_base_key);
+    result = signal_generate_ephemeral_key_pair(builder->global_context, &our_base_key);
     if(result < 0) {
         goto complete;
     }
@@ -340,13 +414,13 @@ complete:
     SIGNAL_UNREF(our_base_key);
     SIGNAL_UNREF(our_identity_key);
     SIGNAL_UNREF(parameters);
-    signal_unlock(builder->global_context);
+    signal_unlock_address(builder->global_context, builder->remote_address, SG_LOCK_WRITE);
     return result;
 }
 
 void session_builder_free(session_builder *builder)
 {
     if(builder) {
-        free(builder);
+        signal_free(builder->global_context, builder);
     }
 }
@@ -51,6 +51,30 @@ int session_builder_create(session_builder **builder,
  */
 int session_builder_process_pre_key_bundle(session_builder *builder, session_pre_key_bundle *bundle);
 
+/**
+ * Build new sessions from several pre key bundles retrieved from a server,
+ * such as those for all of a recipient's devices.
+ *
+ * The signed pre key signatures of all bundles are verified together,
+ * which is considerably cheaper than verifying them one at a time. Each
+ * bundle is then processed as session_builder_process_pre_key_bundle()
+ * would, and a bundle that fails does not stop the others.
+ *
+ * @param store the signal_protocol_store_context to store all state information in
+ * @param addresses array of count remote addresses, one per bundle
+ * @param bundles array of count pre key bundles
+ * @param count number of bundles
+ * @param results Optional caller provided array of count entries, each set
+ *     to what session_builder_process_pre_key_bundle() returns for the
+ *     bundle at the same index
+ * @param global_context the global library context
+ * @return SG_SUCCESS if every bundle was processed, otherwise the first
+ *     error from a bundle or negative on failure
+ */
+int session_builder_process_pre_key_bundles(signal_protocol_store_context *store,
+        const signal_protocol_address *addresses, session_pre_key_bundle **bundles, size_t count,
+        int *results, signal_context *global_context);
+
 void session_builder_free(session_builder *builder);
 
 #ifdef __cplusplus
@@ -21,8 +21,15 @@ struct session_cipher
     void *user_data;
 };
 
+static int session_cipher_encrypt_record(signal_context *global_context,
+        session_record *record,
+        const uint8_t *padded_message, size_t padded_message_len,
+        ciphertext_message **encrypted_message);
 static int session_cipher_decrypt_from_record_and_signal_message(session_cipher *cipher,
         session_record *record, signal_message *ciphertext, signal_buffer **plaintext);
+static int session_cipher_decrypt_from_previous_state(session_cipher *cipher,
+        session_record *record, session_record_state_node *node,
+        signal_message *ciphertext, signal_buffer **plaintext);
 static int session_cipher_decrypt_from_state_and_signal_message(session_cipher *cipher,
         session_state *state, signal_message *ciphertext, signal_buffer **plaintext);
 
@@ -34,11 +41,11 @@ static int session_cipher_get_or_create_message_keys(ratchet_message_keys *messa
         ratchet_chain_key *chain_key, uint32_t counter,
         signal_context *global_context);
 
-static int session_cipher_get_ciphertext(session_cipher *cipher,
+static int session_cipher_get_ciphertext(signal_context *global_context,
         signal_buffer **ciphertext,
         uint32_t version, ratchet_message_keys *message_keys,
         const uint8_t *plaintext, size_t plaintext_len);
-static int session_cipher_get_plaintext(session_cipher *cipher,
+static int session_cipher_get_plaintext(signal_context *global_context,
         signal_buffer **plaintext,
         uint32_t version, ratchet_message_keys *message_keys,
         const uint8_t *ciphertext, size_t ciphertext_len);
@@ -61,7 +68,7 @@ int session_cipher_create(session_cipher **cipher,
         return result;
     }
 
-    result_cipher = malloc(sizeof(session_cipher));
+    result_cipher = signal_malloc(global_context, sizeof(session_cipher));
     if(!result_cipher) {
         return SG_ERR_NOMEM;
     }
@@ -95,12 +102,12 @@ void session_cipher_set_decryption_callback(session_cipher *cipher,
     cipher->decrypt_callback = callback;
 }
 
-int session_cipher_encrypt(session_cipher *cipher,
+static int session_cipher_encrypt_record(signal_context *global_context,
+        session_record *record,
         const uint8_t *padded_message, size_t padded_message_len,
         ciphertext_message **encrypted_message)
 {
     int result = 0;
-    session_record *record = 0;
     session_state *state = 0;
     ratchet_chain_key *chain_key = 0;
     ratchet_chain_key *next_chain_key = 0;
@@ -117,18 +124,7 @@ int session_cipher_encrypt(session_cipher *cipher,
     uint8_t *ciphertext_data = 0;
     size_t ciphertext_len = 0;
 
-    assert(cipher);
-    signal_lock(cipher->global_context);
-
-    if(cipher->inside_callback == 1) {
-        result = SG_ERR_INVAL;
-        goto complete;
-    }
-
-    result = signal_protocol_session_load_session(cipher->store, &record, cipher->remote_address);
-    if(result < 0) {
-        goto complete;
-    }
+    memset(&message_keys, 0, sizeof(ratchet_message_keys));
 
     state = session_record_get_state(record);
     if(!state) {
@@ -142,7 +138,12 @@ int session_cipher_encrypt(session_cipher *cipher,
         goto complete;
     }
 
-    result = ratchet_chain_key_get_message_keys(chain_key, &message_keys);
+    result = ratchet_chain_key_copy(&next_chain_key, chain_key);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = ratchet_chain_key_step(next_chain_key, &message_keys);
     if(result < 0) {
         goto complete;
     }
@@ -156,7 +157,7 @@ int session_cipher_encrypt(session_cipher *cipher,
     previous_counter = session_state_get_previous_counter(state);
     session_version = session_state_get_session_version(state);
 
-    result = session_cipher_get_ciphertext(cipher,
+    result = session_cipher_get_ciphertext(global_context,
             &ciphertext,
             session_version, &message_keys,
             padded_message, padded_message_len);
@@ -187,7 +188,7 @@ int session_cipher_encrypt(session_cipher *cipher,
             chain_key_index, previous_counter,
             ciphertext_data, ciphertext_len,
             local_identity_key, remote_identity_key,
-            cipher->global_context);
+            global_context);
     if(result < 0) {
         goto complete;
     }
@@ -215,7 +216,7 @@ int session_cipher_encrypt(session_cipher *cipher,
                 session_version, local_registration_id, (has_pre_key_id ? &pre_key_id : 0),
                 signed_pre_key_id, base_key, local_identity_key,
                 message,
-                cipher->global_context);
+                global_context);
         if(result < 0) {
             goto complete;
         }
@@ -223,17 +224,7 @@ int session_cipher_encrypt(session_cipher *cipher,
         message = 0;
     }
 
-    result = ratchet_chain_key_create_next(chain_key, &next_chain_key);
-    if(result < 0) {
-        goto complete;
-    }
-
     result = session_state_set_sender_chain_key(state, next_chain_key);
-    if(result < 0) {
-        goto complete;
-    }
-
-    result = signal_protocol_session_store_session(cipher->store, cipher->remote_address, record);
 
 complete:
     if(result >= 0) {
@@ -250,9 +241,117 @@ complete:
     }
     signal_buffer_free(ciphertext);
     SIGNAL_UNREF(next_chain_key);
-    SIGNAL_UNREF(record);
     signal_explicit_bzero(&message_keys, sizeof(ratchet_message_keys));
-    signal_unlock(cipher->global_context);
+    return result;
+}
+
+int session_cipher_encrypt(session_cipher *cipher,
+        const uint8_t *padded_message, size_t padded_message_len,
+        ciphertext_message **encrypted_message)
+{
+    int result = 0;
+    session_record *record = 0;
+    ciphertext_message *result_message = 0;
+
+    assert(cipher);
+
+    /* Checked first, since the decryption calling back holds the address lock */
+    if(cipher->inside_callback == 1) {
+        return SG_ERR_INVAL;
+    }
+
+    signal_lock_address(cipher->global_context, cipher->remote_address, SG_LOCK_WRITE);
+
+    result = signal_protocol_session_load_session(cipher->store, &record, cipher->remote_address);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = session_cipher_encrypt_record(cipher->global_context, record,
+            padded_message, padded_message_len, &result_message);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = signal_protocol_session_store_session(cipher->store, cipher->remote_address, record);
+
+complete:
+    if(result >= 0) {
+        *encrypted_message = result_message;
+    }
+    else {
+        SIGNAL_UNREF(result_message);
+    }
+    SIGNAL_UNREF(record);
+    signal_unlock_address(cipher->global_context, cipher->remote_address, SG_LOCK_WRITE);
+    return result;
+}
+
+int session_cipher_encrypt_batch(signal_protocol_store_context *store,
+        const signal_protocol_address *addresses, size_t count,
+        const uint8_t *padded_message, size_t padded_message_len,
+        ciphertext_message **encrypted_messages,
+        signal_context *global_context)
+{
+    int result = 0;
+    session_record **records = 0;
+    const signal_protocol_address **lock_order = 0;
+    size_t i;
+
+    assert(store);
+    assert(global_context);
+
+    if(count == 0) {
+        return 0;
+    }
+    assert(addresses);
+    assert(encrypted_messages);
+
+    if(count > SIZE_MAX / sizeof(session_record *)) {
+        return SG_ERR_NOMEM;
+    }
+    memset(encrypted_messages, 0, sizeof(ciphertext_message *) * count);
+
+    records = signal_malloc(global_context, sizeof(session_record *) * count);
+    lock_order = signal_malloc(global_context, sizeof(const signal_protocol_address *) * count);
+    if(!records || !lock_order) {
+        signal_free(global_context, records);
+        signal_free(global_context, lock_order);
+        return SG_ERR_NOMEM;
+    }
+    memset(records, 0, sizeof(session_record *) * count);
+    for(i = 0; i < count; i++) {
+        lock_order[i] = &addresses[i];
+    }
+
+    signal_lock_addresses(global_context, lock_order, count, SG_LOCK_WRITE);
+
+    result = signal_protocol_session_load_sessions(store, records, addresses, count);
+    if(result < 0) {
+        goto complete;
+    }
+
+    for(i = 0; i < count; i++) {
+        result = session_cipher_encrypt_record(global_context, records[i],
+                padded_message, padded_message_len, &encrypted_messages[i]);
+        if(result < 0) {
+            goto complete;
+        }
+    }
+
+    result = signal_protocol_session_store_sessions(store, addresses, records, count);
+
+complete:
+    for(i = 0; i < count; i++) {
+        if(result < 0) {
+            SIGNAL_UNREF(encrypted_messages[i]);
+            encrypted_messages[i] = 0;
+        }
+        SIGNAL_UNREF(records[i]);
+    }
+    signal_free(global_context, records);
+    signal_unlock_addresses(global_context, lock_order, count, SG_LOCK_WRITE);
+    signal_free(global_context, lock_order);
     return result;
 }
 
@@ -267,13 +366,14 @@ int session_cipher_decrypt_pre_key_signal_message(session_cipher *cipher,
     uint32_t unsigned_pre_key_id = 0;
 
     assert(cipher);
-    signal_lock(cipher->global_context);
 
+    /* Checked first, since the decryption calling back holds the address lock */
     if(cipher->inside_callback == 1) {
-        result = SG_ERR_INVAL;
-        goto complete;
+        return SG_ERR_INVAL;
     }
 
+    signal_lock_address(cipher->global_context, cipher->remote_address, SG_LOCK_WRITE);
+
     result = signal_protocol_session_load_session(cipher->store, &record, cipher->remote_address);
     if(result < 0) {
         goto complete;
@@ -317,7 +417,7 @@ complete:
     else {
         signal_buffer_free(result_buf);
     }
-    signal_unlock(cipher->global_context);
+    signal_unlock_address(cipher->global_context, cipher->remote_address, SG_LOCK_WRITE);
     return result;
 }
 
@@ -330,13 +430,14 @@ int session_cipher_decrypt_signal_message(session_cipher *cipher,
     session_record *record = 0;
 
     assert(cipher);
-    signal_lock(cipher->global_context);
 
+    /* Checked first, since the decryption calling back holds the address lock */
     if(cipher->inside_callback == 1) {
-        result = SG_ERR_INVAL;
-        goto complete;
+        return SG_ERR_INVAL;
     }
 
+    signal_lock_address(cipher->global_context, cipher->remote_address, SG_LOCK_WRITE);
+
     result = signal_protocol_session_contains_session(cipher->store, cipher->remote_address);
     if(result == 0) {
         signal_log(cipher->global_context, SG_LOG_WARNING, "No session for: %s:%d", cipher->remote_address->name, cipher->remote_address->device_id);
@@ -375,7 +476,44 @@ complete:
     else {
         signal_buffer_free(result_buf);
     }
-    signal_unlock(cipher->global_context);
+    signal_unlock_address(cipher->global_context, cipher->remote_address, SG_LOCK_WRITE);
+    return result;
+}
+
+/*
+ * Archived states are loaded without being kept decoded in the record, so
+ * that those which fail to decrypt the message are left untouched. The
+ * state that decrypts it is promoted to be the current state.
+ */
+static int session_cipher_decrypt_from_previous_state(session_cipher *cipher,
+        session_record *record, session_record_state_node *node,
+        signal_message *ciphertext, signal_buffer **plaintext)
+{
+    int result = 0;
+    session_state *state = 0;
+
+    result = session_record_load_previous_states_element(node, &state);
+    if(result < 0) {
+        return result;
+    }
+
+    result = session_state_checkpoint(state);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = session_cipher_decrypt_from_state_and_signal_message(cipher, state, ciphertext, plaintext);
+    if(result >= SG_SUCCESS) {
+        session_state_commit(state);
+        session_record_get_previous_states_remove(record, node);
+        result = session_record_promote_state(record, state);
+    }
+    else {
+        session_state_rollback(state);
+    }
+
+complete:
+    SIGNAL_UNREF(state);
     return result;
 }
 
@@ -385,54 +523,59 @@ static int session_cipher_decrypt_from_record_and_signal_message(session_cipher
     int result = 0;
     signal_buffer *result_buf = 0;
     session_state *state = 0;
-    session_state *state_copy = 0;
     session_record_state_node *previous_states_node = 0;
+    session_record_state_node *candidate_node = 0;
 
     assert(cipher);
-    signal_lock(cipher->global_context);
 
+    /*
+     * Each candidate state is decrypted in place against a copy-on-write
+     * checkpoint, which is rolled back if the message does not decrypt.
+     */
     state = session_record_get_state(record);
     if(state) {
-        result = session_state_copy(&state_copy, state, cipher->global_context);
+        result = session_state_checkpoint(state);
         if(result < 0) {
             goto complete;
         }
 
         //TODO Collect and log invalid message errors if totally unsuccessful
 
-        result = session_cipher_decrypt_from_state_and_signal_message(cipher, state_copy, ciphertext, &result_buf);
-        if(result < 0 && result != SG_ERR_INVALID_MESSAGE) {
-            goto complete;
-        }
-
+        result = session_cipher_decrypt_from_state_and_signal_message(cipher, state, ciphertext, &result_buf);
         if(result >= SG_SUCCESS) {
-            session_record_set_state(record, state_copy);
+            session_state_commit(state);
             goto complete;
         }
-        SIGNAL_UNREF(state_copy);
-    }
-
-    previous_states_node = session_record_get_previous_states_head(record);
-    while(previous_states_node) {
-        state = session_record_get_previous_states_element(previous_states_node);
 
-        result = session_state_copy(&state_copy, state, cipher->global_context);
-        if(result < 0) {
+        session_state_rollback(state);
+        if(result != SG_ERR_INVALID_MESSAGE) {
             goto complete;
         }
+    }
 
-        result = session_cipher_decrypt_from_state_and_signal_message(cipher, state_copy, ciphertext, &result_buf);
-        if(result < 0 && result != SG_ERR_INVALID_MESSAGE) {
+    /*
+     * An archived state with a receiver chain for the ratchet key of the
+     * message is tried first. Any other state could only decrypt it after
+     * a ratchet step, so they are tried afterwards, most recent first.
+     */
+    candidate_node = session_record_find_previous_states_receiver(record,
+            signal_message_get_sender_ratchet_key(ciphertext));
+    if(candidate_node) {
+        result = session_cipher_decrypt_from_previous_state(cipher, record, candidate_node, ciphertext, &result_buf);
+        if(result != SG_ERR_INVALID_MESSAGE) {
             goto complete;
         }
+    }
 
-        if(result >= SG_SUCCESS) {
-            session_record_get_previous_states_remove(record, previous_states_node);
-            result = session_record_promote_state(record, state_copy);
-            goto complete;
+    previous_states_node = session_record_get_previous_states_head(record);
+    while(previous_states_node) {
+        if(previous_states_node != candidate_node) {
+            result = session_cipher_decrypt_from_previous_state(cipher, record, previous_states_node, ciphertext, &result_buf);
+            if(result != SG_ERR_INVALID_MESSAGE) {
+                goto complete;
+            }
         }
 
-        SIGNAL_UNREF(state_copy);
         previous_states_node = session_record_get_previous_states_next(previous_states_node);
     }
 
@@ -440,14 +583,12 @@ static int session_cipher_decrypt_from_record_and_signal_message(session_cipher
     result = SG_ERR_INVALID_MESSAGE;
 
 complete:
-    SIGNAL_UNREF(state_copy);
     if(result >= 0) {
         *plaintext = result_buf;
     }
     else {
         signal_buffer_free(result_buf);
     }
-    signal_unlock(cipher->global_context);
     return result;
 }
 
@@ -464,7 +605,8 @@ static int session_cipher_decrypt_from_state_and_signal_message(session_cipher *
     uint32_t session_version = 0;
     ec_public_key *remote_identity_key = 0;
     ec_public_key *local_identity_key = 0;
-    signal_buffer *ciphertext_body = 0;
+    const uint8_t *ciphertext_body = 0;
+    size_t ciphertext_body_len = 0;
 
     if(!session_state_has_sender_chain(state)) {
         signal_log(cipher->global_context, SG_LOG_WARNING, "Uninitialized session!");
@@ -527,15 +669,10 @@ static int session_cipher_decrypt_from_state_and_signal_message(session_cipher *
         goto complete;
     }
 
-    ciphertext_body = signal_message_get_body(ciphertext);
-    if(!ciphertext_body) {
-        signal_log(cipher->global_context, SG_LOG_WARNING, "Message body does not exist");
-        result = SG_ERR_INVALID_MESSAGE;
-        goto complete;
-    }
+    ciphertext_body = signal_message_get_body_data(ciphertext, &ciphertext_body_len);
 
-    result = session_cipher_get_plaintext(cipher, &result_buf, message_version, &message_keys,
-            signal_buffer_data(ciphertext_body), signal_buffer_len(ciphertext_body));
+    result = session_cipher_get_plaintext(cipher->global_context, &result_buf, message_version, &message_keys,
+            ciphertext_body, ciphertext_body_len);
     if(result < 0) {
         goto complete;
     }
@@ -595,7 +732,7 @@ static int session_cipher_get_or_create_chain_key(session_cipher *cipher,
         goto complete;
     }
 
-    result = curve_generate_key_pair(cipher->global_context, &our_new_ephemeral);
+    result = signal_generate_ephemeral_key_pair(cipher->global_context, &our_new_ephemeral);
     if(result < 0) {
         goto complete;
     }
@@ -650,7 +787,6 @@ static int session_cipher_get_or_create_message_keys(ratchet_message_keys *messa
 {
     int result = 0;
     ratchet_chain_key *cur_chain_key = 0;
-    ratchet_chain_key *next_chain_key = 0;
     ratchet_message_keys message_keys_result;
 
     if(ratchet_chain_key_get_index(chain_key) > counter) {
@@ -672,40 +808,38 @@ static int session_cipher_get_or_create_message_keys(ratchet_message_keys *messa
         goto complete;
     }
 
-    cur_chain_key = chain_key;
-    SIGNAL_REF(cur_chain_key);
+    /* Walk a private copy of the chain forward, storing any skipped keys */
+    result = ratchet_chain_key_copy(&cur_chain_key, chain_key);
+    if(result < 0) {
+        goto complete;
+    }
 
-    while(ratchet_chain_key_get_index(cur_chain_key) < counter) {
-        result = ratchet_chain_key_get_message_keys(cur_chain_key, &message_keys_result);
+    if(global_context->skipped_key_checkpoint_interval > 0 &&
+            ratchet_chain_key_get_index(cur_chain_key) < counter) {
+        result = session_state_skip_message_keys(state, their_ephemeral, cur_chain_key, counter);
         if(result < 0) {
             goto complete;
         }
+    }
 
-        result = session_state_set_message_keys(state, their_ephemeral, &message_keys_result);
+    while(ratchet_chain_key_get_index(cur_chain_key) < counter) {
+        result = ratchet_chain_key_step(cur_chain_key, &message_keys_result);
         if(result < 0) {
             goto complete;
         }
 
-        result = ratchet_chain_key_create_next(cur_chain_key, &next_chain_key);
+        result = session_state_set_message_keys(state, their_ephemeral, &message_keys_result);
         if(result < 0) {
             goto complete;
         }
-        SIGNAL_UNREF(cur_chain_key);
-        cur_chain_key = next_chain_key;
-        next_chain_key = 0;
-    }
-
-    result = ratchet_chain_key_create_next(cur_chain_key, &next_chain_key);
-    if(result < 0) {
-        goto complete;
     }
 
-    result = session_state_set_receiver_chain_key(state, their_ephemeral, next_chain_key);
+    result = ratchet_chain_key_step(cur_chain_key, &message_keys_result);
     if(result < 0) {
         goto complete;
     }
 
-    result = ratchet_chain_key_get_message_keys(cur_chain_key, &message_keys_result);
+    result = session_state_set_receiver_chain_key(state, their_ephemeral, cur_chain_key);
     if(result < 0) {
         goto complete;
     }
@@ -715,11 +849,29 @@ complete:
         memcpy(message_keys, &message_keys_result, sizeof(ratchet_message_keys));
     }
     SIGNAL_UNREF(cur_chain_key);
-    SIGNAL_UNREF(next_chain_key);
     signal_explicit_bzero(&message_keys_result, sizeof(ratchet_message_keys));
     return result;
 }
 
+/*
+ * A decryption callback runs with the address already locked for writing,
+ * and the keyed locks need not be recursive, so queries made from within
+ * it do not lock again.
+ */
+static void session_cipher_lock_for_query(session_cipher *cipher)
+{
+    if(!cipher->inside_callback) {
+        signal_lock_address(cipher->global_context, cipher->remote_address, SG_LOCK_READ);
+    }
+}
+
+static void session_cipher_unlock_for_query(session_cipher *cipher)
+{
+    if(!cipher->inside_callback) {
+        signal_unlock_address(cipher->global_context, cipher->remote_address, SG_LOCK_READ);
+    }
+}
+
 int session_cipher_get_remote_registration_id(session_cipher *cipher, uint32_t *remote_id)
 {
     int result = 0;
@@ -728,7 +880,7 @@ int session_cipher_get_remote_registration_id(session_cipher *cipher, uint32_t *
     session_state *state = 0;
 
     assert(cipher);
-    signal_lock(cipher->global_context);
+    session_cipher_lock_for_query(cipher);
 
     result = signal_protocol_session_load_session(cipher->store, &record, cipher->remote_address);
     if(result < 0) {
@@ -748,7 +900,7 @@ complete:
     if(result >= 0) {
         *remote_id = id_result;
     }
-    signal_unlock(cipher->global_context);
+    session_cipher_unlock_for_query(cipher);
     return result;
 }
 
@@ -760,7 +912,7 @@ int session_cipher_get_session_version(session_cipher *cipher, uint32_t *version
     session_state *state = 0;
 
     assert(cipher);
-    signal_lock(cipher->global_context);
+    session_cipher_lock_for_query(cipher);
 
     result = signal_protocol_session_contains_session(cipher->store, cipher->remote_address);
     if(result != 1) {
@@ -789,11 +941,11 @@ complete:
     if(result >= 0) {
         *version = version_result;
     }
-    signal_unlock(cipher->global_context);
+    session_cipher_unlock_for_query(cipher);
     return result;
 }
 
-static int session_cipher_get_ciphertext(session_cipher *cipher,
+static int session_cipher_get_ciphertext(signal_context *global_context,
         signal_buffer **ciphertext,
         uint32_t version, ratchet_message_keys *message_keys,
         const uint8_t *plaintext, size_t plaintext_len)
@@ -802,7 +954,7 @@ static int session_cipher_get_ciphertext(session_cipher *cipher,
     signal_buffer *output = 0;
 
     if(version >= 3) {
-        result = signal_encrypt(cipher->global_context,
+        result = signal_encrypt(global_context,
                 &output, SG_CIPHER_AES_CBC_PKCS5,
                 message_keys->cipher_key, sizeof(message_keys->cipher_key),
                 message_keys->iv, sizeof(message_keys->iv),
@@ -816,7 +968,7 @@ static int session_cipher_get_ciphertext(session_cipher *cipher,
         iv[1] = (uint8_t)(message_keys->counter >> 16);
         iv[0] = (uint8_t)(message_keys->counter >> 24);
 
-        result = signal_encrypt(cipher->global_context,
+        result = signal_encrypt(global_context,
                 &output, SG_CIPHER_AES_CTR_NOPADDING,
                 message_keys->cipher_key, sizeof(message_keys->cipher_key),
                 iv, sizeof(iv),
@@ -830,7 +982,7 @@ static int session_cipher_get_ciphertext(session_cipher *cipher,
     return result;
 }
 
-static int session_cipher_get_plaintext(session_cipher *cipher,
+static int session_cipher_get_plaintext(signal_context *global_context,
         signal_buffer **plaintext,
         uint32_t version, ratchet_message_keys *message_keys,
         const uint8_t *ciphertext, size_t ciphertext_len)
@@ -839,7 +991,7 @@ static int session_cipher_get_plaintext(session_cipher *cipher,
     signal_buffer *output = 0;
 
     if(version >= 3) {
-        result = signal_decrypt(cipher->global_context,
+        result = signal_decrypt(global_context,
                 &output, SG_CIPHER_AES_CBC_PKCS5,
                 message_keys->cipher_key, sizeof(message_keys->cipher_key),
                 message_keys->iv, sizeof(message_keys->iv),
@@ -853,7 +1005,7 @@ static int session_cipher_get_plaintext(session_cipher *cipher,
         iv[1] = (uint8_t)(message_keys->counter >> 16);
         iv[0] = (uint8_t)(message_keys->counter >> 24);
 
-        result = signal_decrypt(cipher->global_context,
+        result = signal_decrypt(global_context,
                 &output, SG_CIPHER_AES_CTR_NOPADDING,
                 message_keys->cipher_key, sizeof(message_keys->cipher_key),
                 iv, sizeof(iv),
@@ -882,6 +1034,6 @@ void session_cipher_free(session_cipher *cipher)
 {
     if(cipher) {
         session_builder_free(cipher->builder);
-        free(cipher);
+        signal_free(cipher->global_context, cipher);
     }
 }
@@ -68,6 +68,13 @@ void *session_cipher_get_user_data(session_cipher *cipher);
  * or write error happening between the time the session state is updated but
  * before they're able to successfully store the plaintext to disk.
  *
+ * The callback runs with the remote address of the cipher locked for
+ * writing. It may call session_cipher_get_remote_registration_id() and
+ * session_cipher_get_session_version() on the same cipher, which then do
+ * not lock again, while encrypting or decrypting with it fails with
+ * SG_ERR_INVAL. With keyed locking functions, it must not use any other
+ * session_cipher or session_builder for the same address.
+ *
  * @param callback the callback function to set
  */
 void session_cipher_set_decryption_callback(session_cipher *cipher,
@@ -86,6 +93,42 @@ int session_cipher_encrypt(session_cipher *cipher,
         const uint8_t *padded_message, size_t padded_message_len,
         ciphertext_message **encrypted_message);
 
+/**
+ * Encrypt one message to several recipient+device tuples at once.
+ *
+ * All session records are loaded from the store up front, the message is
+ * encrypted against each of them, and the updated records are committed
+ * together. If the session store implements the batch callbacks, this is a
+ * single load and a single store call. The write lock of every address is
+ * held for the whole batch, taken in a canonical order so that concurrent
+ * batches cannot deadlock. Without keyed locking functions, this is the
+ * global lock.
+ *
+ * The batch either succeeds or fails as a whole. On failure no messages
+ * are returned and no updated record is committed by the library, with one
+ * exception: a session store without store_sessions_func is given the
+ * records one at a time, so a store error partway through leaves the
+ * records before it committed. Their sessions have then skipped a message,
+ * which recipients handle like any other lost message.
+ *
+ * @param store the signal_protocol_store_context holding the sessions
+ * @param addresses array of count distinct remote addresses to encrypt to
+ * @param count number of addresses
+ * @param padded_message The plaintext message bytes, optionally padded to a constant multiple.
+ * @param padded_message_len The length of the data pointed to by padded_message
+ * @param encrypted_messages Caller provided array of count entries, each set to
+ *     the ciphertext message for the address at the same index. The caller
+ *     is responsible for unreferencing each of them.
+ * @param global_context the global library context
+ *
+ * @return SG_SUCCESS on success, negative on error
+ */
+int session_cipher_encrypt_batch(signal_protocol_store_context *store,
+        const signal_protocol_address *addresses, size_t count,
+        const uint8_t *padded_message, size_t padded_message_len,
+        ciphertext_message **encrypted_messages,
+        signal_context *global_context);
+
 /**
  * Decrypt a message.
  *
@@ -139,7 +139,7 @@ int session_pre_key_deserialize(session_pre_key **pre_key, const uint8_t *data,
     ec_key_pair *key_pair = 0;
     session_pre_key *result_pre_key = 0;
 
-    record = textsecure__pre_key_record_structure__unpack(0, len, data);
+    record = textsecure__pre_key_record_structure__unpack(signal_protobuf_allocator(global_context), len, data);
     if(!record) {
         result = SG_ERR_INVALID_PROTO_BUF;
         goto complete;
@@ -172,7 +172,7 @@ int session_pre_key_deserialize(session_pre_key **pre_key, const uint8_t *data,
 
 complete:
     if(record) {
-        textsecure__pre_key_record_structure__free_unpacked(record, 0);
+        textsecure__pre_key_record_structure__free_unpacked(record, signal_protobuf_allocator(global_context));
     }
     if(public_key) {
         SIGNAL_UNREF(public_key);
@@ -339,7 +339,7 @@ int session_signed_pre_key_deserialize(session_signed_pre_key **pre_key, const u
     ec_key_pair *key_pair = 0;
     session_signed_pre_key *result_pre_key = 0;
 
-    record = textsecure__signed_pre_key_record_structure__unpack(0, len, data);
+    record = textsecure__signed_pre_key_record_structure__unpack(signal_protobuf_allocator(global_context), len, data);
     if(!record) {
         result = SG_ERR_INVALID_PROTO_BUF;
         goto complete;
@@ -376,7 +376,7 @@ int session_signed_pre_key_deserialize(session_signed_pre_key **pre_key, const u
 
 complete:
     if(record) {
-        textsecure__signed_pre_key_record_structure__free_unpacked(record, 0);
+        textsecure__signed_pre_key_record_structure__free_unpacked(record, signal_protobuf_allocator(global_context));
     }
     if(public_key) {
         SIGNAL_UNREF(public_key);
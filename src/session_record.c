@@ -5,16 +5,53 @@
 #include <assert.h>
 
 #include "session_state.h"
+#include "protocol_wire.h"
 #include "utlist.h"
 #include "LocalStorageProtocol.pb-c.h"
 #include "signal_protocol_internal.h"
 
 #define ARCHIVED_STATES_MAX_LENGTH 40
-
+#define INDEX_BUCKET_COUNT 64
+
+#define INDEX_ALICE_BASE_KEY 0
+#define INDEX_RECEIVER_RATCHET_KEY 1
+
+/*
+ * Archived states are indexed by their alice base key and by the sender
+ * ratchet keys of their receiver chains, so that the state matching an
+ * incoming message is found without decoding or trying every state.
+ *
+ * The index is only needed when the current state does not match, so it is
+ * built by the first lookup and discarded whenever the list of archived
+ * states changes.
+ */
+typedef struct session_record_index_entry
+{
+    struct session_record_index_entry *hash_next;
+    session_record_state_node *node;
+    int type;
+    uint32_t session_version;
+    uint8_t key[EC_PUBLIC_KEY_SERIALIZED_LENGTH];
+} session_record_index_entry;
+
+/*
+ * Archived states of a deserialized record are kept in their encoded form
+ * until they are needed, since almost every message decrypts with the
+ * current state. A node holds either a decoded state or the encoded one.
+ *
+ * A node handed out through session_record_get_previous_states_element()
+ * may be modified by the caller, so it is left out of the index and
+ * matched against its state directly.
+ */
 struct session_record_state_node
 {
     session_state *state;
+    signal_context *global_context;
     struct session_record_state_node *prev, *next;
+    session_record *record;
+    int unindexed;
+    size_t serialized_len;
+    uint8_t serialized[];
 };
 
 struct session_record
@@ -22,16 +59,37 @@ struct session_record
     signal_type_base base;
     session_state *state;
     session_record_state_node *previous_states_head;
+    session_record_index_entry *index[INDEX_BUCKET_COUNT];
+    session_record_index_entry *index_entries;
+    int index_valid;
+    size_t unindexed_count;
     int is_fresh;
     signal_buffer *user_record;
     signal_context *global_context;
 };
 
+typedef struct session_record_deserialize_context
+{
+    session_record_state_node *previous_states_head;
+    signal_context *global_context;
+} session_record_deserialize_context;
+
+static int session_record_state_node_create(session_record_state_node **node,
+        session_state *state, const uint8_t *serialized, size_t serialized_len,
+        signal_context *global_context);
+static void session_record_state_node_free(session_record_state_node *node);
+static int session_record_state_node_matches(const session_record_state_node *node,
+        uint32_t version, const ec_public_key *alice_base_key);
+static void session_record_link_node(session_record *record, session_record_state_node *node, int prepend);
+static void session_record_unlink_node(session_record *record, session_record_state_node *node);
+static int session_record_build_index(session_record *record);
+static void session_record_clear_index(session_record *record);
+static size_t session_record_index_bucket(int type, const uint8_t *key_data);
 static void session_record_free_previous_states(session_record *record);
 
 int session_record_create(session_record **record, session_state *state, signal_context *global_context)
 {
-    session_record *result = malloc(sizeof(session_record));
+    session_record *result = signal_malloc(global_context, sizeof(session_record));
     if(!result) {
         return SG_ERR_NOMEM;
     }
@@ -62,75 +120,96 @@ int session_record_serialize(signal_buffer **buffer, const session_record *recor
     int result = 0;
     size_t result_size = 0;
     unsigned int i = 0;
-    Textsecure__RecordStructure record_structure = TEXTSECURE__RECORD_STRUCTURE__INIT;
+    Textsecure__SessionStructure current_structure = TEXTSECURE__SESSION_STRUCTURE__INIT;
+    Textsecure__SessionStructure *previous_structures = 0;
+    size_t current_len = 0;
+    size_t *previous_lens = 0;
     session_record_state_node *cur_node = 0;
+    size_t count = 0;
+    signal_arena arena;
     signal_buffer *result_buf = 0;
     size_t len = 0;
     uint8_t *data = 0;
 
     if(!record) {
-        result = SG_ERR_INVAL;
-        goto complete;
+        return SG_ERR_INVAL;
     }
 
+    DL_COUNT(record->previous_states_head, cur_node, count);
+    signal_arena_init(&arena, record->global_context, (count + 1) * SESSION_STATE_SERIALIZE_SIZE_HINT);
+
+    /*
+     * The record is assembled directly, in the same field order as
+     * protobuf-c, so that archived states still in encoded form can be
+     * copied through unchanged.
+     */
     if(record->state) {
-        record_structure.currentsession = malloc(sizeof(Textsecure__SessionStructure));
-        if(!record_structure.currentsession) {
-            result = SG_ERR_NOMEM;
-            goto complete;
-        }
-        textsecure__session_structure__init(record_structure.currentsession);
-        result = session_state_serialize_prepare(record->state, record_structure.currentsession);
+        result = session_state_serialize_prepare(record->state, &current_structure, &arena);
         if(result < 0) {
             goto complete;
         }
+        current_len = textsecure__session_structure__get_packed_size(&current_structure);
+        len += protocol_wire_record_session_get_size(PROTOCOL_WIRE_RECORD_CURRENT_SESSION, current_len);
     }
 
-    if(record->previous_states_head) {
-        size_t count;
-        DL_COUNT(record->previous_states_head, cur_node, count);
-
-        if(count > SIZE_MAX / sizeof(Textsecure__SessionStructure *)) {
+    if(count > 0) {
+        if(count > SIZE_MAX / sizeof(Textsecure__SessionStructure)) {
             result = SG_ERR_NOMEM;
             goto complete;
         }
 
-        record_structure.previoussessions = malloc(sizeof(Textsecure__SessionStructure *) * count);
-        if(!record_structure.previoussessions) {
+        previous_structures = signal_arena_alloc(&arena, sizeof(Textsecure__SessionStructure) * count);
+        previous_lens = signal_arena_alloc(&arena, sizeof(size_t) * count);
+        if(!previous_structures || !previous_lens) {
             result = SG_ERR_NOMEM;
             goto complete;
         }
 
         i = 0;
         DL_FOREACH(record->previous_states_head, cur_node) {
-            record_structure.previoussessions[i] = malloc(sizeof(Textsecure__SessionStructure));
-            if(!record_structure.previoussessions[i]) {
-                result = SG_ERR_NOMEM;
-                break;
+            if(cur_node->state) {
+                textsecure__session_structure__init(&previous_structures[i]);
+                result = session_state_serialize_prepare(cur_node->state, &previous_structures[i], &arena);
+                if(result < 0) {
+                    goto complete;
+                }
+                previous_lens[i] = textsecure__session_structure__get_packed_size(&previous_structures[i]);
             }
-            textsecure__session_structure__init(record_structure.previoussessions[i]);
-            result = session_state_serialize_prepare(cur_node->state, record_structure.previoussessions[i]);
-            if(result < 0) {
-                break;
+            else {
+                previous_lens[i] = cur_node->serialized_len;
             }
+            len += protocol_wire_record_session_get_size(PROTOCOL_WIRE_RECORD_PREVIOUS_SESSION, previous_lens[i]);
             i++;
         }
-        record_structure.n_previoussessions = i;
-        if(result < 0) {
-            goto complete;
-        }
     }
 
-    len = textsecure__record_structure__get_packed_size(&record_structure);
-
-    result_buf = signal_buffer_alloc(len);
+    result_buf = signal_buffer_context_alloc(record->global_context, len);
     if(!result_buf) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
 
     data = signal_buffer_data(result_buf);
-    result_size = textsecure__record_structure__pack(&record_structure, data);
+    if(record->state) {
+        result_size += protocol_wire_write_record_session_header(data + result_size,
+                PROTOCOL_WIRE_RECORD_CURRENT_SESSION, current_len);
+        result_size += textsecure__session_structure__pack(&current_structure, data + result_size);
+    }
+
+    i = 0;
+    DL_FOREACH(record->previous_states_head, cur_node) {
+        result_size += protocol_wire_write_record_session_header(data + result_size,
+                PROTOCOL_WIRE_RECORD_PREVIOUS_SESSION, previous_lens[i]);
+        if(cur_node->state) {
+            result_size += textsecure__session_structure__pack(&previous_structures[i], data + result_size);
+        }
+        else {
+            memcpy(data + result_size, cur_node->serialized, cur_node->serialized_len);
+            result_size += cur_node->serialized_len;
+        }
+        i++;
+    }
+
     if(result_size != len) {
         signal_buffer_free(result_buf);
         result = SG_ERR_INVALID_PROTO_BUF;
@@ -139,33 +218,24 @@ int session_record_serialize(signal_buffer **buffer, const session_record *recor
     }
 
 complete:
-    if(record_structure.currentsession) {
-        session_state_serialize_prepare_free(record_structure.currentsession);
-    }
-    if(record_structure.previoussessions) {
-        for(i = 0; i < record_structure.n_previoussessions; i++) {
-            if(record_structure.previoussessions[i]) {
-                session_state_serialize_prepare_free(record_structure.previoussessions[i]);
-            }
-        }
-        free(record_structure.previoussessions);
-    }
-
+    signal_arena_release(&arena);
     if(result >= 0) {
         *buffer = result_buf;
     }
     return result;
 }
 
-int session_record_deserialize(session_record **record, const uint8_t *data, size_t len, signal_context *global_context)
+static int session_record_deserialize_protobuf(session_record **record, const uint8_t *data, size_t len, signal_context *global_context)
 {
     int result = 0;
     session_record *result_record = 0;
     session_state *current_state = 0;
-    session_record_state_node *previous_states_head = 0;
     Textsecure__RecordStructure *record_structure = 0;
+    signal_arena arena;
+
+    signal_arena_init(&arena, global_context, len * SIGNAL_ARENA_UNPACK_SIZE_FACTOR);
 
-    record_structure = textsecure__record_structure__unpack(0, len, data);
+    record_structure = textsecure__record_structure__unpack(signal_arena_protobuf_allocator(&arena), len, data);
     if(!record_structure) {
         result = SG_ERR_INVALID_PROTO_BUF;
         goto complete;
@@ -182,49 +252,110 @@ int session_record_deserialize(session_record **record, const uint8_t *data, siz
     if(result < 0) {
         goto complete;
     }
-    SIGNAL_UNREF(current_state);
-    current_state = 0;
     result_record->is_fresh = 0;
 
     if(record_structure->n_previoussessions > 0) {
         unsigned int i;
         for(i = 0; i < record_structure->n_previoussessions; i++) {
-            Textsecure__SessionStructure *session_structure =
-                    record_structure->previoussessions[i];
+            session_state *state = 0;
+            session_record_state_node *node = 0;
 
-            session_record_state_node *node = malloc(sizeof(session_record_state_node));
-            if(!node) {
-                result = SG_ERR_NOMEM;
+            result = session_state_deserialize_protobuf(&state, record_structure->previoussessions[i], global_context);
+            if(result < 0) {
                 goto complete;
             }
 
-            result = session_state_deserialize_protobuf(&node->state, session_structure, global_context);
+            result = session_record_state_node_create(&node, state, 0, 0, global_context);
+            SIGNAL_UNREF(state);
             if(result < 0) {
-                free(node);
                 goto complete;
             }
 
-            DL_APPEND(previous_states_head, node);
+            session_record_link_node(result_record, node, 0);
         }
     }
-    result_record->previous_states_head = previous_states_head;
-    previous_states_head = 0;
 
 complete:
-    if(record_structure) {
-        textsecure__record_structure__free_unpacked(record_structure, 0);
+    signal_arena_release(&arena);
+    SIGNAL_UNREF(current_state);
+    if(result_record) {
+        if(result < 0) {
+            SIGNAL_UNREF(result_record);
+        }
+        else {
+            *record = result_record;
+        }
+    }
+
+    return result;
+}
+
+static int session_record_deserialize_previous_state(const protocol_wire_bytes *session, void *user_data)
+{
+    int result = 0;
+    session_record_deserialize_context *context = user_data;
+    session_record_state_node *node = 0;
+
+    result = session_record_state_node_create(&node, 0, session->data, session->len, context->global_context);
+    if(result < 0) {
+        return result;
+    }
+
+    DL_APPEND(context->previous_states_head, node);
+    return 0;
+}
+
+int session_record_deserialize(session_record **record, const uint8_t *data, size_t len, signal_context *global_context)
+{
+    int result = 0;
+    session_record *result_record = 0;
+    session_state *current_state = 0;
+    protocol_wire_record record_wire;
+    session_record_deserialize_context context;
+    session_record_state_node *cur_node;
+    session_record_state_node *tmp_node;
+
+    context.previous_states_head = 0;
+    context.global_context = global_context;
+
+    result = protocol_wire_parse_record(&record_wire, data, len,
+            session_record_deserialize_previous_state, &context);
+    if(result < 0) {
+        goto complete;
     }
-    if(current_state) {
-        SIGNAL_UNREF(current_state);
+
+    if(record_wire.current_session_count > 1) {
+        /* Repeated occurrences of the current session are merged by protobuf-c */
+        result = session_record_deserialize_protobuf(&result_record, data, len, global_context);
+        goto complete;
     }
-    if(previous_states_head) {
-        session_record_state_node *cur_node;
-        session_record_state_node *tmp_node;
-        DL_FOREACH_SAFE(previous_states_head, cur_node, tmp_node) {
-            DL_DELETE(previous_states_head, cur_node);
-            free(cur_node);
+
+    if(record_wire.current_session_count == 1) {
+        result = session_state_deserialize(&current_state,
+                record_wire.current_session.data, record_wire.current_session.len,
+                global_context);
+        if(result < 0) {
+            goto complete;
         }
     }
+
+    result = session_record_create(&result_record, current_state, global_context);
+    if(result < 0) {
+        goto complete;
+    }
+    result_record->is_fresh = 0;
+
+    DL_FOREACH_SAFE(context.previous_states_head, cur_node, tmp_node) {
+        DL_DELETE(context.previous_states_head, cur_node);
+        session_record_link_node(result_record, cur_node, 0);
+    }
+
+complete:
+    SIGNAL_UNREF(current_state);
+    DL_FOREACH_SAFE(context.previous_states_head, cur_node, tmp_node) {
+        DL_DELETE(context.previous_states_head, cur_node);
+        session_record_state_node_free(cur_node);
+    }
     if(result_record) {
         if(result < 0) {
             SIGNAL_UNREF(result_record);
@@ -241,25 +372,46 @@ int session_record_copy(session_record **record, session_record *other_record, s
 {
     int result = 0;
     session_record *result_record = 0;
-    signal_buffer *buffer = 0;
-    size_t len = 0;
-    uint8_t *data = 0;
+    session_state *state_copy = 0;
+    session_record_state_node *cur_node = 0;
 
     assert(other_record);
     assert(global_context);
 
-    result = session_record_serialize(&buffer, other_record);
+    result = session_state_copy(&state_copy, other_record->state, global_context);
     if(result < 0) {
         goto complete;
     }
 
-    data = signal_buffer_data(buffer);
-    len = signal_buffer_len(buffer);
-
-    result = session_record_deserialize(&result_record, data, len, global_context);
+    result = session_record_create(&result_record, state_copy, global_context);
     if(result < 0) {
         goto complete;
     }
+
+    /* Matches a copy made through serialization, which is never fresh */
+    result_record->is_fresh = 0;
+
+    DL_FOREACH(other_record->previous_states_head, cur_node) {
+        session_record_state_node *node = 0;
+        session_state *previous_state_copy = 0;
+
+        if(cur_node->state) {
+            result = session_state_copy(&previous_state_copy, cur_node->state, global_context);
+            if(result < 0) {
+                goto complete;
+            }
+        }
+
+        result = session_record_state_node_create(&node, previous_state_copy,
+                cur_node->serialized, cur_node->serialized_len, global_context);
+        SIGNAL_UNREF(previous_state_copy);
+        if(result < 0) {
+            goto complete;
+        }
+
+        session_record_link_node(result_record, node, 0);
+    }
+
     if(other_record->user_record) {
         result_record->user_record = signal_buffer_copy(other_record->user_record);
         if(!result_record->user_record) {
@@ -269,9 +421,7 @@ int session_record_copy(session_record **record, session_record *other_record, s
     }
 
 complete:
-    if(buffer) {
-        signal_buffer_free(buffer);
-    }
+    SIGNAL_UNREF(state_copy);
     if(result >= 0) {
         *record = result_record;
     }
@@ -284,6 +434,8 @@ complete:
 int session_record_has_session_state(session_record *record, uint32_t version, const ec_public_key *alice_base_key)
 {
     session_record_state_node *cur_node = 0;
+    session_record_index_entry *entry = 0;
+    uint8_t key_data[EC_PUBLIC_KEY_SERIALIZED_LENGTH];
 
     assert(record);
     assert(record->state);
@@ -295,15 +447,67 @@ int session_record_has_session_state(session_record *record, uint32_t version, c
         return 1;
     }
 
-    DL_FOREACH(record->previous_states_head, cur_node) {
-        if(session_state_get_session_version(cur_node->state) == version &&
-                ec_public_key_compare(
-                        session_state_get_alice_base_key(cur_node->state),
-                        alice_base_key) == 0) {
+    if(!alice_base_key || session_record_build_index(record) < 0) {
+        DL_FOREACH(record->previous_states_head, cur_node) {
+            if(session_record_state_node_matches(cur_node, version, alice_base_key)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    ec_public_key_serialize_into(key_data, alice_base_key);
+    for(entry = record->index[session_record_index_bucket(INDEX_ALICE_BASE_KEY, key_data)];
+            entry; entry = entry->hash_next) {
+        if(entry->type == INDEX_ALICE_BASE_KEY &&
+                entry->session_version == version &&
+                memcmp(entry->key, key_data, sizeof(key_data)) == 0) {
             return 1;
         }
     }
 
+    if(record->unindexed_count > 0) {
+        DL_FOREACH(record->previous_states_head, cur_node) {
+            if(cur_node->unindexed && session_record_state_node_matches(cur_node, version, alice_base_key)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+session_record_state_node *session_record_find_previous_states_receiver(session_record *record, const ec_public_key *sender_ratchet_key)
+{
+    session_record_state_node *cur_node = 0;
+    session_record_index_entry *entry = 0;
+    uint8_t key_data[EC_PUBLIC_KEY_SERIALIZED_LENGTH];
+
+    assert(record);
+    assert(sender_ratchet_key);
+
+    /* Without an index the caller still tries every state, just not in the best order */
+    if(session_record_build_index(record) < 0) {
+        return 0;
+    }
+
+    ec_public_key_serialize_into(key_data, sender_ratchet_key);
+    for(entry = record->index[session_record_index_bucket(INDEX_RECEIVER_RATCHET_KEY, key_data)];
+            entry; entry = entry->hash_next) {
+        if(entry->type == INDEX_RECEIVER_RATCHET_KEY &&
+                memcmp(entry->key, key_data, sizeof(key_data)) == 0) {
+            return entry->node;
+        }
+    }
+
+    if(record->unindexed_count > 0) {
+        DL_FOREACH(record->previous_states_head, cur_node) {
+            if(cur_node->unindexed && session_state_has_receiver_chain(cur_node->state, sender_ratchet_key)) {
+                return cur_node;
+            }
+        }
+    }
+
     return 0;
 }
 
@@ -329,12 +533,41 @@ session_record_state_node *session_record_get_previous_states_head(const session
     return record->previous_states_head;
 }
 
-session_state *session_record_get_previous_states_element(const session_record_state_node *node)
+session_state *session_record_get_previous_states_element(session_record_state_node *node)
 {
     assert(node);
+
+    if(!node->state) {
+        if(session_record_load_previous_states_element(node, &node->state) < 0) {
+            return 0;
+        }
+
+        /* The caller may modify the state, so it replaces the encoded form */
+        signal_explicit_bzero(node->serialized, node->serialized_len);
+        node->serialized_len = 0;
+    }
+    if(!node->unindexed && node->record) {
+        session_record_clear_index(node->record);
+        node->unindexed = 1;
+        node->record->unindexed_count++;
+    }
     return node->state;
 }
 
+int session_record_load_previous_states_element(const session_record_state_node *node, session_state **state)
+{
+    assert(node);
+    assert(state);
+
+    if(node->state) {
+        SIGNAL_REF(node->state);
+        *state = node->state;
+        return 0;
+    }
+
+    return session_state_deserialize(state, node->serialized, node->serialized_len, node->global_context);
+}
+
 session_record_state_node *session_record_get_previous_states_next(const session_record_state_node *node)
 {
     assert(node);
@@ -349,9 +582,8 @@ session_record_state_node *session_record_get_previous_states_remove(session_rec
     assert(node);
 
     next_node = node->next;
-    DL_DELETE(record->previous_states_head, node);
-    SIGNAL_UNREF(node->state);
-    free(node);
+    session_record_unlink_node(record, node);
+    session_record_state_node_free(node);
     return next_node;
 }
 
@@ -382,6 +614,7 @@ complete:
 
 int session_record_promote_state(session_record *record, session_state *promoted_state)
 {
+    int result = 0;
     int count = 0;
     session_record_state_node *cur_node = 0;
     session_record_state_node *tmp_node = 0;
@@ -391,13 +624,14 @@ int session_record_promote_state(session_record *record, session_state *promoted
 
     // Move the previously current state to the list of previous states
     if(record->state) {
-        session_record_state_node *node = malloc(sizeof(session_record_state_node));
-        if(!node) {
-            return SG_ERR_NOMEM;
+        session_record_state_node *node = 0;
+        result = session_record_state_node_create(&node, record->state, 0, 0, record->global_context);
+        if(result < 0) {
+            return result;
         }
 
-        node->state = record->state;
-        DL_PREPEND(record->previous_states_head, node);
+        session_record_link_node(record, node, 1);
+        SIGNAL_UNREF(record->state);
         record->state = 0;
     }
 
@@ -409,29 +643,269 @@ int session_record_promote_state(session_record *record, session_state *promoted
     DL_FOREACH_SAFE(record->previous_states_head, cur_node, tmp_node) {
         count++;
         if(count > ARCHIVED_STATES_MAX_LENGTH) {
-            DL_DELETE(record->previous_states_head, cur_node);
-            if(cur_node->state) {
-                SIGNAL_UNREF(cur_node->state);
+            session_record_unlink_node(record, cur_node);
+            session_record_state_node_free(cur_node);
+        }
+    }
+
+    return 0;
+}
+
+static int session_record_state_node_create(session_record_state_node **node,
+        session_state *state, const uint8_t *serialized, size_t serialized_len,
+        signal_context *global_context)
+{
+    session_record_state_node *result = 0;
+
+    if(state) {
+        serialized_len = 0;
+    }
+    if(serialized_len > SIZE_MAX - sizeof(session_record_state_node)) {
+        return SG_ERR_NOMEM;
+    }
+
+    result = signal_malloc(global_context, sizeof(session_record_state_node) + serialized_len);
+    if(!result) {
+        return SG_ERR_NOMEM;
+    }
+    memset(result, 0, sizeof(session_record_state_node));
+
+    if(state) {
+        SIGNAL_REF(state);
+        result->state = state;
+    }
+    else if(serialized_len > 0) {
+        memcpy(result->serialized, serialized, serialized_len);
+    }
+    result->serialized_len = serialized_len;
+    result->global_context = global_context;
+
+    *node = result;
+    return 0;
+}
+
+static void session_record_state_node_free(session_record_state_node *node)
+{
+    if(node->state) {
+        SIGNAL_UNREF(node->state);
+    }
+    signal_explicit_bzero(node->serialized, node->serialized_len);
+    signal_free(node->global_context, node);
+}
+
+static int session_record_state_node_matches(const session_record_state_node *node,
+        uint32_t version, const ec_public_key *alice_base_key)
+{
+    int result = 0;
+    protocol_wire_session_summary summary;
+    uint8_t key_data[EC_PUBLIC_KEY_SERIALIZED_LENGTH];
+
+    if(!node->state) {
+        /* Compare the encoded fields, which is all that is needed for nearly every state */
+        if(protocol_wire_parse_session_summary(&summary, node->serialized, node->serialized_len, 0, 0) < 0) {
+            return 0;
+        }
+        if(summary.has_session_version) {
+            if(summary.session_version != version) {
+                return 0;
+            }
+            if(!summary.has_alice_base_key || !alice_base_key) {
+                return !summary.has_alice_base_key && !alice_base_key;
+            }
+            if(summary.alice_base_key.len != sizeof(key_data)) {
+                return 0;
+            }
+            ec_public_key_serialize_into(key_data, alice_base_key);
+            return signal_constant_memcmp(summary.alice_base_key.data, key_data, sizeof(key_data)) == 0;
+        }
+    }
+
+    {
+        session_state *state = 0;
+        if(session_record_load_previous_states_element(node, &state) < 0) {
+            return 0;
+        }
+        result = session_state_get_session_version(state) == version &&
+                ec_public_key_compare(session_state_get_alice_base_key(state), alice_base_key) == 0;
+        SIGNAL_UNREF(state);
+    }
+    return result;
+}
+
+static void session_record_link_node(session_record *record, session_record_state_node *node, int prepend)
+{
+    if(prepend) {
+        DL_PREPEND(record->previous_states_head, node);
+    }
+    else {
+        DL_APPEND(record->previous_states_head, node);
+    }
+    node->record = record;
+    if(node->unindexed) {
+        record->unindexed_count++;
+    }
+    session_record_clear_index(record);
+}
+
+static void session_record_unlink_node(session_record *record, session_record_state_node *node)
+{
+    DL_DELETE(record->previous_states_head, node);
+    node->record = 0;
+    if(node->unindexed) {
+        record->unindexed_count--;
+    }
+    session_record_clear_index(record);
+}
+
+typedef struct session_record_index_builder
+{
+    session_record *record;
+    session_record_state_node *node;
+    uint32_t session_version;
+    size_t count;
+} session_record_index_builder;
+
+static void session_record_index_add(session_record_index_builder *builder, int type, const uint8_t *key_data)
+{
+    session_record *record = builder->record;
+
+    /* Keys are only counted until the entries have been allocated */
+    if(record->index_entries) {
+        session_record_index_entry *entry = &record->index_entries[builder->count];
+        size_t bucket = session_record_index_bucket(type, key_data);
+
+        entry->node = builder->node;
+        entry->type = type;
+        entry->session_version = builder->session_version;
+        memcpy(entry->key, key_data, EC_PUBLIC_KEY_SERIALIZED_LENGTH);
+        entry->hash_next = record->index[bucket];
+        record->index[bucket] = entry;
+    }
+    builder->count++;
+}
+
+static int session_record_index_add_receiver_ratchet_key(const protocol_wire_bytes *bytes, void *user_data)
+{
+    /* A key of any other length does not decode, so it never matches */
+    if(bytes->len == EC_PUBLIC_KEY_SERIALIZED_LENGTH) {
+        session_record_index_add(user_data, INDEX_RECEIVER_RATCHET_KEY, bytes->data);
+    }
+    return 0;
+}
+
+static void session_record_index_add_node(session_record_index_builder *builder, session_record_state_node *node)
+{
+    uint8_t key_data[EC_PUBLIC_KEY_SERIALIZED_LENGTH];
+    ec_public_key *key;
+    int i;
+
+    builder->node = node;
+
+    if(node->state) {
+        builder->session_version = session_state_get_session_version(node->state);
+        key = session_state_get_alice_base_key(node->state);
+        if(key) {
+            ec_public_key_serialize_into(key_data, key);
+            session_record_index_add(builder, INDEX_ALICE_BASE_KEY, key_data);
+        }
+        for(i = 0; (key = session_state_get_receiver_chain_ratchet_key(node->state, i)) != 0; i++) {
+            ec_public_key_serialize_into(key_data, key);
+            session_record_index_add(builder, INDEX_RECEIVER_RATCHET_KEY, key_data);
+        }
+    }
+    else {
+        protocol_wire_session_summary summary;
+        size_t count = builder->count;
+
+        /* An encoded state that cannot be parsed will not decode either, so it never matches */
+        if(protocol_wire_parse_session_summary(&summary, node->serialized, node->serialized_len,
+                session_record_index_add_receiver_ratchet_key, builder) < 0) {
+            /* Entries are pushed onto their buckets, so they are removed in reverse */
+            while(builder->count > count) {
+                builder->count--;
+                if(builder->record->index_entries) {
+                    session_record_index_entry *entry = &builder->record->index_entries[builder->count];
+                    builder->record->index[session_record_index_bucket(entry->type, entry->key)] = entry->hash_next;
+                }
             }
-            free(cur_node);
+            return;
+        }
+
+        /* Same default as session_state_create() */
+        builder->session_version = summary.has_session_version ? summary.session_version : 2;
+        if(summary.has_alice_base_key && summary.alice_base_key.len == EC_PUBLIC_KEY_SERIALIZED_LENGTH) {
+            session_record_index_add(builder, INDEX_ALICE_BASE_KEY, summary.alice_base_key.data);
         }
     }
+}
+
+static int session_record_build_index(session_record *record)
+{
+    session_record_index_builder builder;
+    session_record_state_node *cur_node;
+
+    if(record->index_valid) {
+        return 0;
+    }
 
+    builder.record = record;
+    builder.count = 0;
+
+    /* Count the keys, then index them into a single allocation */
+    DL_FOREACH(record->previous_states_head, cur_node) {
+        if(!cur_node->unindexed) {
+            session_record_index_add_node(&builder, cur_node);
+        }
+    }
+
+    if(builder.count > 0) {
+        if(builder.count > SIZE_MAX / sizeof(session_record_index_entry)) {
+            return SG_ERR_NOMEM;
+        }
+        record->index_entries = signal_malloc(record->global_context,
+                builder.count * sizeof(session_record_index_entry));
+        if(!record->index_entries) {
+            return SG_ERR_NOMEM;
+        }
+
+        builder.count = 0;
+        DL_FOREACH(record->previous_states_head, cur_node) {
+            if(!cur_node->unindexed) {
+                session_record_index_add_node(&builder, cur_node);
+            }
+        }
+    }
+
+    record->index_valid = 1;
     return 0;
 }
 
+static void session_record_clear_index(session_record *record)
+{
+    if(record->index_entries) {
+        signal_free(record->global_context, record->index_entries);
+        record->index_entries = 0;
+    }
+    memset(record->index, 0, sizeof(record->index));
+    record->index_valid = 0;
+}
+
+static size_t session_record_index_bucket(int type, const uint8_t *key_data)
+{
+    /* Skip the key type byte, the rest of a public key is uniformly distributed */
+    uint32_t hash = (uint32_t)key_data[1] | ((uint32_t)key_data[2] << 8) |
+            ((uint32_t)key_data[3] << 16) | ((uint32_t)key_data[4] << 24);
+    return (size_t)(hash ^ (uint32_t)type) & (INDEX_BUCKET_COUNT - 1);
+}
+
 static void session_record_free_previous_states(session_record *record)
 {
     session_record_state_node *cur_node;
     session_record_state_node *tmp_node;
     DL_FOREACH_SAFE(record->previous_states_head, cur_node, tmp_node) {
-        DL_DELETE(record->previous_states_head, cur_node);
-        if(cur_node->state) {
-            SIGNAL_UNREF(cur_node->state);
-        }
-        free(cur_node);
+        session_record_unlink_node(record, cur_node);
+        session_record_state_node_free(cur_node);
     }
-    record->previous_states_head = 0;
 }
 
 signal_buffer *session_record_get_user_record(const session_record *record)
@@ -462,5 +936,5 @@ void session_record_destroy(signal_type_base *type)
         signal_buffer_free(record->user_record);
     }
 
-    free(record);
+    signal_free(record->global_context, record);
 }
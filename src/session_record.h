@@ -19,9 +19,35 @@ session_state *session_record_get_state(session_record *record);
 void session_record_set_state(session_record *record, session_state *state);
 
 session_record_state_node *session_record_get_previous_states_head(const session_record *record);
-session_state *session_record_get_previous_states_element(const session_record_state_node *node);
+
+/**
+ * Archived states may be kept in encoded form until first accessed. This
+ * decodes the state if needed and keeps it in the node.
+ *
+ * @return the state of the node, or null if it could not be decoded
+ */
+session_state *session_record_get_previous_states_element(session_record_state_node *node);
+
+/**
+ * Get the state of a node without keeping a decoded copy in the node, so
+ * that the record still serializes the untouched encoded state.
+ *
+ * @param state set to a newly referenced state, to be unreferenced by the caller
+ * @return 0 on success, negative on failure
+ */
+int session_record_load_previous_states_element(const session_record_state_node *node, session_state **state);
+
 session_record_state_node *session_record_get_previous_states_next(const session_record_state_node *node);
 
+/**
+ * Find the archived state with a receiver chain for the sender ratchet key
+ * of an incoming message, using the index of the record rather than
+ * decoding each state.
+ *
+ * @return a matching node, or null if no archived state has such a chain
+ */
+session_record_state_node *session_record_find_previous_states_receiver(session_record *record, const ec_public_key *sender_ratchet_key);
+
 /**
  * Removes the specified node in the previous states list.
  * @param node the node to remove
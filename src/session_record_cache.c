@@ -0,0 +1,313 @@
+#include "session_record_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "signal_protocol.h"
+#include "signal_protocol_internal.h"
+#include "utlist.h"
+
+#define SESSION_RECORD_CACHE_MIN_BUCKETS 16
+
+typedef struct session_record_cache_entry session_record_cache_entry;
+
+struct session_record_cache_entry
+{
+    signal_protocol_address address;
+    uint32_t hash;
+    session_record *record;
+    int dirty;
+    session_record_cache_entry *hash_next;
+    session_record_cache_entry *prev, *next;
+};
+
+struct session_record_cache
+{
+    size_t capacity;
+    size_t count;
+
+    /* Least recently used entry first */
+    session_record_cache_entry *lru_head;
+
+    /* Chained hash table, sized for capacity so that it never grows */
+    size_t bucket_count;
+    session_record_cache_entry **buckets;
+
+    session_record_cache_write_back_func write_back;
+    void *user_data;
+
+    signal_protocol_session_cache_stats stats;
+
+    signal_context *global_context;
+};
+
+static uint32_t session_record_cache_hash(const char *name, size_t name_len)
+{
+    /* FNV-1a over the name, so that all devices of a name share a hash */
+    uint32_t hash = 2166136261U;
+    size_t i;
+    for(i = 0; i < name_len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static size_t session_record_cache_bucket(const session_record_cache *cache, uint32_t hash, int32_t device_id)
+{
+    return (size_t)(hash ^ ((uint32_t)device_id * 2654435761U)) & (cache->bucket_count - 1);
+}
+
+static int session_record_cache_name_matches(const session_record_cache_entry *entry, const char *name, size_t name_len)
+{
+    return entry->address.name_len == name_len && memcmp(entry->address.name, name, name_len) == 0;
+}
+
+static session_record_cache_entry **session_record_cache_find(session_record_cache *cache, const signal_protocol_address *address)
+{
+    uint32_t hash = session_record_cache_hash(address->name, address->name_len);
+    session_record_cache_entry **link = &cache->buckets[session_record_cache_bucket(cache, hash, address->device_id)];
+
+    while(*link) {
+        session_record_cache_entry *entry = *link;
+        if(entry->hash == hash && entry->address.device_id == address->device_id &&
+                session_record_cache_name_matches(entry, address->name, address->name_len)) {
+            return link;
+        }
+        link = &entry->hash_next;
+    }
+    return 0;
+}
+
+static void session_record_cache_unlink(session_record_cache *cache, session_record_cache_entry **link)
+{
+    session_record_cache_entry *entry = *link;
+
+    *link = entry->hash_next;
+    DL_DELETE(cache->lru_head, entry);
+    cache->count--;
+
+    SIGNAL_UNREF(entry->record);
+    signal_free(cache->global_context, (char *)entry->address.name);
+    signal_free(cache->global_context, entry);
+}
+
+static int session_record_cache_write_back_entry(session_record_cache *cache, session_record_cache_entry *entry)
+{
+    int result = cache->write_back(&entry->address, entry->record, cache->user_data);
+    if(result >= 0) {
+        entry->dirty = 0;
+        cache->stats.write_backs++;
+    }
+    return result;
+}
+
+int session_record_cache_create(session_record_cache **cache, size_t capacity,
+        session_record_cache_write_back_func write_back, void *user_data,
+        signal_context *global_context)
+{
+    session_record_cache *result = 0;
+    size_t bucket_count = SESSION_RECORD_CACHE_MIN_BUCKETS;
+
+    assert(capacity > 0);
+    assert(write_back);
+
+    while(bucket_count < capacity) {
+        if(bucket_count > SIZE_MAX / 2 / sizeof(session_record_cache_entry *)) {
+            return SG_ERR_NOMEM;
+        }
+        bucket_count *= 2;
+    }
+
+    result = signal_malloc(global_context, sizeof(session_record_cache));
+    if(!result) {
+        return SG_ERR_NOMEM;
+    }
+    memset(result, 0, sizeof(session_record_cache));
+
+    result->buckets = signal_malloc(global_context, sizeof(session_record_cache_entry *) * bucket_count);
+    if(!result->buckets) {
+        signal_free(global_context, result);
+        return SG_ERR_NOMEM;
+    }
+    memset(result->buckets, 0, sizeof(session_record_cache_entry *) * bucket_count);
+
+    result->capacity = capacity;
+    result->bucket_count = bucket_count;
+    result->write_back = write_back;
+    result->user_data = user_data;
+    result->global_context = global_context;
+
+    *cache = result;
+    return 0;
+}
+
+session_record *session_record_cache_get(session_record_cache *cache, const signal_protocol_address *address)
+{
+    session_record_cache_entry **link;
+    session_record_cache_entry *entry;
+
+    assert(cache);
+    assert(address);
+
+    link = session_record_cache_find(cache, address);
+    if(!link) {
+        cache->stats.misses++;
+        return 0;
+    }
+
+    entry = *link;
+    DL_DELETE(cache->lru_head, entry);
+    DL_APPEND(cache->lru_head, entry);
+    cache->stats.hits++;
+    return entry->record;
+}
+
+session_record *session_record_cache_peek(session_record_cache *cache, const signal_protocol_address *address, int *dirty)
+{
+    session_record_cache_entry **link;
+
+    assert(cache);
+    assert(address);
+
+    link = session_record_cache_find(cache, address);
+    if(!link) {
+        return 0;
+    }
+    if(dirty) {
+        *dirty = (*link)->dirty;
+    }
+    return (*link)->record;
+}
+
+int session_record_cache_put(session_record_cache *cache, const signal_protocol_address *address, session_record *record, int dirty)
+{
+    int result = 0;
+    session_record_cache_entry **link;
+    session_record_cache_entry *entry;
+    char *name = 0;
+    size_t bucket;
+
+    assert(cache);
+    assert(address);
+    assert(record);
+
+    link = session_record_cache_find(cache, address);
+    if(link) {
+        entry = *link;
+        SIGNAL_REF(record);
+        SIGNAL_UNREF(entry->record);
+        entry->record = record;
+        entry->dirty = dirty;
+        DL_DELETE(cache->lru_head, entry);
+        DL_APPEND(cache->lru_head, entry);
+        return 0;
+    }
+
+    if(cache->count >= cache->capacity) {
+        entry = cache->lru_head;
+        if(entry->dirty) {
+            result = session_record_cache_write_back_entry(cache, entry);
+            if(result < 0) {
+                return result;
+            }
+        }
+        session_record_cache_unlink(cache, session_record_cache_find(cache, &entry->address));
+        cache->stats.evictions++;
+    }
+
+    entry = signal_malloc(cache->global_context, sizeof(session_record_cache_entry));
+    name = signal_malloc(cache->global_context, address->name_len + 1);
+    if(!entry || !name) {
+        signal_free(cache->global_context, entry);
+        signal_free(cache->global_context, name);
+        return SG_ERR_NOMEM;
+    }
+    memset(entry, 0, sizeof(session_record_cache_entry));
+    memcpy(name, address->name, address->name_len);
+    name[address->name_len] = '\0';
+
+    entry->address.name = name;
+    entry->address.name_len = address->name_len;
+    entry->address.device_id = address->device_id;
+    entry->hash = session_record_cache_hash(address->name, address->name_len);
+    SIGNAL_REF(record);
+    entry->record = record;
+    entry->dirty = dirty;
+
+    bucket = session_record_cache_bucket(cache, entry->hash, address->device_id);
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    DL_APPEND(cache->lru_head, entry);
+    cache->count++;
+
+    return 0;
+}
+
+void session_record_cache_remove(session_record_cache *cache, const signal_protocol_address *address)
+{
+    session_record_cache_entry **link;
+
+    assert(cache);
+    assert(address);
+
+    link = session_record_cache_find(cache, address);
+    if(link) {
+        session_record_cache_unlink(cache, link);
+    }
+}
+
+void session_record_cache_remove_all(session_record_cache *cache, const char *name, size_t name_len)
+{
+    session_record_cache_entry *cur_node;
+    session_record_cache_entry *tmp_node;
+
+    assert(cache);
+
+    DL_FOREACH_SAFE(cache->lru_head, cur_node, tmp_node) {
+        if(!name || session_record_cache_name_matches(cur_node, name, name_len)) {
+            session_record_cache_unlink(cache, session_record_cache_find(cache, &cur_node->address));
+        }
+    }
+}
+
+int session_record_cache_flush(session_record_cache *cache, const char *name, size_t name_len)
+{
+    int result = 0;
+    session_record_cache_entry *cur_node;
+
+    assert(cache);
+
+    DL_FOREACH(cache->lru_head, cur_node) {
+        if(cur_node->dirty && (!name || session_record_cache_name_matches(cur_node, name, name_len))) {
+            int entry_result = session_record_cache_write_back_entry(cache, cur_node);
+            if(entry_result < 0 && result >= 0) {
+                result = entry_result;
+            }
+        }
+    }
+    return result;
+}
+
+size_t session_record_cache_get_capacity(const session_record_cache *cache)
+{
+    assert(cache);
+    return cache->capacity;
+}
+
+void session_record_cache_get_stats(const session_record_cache *cache, signal_protocol_session_cache_stats *stats)
+{
+    assert(cache);
+    assert(stats);
+    memcpy(stats, &cache->stats, sizeof(signal_protocol_session_cache_stats));
+}
+
+void session_record_cache_free(session_record_cache *cache)
+{
+    if(cache) {
+        session_record_cache_remove_all(cache, 0, 0);
+        signal_free(cache->global_context, cache->buckets);
+        signal_free(cache->global_context, cache);
+    }
+}
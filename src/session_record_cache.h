@@ -0,0 +1,87 @@
+#ifndef SESSION_RECORD_CACHE_H
+#define SESSION_RECORD_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "signal_protocol_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bounded LRU cache of deserialized session records, keyed by address.
+ *
+ * Entries may be marked dirty, meaning the cached record is newer than the
+ * one in the session store. Dirty entries are passed to the write back
+ * function when they are evicted or flushed, and are only dropped once it
+ * succeeds. The cache holds its own reference to each record, and callers
+ * must not modify a record after handing it to the cache.
+ */
+typedef struct session_record_cache session_record_cache;
+
+typedef int (*session_record_cache_write_back_func)(const signal_protocol_address *address, session_record *record, void *user_data);
+
+int session_record_cache_create(session_record_cache **cache, size_t capacity,
+        session_record_cache_write_back_func write_back, void *user_data,
+        signal_context *global_context);
+
+/**
+ * Find the cached record for an address and mark it as most recently used.
+ *
+ * @return the cached record, or 0 if there is none. The cache keeps
+ *     ownership of the record.
+ */
+session_record *session_record_cache_get(session_record_cache *cache, const signal_protocol_address *address);
+
+/**
+ * Find the cached record for an address without counting a hit or a miss
+ * or changing its place in the LRU order.
+ *
+ * @param dirty set to the dirty flag of the entry, if there is one
+ * @return the cached record, or 0 if there is none. The cache keeps
+ *     ownership of the record.
+ */
+session_record *session_record_cache_peek(session_record_cache *cache, const signal_protocol_address *address, int *dirty);
+
+/**
+ * Cache a record for an address, replacing any existing entry. If the cache
+ * is full, the least recently used entry is evicted first.
+ *
+ * @param record record to cache, the cache takes a reference to it
+ * @param dirty 1 if the record has not yet been written to the store
+ * @return 0 on success, negative on failure. On failure the cache holds no
+ *     entry for the address.
+ */
+int session_record_cache_put(session_record_cache *cache, const signal_protocol_address *address, session_record *record, int dirty);
+
+/**
+ * Remove the entry for an address, discarding it even if it is dirty.
+ */
+void session_record_cache_remove(session_record_cache *cache, const signal_protocol_address *address);
+
+/**
+ * Remove the entries for every device of a name, or every entry if name
+ * is 0, discarding them even if they are dirty.
+ */
+void session_record_cache_remove_all(session_record_cache *cache, const char *name, size_t name_len);
+
+/**
+ * Write back the dirty entries for every device of a name, or every dirty
+ * entry if name is 0.
+ *
+ * @return 0 on success, or the first write back error
+ */
+int session_record_cache_flush(session_record_cache *cache, const char *name, size_t name_len);
+
+size_t session_record_cache_get_capacity(const session_record_cache *cache);
+
+void session_record_cache_get_stats(const session_record_cache *cache, signal_protocol_session_cache_stats *stats);
+
+void session_record_cache_free(session_record_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SESSION_RECORD_CACHE_H */
@@ -10,16 +10,12 @@
 #include "LocalStorageProtocol.pb-c.h"
 #include "signal_protocol_internal.h"
 
+#include "message_key_ring.h"
+#include "message_key_checkpoints.h"
 #include "utlist.h"
 
 #define MAX_MESSAGE_KEYS 2000
 
-typedef struct message_keys_node
-{
-    ratchet_message_keys message_key;
-    struct message_keys_node *prev, *next;
-} message_keys_node;
-
 typedef struct session_state_sender_chain
 {
     ec_key_pair *sender_ratchet_key_pair;
@@ -30,7 +26,8 @@ typedef struct session_state_receiver_chain
 {
     ec_public_key *sender_ratchet_key;
     ratchet_chain_key *chain_key;
-    message_keys_node *message_keys_head;
+    message_key_ring *message_keys;
+    message_key_checkpoints *checkpoints;
     struct session_state_receiver_chain *prev, *next;
 } session_state_receiver_chain;
 
@@ -78,38 +75,43 @@ struct session_state
     int needs_refresh;
     ec_public_key *alice_base_key;
 
+    session_state *checkpoint;
+
     signal_context *global_context;
 };
 
 static int session_state_serialize_prepare_sender_chain(
         session_state_sender_chain *chain,
-        Textsecure__SessionStructure__Chain *chain_structure);
+        Textsecure__SessionStructure__Chain *chain_structure,
+        signal_arena *arena);
 static int session_state_serialize_prepare_receiver_chain(
         session_state_receiver_chain *chain,
-        Textsecure__SessionStructure__Chain *chain_structure);
-static void session_state_serialize_prepare_chain_free(
-        Textsecure__SessionStructure__Chain *chain_structure);
+        Textsecure__SessionStructure__Chain *chain_structure,
+        signal_arena *arena);
 static int session_state_serialize_prepare_chain_chain_key(
         ratchet_chain_key *chain_key,
-        Textsecure__SessionStructure__Chain *chain_structure);
+        Textsecure__SessionStructure__Chain *chain_structure,
+        signal_arena *arena);
 static int session_state_serialize_prepare_chain_message_keys_list(
-        message_keys_node *message_keys_head,
-        Textsecure__SessionStructure__Chain *chain_structure);
+        message_key_ring *message_keys,
+        Textsecure__SessionStructure__Chain *chain_structure,
+        signal_arena *arena);
 static int session_state_serialize_prepare_message_keys(
         ratchet_message_keys *message_key,
-        Textsecure__SessionStructure__Chain__MessageKey *message_key_structure);
-static void session_state_serialize_prepare_message_keys_free(
-        Textsecure__SessionStructure__Chain__MessageKey *message_key_structure);
+        Textsecure__SessionStructure__Chain__MessageKey *message_key_structure,
+        signal_arena *arena);
+static int session_state_serialize_prepare_chain_checkpoints(
+        message_key_checkpoints *checkpoints,
+        Textsecure__SessionStructure__Chain *chain_structure,
+        signal_arena *arena);
 static int session_state_serialize_prepare_pending_key_exchange(
         session_pending_key_exchange *exchange,
-        Textsecure__SessionStructure__PendingKeyExchange *exchange_structure);
-static void session_state_serialize_prepare_pending_key_exchange_free(
-        Textsecure__SessionStructure__PendingKeyExchange *exchange_structure);
+        Textsecure__SessionStructure__PendingKeyExchange *exchange_structure,
+        signal_arena *arena);
 static int session_state_serialize_prepare_pending_pre_key(
         session_pending_pre_key *pre_key,
-        Textsecure__SessionStructure__PendingPreKey *pre_key_structure);
-static void session_state_serialize_prepare_pending_pre_key_free(
-        Textsecure__SessionStructure__PendingPreKey *pre_key_structure);
+        Textsecure__SessionStructure__PendingPreKey *pre_key_structure,
+        signal_arena *arena);
 
 static int session_state_deserialize_protobuf_pending_key_exchange(
         session_pending_key_exchange *result_exchange,
@@ -131,13 +133,13 @@ static int session_state_deserialize_protobuf_receiver_chain(
         signal_context *global_context);
 
 static void session_state_free_sender_chain(session_state *state);
-static void session_state_free_receiver_chain_node(session_state_receiver_chain *node);
+static void session_state_free_receiver_chain_node(session_state_receiver_chain *node, signal_context *global_context);
 static void session_state_free_receiver_chain(session_state *state);
 static session_state_receiver_chain *session_state_find_receiver_chain(const session_state *state, const ec_public_key *sender_ephemeral);
 
 int session_state_create(session_state **state, signal_context *global_context)
 {
-    session_state *result = malloc(sizeof(session_state));
+    session_state *result = signal_malloc(global_context, sizeof(session_state));
     if(!result) {
         return SG_ERR_NOMEM;
     }
@@ -154,33 +156,29 @@ int session_state_serialize(signal_buffer **buffer, session_state *state)
 {
     int result = 0;
     size_t result_size = 0;
-    Textsecure__SessionStructure *state_structure = 0;
+    Textsecure__SessionStructure state_structure = TEXTSECURE__SESSION_STRUCTURE__INIT;
+    signal_arena arena;
     signal_buffer *result_buf = 0;
     size_t len = 0;
     uint8_t *data = 0;
 
-    state_structure = malloc(sizeof(Textsecure__SessionStructure));
-    if(!state_structure) {
-        result = SG_ERR_NOMEM;
-        goto complete;
-    }
-    textsecure__session_structure__init(state_structure);
+    signal_arena_init(&arena, state->global_context, SESSION_STATE_SERIALIZE_SIZE_HINT);
 
-    result = session_state_serialize_prepare(state, state_structure);
+    result = session_state_serialize_prepare(state, &state_structure, &arena);
     if(result < 0) {
         goto complete;
     }
 
-    len = textsecure__session_structure__get_packed_size(state_structure);
+    len = textsecure__session_structure__get_packed_size(&state_structure);
 
-    result_buf = signal_buffer_alloc(len);
+    result_buf = signal_buffer_context_alloc(state->global_context, len);
     if(!result_buf) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
 
     data = signal_buffer_data(result_buf);
-    result_size = textsecure__session_structure__pack(state_structure, data);
+    result_size = textsecure__session_structure__pack(&state_structure, data);
     if(result_size != len) {
         signal_buffer_free(result_buf);
         result = SG_ERR_INVALID_PROTO_BUF;
@@ -189,9 +187,7 @@ int session_state_serialize(signal_buffer **buffer, session_state *state)
     }
 
 complete:
-    if(state_structure) {
-        session_state_serialize_prepare_free(state_structure);
-    }
+    signal_arena_release(&arena);
     if(result >= 0) {
         *buffer = result_buf;
     }
@@ -203,8 +199,11 @@ int session_state_deserialize(session_state **state, const uint8_t *data, size_t
     int result = 0;
     session_state *result_state = 0;
     Textsecure__SessionStructure *session_structure = 0;
+    signal_arena arena;
 
-    session_structure = textsecure__session_structure__unpack(0, len, data);
+    signal_arena_init(&arena, global_context, len * SIGNAL_ARENA_UNPACK_SIZE_FACTOR);
+
+    session_structure = textsecure__session_structure__unpack(signal_arena_protobuf_allocator(&arena), len, data);
     if(!session_structure) {
         result = SG_ERR_INVALID_PROTO_BUF;
         goto complete;
@@ -216,9 +215,7 @@ int session_state_deserialize(session_state **state, const uint8_t *data, size_t
     }
 
 complete:
-    if(session_structure) {
-        textsecure__session_structure__free_unpacked(session_structure, 0);
-    }
+    signal_arena_release(&arena);
     if(result_state) {
         if(result < 0) {
             SIGNAL_UNREF(result_state);
@@ -230,7 +227,7 @@ complete:
     return result;
 }
 
-int session_state_serialize_prepare(session_state *state, Textsecure__SessionStructure *session_structure)
+int session_state_serialize_prepare(session_state *state, Textsecure__SessionStructure *session_structure, signal_arena *arena)
 {
     int result = 0;
 
@@ -242,7 +239,7 @@ int session_state_serialize_prepare(session_state *state, Textsecure__SessionStr
 
     if(state->local_identity_public) {
         result = ec_public_key_serialize_protobuf(
-                &session_structure->localidentitypublic, state->local_identity_public);
+                &session_structure->localidentitypublic, state->local_identity_public, arena);
         if(result < 0) {
             goto complete;
         }
@@ -251,7 +248,7 @@ int session_state_serialize_prepare(session_state *state, Textsecure__SessionStr
 
     if(state->remote_identity_public) {
         result = ec_public_key_serialize_protobuf(
-                &session_structure->remoteidentitypublic, state->remote_identity_public);
+                &session_structure->remoteidentitypublic, state->remote_identity_public, arena);
         if(result < 0) {
             goto complete;
         }
@@ -260,7 +257,7 @@ int session_state_serialize_prepare(session_state *state, Textsecure__SessionStr
 
     if(state->root_key) {
         result = ratchet_root_key_get_key_protobuf(
-                state->root_key, &session_structure->rootkey);
+                state->root_key, &session_structure->rootkey, arena);
         if(result < 0) {
             goto complete;
         }
@@ -272,14 +269,14 @@ int session_state_serialize_prepare(session_state *state, Textsecure__SessionStr
 
 
     if(state->has_sender_chain) {
-        session_structure->senderchain = malloc(sizeof(Textsecure__SessionStructure__Chain));
+        session_structure->senderchain = signal_arena_alloc(arena, sizeof(Textsecure__SessionStructure__Chain));
         if(!session_structure->senderchain) {
             result = SG_ERR_NOMEM;
             goto complete;
         }
         textsecure__session_structure__chain__init(session_structure->senderchain);
         result = session_state_serialize_prepare_sender_chain(
-                &state->sender_chain, session_structure->senderchain);
+                &state->sender_chain, session_structure->senderchain, arena);
         if(result < 0) {
             goto complete;
         }
@@ -295,20 +292,20 @@ int session_state_serialize_prepare(session_state *state, Textsecure__SessionStr
             goto complete;
         }
 
-        session_structure->receiverchains = malloc(sizeof(Textsecure__SessionStructure__Chain *) * count);
+        session_structure->receiverchains = signal_arena_alloc(arena, sizeof(Textsecure__SessionStructure__Chain *) * count);
         if(!session_structure->receiverchains) {
             result = SG_ERR_NOMEM;
             goto complete;
         }
 
         DL_FOREACH(state->receiver_chain_head, cur_node) {
-            session_structure->receiverchains[i] = malloc(sizeof(Textsecure__SessionStructure__Chain));
+            session_structure->receiverchains[i] = signal_arena_alloc(arena, sizeof(Textsecure__SessionStructure__Chain));
             if(!session_structure->receiverchains[i]) {
                 result = SG_ERR_NOMEM;
                 break;
             }
             textsecure__session_structure__chain__init(session_structure->receiverchains[i]);
-            result = session_state_serialize_prepare_receiver_chain(cur_node, session_structure->receiverchains[i]);
+            result = session_state_serialize_prepare_receiver_chain(cur_node, session_structure->receiverchains[i], arena);
             if(result < 0) {
                 break;
             }
@@ -321,7 +318,7 @@ int session_state_serialize_prepare(session_state *state, Textsecure__SessionStr
     }
 
     if(state->has_pending_key_exchange) {
-        session_structure->pendingkeyexchange = malloc(sizeof(Textsecure__SessionStructure__PendingKeyExchange));
+        session_structure->pendingkeyexchange = signal_arena_alloc(arena, sizeof(Textsecure__SessionStructure__PendingKeyExchange));
         if(!session_structure->pendingkeyexchange) {
             result = SG_ERR_NOMEM;
             goto complete;
@@ -329,14 +326,14 @@ int session_state_serialize_prepare(session_state *state, Textsecure__SessionStr
         textsecure__session_structure__pending_key_exchange__init(session_structure->pendingkeyexchange);
         result = session_state_serialize_prepare_pending_key_exchange(
                 &state->pending_key_exchange,
-                session_structure->pendingkeyexchange);
+                session_structure->pendingkeyexchange, arena);
         if(result < 0) {
             goto complete;
         }
     }
 
     if(state->has_pending_pre_key) {
-        session_structure->pendingprekey = malloc(sizeof(Textsecure__SessionStructure__PendingPreKey));
+        session_structure->pendingprekey = signal_arena_alloc(arena, sizeof(Textsecure__SessionStructure__PendingPreKey));
         if(!session_structure->pendingprekey) {
             result = SG_ERR_NOMEM;
             goto complete;
@@ -344,7 +341,7 @@ int session_state_serialize_prepare(session_state *state, Textsecure__SessionStr
         textsecure__session_structure__pending_pre_key__init(session_structure->pendingprekey);
         result = session_state_serialize_prepare_pending_pre_key(
                 &state->pending_pre_key,
-                session_structure->pendingprekey);
+                session_structure->pendingprekey, arena);
         if(result < 0) {
             goto complete;
         }
@@ -361,7 +358,7 @@ int session_state_serialize_prepare(session_state *state, Textsecure__SessionStr
 
     if(state->alice_base_key) {
         result = ec_public_key_serialize_protobuf(
-                &session_structure->alicebasekey, state->alice_base_key);
+                &session_structure->alicebasekey, state->alice_base_key, arena);
         if(result < 0) {
             goto complete;
         }
@@ -374,7 +371,8 @@ complete:
 
 static int session_state_serialize_prepare_sender_chain(
         session_state_sender_chain *chain,
-        Textsecure__SessionStructure__Chain *chain_structure)
+        Textsecure__SessionStructure__Chain *chain_structure,
+        signal_arena *arena)
 {
     int result = 0;
 
@@ -383,14 +381,14 @@ static int session_state_serialize_prepare_sender_chain(
         ec_private_key *private_key = 0;
 
         public_key = ec_key_pair_get_public(chain->sender_ratchet_key_pair);
-        result = ec_public_key_serialize_protobuf(&chain_structure->senderratchetkey, public_key);
+        result = ec_public_key_serialize_protobuf(&chain_structure->senderratchetkey, public_key, arena);
         if(result < 0) {
             goto complete;
         }
         chain_structure->has_senderratchetkey = 1;
 
         private_key = ec_key_pair_get_private(chain->sender_ratchet_key_pair);
-        result = ec_private_key_serialize_protobuf(&chain_structure->senderratchetkeyprivate, private_key);
+        result = ec_private_key_serialize_protobuf(&chain_structure->senderratchetkeyprivate, private_key, arena);
         if(result < 0) {
             goto complete;
         }
@@ -398,7 +396,7 @@ static int session_state_serialize_prepare_sender_chain(
     }
 
     if(chain->chain_key) {
-        result = session_state_serialize_prepare_chain_chain_key(chain->chain_key, chain_structure);
+        result = session_state_serialize_prepare_chain_chain_key(chain->chain_key, chain_structure, arena);
         if(result < 0) {
             goto complete;
         }
@@ -410,12 +408,13 @@ complete:
 
 static int session_state_serialize_prepare_receiver_chain(
         session_state_receiver_chain *chain,
-        Textsecure__SessionStructure__Chain *chain_structure)
+        Textsecure__SessionStructure__Chain *chain_structure,
+        signal_arena *arena)
 {
     int result = 0;
 
     if(chain->sender_ratchet_key) {
-        result = ec_public_key_serialize_protobuf(&chain_structure->senderratchetkey, chain->sender_ratchet_key);
+        result = ec_public_key_serialize_protobuf(&chain_structure->senderratchetkey, chain->sender_ratchet_key, arena);
         if(result < 0) {
             goto complete;
         }
@@ -423,14 +422,21 @@ static int session_state_serialize_prepare_receiver_chain(
     }
 
     if(chain->chain_key) {
-        result = session_state_serialize_prepare_chain_chain_key(chain->chain_key, chain_structure);
+        result = session_state_serialize_prepare_chain_chain_key(chain->chain_key, chain_structure, arena);
         if(result < 0) {
             goto complete;
         }
     }
 
-    if(chain->message_keys_head) {
-        result = session_state_serialize_prepare_chain_message_keys_list(chain->message_keys_head, chain_structure);
+    if(chain->message_keys) {
+        result = session_state_serialize_prepare_chain_message_keys_list(chain->message_keys, chain_structure, arena);
+        if(result < 0) {
+            goto complete;
+        }
+    }
+
+    if(chain->checkpoints && message_key_checkpoints_count(chain->checkpoints) > 0) {
+        result = session_state_serialize_prepare_chain_checkpoints(chain->checkpoints, chain_structure, arena);
         if(result < 0) {
             goto complete;
         }
@@ -442,10 +448,11 @@ complete:
 
 static int session_state_serialize_prepare_chain_chain_key(
         ratchet_chain_key *chain_key,
-        Textsecure__SessionStructure__Chain *chain_structure)
+        Textsecure__SessionStructure__Chain *chain_structure,
+        signal_arena *arena)
 {
     int result = 0;
-    chain_structure->chainkey = malloc(sizeof(Textsecure__SessionStructure__Chain__ChainKey));
+    chain_structure->chainkey = signal_arena_alloc(arena, sizeof(Textsecure__SessionStructure__Chain__ChainKey));
     if(!chain_structure->chainkey) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -455,7 +462,7 @@ static int session_state_serialize_prepare_chain_chain_key(
     chain_structure->chainkey->has_index = 1;
     chain_structure->chainkey->index = ratchet_chain_key_get_index(chain_key);
 
-    result = ratchet_chain_key_get_key_protobuf(chain_key, &chain_structure->chainkey->key);
+    result = ratchet_chain_key_get_key_protobuf(chain_key, &chain_structure->chainkey->key, arena);
     if(result < 0) {
         goto complete;
     }
@@ -466,13 +473,15 @@ complete:
 }
 
 static int session_state_serialize_prepare_chain_message_keys_list(
-        message_keys_node *message_keys_head,
-        Textsecure__SessionStructure__Chain *chain_structure)
+        message_key_ring *message_keys,
+        Textsecure__SessionStructure__Chain *chain_structure,
+        signal_arena *arena)
 {
     int result = 0;
     size_t count, i = 0;
-    message_keys_node *cur_node;
-    DL_COUNT(message_keys_head, cur_node, count);
+    size_t iterator = 0;
+    ratchet_message_keys *cur_key;
+    count = message_key_ring_count(message_keys);
 
     if(count == 0) {
         goto complete;
@@ -483,21 +492,21 @@ static int session_state_serialize_prepare_chain_message_keys_list(
         goto complete;
     }
 
-    chain_structure->messagekeys = malloc(sizeof(Textsecure__SessionStructure__Chain__MessageKey *) * count);
+    chain_structure->messagekeys = signal_arena_alloc(arena, sizeof(Textsecure__SessionStructure__Chain__MessageKey *) * count);
     if(!chain_structure->messagekeys) {
         result = SG_ERR_NOMEM;
         goto complete;
     }
 
-    DL_FOREACH(message_keys_head, cur_node) {
-        chain_structure->messagekeys[i] = malloc(sizeof(Textsecure__SessionStructure__Chain__MessageKey));
+    while((cur_key = message_key_ring_next(message_keys, &iterator, 0)) != 0) {
+        chain_structure->messagekeys[i] = signal_arena_alloc(arena, sizeof(Textsecure__SessionStructure__Chain__MessageKey));
         if(!chain_structure->messagekeys[i]) {
             result = SG_ERR_NOMEM;
             break;
         }
         textsecure__session_structure__chain__message_key__init(chain_structure->messagekeys[i]);
 
-        result = session_state_serialize_prepare_message_keys(&cur_node->message_key, chain_structure->messagekeys[i]);
+        result = session_state_serialize_prepare_message_keys(cur_key, chain_structure->messagekeys[i], arena);
         if(result < 0) {
             break;
         }
@@ -512,16 +521,67 @@ complete:
     return result;
 }
 
+static int session_state_serialize_prepare_chain_checkpoints(
+        message_key_checkpoints *checkpoints,
+        Textsecure__SessionStructure__Chain *chain_structure,
+        signal_arena *arena)
+{
+    int result = 0;
+    size_t count, i;
+    const uint8_t *bitmap;
+    size_t bitmap_len;
+
+    /* Checkpoint keys and the bitmap are referenced, not copied */
+    count = message_key_checkpoints_get_checkpoint_count(checkpoints);
+    if(count > SIZE_MAX / sizeof(Textsecure__SessionStructure__Chain__ChainKey *)) {
+        result = SG_ERR_NOMEM;
+        goto complete;
+    }
+
+    chain_structure->messagekeycheckpoints = signal_arena_alloc(arena, sizeof(Textsecure__SessionStructure__Chain__ChainKey *) * count);
+    if(!chain_structure->messagekeycheckpoints) {
+        result = SG_ERR_NOMEM;
+        goto complete;
+    }
+
+    for(i = 0; i < count; i++) {
+        Textsecure__SessionStructure__Chain__ChainKey *checkpoint_structure =
+                signal_arena_alloc(arena, sizeof(Textsecure__SessionStructure__Chain__ChainKey));
+        if(!checkpoint_structure) {
+            result = SG_ERR_NOMEM;
+            goto complete;
+        }
+        textsecure__session_structure__chain__chain_key__init(checkpoint_structure);
+        chain_structure->messagekeycheckpoints[i] = checkpoint_structure;
+        chain_structure->n_messagekeycheckpoints++;
+
+        checkpoint_structure->key.data = (uint8_t *)message_key_checkpoints_get_checkpoint(
+                checkpoints, i, &checkpoint_structure->index);
+        checkpoint_structure->key.len = MESSAGE_KEY_CHECKPOINT_KEY_LENGTH;
+        checkpoint_structure->has_key = 1;
+        checkpoint_structure->has_index = 1;
+    }
+
+    bitmap = message_key_checkpoints_get_bitmap(checkpoints, &bitmap_len);
+    chain_structure->skippedmessagekeys.data = (uint8_t *)bitmap;
+    chain_structure->skippedmessagekeys.len = bitmap_len;
+    chain_structure->has_skippedmessagekeys = 1;
+
+complete:
+    return result;
+}
+
 static int session_state_serialize_prepare_message_keys(
         ratchet_message_keys *message_key,
-        Textsecure__SessionStructure__Chain__MessageKey *message_key_structure)
+        Textsecure__SessionStructure__Chain__MessageKey *message_key_structure,
+        signal_arena *arena)
 {
     int result = 0;
 
     message_key_structure->has_index = 1;
     message_key_structure->index = message_key->counter;
 
-    message_key_structure->cipherkey.data = malloc(sizeof(message_key->cipher_key));
+    message_key_structure->cipherkey.data = signal_arena_alloc(arena, sizeof(message_key->cipher_key));
     if(!message_key_structure->cipherkey.data) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -530,7 +590,7 @@ static int session_state_serialize_prepare_message_keys(
     message_key_structure->cipherkey.len = sizeof(message_key->cipher_key);
     message_key_structure->has_cipherkey = 1;
 
-    message_key_structure->mackey.data = malloc(sizeof(message_key->mac_key));
+    message_key_structure->mackey.data = signal_arena_alloc(arena, sizeof(message_key->mac_key));
     if(!message_key_structure->mackey.data) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -539,7 +599,7 @@ static int session_state_serialize_prepare_message_keys(
     message_key_structure->mackey.len = sizeof(message_key->mac_key);
     message_key_structure->has_mackey = 1;
 
-    message_key_structure->iv.data = malloc(sizeof(message_key->iv));
+    message_key_structure->iv.data = signal_arena_alloc(arena, sizeof(message_key->iv));
     if(!message_key_structure->iv.data) {
         result = SG_ERR_NOMEM;
         goto complete;
@@ -552,24 +612,10 @@ complete:
     return result;
 }
 
-static void session_state_serialize_prepare_message_keys_free(
-        Textsecure__SessionStructure__Chain__MessageKey *message_key_structure)
-{
-    if(message_key_structure->has_cipherkey) {
-        free(message_key_structure->cipherkey.data);
-    }
-    if(message_key_structure->has_mackey) {
-        free(message_key_structure->mackey.data);
-    }
-    if(message_key_structure->has_iv) {
-        free(message_key_structure->iv.data);
-    }
-    free(message_key_structure);
-}
-
 static int session_state_serialize_prepare_pending_key_exchange(
         session_pending_key_exchange *exchange,
-        Textsecure__SessionStructure__PendingKeyExchange *exchange_structure)
+        Textsecure__SessionStructure__PendingKeyExchange *exchange_structure,
+        signal_arena *arena)
 {
     int result = 0;
 
@@ -581,14 +627,14 @@ static int session_state_serialize_prepare_pending_key_exchange(
         ec_private_key *private_key = 0;
 
         public_key = ec_key_pair_get_public(exchange->local_base_key);
-        result = ec_public_key_serialize_protobuf(&exchange_structure->localbasekey, public_key);
+        result = ec_public_key_serialize_protobuf(&exchange_structure->localbasekey, public_key, arena);
         if(result < 0) {
             goto complete;
         }
         exchange_structure->has_localbasekey = 1;
 
         private_key = ec_key_pair_get_private(exchange->local_base_key);
-        result = ec_private_key_serialize_protobuf(&exchange_structure->localbasekeyprivate, private_key);
+        result = ec_private_key_serialize_protobuf(&exchange_structure->localbasekeyprivate, private_key, arena);
         if(result < 0) {
             goto complete;
         }
@@ -600,14 +646,14 @@ static int session_state_serialize_prepare_pending_key_exchange(
         ec_private_key *private_key;
 
         public_key = ec_key_pair_get_public(exchange->local_ratchet_key);
-        result = ec_public_key_serialize_protobuf(&exchange_structure->localratchetkey, public_key);
+        result = ec_public_key_serialize_protobuf(&exchange_structure->localratchetkey, public_key, arena);
         if(result < 0) {
             goto complete;
         }
         exchange_structure->has_localratchetkey = 1;
 
         private_key = ec_key_pair_get_private(exchange->local_ratchet_key);
-        result = ec_private_key_serialize_protobuf(&exchange_structure->localratchetkeyprivate, private_key);
+        result = ec_private_key_serialize_protobuf(&exchange_structure->localratchetkeyprivate, private_key, arena);
         if(result < 0) {
             goto complete;
         }
@@ -619,14 +665,14 @@ static int session_state_serialize_prepare_pending_key_exchange(
         ec_private_key *private_key;
 
         public_key = ratchet_identity_key_pair_get_public(exchange->local_identity_key);
-        result = ec_public_key_serialize_protobuf(&exchange_structure->localidentitykey, public_key);
+        result = ec_public_key_serialize_protobuf(&exchange_structure->localidentitykey, public_key, arena);
         if(result < 0) {
             goto complete;
         }
         exchange_structure->has_localidentitykey = 1;
 
         private_key = ratchet_identity_key_pair_get_private(exchange->local_identity_key);
-        result = ec_private_key_serialize_protobuf(&exchange_structure->localidentitykeyprivate, private_key);
+        result = ec_private_key_serialize_protobuf(&exchange_structure->localidentitykeyprivate, private_key, arena);
         if(result < 0) {
             goto complete;
         }
@@ -639,7 +685,8 @@ complete:
 
 static int session_state_serialize_prepare_pending_pre_key(
         session_pending_pre_key *pre_key,
-        Textsecure__SessionStructure__PendingPreKey *pre_key_structure)
+        Textsecure__SessionStructure__PendingPreKey *pre_key_structure,
+        signal_arena *arena)
 {
     int result = 0;
 
@@ -652,7 +699,7 @@ static int session_state_serialize_prepare_pending_pre_key(
     pre_key_structure->signedprekeyid = (int32_t)pre_key->signed_pre_key_id;
 
     if(pre_key->base_key) {
-        result = ec_public_key_serialize_protobuf(&pre_key_structure->basekey, pre_key->base_key);
+        result = ec_public_key_serialize_protobuf(&pre_key_structure->basekey, pre_key->base_key, arena);
         if(result < 0) {
             goto complete;
         }
@@ -663,112 +710,6 @@ complete:
     return result;
 }
 
-void session_state_serialize_prepare_free(Textsecure__SessionStructure *session_structure)
-{
-    assert(session_structure);
-
-    if(session_structure->has_localidentitypublic) {
-        free(session_structure->localidentitypublic.data);
-    }
-
-    if(session_structure->has_remoteidentitypublic) {
-        free(session_structure->remoteidentitypublic.data);
-    }
-
-    if(session_structure->has_rootkey) {
-        free(session_structure->rootkey.data);
-    }
-
-    if(session_structure->senderchain) {
-        session_state_serialize_prepare_chain_free(session_structure->senderchain);
-    }
-
-    if(session_structure->receiverchains) {
-        unsigned int i;
-        for(i = 0; i < session_structure->n_receiverchains; i++) {
-            if(session_structure->receiverchains[i]) {
-                session_state_serialize_prepare_chain_free(session_structure->receiverchains[i]);
-            }
-        }
-        free(session_structure->receiverchains);
-    }
-
-    if(session_structure->pendingkeyexchange) {
-        session_state_serialize_prepare_pending_key_exchange_free(session_structure->pendingkeyexchange);
-    }
-
-    if(session_structure->pendingprekey) {
-        session_state_serialize_prepare_pending_pre_key_free(session_structure->pendingprekey);
-    }
-
-    if(session_structure->has_alicebasekey) {
-        free(session_structure->alicebasekey.data);
-    }
-
-    free(session_structure);
-}
-
-static void session_state_serialize_prepare_chain_free(
-        Textsecure__SessionStructure__Chain *chain_structure)
-{
-    if(chain_structure->has_senderratchetkey) {
-        free(chain_structure->senderratchetkey.data);
-    }
-    if(chain_structure->has_senderratchetkeyprivate) {
-        free(chain_structure->senderratchetkeyprivate.data);
-    }
-    if(chain_structure->chainkey) {
-        if(chain_structure->chainkey->has_key) {
-            free(chain_structure->chainkey->key.data);
-        }
-        free(chain_structure->chainkey);
-    }
-    if(chain_structure->messagekeys) {
-        unsigned int i;
-        for(i = 0; i < chain_structure->n_messagekeys; i++) {
-            if(chain_structure->messagekeys[i]) {
-                session_state_serialize_prepare_message_keys_free(chain_structure->messagekeys[i]);
-            }
-        }
-        free(chain_structure->messagekeys);
-    }
-    free(chain_structure);
-}
-
-static void session_state_serialize_prepare_pending_key_exchange_free(
-        Textsecure__SessionStructure__PendingKeyExchange *exchange_structure)
-{
-    if(exchange_structure->has_localbasekey) {
-        free(exchange_structure->localbasekey.data);
-    }
-    if(exchange_structure->has_localbasekeyprivate) {
-        free(exchange_structure->localbasekeyprivate.data);
-    }
-    if(exchange_structure->has_localratchetkey) {
-        free(exchange_structure->localratchetkey.data);
-    }
-    if(exchange_structure->has_localratchetkeyprivate) {
-        free(exchange_structure->localratchetkeyprivate.data);
-    }
-    if(exchange_structure->has_localidentitykey) {
-        free(exchange_structure->localidentitykey.data);
-    }
-    if(exchange_structure->has_localidentitykeyprivate) {
-        free(exchange_structure->localidentitykeyprivate.data);
-    }
-    free(exchange_structure);
-}
-
-static void session_state_serialize_prepare_pending_pre_key_free(
-        Textsecure__SessionStructure__PendingPreKey *pre_key_structure)
-{
-    if(pre_key_structure->has_basekey) {
-        free(pre_key_structure->basekey.data);
-    }
-
-    free(pre_key_structure);
-}
-
 int session_state_deserialize_protobuf(session_state **state, Textsecure__SessionStructure *session_structure, signal_context *global_context)
 {
     int result = 0;
@@ -840,7 +781,7 @@ int session_state_deserialize_protobuf(session_state **state, Textsecure__Sessio
     if(session_structure->n_receiverchains > 0) {
         unsigned int i;
         for(i = 0; i < session_structure->n_receiverchains; i++) {
-            session_state_receiver_chain *node = malloc(sizeof(session_state_receiver_chain));
+            session_state_receiver_chain *node = signal_malloc(global_context, sizeof(session_state_receiver_chain));
             if(!node) {
                 result = SG_ERR_NOMEM;
                 goto complete;
@@ -852,7 +793,7 @@ int session_state_deserialize_protobuf(session_state **state, Textsecure__Sessio
                     node, session_structure->receiverchains[i],
                     global_context);
             if(result < 0) {
-                free(node);
+                signal_free(global_context, node);
                 goto complete;
             }
 
@@ -1140,7 +1081,9 @@ static int session_state_deserialize_protobuf_receiver_chain(
     hkdf_context *kdf = 0;
     ec_public_key *sender_ratchet_key = 0;
     ratchet_chain_key *chain_key = 0;
-    message_keys_node *message_keys_head = 0;
+    message_key_ring *message_keys = 0;
+    message_key_checkpoints *checkpoints = 0;
+    ratchet_message_keys message_key;
 
     if(chain_structure->has_senderratchetkey) {
         result = curve_decode_point(&sender_ratchet_key,
@@ -1171,86 +1114,240 @@ static int session_state_deserialize_protobuf_receiver_chain(
 
     if(chain_structure->n_messagekeys > 0) {
         unsigned int i;
+        result = message_key_ring_create(&message_keys, sizeof(ratchet_message_keys), MAX_MESSAGE_KEYS, global_context);
+        if(result < 0) {
+            goto complete;
+        }
         for(i = 0; i < chain_structure->n_messagekeys; i++) {
             Textsecure__SessionStructure__Chain__MessageKey *key_structure =
                     chain_structure->messagekeys[i];
 
-            message_keys_node *node = malloc(sizeof(message_keys_node));
-            if(!node) {
-                result = SG_ERR_NOMEM;
-                goto complete;
-            }
-            memset(node, 0, sizeof(message_keys_node));
+            memset(&message_key, 0, sizeof(message_key));
 
             if(key_structure->has_index) {
-                node->message_key.counter = key_structure->index;
+                message_key.counter = key_structure->index;
             }
-            if(key_structure->has_cipherkey && key_structure->cipherkey.len == sizeof(node->message_key.cipher_key)) {
-                memcpy(node->message_key.cipher_key, key_structure->cipherkey.data, key_structure->cipherkey.len);
+            if(key_structure->has_cipherkey && key_structure->cipherkey.len == sizeof(message_key.cipher_key)) {
+                memcpy(message_key.cipher_key, key_structure->cipherkey.data, key_structure->cipherkey.len);
             }
-            if(key_structure->has_mackey && key_structure->mackey.len == sizeof(node->message_key.mac_key)) {
-                memcpy(node->message_key.mac_key, key_structure->mackey.data, key_structure->mackey.len);
+            if(key_structure->has_mackey && key_structure->mackey.len == sizeof(message_key.mac_key)) {
+                memcpy(message_key.mac_key, key_structure->mackey.data, key_structure->mackey.len);
             }
-            if(key_structure->has_iv && key_structure->iv.len == sizeof(node->message_key.iv)) {
-                memcpy(node->message_key.iv, key_structure->iv.data, key_structure->iv.len);
+            if(key_structure->has_iv && key_structure->iv.len == sizeof(message_key.iv)) {
+                memcpy(message_key.iv, key_structure->iv.data, key_structure->iv.len);
+            }
+
+            result = message_key_ring_push(message_keys, message_key.counter, &message_key);
+            if(result < 0) {
+                goto complete;
             }
+        }
+    }
 
-            DL_APPEND(message_keys_head, node);
+    if(chain_structure->n_messagekeycheckpoints > 0) {
+        unsigned int i;
+        uint32_t interval = global_context->skipped_key_checkpoint_interval;
+        result = message_key_checkpoints_create(&checkpoints,
+                interval > 0 ? interval : MESSAGE_KEY_CHECKPOINTS_MAX_INTERVAL,
+                MAX_MESSAGE_KEYS, global_context);
+        if(result < 0) {
+            goto complete;
+        }
+        for(i = 0; i < chain_structure->n_messagekeycheckpoints; i++) {
+            Textsecure__SessionStructure__Chain__ChainKey *checkpoint_structure =
+                    chain_structure->messagekeycheckpoints[i];
+
+            if(!checkpoint_structure->has_index || !checkpoint_structure->has_key) {
+                result = SG_ERR_INVALID_PROTO_BUF;
+                goto complete;
+            }
+            result = message_key_checkpoints_load_checkpoint(checkpoints,
+                    checkpoint_structure->index,
+                    checkpoint_structure->key.data, checkpoint_structure->key.len);
+            if(result < 0) {
+                goto complete;
+            }
+        }
+        if(chain_structure->has_skippedmessagekeys) {
+            result = message_key_checkpoints_load_bitmap(checkpoints,
+                    chain_structure->skippedmessagekeys.data,
+                    chain_structure->skippedmessagekeys.len);
+            if(result < 0) {
+                goto complete;
+            }
         }
     }
 
     chain->sender_ratchet_key = sender_ratchet_key;
     chain->chain_key = chain_key;
-    chain->message_keys_head = message_keys_head;
+    chain->message_keys = message_keys;
+    chain->checkpoints = checkpoints;
 
 complete:
     SIGNAL_UNREF(kdf);
+    signal_explicit_bzero(&message_key, sizeof(ratchet_message_keys));
     if(result < 0) {
         SIGNAL_UNREF(sender_ratchet_key);
         SIGNAL_UNREF(chain_key);
-        if(message_keys_head) {
-            message_keys_node *cur_node;
-            message_keys_node *tmp_node;
-            DL_FOREACH_SAFE(message_keys_head, cur_node, tmp_node) {
-                DL_DELETE(message_keys_head, cur_node);
-                signal_explicit_bzero(&cur_node->message_key, sizeof(ratchet_message_keys));
-                free(cur_node);
-            }
-        }
+        SIGNAL_UNREF(message_keys);
+        SIGNAL_UNREF(checkpoints);
     }
     return result;
 }
 
+static int session_state_copy_receiver_chains(session_state *state, const session_state *other_state)
+{
+    session_state_receiver_chain *cur_node;
+    session_state_receiver_chain *node;
+
+    DL_FOREACH(other_state->receiver_chain_head, cur_node) {
+        node = signal_malloc(state->global_context, sizeof(session_state_receiver_chain));
+        if(!node) {
+            return SG_ERR_NOMEM;
+        }
+        memset(node, 0, sizeof(session_state_receiver_chain));
+
+        /* Skipped message keys are shared until either side modifies them */
+        if(cur_node->sender_ratchet_key) {
+            SIGNAL_REF(cur_node->sender_ratchet_key);
+            node->sender_ratchet_key = cur_node->sender_ratchet_key;
+        }
+        if(cur_node->chain_key) {
+            SIGNAL_REF(cur_node->chain_key);
+            node->chain_key = cur_node->chain_key;
+        }
+        if(cur_node->message_keys) {
+            SIGNAL_REF(cur_node->message_keys);
+            node->message_keys = cur_node->message_keys;
+        }
+        if(cur_node->checkpoints) {
+            SIGNAL_REF(cur_node->checkpoints);
+            node->checkpoints = cur_node->checkpoints;
+        }
+
+        DL_APPEND(state->receiver_chain_head, node);
+    }
+    return 0;
+}
+
 int session_state_copy(session_state **state, session_state *other_state, signal_context *global_context)
 {
     int result = 0;
-    signal_buffer *buffer = 0;
-    size_t len = 0;
-    uint8_t *data = 0;
+    session_state *result_state = 0;
 
     assert(other_state);
     assert(global_context);
 
-    result = session_state_serialize(&buffer, other_state);
+    result = session_state_create(&result_state, global_context);
     if(result < 0) {
         goto complete;
     }
 
-    data = signal_buffer_data(buffer);
-    len = signal_buffer_len(buffer);
+    /*
+     * Keys and chain keys are immutable once created, so the copy
+     * shares them by reference rather than re-encoding the state.
+     */
+    result_state->session_version = other_state->session_version;
 
-    result = session_state_deserialize(state, data, len, global_context);
+    if(other_state->local_identity_public) {
+        SIGNAL_REF(other_state->local_identity_public);
+        result_state->local_identity_public = other_state->local_identity_public;
+    }
+    if(other_state->remote_identity_public) {
+        SIGNAL_REF(other_state->remote_identity_public);
+        result_state->remote_identity_public = other_state->remote_identity_public;
+    }
+    if(other_state->root_key) {
+        SIGNAL_REF(other_state->root_key);
+        result_state->root_key = other_state->root_key;
+    }
+    result_state->previous_counter = other_state->previous_counter;
+
+    result_state->has_sender_chain = other_state->has_sender_chain;
+    if(other_state->sender_chain.sender_ratchet_key_pair) {
+        SIGNAL_REF(other_state->sender_chain.sender_ratchet_key_pair);
+        result_state->sender_chain.sender_ratchet_key_pair = other_state->sender_chain.sender_ratchet_key_pair;
+    }
+    if(other_state->sender_chain.chain_key) {
+        SIGNAL_REF(other_state->sender_chain.chain_key);
+        result_state->sender_chain.chain_key = other_state->sender_chain.chain_key;
+    }
+
+    result = session_state_copy_receiver_chains(result_state, other_state);
     if(result < 0) {
         goto complete;
     }
 
+    result_state->has_pending_key_exchange = other_state->has_pending_key_exchange;
+    if(other_state->has_pending_key_exchange) {
+        result_state->pending_key_exchange.sequence = other_state->pending_key_exchange.sequence;
+        if(other_state->pending_key_exchange.local_base_key) {
+            SIGNAL_REF(other_state->pending_key_exchange.local_base_key);
+            result_state->pending_key_exchange.local_base_key = other_state->pending_key_exchange.local_base_key;
+        }
+        if(other_state->pending_key_exchange.local_ratchet_key) {
+            SIGNAL_REF(other_state->pending_key_exchange.local_ratchet_key);
+            result_state->pending_key_exchange.local_ratchet_key = other_state->pending_key_exchange.local_ratchet_key;
+        }
+        if(other_state->pending_key_exchange.local_identity_key) {
+            SIGNAL_REF(other_state->pending_key_exchange.local_identity_key);
+            result_state->pending_key_exchange.local_identity_key = other_state->pending_key_exchange.local_identity_key;
+        }
+    }
+
+    result_state->has_pending_pre_key = other_state->has_pending_pre_key;
+    if(other_state->has_pending_pre_key) {
+        result_state->pending_pre_key.has_pre_key_id = other_state->pending_pre_key.has_pre_key_id;
+        result_state->pending_pre_key.pre_key_id = other_state->pending_pre_key.pre_key_id;
+        result_state->pending_pre_key.signed_pre_key_id = other_state->pending_pre_key.signed_pre_key_id;
+        if(other_state->pending_pre_key.base_key) {
+            SIGNAL_REF(other_state->pending_pre_key.base_key);
+            result_state->pending_pre_key.base_key = other_state->pending_pre_key.base_key;
+        }
+    }
+
+    result_state->remote_registration_id = other_state->remote_registration_id;
+    result_state->local_registration_id = other_state->local_registration_id;
+    result_state->needs_refresh = other_state->needs_refresh;
+
+    if(other_state->alice_base_key) {
+        SIGNAL_REF(other_state->alice_base_key);
+        result_state->alice_base_key = other_state->alice_base_key;
+    }
+
 complete:
-    if(buffer) {
-        signal_buffer_free(buffer);
+    if(result >= 0) {
+        *state = result_state;
+    }
+    else {
+        SIGNAL_UNREF(result_state);
     }
     return result;
 }
 
+int session_state_checkpoint(session_state *state)
+{
+    int result = 0;
+
+    assert(state);
+
+    if(state->checkpoint) {
+        SIGNAL_UNREF(state->checkpoint);
+    }
+
+    result = session_state_copy(&state->checkpoint, state, state->global_context);
+    return result;
+}
+
+void session_state_commit(session_state *state)
+{
+    assert(state);
+
+    if(state->checkpoint) {
+        SIGNAL_UNREF(state->checkpoint);
+    }
+}
+
 void session_state_set_session_version(session_state *state, uint32_t version)
 {
     assert(state);
@@ -1395,7 +1492,6 @@ int session_state_has_sender_chain(const session_state *state)
 int session_state_has_message_keys(session_state *state, ec_public_key *sender_ephemeral, uint32_t counter)
 {
     session_state_receiver_chain *chain = 0;
-    message_keys_node *cur_node = 0;
 
     assert(state);
     assert(sender_ephemeral);
@@ -1405,12 +1501,12 @@ int session_state_has_message_keys(session_state *state, ec_public_key *sender_e
         return 0;
     }
 
-    DL_FOREACH(chain->message_keys_head, cur_node) {
-        if(cur_node->message_key.counter == counter) {
-            return 1;
-        }
+    if(chain->message_keys && message_key_ring_find(chain->message_keys, counter)) {
+        return 1;
+    }
+    if(chain->checkpoints && message_key_checkpoints_contains(chain->checkpoints, counter)) {
+        return 1;
     }
-
     return 0;
 }
 
@@ -1418,9 +1514,8 @@ int session_state_remove_message_keys(session_state *state,
         ratchet_message_keys *message_keys_result,
         ec_public_key *sender_ephemeral, uint32_t counter)
 {
+    int result = 0;
     session_state_receiver_chain *chain = 0;
-    message_keys_node *cur_node = 0;
-    message_keys_node *tmp_node = 0;
 
     assert(state);
     assert(message_keys_result);
@@ -1431,14 +1526,31 @@ int session_state_remove_message_keys(session_state *state,
         return 0;
     }
 
-    DL_FOREACH_SAFE(chain->message_keys_head, cur_node, tmp_node) {
-        if(cur_node->message_key.counter == counter) {
-            memcpy(message_keys_result, &(cur_node->message_key), sizeof(ratchet_message_keys));
-            DL_DELETE(chain->message_keys_head, cur_node);
-            signal_explicit_bzero(&cur_node->message_key, sizeof(ratchet_message_keys));
-            free(cur_node);
-            return 1;
+    if(chain->message_keys && message_key_ring_find(chain->message_keys, counter)) {
+        result = message_key_ring_unshare(&chain->message_keys);
+        if(result < 0) {
+            return result;
+        }
+        return message_key_ring_remove(chain->message_keys, counter, message_keys_result);
+    }
+
+    if(chain->checkpoints && message_key_checkpoints_contains(chain->checkpoints, counter)) {
+        uint8_t chain_key[MESSAGE_KEY_CHECKPOINT_KEY_LENGTH];
+
+        result = message_key_checkpoints_unshare(&chain->checkpoints);
+        if(result < 0) {
+            return result;
+        }
+        result = message_key_checkpoints_take(chain->checkpoints, counter, chain_key);
+        if(result == 1) {
+            result = ratchet_chain_key_get_message_keys_at(chain->chain_key,
+                    chain_key, sizeof(chain_key), counter, message_keys_result);
+            if(result >= 0) {
+                result = 1;
+            }
         }
+        signal_explicit_bzero(chain_key, sizeof(chain_key));
+        return result;
     }
 
     return 0;
@@ -1447,9 +1559,8 @@ int session_state_remove_message_keys(session_state *state,
 int session_state_set_message_keys(session_state *state,
         ec_public_key *sender_ephemeral, ratchet_message_keys *message_keys)
 {
+    int result = 0;
     session_state_receiver_chain *chain = 0;
-    message_keys_node *node = 0;
-    int count;
 
     assert(state);
     assert(sender_ephemeral);
@@ -1460,26 +1571,72 @@ int session_state_set_message_keys(session_state *state,
         return 0;
     }
 
-    node = malloc(sizeof(message_keys_node));
-    if(!node) {
-        return SG_ERR_NOMEM;
+    if(!chain->message_keys) {
+        result = message_key_ring_create(&chain->message_keys, sizeof(ratchet_message_keys), MAX_MESSAGE_KEYS,
+                state->global_context);
+        if(result < 0) {
+            return result;
+        }
     }
-    memcpy(&(node->message_key), message_keys, sizeof(ratchet_message_keys));
-    node->prev = 0;
-    node->next = 0;
+    else {
+        result = message_key_ring_unshare(&chain->message_keys);
+        if(result < 0) {
+            return result;
+        }
+    }
+
+    return message_key_ring_push(chain->message_keys, message_keys->counter, message_keys);
+}
 
-    DL_APPEND(chain->message_keys_head, node);
+int session_state_skip_message_keys(session_state *state,
+        ec_public_key *sender_ephemeral, ratchet_chain_key *chain_key, uint32_t counter)
+{
+    int result = 0;
+    session_state_receiver_chain *chain = 0;
+    signal_buffer *key = 0;
 
-    DL_COUNT(chain->message_keys_head, node, count);
-    while(count > MAX_MESSAGE_KEYS) {
-        node = chain->message_keys_head;
-        DL_DELETE(chain->message_keys_head, node);
-        signal_explicit_bzero(&node->message_key, sizeof(ratchet_message_keys));
-        free(node);
-        --count;
+    assert(state);
+    assert(sender_ephemeral);
+    assert(chain_key);
+    assert(state->global_context->skipped_key_checkpoint_interval > 0);
+
+    chain = session_state_find_receiver_chain(state, sender_ephemeral);
+    if(!chain) {
+        return SG_ERR_UNKNOWN;
     }
 
-    return 0;
+    result = ratchet_chain_key_get_key(chain_key, &key);
+    if(result < 0) {
+        goto complete;
+    }
+    if(signal_buffer_len(key) != MESSAGE_KEY_CHECKPOINT_KEY_LENGTH) {
+        result = SG_ERR_INVALID_KEY;
+        goto complete;
+    }
+
+    if(!chain->checkpoints) {
+        result = message_key_checkpoints_create(&chain->checkpoints,
+                state->global_context->skipped_key_checkpoint_interval,
+                MAX_MESSAGE_KEYS, state->global_context);
+    }
+    else {
+        result = message_key_checkpoints_unshare(&chain->checkpoints);
+    }
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = message_key_checkpoints_skip(chain->checkpoints,
+            signal_buffer_data(key), ratchet_chain_key_get_index(chain_key), counter);
+    if(result < 0) {
+        goto complete;
+    }
+
+    result = ratchet_chain_key_set_key(chain_key, signal_buffer_data(key), signal_buffer_len(key), counter);
+
+complete:
+    signal_buffer_bzero_free(key);
+    return result;
 }
 
 int session_state_add_receiver_chain(session_state *state, ec_public_key *sender_ratchet_key, ratchet_chain_key *chain_key)
@@ -1491,7 +1648,7 @@ int session_state_add_receiver_chain(session_state *state, ec_public_key *sender
     assert(sender_ratchet_key);
     assert(chain_key);
 
-    node = malloc(sizeof(session_state_receiver_chain));
+    node = signal_malloc(state->global_context, sizeof(session_state_receiver_chain));
     if(!node) {
         return SG_ERR_NOMEM;
     }
@@ -1508,7 +1665,7 @@ int session_state_add_receiver_chain(session_state *state, ec_public_key *sender
     while(count > 5) {
         node = state->receiver_chain_head;
         DL_DELETE(state->receiver_chain_head, node);
-        session_state_free_receiver_chain_node(node);
+        session_state_free_receiver_chain_node(node, state->global_context);
         --count;
     }
 
@@ -1566,6 +1723,27 @@ ratchet_chain_key *session_state_get_receiver_chain_key(session_state *state, ec
     return result;
 }
 
+int session_state_has_receiver_chain(const session_state *state, const ec_public_key *sender_ephemeral)
+{
+    assert(state);
+    return session_state_find_receiver_chain(state, sender_ephemeral) != 0;
+}
+
+ec_public_key *session_state_get_receiver_chain_ratchet_key(const session_state *state, int index)
+{
+    session_state_receiver_chain *cur_node;
+
+    assert(state);
+
+    DL_FOREACH(state->receiver_chain_head, cur_node) {
+        if(index == 0) {
+            return cur_node->sender_ratchet_key;
+        }
+        index--;
+    }
+    return 0;
+}
+
 void session_state_set_pending_key_exchange(session_state *state,
         uint32_t sequence,
         ec_key_pair *our_base_key, ec_key_pair *our_ratchet_key,
@@ -1784,7 +1962,7 @@ static void session_state_free_sender_chain(session_state *state)
     }
 }
 
-static void session_state_free_receiver_chain_node(session_state_receiver_chain *node)
+static void session_state_free_receiver_chain_node(session_state_receiver_chain *node, signal_context *global_context)
 {
     if(node->sender_ratchet_key) {
         SIGNAL_UNREF(node->sender_ratchet_key);
@@ -1793,18 +1971,14 @@ static void session_state_free_receiver_chain_node(session_state_receiver_chain
         SIGNAL_UNREF(node->chain_key);
     }
 
-    if(node->message_keys_head) {
-        message_keys_node *cur_node;
-        message_keys_node *tmp_node;
-        DL_FOREACH_SAFE(node->message_keys_head, cur_node, tmp_node) {
-            DL_DELETE(node->message_keys_head, cur_node);
-            signal_explicit_bzero(&cur_node->message_key, sizeof(ratchet_message_keys));
-            free(cur_node);
-        }
-        node->message_keys_head = 0;
+    if(node->message_keys) {
+        SIGNAL_UNREF(node->message_keys);
+    }
+    if(node->checkpoints) {
+        SIGNAL_UNREF(node->checkpoints);
     }
 
-    free(node);
+    signal_free(global_context, node);
 }
 
 static void session_state_free_receiver_chain(session_state *state)
@@ -1813,15 +1987,16 @@ static void session_state_free_receiver_chain(session_state *state)
     session_state_receiver_chain *tmp_node;
     DL_FOREACH_SAFE(state->receiver_chain_head, cur_node, tmp_node) {
         DL_DELETE(state->receiver_chain_head, cur_node);
-        session_state_free_receiver_chain_node(cur_node);
+        session_state_free_receiver_chain_node(cur_node, state->global_context);
     }
     state->receiver_chain_head = 0;
 }
 
-void session_state_destroy(signal_type_base *type)
+static void session_state_free_contents(session_state *state)
 {
-    session_state *state = (session_state *)type;
-
+    if(state->checkpoint) {
+        SIGNAL_UNREF(state->checkpoint);
+    }
     if(state->local_identity_public) {
         SIGNAL_UNREF(state->local_identity_public);
     }
@@ -1852,5 +2027,32 @@ void session_state_destroy(signal_type_base *type)
     if(state->alice_base_key) {
         SIGNAL_UNREF(state->alice_base_key);
     }
-    free(state);
+}
+
+void session_state_rollback(session_state *state)
+{
+    session_state *checkpoint;
+    signal_type_base base;
+
+    assert(state);
+
+    checkpoint = state->checkpoint;
+    if(!checkpoint) {
+        return;
+    }
+    state->checkpoint = 0;
+
+    /* Take over everything the checkpoint owns, keeping our own reference count */
+    session_state_free_contents(state);
+    base = state->base;
+    memcpy(state, checkpoint, sizeof(session_state));
+    state->base = base;
+    signal_free(checkpoint->global_context, checkpoint);
+}
+
+void session_state_destroy(signal_type_base *type)
+{
+    session_state *state = (session_state *)type;
+    session_state_free_contents(state);
+    signal_free(state->global_context, state);
 }
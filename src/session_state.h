@@ -16,6 +16,15 @@ int session_state_serialize(signal_buffer **buffer, session_state *state);
 int session_state_deserialize(session_state **state, const uint8_t *data, size_t len, signal_context *global_context);
 int session_state_copy(session_state **state, session_state *other_state, signal_context *global_context);
 
+/*
+ * Tentative updates: session_state_checkpoint() saves a copy-on-write
+ * snapshot of the state, which session_state_rollback() restores in place
+ * and session_state_commit() discards.
+ */
+int session_state_checkpoint(session_state *state);
+void session_state_commit(session_state *state);
+void session_state_rollback(session_state *state);
+
 void session_state_set_session_version(session_state *state, uint32_t version);
 uint32_t session_state_get_session_version(const session_state *state);
 
@@ -45,9 +54,26 @@ int session_state_remove_message_keys(session_state *state,
 int session_state_set_message_keys(session_state *state,
         ec_public_key *sender_ephemeral, ratchet_message_keys *message_keys);
 
+/**
+ * Advance a private copy of a receiver chain key to the given counter,
+ * recording the skipped positions as checkpoints of that receiver chain
+ * instead of storing their message keys.
+ *
+ * @return 0 on success, negative on failure
+ */
+int session_state_skip_message_keys(session_state *state,
+        ec_public_key *sender_ephemeral, ratchet_chain_key *chain_key, uint32_t counter);
+
 int session_state_add_receiver_chain(session_state *state, ec_public_key *sender_ratchet_key, ratchet_chain_key *chain_key);
 int session_state_set_receiver_chain_key(session_state *state, ec_public_key *sender_ephemeral, ratchet_chain_key *chain_key);
 ratchet_chain_key *session_state_get_receiver_chain_key(session_state *state, ec_public_key *sender_ephemeral);
+int session_state_has_receiver_chain(const session_state *state, const ec_public_key *sender_ephemeral);
+
+/**
+ * @return the sender ratchet key of the receiver chain at index, oldest
+ *     first, or 0 if the state has no more receiver chains
+ */
+ec_public_key *session_state_get_receiver_chain_ratchet_key(const session_state *state, int index);
 
 void session_state_set_pending_key_exchange(session_state *state,
         uint32_t sequence,
@@ -0,0 +1,129 @@
+#include "signal_arena.h"
+
+#include <string.h>
+#include <assert.h>
+
+#include "signal_protocol_internal.h"
+
+#define SIGNAL_ARENA_ALIGNMENT 16
+#define SIGNAL_ARENA_MIN_BLOCK_SIZE 1024
+#define SIGNAL_ARENA_MAX_BLOCK_SIZE 65536
+
+#define SIGNAL_ARENA_ALIGN(size) (((size) + (SIGNAL_ARENA_ALIGNMENT - 1)) & ~(size_t)(SIGNAL_ARENA_ALIGNMENT - 1))
+
+struct signal_arena_block
+{
+    signal_arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+#define SIGNAL_ARENA_BLOCK_HEADER_SIZE SIGNAL_ARENA_ALIGN(sizeof(signal_arena_block))
+
+static void *signal_arena_protobuf_alloc(void *allocator_data, size_t size);
+static void signal_arena_protobuf_free(void *allocator_data, void *pointer);
+
+void signal_arena_init(signal_arena *arena, signal_context *global_context, size_t size_hint)
+{
+    assert(arena);
+    arena->global_context = global_context;
+    arena->blocks = 0;
+    if(size_hint > SIZE_MAX - SIGNAL_ARENA_BLOCK_HEADER_SIZE - SIGNAL_ARENA_ALIGNMENT) {
+        size_hint = SIGNAL_ARENA_MAX_BLOCK_SIZE;
+    }
+    arena->next_block_size = size_hint < SIGNAL_ARENA_MIN_BLOCK_SIZE
+            ? SIGNAL_ARENA_MIN_BLOCK_SIZE : SIGNAL_ARENA_ALIGN(size_hint);
+    arena->protobuf_allocator.alloc = signal_arena_protobuf_alloc;
+    arena->protobuf_allocator.free = signal_arena_protobuf_free;
+    arena->protobuf_allocator.allocator_data = arena;
+}
+
+void *signal_arena_alloc(signal_arena *arena, size_t size)
+{
+    signal_arena_block *block = arena->blocks;
+    uint8_t *result;
+
+    if(size > SIZE_MAX - SIGNAL_ARENA_BLOCK_HEADER_SIZE - SIGNAL_ARENA_ALIGNMENT) {
+        return 0;
+    }
+    size = size == 0 ? SIGNAL_ARENA_ALIGNMENT : SIGNAL_ARENA_ALIGN(size);
+
+    if(!block || block->size - block->used < size) {
+        size_t block_size = size > arena->next_block_size ? size : arena->next_block_size;
+        signal_arena_block *new_block = signal_malloc(arena->global_context,
+                SIGNAL_ARENA_BLOCK_HEADER_SIZE + block_size);
+        if(!new_block) {
+            return 0;
+        }
+        new_block->size = block_size;
+        new_block->used = 0;
+
+        /* An oversized allocation gets a block of its own, behind the one still being filled */
+        if(block && size > arena->next_block_size) {
+            new_block->next = block->next;
+            block->next = new_block;
+        }
+        else {
+            new_block->next = block;
+            arena->blocks = new_block;
+            if(arena->next_block_size < SIGNAL_ARENA_MAX_BLOCK_SIZE) {
+                arena->next_block_size *= 2;
+            }
+        }
+        block = new_block;
+    }
+
+    result = (uint8_t *)block + SIGNAL_ARENA_BLOCK_HEADER_SIZE + block->used;
+    block->used += size;
+    return result;
+}
+
+void *signal_arena_calloc(signal_arena *arena, size_t count, size_t size)
+{
+    void *result;
+    if(size != 0 && count > SIZE_MAX / size) {
+        return 0;
+    }
+
+    result = signal_arena_alloc(arena, count * size);
+    if(result) {
+        memset(result, 0, count * size);
+    }
+    return result;
+}
+
+void *signal_arena_memdup(signal_arena *arena, const void *data, size_t len)
+{
+    void *result = signal_arena_alloc(arena, len);
+    if(result && len > 0) {
+        memcpy(result, data, len);
+    }
+    return result;
+}
+
+ProtobufCAllocator *signal_arena_protobuf_allocator(signal_arena *arena)
+{
+    return &arena->protobuf_allocator;
+}
+
+void signal_arena_release(signal_arena *arena)
+{
+    signal_arena_block *block = arena->blocks;
+    while(block) {
+        signal_arena_block *next = block->next;
+        signal_explicit_bzero((uint8_t *)block + SIGNAL_ARENA_BLOCK_HEADER_SIZE, block->used);
+        signal_free(arena->global_context, block);
+        block = next;
+    }
+    arena->blocks = 0;
+}
+
+static void *signal_arena_protobuf_alloc(void *allocator_data, size_t size)
+{
+    return signal_arena_alloc(allocator_data, size);
+}
+
+static void signal_arena_protobuf_free(void *allocator_data, void *pointer)
+{
+    /* Released with the arena */
+}
@@ -0,0 +1,76 @@
+#ifndef SIGNAL_ARENA_H
+#define SIGNAL_ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <protobuf-c/protobuf-c.h>
+#include "signal_protocol_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Scratch memory for a single serialize or deserialize operation.
+ *
+ * Allocations are carved out of large blocks taken from the context
+ * allocator, and are never freed individually. Everything is released at
+ * once by signal_arena_release(), which also zeroes the memory, since the
+ * transient protobuf structures of a record hold key material.
+ *
+ * An arena lives on the stack of the operation that uses it and must not
+ * outlive it.
+ */
+typedef struct signal_arena_block signal_arena_block;
+
+/* Unpacked protobuf structures take up to about this many times their encoded size */
+#define SIGNAL_ARENA_UNPACK_SIZE_FACTOR 4
+
+typedef struct signal_arena
+{
+    signal_context *global_context;
+    signal_arena_block *blocks;
+    size_t next_block_size;
+    ProtobufCAllocator protobuf_allocator;
+} signal_arena;
+
+/**
+ * Prepare an arena. No memory is taken until the first allocation.
+ *
+ * @param size_hint expected total size of the allocations, used to size
+ *     the first block
+ */
+void signal_arena_init(signal_arena *arena, signal_context *global_context, size_t size_hint);
+
+/**
+ * @return size bytes of memory aligned for any type, or 0 on failure
+ */
+void *signal_arena_alloc(signal_arena *arena, size_t size);
+
+/**
+ * @return memory for count zeroed elements of size bytes, or 0 on failure
+ */
+void *signal_arena_calloc(signal_arena *arena, size_t count, size_t size);
+
+/**
+ * @return a copy of len bytes of data, or 0 on failure
+ */
+void *signal_arena_memdup(signal_arena *arena, const void *data, size_t len);
+
+/**
+ * Allocator for protobuf-c unpacking into the arena. Its free function
+ * does nothing, so calling __free_unpacked() on the result is unnecessary.
+ */
+ProtobufCAllocator *signal_arena_protobuf_allocator(signal_arena *arena);
+
+/**
+ * Zero and free everything allocated from the arena. The arena may be used
+ * again afterwards.
+ */
+void signal_arena_release(signal_arena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SIGNAL_ARENA_H */
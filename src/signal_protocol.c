@@ -9,10 +9,16 @@
 
 #include "signal_protocol_internal.h"
 #include "signal_utarray.h"
+#include "curve.h"
+#include "message_key_checkpoints.h"
+#include "session_record_cache.h"
+#include "signal_random.h"
 
 #ifdef _WINDOWS
 #include "Windows.h"
 #include "WinBase.h"
+#else
+#include <sched.h>
 #endif
 
 #ifdef DEBUG_REFCOUNT
@@ -22,6 +28,13 @@ int type_unref_count = 0;
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
+struct signal_key_pair_pool {
+    ec_key_pair **key_pairs;
+    size_t count;
+    size_t capacity;
+    void (*refill_needed)(void *user_data);
+};
+
 struct signal_protocol_store_context {
     signal_context *global_context;
     signal_protocol_session_store session_store;
@@ -29,12 +42,18 @@ struct signal_protocol_store_context {
     signal_protocol_signed_pre_key_store signed_pre_key_store;
     signal_protocol_identity_key_store identity_key_store;
     signal_protocol_sender_key_store sender_key_store;
+    session_record_cache *session_cache;
+    int session_cache_write_policy;
 };
 
 void signal_type_init(signal_type_base *instance,
         void (*destroy_func)(signal_type_base *instance))
 {
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    atomic_init(&instance->ref_count, 1);
+#else
     instance->ref_count = 1;
+#endif
     instance->destroy = destroy_func;
 #ifdef DEBUG_REFCOUNT
     type_ref_count++;
@@ -47,8 +66,17 @@ void signal_type_ref(signal_type_base *instance)
     type_ref_count++;
 #endif
     assert(instance);
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    /* A new reference can only be made from an existing one, so no ordering is needed */
+    {
+        unsigned int previous = atomic_fetch_add_explicit(&instance->ref_count, 1, memory_order_relaxed);
+        assert(previous > 0);
+        (void)previous;
+    }
+#else
     assert(instance->ref_count > 0);
     instance->ref_count++;
+#endif
 }
 
 void signal_type_unref(signal_type_base *instance)
@@ -57,6 +85,18 @@ void signal_type_unref(signal_type_base *instance)
 #ifdef DEBUG_REFCOUNT
     type_unref_count++;
 #endif
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+        /*
+         * Each release publishes this thread's use of the instance, and the
+         * acquire on the last one makes every other thread's use visible
+         * before it is destroyed.
+         */
+        unsigned int previous = atomic_fetch_sub_explicit(&instance->ref_count, 1, memory_order_acq_rel);
+        assert(previous > 0);
+        if(previous == 1) {
+            instance->destroy(instance);
+        }
+#else
         assert(instance->ref_count > 0);
         if(instance->ref_count > 1) {
             instance->ref_count--;
@@ -64,6 +104,7 @@ void signal_type_unref(signal_type_base *instance)
         else {
             instance->destroy(instance);
         }
+#endif
     }
 }
 
@@ -73,29 +114,55 @@ int signal_type_ref_count(signal_type_base *instance)
     if(!instance) {
         return 0;
     }
-    return instance->ref_count;
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    return (int)atomic_load_explicit(&instance->ref_count, memory_order_relaxed);
+#else
+    return (int)instance->ref_count;
+#endif
 }
 #endif
 
+int signal_type_is_unique(const signal_type_base *instance)
+{
+    assert(instance);
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    /* Acquire pairs with the release in signal_type_unref() of the other holders */
+    return atomic_load_explicit((signal_ref_count *)&instance->ref_count, memory_order_acquire) == 1;
+#else
+    return instance->ref_count == 1;
+#endif
+}
+
 /*------------------------------------------------------------------------*/
 
 signal_buffer *signal_buffer_alloc(size_t len)
+{
+    return signal_buffer_context_alloc(0, len);
+}
+
+signal_buffer *signal_buffer_context_alloc(signal_context *context, size_t len)
 {
     signal_buffer *buffer;
     if(len > (SIZE_MAX - sizeof(struct signal_buffer)) / sizeof(uint8_t)) {
         return 0;
     }
 
-    buffer = malloc(sizeof(struct signal_buffer) + (sizeof(uint8_t) * len));
+    buffer = signal_malloc(context, sizeof(struct signal_buffer) + (sizeof(uint8_t) * len));
     if(buffer) {
         buffer->len = len;
+        buffer->context = context;
     }
     return buffer;
 }
 
 signal_buffer *signal_buffer_create(const uint8_t *data, size_t len)
 {
-    signal_buffer *buffer = signal_buffer_alloc(len);
+    return signal_buffer_context_create(0, data, len);
+}
+
+signal_buffer *signal_buffer_context_create(signal_context *context, const uint8_t *data, size_t len)
+{
+    signal_buffer *buffer = signal_buffer_context_alloc(context, len);
     if(!buffer) {
         return 0;
     }
@@ -106,13 +173,13 @@ signal_buffer *signal_buffer_create(const uint8_t *data, size_t len)
 
 signal_buffer *signal_buffer_copy(const signal_buffer *buffer)
 {
-    return signal_buffer_create(buffer->data, buffer->len);
+    return signal_buffer_context_create(buffer->context, buffer->data, buffer->len);
 }
 
 signal_buffer *signal_buffer_n_copy(const signal_buffer *buffer, size_t n)
 {
     size_t len = MIN(buffer->len, n);
-    return signal_buffer_create(buffer->data, len);
+    return signal_buffer_context_create(buffer->context, buffer->data, len);
 }
 
 signal_buffer *signal_buffer_append(signal_buffer *buffer, const uint8_t *data, size_t len)
@@ -125,7 +192,7 @@ signal_buffer *signal_buffer_append(signal_buffer *buffer, const uint8_t *data,
         return 0;
     }
 
-    tmp_buffer = realloc(buffer, previous_alloc + (sizeof(uint8_t) * len));
+    tmp_buffer = signal_realloc(buffer->context, buffer, previous_alloc + (sizeof(uint8_t) * len));
     if(!tmp_buffer) {
         return 0;
     }
@@ -177,7 +244,7 @@ int signal_buffer_compare(signal_buffer *buffer1, signal_buffer *buffer2)
 void signal_buffer_free(signal_buffer *buffer)
 {
     if(buffer) {
-        free(buffer);
+        signal_free(buffer->context, buffer);
     }
 }
 
@@ -185,7 +252,7 @@ void signal_buffer_bzero_free(signal_buffer *buffer)
 {
     if(buffer) {
         signal_explicit_bzero(buffer->data, buffer->len);
-        free(buffer);
+        signal_free(buffer->context, buffer);
     }
 }
 
@@ -399,6 +466,10 @@ int signal_context_create(signal_context **context, void *user_data)
     }
     memset(*context, 0, sizeof(signal_context));
     (*context)->user_data = user_data;
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    atomic_init(&(*context)->random_pool, 0);
+    atomic_init(&(*context)->random_pool_users, 0);
+#endif
 #ifdef DEBUG_REFCOUNT
     type_ref_count = 0;
     type_unref_count = 0;
@@ -406,8 +477,61 @@ int signal_context_create(signal_context **context, void *user_data)
     return 0;
 }
 
+/*
+ * Get the random pool, or 0 if buffering is off, for use until the matching
+ * signal_context_put_random_pool(). With atomics, the caller is counted
+ * before the pool is loaded, so that turning buffering off can wait for it
+ * before freeing the pool, and uncounted right away if there is no pool.
+ * Otherwise the global lock is held while a pool is in use, and the pointer
+ * is read again under it.
+ */
+static signal_random_pool *signal_context_get_random_pool(signal_context *context)
+{
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    signal_random_pool *pool;
+
+    atomic_fetch_add_explicit(&context->random_pool_users, 1, memory_order_seq_cst);
+    pool = atomic_load_explicit(&context->random_pool, memory_order_seq_cst);
+    if(!pool) {
+        atomic_fetch_sub_explicit(&context->random_pool_users, 1, memory_order_release);
+    }
+    return pool;
+#else
+    signal_random_pool *pool;
+
+    /*
+     * Without buffering, the global lock is not needed at all. The unlocked
+     * read is why buffering may only be toggled while the context is idle.
+     */
+    if(!context->random_pool) {
+        return 0;
+    }
+    signal_lock(context);
+    pool = context->random_pool;
+    if(!pool) {
+        signal_unlock(context);
+    }
+    return pool;
+#endif
+}
+
+static void signal_context_put_random_pool(signal_context *context, signal_random_pool *pool)
+{
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    if(pool) {
+        atomic_fetch_sub_explicit(&context->random_pool_users, 1, memory_order_release);
+    }
+#else
+    if(pool) {
+        signal_unlock(context);
+    }
+#endif
+}
+
 int signal_context_set_crypto_provider(signal_context *context, const signal_crypto_provider *crypto_provider)
 {
+    signal_random_pool *pool;
+
     assert(context);
     if(!crypto_provider
             || !crypto_provider->hmac_sha256_init_func
@@ -417,6 +541,11 @@ int signal_context_set_crypto_provider(signal_context *context, const signal_cry
         return SG_ERR_INVAL;
     }
     memcpy(&(context->crypto_provider), crypto_provider, sizeof(signal_crypto_provider));
+    pool = signal_context_get_random_pool(context);
+    if(pool) {
+        signal_random_pool_reseed(pool);
+    }
+    signal_context_put_random_pool(context, pool);
     return 0;
 }
 
@@ -433,6 +562,258 @@ int signal_context_set_locking_functions(signal_context *context,
     return 0;
 }
 
+int signal_context_set_address_locking_functions(signal_context *context,
+        void (*lock)(const signal_protocol_address *address, int mode, void *user_data),
+        void (*unlock)(const signal_protocol_address *address, int mode, void *user_data))
+{
+    assert(context);
+    if((lock && !unlock) || (!lock && unlock)) {
+        return SG_ERR_INVAL;
+    }
+
+    context->lock_address = lock;
+    context->unlock_address = unlock;
+    return 0;
+}
+
+int signal_context_set_sender_key_locking_functions(signal_context *context,
+        void (*lock)(const signal_protocol_sender_key_name *sender_key_name, int mode, void *user_data),
+        void (*unlock)(const signal_protocol_sender_key_name *sender_key_name, int mode, void *user_data))
+{
+    assert(context);
+    if((lock && !unlock) || (!lock && unlock)) {
+        return SG_ERR_INVAL;
+    }
+
+    context->lock_sender_key = lock;
+    context->unlock_sender_key = unlock;
+    return 0;
+}
+
+int signal_context_set_skipped_key_checkpoint_interval(signal_context *context, uint32_t interval)
+{
+    assert(context);
+    if(interval > MESSAGE_KEY_CHECKPOINTS_MAX_INTERVAL) {
+        return SG_ERR_INVAL;
+    }
+
+    context->skipped_key_checkpoint_interval = interval;
+    return 0;
+}
+
+int signal_context_set_random_buffering(signal_context *context, int enabled)
+{
+    int result = 0;
+    signal_random_pool *pool = 0;
+
+    assert(context);
+
+    if(enabled) {
+        result = signal_random_pool_create(&pool, context);
+        if(result < 0) {
+            return result;
+        }
+    }
+
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    if(enabled) {
+        signal_random_pool *expected = 0;
+        if(atomic_compare_exchange_strong_explicit(&context->random_pool, &expected, pool,
+                memory_order_seq_cst, memory_order_seq_cst)) {
+            pool = 0;
+        }
+    }
+    else {
+        pool = atomic_exchange_explicit(&context->random_pool, 0, memory_order_seq_cst);
+        if(pool) {
+            /* Only calls that loaded the pool before it was unpublished stay counted */
+            while(atomic_load_explicit(&context->random_pool_users, memory_order_seq_cst) != 0) {
+#ifdef _WINDOWS
+                SwitchToThread();
+#else
+                sched_yield();
+#endif
+            }
+        }
+    }
+#else
+    signal_lock(context);
+    if(enabled && !context->random_pool) {
+        context->random_pool = pool;
+        pool = 0;
+    }
+    else if(!enabled) {
+        pool = context->random_pool;
+        context->random_pool = 0;
+    }
+    signal_unlock(context);
+#endif
+
+    signal_random_pool_free(pool);
+    return 0;
+}
+
+static void signal_key_pair_pool_free(signal_context *context, signal_key_pair_pool *pool)
+{
+    size_t i;
+    if(pool) {
+        for(i = 0; i < pool->count; i++) {
+            SIGNAL_UNREF(pool->key_pairs[i]);
+        }
+        signal_free(context, pool->key_pairs);
+        signal_free(context, pool);
+    }
+}
+
+int signal_context_set_key_pair_pool(signal_context *context, size_t capacity,
+        void (*refill_needed)(void *user_data))
+{
+    signal_key_pair_pool *pool = 0;
+    signal_key_pair_pool *old_pool = 0;
+
+    assert(context);
+
+    if(capacity > 0) {
+        pool = signal_malloc(context, sizeof(signal_key_pair_pool));
+        if(!pool) {
+            return SG_ERR_NOMEM;
+        }
+        pool->key_pairs = signal_calloc(context, capacity, sizeof(ec_key_pair *));
+        if(!pool->key_pairs) {
+            signal_free(context, pool);
+            return SG_ERR_NOMEM;
+        }
+        pool->count = 0;
+        pool->capacity = capacity;
+        pool->refill_needed = refill_needed;
+    }
+
+    /* Key pairs already generated carry over, up to the new capacity */
+    signal_lock(context);
+    old_pool = context->key_pair_pool;
+    if(pool && old_pool) {
+        while(old_pool->count > 0 && pool->count < pool->capacity) {
+            pool->key_pairs[pool->count++] = old_pool->key_pairs[--old_pool->count];
+        }
+    }
+    context->key_pair_pool = pool;
+    signal_unlock(context);
+
+    signal_key_pair_pool_free(context, old_pool);
+    return 0;
+}
+
+int signal_context_refill_key_pair_pool(signal_context *context)
+{
+    int result = 0;
+    int added = 0;
+    int full = 0;
+    ec_key_pair *key_pair = 0;
+
+    assert(context);
+
+    for(;;) {
+        signal_lock(context);
+        full = !context->key_pair_pool || context->key_pair_pool->count >= context->key_pair_pool->capacity;
+        signal_unlock(context);
+        if(full) {
+            break;
+        }
+
+        result = curve_generate_key_pair(context, &key_pair);
+        if(result < 0) {
+            return result;
+        }
+
+        /* The pool may have been filled or replaced meanwhile */
+        signal_lock(context);
+        if(context->key_pair_pool && context->key_pair_pool->count < context->key_pair_pool->capacity) {
+            context->key_pair_pool->key_pairs[context->key_pair_pool->count++] = key_pair;
+            key_pair = 0;
+            added++;
+        }
+        signal_unlock(context);
+
+        if(key_pair) {
+            SIGNAL_UNREF(key_pair);
+            break;
+        }
+    }
+
+    return added;
+}
+
+size_t signal_context_get_key_pair_pool_count(signal_context *context)
+{
+    size_t count = 0;
+
+    assert(context);
+
+    signal_lock(context);
+    if(context->key_pair_pool) {
+        count = context->key_pair_pool->count;
+    }
+    signal_unlock(context);
+    return count;
+}
+
+int signal_generate_ephemeral_key_pair(signal_context *context, ec_key_pair **key_pair)
+{
+    ec_key_pair *pooled = 0;
+    void (*refill_needed)(void *user_data) = 0;
+
+    assert(context);
+
+    if(context->key_pair_pool) {
+        signal_lock(context);
+        if(context->key_pair_pool && context->key_pair_pool->count > 0) {
+            pooled = context->key_pair_pool->key_pairs[--context->key_pair_pool->count];
+            context->key_pair_pool->key_pairs[context->key_pair_pool->count] = 0;
+            if(context->key_pair_pool->count <= context->key_pair_pool->capacity / 2) {
+                refill_needed = context->key_pair_pool->refill_needed;
+            }
+        }
+        else if(context->key_pair_pool) {
+            refill_needed = context->key_pair_pool->refill_needed;
+        }
+        signal_unlock(context);
+
+        if(refill_needed) {
+            refill_needed(context->user_data);
+        }
+    }
+
+    if(pooled) {
+        *key_pair = pooled;
+        return 0;
+    }
+    return curve_generate_key_pair(context, key_pair);
+}
+
+static void *signal_protobuf_alloc(void *allocator_data, size_t size);
+static void signal_protobuf_free(void *allocator_data, void *ptr);
+
+int signal_context_set_allocator(signal_context *context,
+        void *(*malloc_func)(size_t size, void *user_data),
+        void *(*realloc_func)(void *ptr, size_t size, void *user_data),
+        void (*free_func)(void *ptr, void *user_data),
+        void *user_data)
+{
+    assert(context);
+    if(!malloc_func || !realloc_func || !free_func) {
+        return SG_ERR_INVAL;
+    }
+
+    context->malloc_func = malloc_func;
+    context->realloc_func = realloc_func;
+    context->free_func = free_func;
+    context->allocator_user_data = user_data;
+    context->protobuf_allocator.alloc = signal_protobuf_alloc;
+    context->protobuf_allocator.free = signal_protobuf_free;
+    context->protobuf_allocator.allocator_data = context;
+    return 0;
+}
+
 int signal_context_set_log_function(signal_context *context,
         void (*log)(int level, const char *message, size_t len, void *user_data))
 {
@@ -448,16 +829,94 @@ void signal_context_destroy(signal_context *context)
     fprintf(stderr, "Global UNREF count: %d\n", type_unref_count);
 #endif
     if(context) {
+        signal_random_pool_free(context->random_pool);
+        signal_key_pair_pool_free(context, context->key_pair_pool);
         free(context);
     }
 }
 
 /*------------------------------------------------------------------------*/
 
+void *signal_malloc(signal_context *context, size_t size)
+{
+    if(context && context->malloc_func) {
+        return context->malloc_func(size, context->allocator_user_data);
+    }
+    return malloc(size);
+}
+
+void *signal_calloc(signal_context *context, size_t count, size_t size)
+{
+    void *ptr;
+    if(size != 0 && count > SIZE_MAX / size) {
+        return 0;
+    }
+
+    ptr = signal_malloc(context, count * size);
+    if(ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void *signal_realloc(signal_context *context, void *ptr, size_t size)
+{
+    if(context && context->realloc_func) {
+        return context->realloc_func(ptr, size, context->allocator_user_data);
+    }
+    return realloc(ptr, size);
+}
+
+void signal_free(signal_context *context, void *ptr)
+{
+    if(!ptr) {
+        return;
+    }
+    if(context && context->free_func) {
+        context->free_func(ptr, context->allocator_user_data);
+    }
+    else {
+        free(ptr);
+    }
+}
+
+static void *signal_protobuf_alloc(void *allocator_data, size_t size)
+{
+    return signal_malloc(allocator_data, size);
+}
+
+static void signal_protobuf_free(void *allocator_data, void *ptr)
+{
+    signal_free(allocator_data, ptr);
+}
+
+ProtobufCAllocator *signal_protobuf_allocator(signal_context *global_context)
+{
+    if(!global_context || !global_context->malloc_func) {
+        return 0;
+    }
+    return &global_context->protobuf_allocator;
+}
+
+/*------------------------------------------------------------------------*/
+
 int signal_crypto_random(signal_context *context, uint8_t *data, size_t len)
 {
+    int result = 0;
+    signal_random_pool *pool;
+
     assert(context);
     assert(context->crypto_provider.random_func);
+
+    pool = signal_context_get_random_pool(context);
+    if(pool) {
+        result = signal_random_pool_fill(pool, data, len);
+    }
+    signal_context_put_random_pool(context, pool);
+    if(pool) {
+        return result;
+    }
+
     return context->crypto_provider.random_func(data, len, context->crypto_provider.user_data);
 }
 
@@ -482,6 +941,76 @@ int signal_hmac_sha256_final(signal_context *context, void *hmac_context, signal
     return context->crypto_provider.hmac_sha256_final_func(hmac_context, output, context->crypto_provider.user_data);
 }
 
+int signal_hmac_sha256_final_into(signal_context *context, void *hmac_context, uint8_t *output)
+{
+    int result = 0;
+    signal_buffer *output_buffer = 0;
+
+    assert(context);
+
+    if(context->crypto_provider.hmac_sha256_final_reset_func) {
+        return context->crypto_provider.hmac_sha256_final_reset_func(hmac_context, output, context->crypto_provider.user_data);
+    }
+
+    result = signal_hmac_sha256_final(context, hmac_context, &output_buffer);
+    if(result < 0) {
+        return result;
+    }
+
+    if(signal_buffer_len(output_buffer) != SIGNAL_HMAC_SHA256_LENGTH) {
+        result = SG_ERR_UNKNOWN;
+    }
+    else {
+        memcpy(output, signal_buffer_data(output_buffer), SIGNAL_HMAC_SHA256_LENGTH);
+    }
+
+    signal_buffer_bzero_free(output_buffer);
+    return result;
+}
+
+int signal_hmac_sha256_can_reset(signal_context *context)
+{
+    assert(context);
+    return context->crypto_provider.hmac_sha256_final_reset_func != 0;
+}
+
+int signal_hmac_sha256(signal_context *context,
+        const uint8_t *key, size_t key_len,
+        const signal_iovec *iov, size_t iov_count,
+        uint8_t *output)
+{
+    int result = 0;
+    void *hmac_context = 0;
+    size_t i;
+
+    assert(context);
+
+    if(context->crypto_provider.hmac_sha256_oneshot_func) {
+        return context->crypto_provider.hmac_sha256_oneshot_func(key, key_len,
+                iov, iov_count, output, context->crypto_provider.user_data);
+    }
+
+    result = signal_hmac_sha256_init(context, &hmac_context, key, key_len);
+    if(result < 0) {
+        goto complete;
+    }
+
+    for(i = 0; i < iov_count; i++) {
+        result = signal_hmac_sha256_update(context, hmac_context, iov[i].data, iov[i].len);
+        if(result < 0) {
+            goto complete;
+        }
+    }
+
+    result = signal_hmac_sha256_final_into(context, hmac_context, output);
+
+complete:
+    if(hmac_context) {
+        signal_hmac_sha256_cleanup(context, hmac_context);
+    }
+    return result;
+}
+
 void signal_hmac_sha256_cleanup(signal_context *context, void *hmac_context)
 {
     assert(context);
@@ -561,11 +1090,105 @@ void signal_unlock(signal_context *context)
     }
 }
 
-void signal_log(signal_context *context, int level, const char *format, ...)
+void signal_lock_address(signal_context *context, const signal_protocol_address *address, int mode)
 {
-    char buf[256];
-    int n;
-    if(context && context->log) {
+    if(context->lock_address) {
+        context->lock_address(address, mode, context->user_data);
+    }
+    else {
+        signal_lock(context);
+    }
+}
+
+void signal_unlock_address(signal_context *context, const signal_protocol_address *address, int mode)
+{
+    if(context->unlock_address) {
+        context->unlock_address(address, mode, context->user_data);
+    }
+    else {
+        signal_unlock(context);
+    }
+}
+
+void signal_lock_sender_key(signal_context *context, const signal_protocol_sender_key_name *sender_key_name, int mode)
+{
+    if(context->lock_sender_key) {
+        context->lock_sender_key(sender_key_name, mode, context->user_data);
+    }
+    else {
+        signal_lock(context);
+    }
+}
+
+void signal_unlock_sender_key(signal_context *context, const signal_protocol_sender_key_name *sender_key_name, int mode)
+{
+    if(context->unlock_sender_key) {
+        context->unlock_sender_key(sender_key_name, mode, context->user_data);
+    }
+    else {
+        signal_unlock(context);
+    }
+}
+
+static int signal_address_compare(const signal_protocol_address *address1, const signal_protocol_address *address2)
+{
+    size_t len = address1->name_len < address2->name_len ? address1->name_len : address2->name_len;
+    int result = memcmp(address1->name, address2->name, len);
+    if(result != 0) {
+        return result;
+    }
+    if(address1->name_len != address2->name_len) {
+        return address1->name_len < address2->name_len ? -1 : 1;
+    }
+    if(address1->device_id != address2->device_id) {
+        return address1->device_id < address2->device_id ? -1 : 1;
+    }
+    return 0;
+}
+
+static int signal_address_pointer_compare(const void *a, const void *b)
+{
+    return signal_address_compare(*(const signal_protocol_address * const *)a, *(const signal_protocol_address * const *)b);
+}
+
+void signal_lock_addresses(signal_context *context, const signal_protocol_address **addresses, size_t count, int mode)
+{
+    size_t i;
+
+    if(!context->lock_address) {
+        signal_lock(context);
+        return;
+    }
+
+    qsort(addresses, count, sizeof(const signal_protocol_address *), signal_address_pointer_compare);
+    for(i = 0; i < count; i++) {
+        if(i == 0 || signal_address_compare(addresses[i - 1], addresses[i]) != 0) {
+            context->lock_address(addresses[i], mode, context->user_data);
+        }
+    }
+}
+
+void signal_unlock_addresses(signal_context *context, const signal_protocol_address **addresses, size_t count, int mode)
+{
+    size_t i;
+
+    if(!context->unlock_address) {
+        signal_unlock(context);
+        return;
+    }
+
+    for(i = count; i > 0; i--) {
+        if(i == 1 || signal_address_compare(addresses[i - 2], addresses[i - 1]) != 0) {
+            context->unlock_address(addresses[i - 1], mode, context->user_data);
+        }
+    }
+}
+
+void signal_log(signal_context *context, int level, const char *format, ...)
+{
+    char buf[256];
+    int n;
+    if(context && context->log) {
         va_list args;
         va_start(args, format);
         n = vsnprintf(buf, sizeof(buf), format, args);
@@ -582,6 +1205,8 @@ void signal_explicit_bzero(void *v, size_t n)
     SecureZeroMemory(v, n);
 #elif HAVE_MEMSET_S
     memset_s(v, n, 0, n);
+#elif HAVE_EXPLICIT_BZERO
+    explicit_bzero(v, n);
 #else
     volatile unsigned char  *p  =  v;
     while(n--) *p++ = 0;
@@ -610,12 +1235,12 @@ void signal_protocol_str_serialize_protobuf(ProtobufCBinaryData *buffer, const c
     buffer->len = strlen(str);
 }
 
-char *signal_protocol_str_deserialize_protobuf(ProtobufCBinaryData *buffer)
+char *signal_protocol_str_deserialize_protobuf(ProtobufCBinaryData *buffer, signal_context *global_context)
 {
     char *str = 0;
     assert(buffer);
 
-    str = malloc(buffer->len + 1);
+    str = signal_malloc(global_context, buffer->len + 1);
     if(!str) {
         return 0;
     }
@@ -631,7 +1256,7 @@ char *signal_protocol_str_deserialize_protobuf(ProtobufCBinaryData *buffer)
 int signal_protocol_store_context_create(signal_protocol_store_context **context, signal_context *global_context)
 {
     assert(global_context);
-    *context = malloc(sizeof(signal_protocol_store_context));
+    *context = signal_malloc(global_context, sizeof(signal_protocol_store_context));
     if(!(*context)) {
         return SG_ERR_NOMEM;
     }
@@ -685,9 +1310,115 @@ int signal_protocol_store_context_set_sender_key_store(signal_protocol_store_con
     return 0;
 }
 
+static int signal_protocol_session_store_session_uncached(signal_protocol_store_context *context, const signal_protocol_address *address, session_record *record);
+
+static int signal_protocol_session_cache_write_back(const signal_protocol_address *address, session_record *record, void *user_data)
+{
+    return signal_protocol_session_store_session_uncached(user_data, address, record);
+}
+
+int signal_protocol_store_context_set_session_cache(signal_protocol_store_context *context, size_t capacity, int write_policy)
+{
+    int result = 0;
+    session_record_cache *cache = 0;
+
+    assert(context);
+
+    if(write_policy != SG_SESSION_CACHE_WRITE_THROUGH && write_policy != SG_SESSION_CACHE_WRITE_BEHIND) {
+        return SG_ERR_INVAL;
+    }
+
+#ifndef SIGNAL_ATOMIC_REFCOUNT
+    /*
+     * Cached copies share refcounted substructures with the records of
+     * their callers, which is only safe across threads with atomic counts
+     */
+    if(capacity > 0 && context->global_context->lock_address) {
+        return SG_ERR_INVAL;
+    }
+#endif
+
+    if(capacity > 0) {
+        result = session_record_cache_create(&cache, capacity,
+                signal_protocol_session_cache_write_back, context,
+                context->global_context);
+        if(result < 0) {
+            return result;
+        }
+    }
+
+    signal_lock(context->global_context);
+    if(context->session_cache) {
+        result = session_record_cache_flush(context->session_cache, 0, 0);
+        if(result < 0) {
+            signal_unlock(context->global_context);
+            session_record_cache_free(cache);
+            return result;
+        }
+        session_record_cache_free(context->session_cache);
+    }
+    context->session_cache = cache;
+    context->session_cache_write_policy = write_policy;
+    signal_unlock(context->global_context);
+
+    return 0;
+}
+
+int signal_protocol_session_cache_flush(signal_protocol_store_context *context)
+{
+    int result = 0;
+
+    assert(context);
+
+    if(context->session_cache) {
+        signal_lock(context->global_context);
+        result = session_record_cache_flush(context->session_cache, 0, 0);
+        signal_unlock(context->global_context);
+    }
+    return result;
+}
+
+void signal_protocol_session_cache_invalidate(signal_protocol_store_context *context, const signal_protocol_address *address)
+{
+    assert(context);
+
+    if(context->session_cache) {
+        signal_lock(context->global_context);
+        if(address) {
+            session_record_cache_remove(context->session_cache, address);
+        }
+        else {
+            session_record_cache_remove_all(context->session_cache, 0, 0);
+        }
+        signal_unlock(context->global_context);
+    }
+}
+
+void signal_protocol_session_cache_get_stats(signal_protocol_store_context *context, signal_protocol_session_cache_stats *stats)
+{
+    assert(context);
+    assert(stats);
+
+    if(context->session_cache) {
+        signal_lock(context->global_context);
+        session_record_cache_get_stats(context->session_cache, stats);
+        signal_unlock(context->global_context);
+    }
+    else {
+        memset(stats, 0, sizeof(signal_protocol_session_cache_stats));
+    }
+}
+
 void signal_protocol_store_context_destroy(signal_protocol_store_context *context)
 {
     if(context) {
+        if(context->session_cache) {
+            /* Pending writes are kept if possible, but errors cannot be reported here */
+            if(session_record_cache_flush(context->session_cache, 0, 0) < 0) {
+                signal_log(context->global_context, SG_LOG_WARNING, "Unable to flush session cache");
+            }
+            session_record_cache_free(context->session_cache);
+        }
         if(context->session_store.destroy_func) {
             context->session_store.destroy_func(context->session_store.user_data);
         }
@@ -703,18 +1434,43 @@ void signal_protocol_store_context_destroy(signal_protocol_store_context *contex
         if(context->sender_key_store.destroy_func) {
             context->sender_key_store.destroy_func(context->sender_key_store.user_data);
         }
-        free(context);
+        signal_free(context->global_context, context);
     }
 }
 
 /*------------------------------------------------------------------------*/
 
-int signal_protocol_session_load_session(signal_protocol_store_context *context, session_record **record, const signal_protocol_address *address)
+static int signal_protocol_session_record_from_buffers(signal_protocol_store_context *context, session_record **record, signal_buffer *buffer, signal_buffer *user_buffer)
+{
+    int result = 0;
+    session_record *result_record = 0;
+
+    if(buffer) {
+        result = session_record_deserialize(&result_record,
+                signal_buffer_data(buffer), signal_buffer_len(buffer), context->global_context);
+    }
+    else {
+        result = session_record_create(&result_record, 0, context->global_context);
+    }
+
+    signal_buffer_free(buffer);
+    if(result >= 0) {
+        if(user_buffer) {
+            session_record_set_user_record(result_record, user_buffer);
+        }
+        *record = result_record;
+    }
+    else {
+        signal_buffer_free(user_buffer);
+    }
+    return result;
+}
+
+static int signal_protocol_session_load_session_uncached(signal_protocol_store_context *context, session_record **record, const signal_protocol_address *address)
 {
     int result = 0;
     signal_buffer *buffer = 0;
     signal_buffer *user_buffer = 0;
-    session_record *result_record = 0;
 
     assert(context);
     assert(context->session_store.load_session_func);
@@ -731,32 +1487,87 @@ int signal_protocol_session_load_session(signal_protocol_store_context *context,
             result = SG_ERR_UNKNOWN;
             goto complete;
         }
-        result = session_record_create(&result_record, 0, context->global_context);
     }
     else if(result == 1) {
         if(!buffer) {
             result = -1;
             goto complete;
         }
-        result = session_record_deserialize(&result_record,
-                signal_buffer_data(buffer), signal_buffer_len(buffer), context->global_context);
     }
     else {
         result = SG_ERR_UNKNOWN;
+        goto complete;
     }
 
+    /* Ownership of both buffers passes to the record */
+    result = signal_protocol_session_record_from_buffers(context, record, buffer, user_buffer);
+    buffer = 0;
+    user_buffer = 0;
+
 complete:
-    if(buffer) {
-        signal_buffer_free(buffer);
+    signal_buffer_free(buffer);
+    signal_buffer_free(user_buffer);
+    return result;
+}
+
+static int signal_protocol_session_load_sessions_uncached(signal_protocol_store_context *context, session_record **records, const signal_protocol_address *addresses, size_t count)
+{
+    int result = 0;
+    signal_buffer **buffers = 0;
+    size_t i;
+
+    assert(context);
+    assert(records);
+
+    memset(records, 0, sizeof(session_record *) * count);
+
+    if(!context->session_store.load_sessions_func) {
+        for(i = 0; i < count; i++) {
+            result = signal_protocol_session_load_session_uncached(context, &records[i], &addresses[i]);
+            if(result < 0) {
+                goto complete;
+            }
+        }
+        goto complete;
     }
-    if(result >= 0) {
-        if(user_buffer) {
-            session_record_set_user_record(result_record, user_buffer);
+
+    if(count > SIZE_MAX / 2 / sizeof(signal_buffer *)) {
+        return SG_ERR_NOMEM;
+    }
+    buffers = signal_malloc(context->global_context, sizeof(signal_buffer *) * count * 2);
+    if(!buffers) {
+        return SG_ERR_NOMEM;
+    }
+    memset(buffers, 0, sizeof(signal_buffer *) * count * 2);
+
+    /* Records in the first half, user records in the second */
+    result = context->session_store.load_sessions_func(
+            buffers, buffers + count, addresses, count,
+            context->session_store.user_data);
+    if(result < 0) {
+        for(i = 0; i < count * 2; i++) {
+            signal_buffer_free(buffers[i]);
         }
-        *record = result_record;
+        goto complete;
     }
-    else {
-        signal_buffer_free(user_buffer);
+
+    /* Every pair of buffers is handed over, even after a failure */
+    result = 0;
+    for(i = 0; i < count; i++) {
+        int record_result = signal_protocol_session_record_from_buffers(context, &records[i],
+                buffers[i], buffers[count + i]);
+        if(record_result < 0) {
+            result = record_result;
+        }
+    }
+
+complete:
+    signal_free(context->global_context, buffers);
+    if(result < 0) {
+        for(i = 0; i < count; i++) {
+            SIGNAL_UNREF(records[i]);
+            records[i] = 0;
+        }
     }
     return result;
 }
@@ -766,12 +1577,23 @@ int signal_protocol_session_get_sub_device_sessions(signal_protocol_store_contex
     assert(context);
     assert(context->session_store.get_sub_device_sessions_func);
 
+    /* The store must see pending writes before it can list them */
+    if(context->session_cache) {
+        int result;
+        signal_lock(context->global_context);
+        result = session_record_cache_flush(context->session_cache, name, name_len);
+        signal_unlock(context->global_context);
+        if(result < 0) {
+            return result;
+        }
+    }
+
     return context->session_store.get_sub_device_sessions_func(
             sessions, name, name_len,
             context->session_store.user_data);
 }
 
-int signal_protocol_session_store_session(signal_protocol_store_context *context, const signal_protocol_address *address, session_record *record)
+static int signal_protocol_session_store_session_uncached(signal_protocol_store_context *context, const signal_protocol_address *address, session_record *record)
 {
     int result = 0;
     signal_buffer *buffer = 0;
@@ -808,11 +1630,364 @@ complete:
     return result;
 }
 
+/*
+ * Every record is serialized before any is stored, so that a record that
+ * fails to serialize leaves the store untouched. Without a batch callback
+ * the records are then stored one at a time, and a store error partway
+ * through cannot undo the records already stored.
+ */
+static int signal_protocol_session_store_sessions_uncached(signal_protocol_store_context *context, const signal_protocol_address *addresses, session_record **records, size_t count)
+{
+    int result = 0;
+    signal_buffer **buffers = 0;
+    size_t i;
+
+    assert(context);
+    assert(records);
+
+    if(count > SIZE_MAX / 2 / sizeof(signal_buffer *)) {
+        return SG_ERR_NOMEM;
+    }
+    buffers = signal_malloc(context->global_context, sizeof(signal_buffer *) * count * 2);
+    if(!buffers) {
+        return SG_ERR_NOMEM;
+    }
+    memset(buffers, 0, sizeof(signal_buffer *) * count * 2);
+
+    for(i = 0; i < count; i++) {
+        result = session_record_serialize(&buffers[i], records[i]);
+        if(result < 0) {
+            goto complete;
+        }
+        /* Borrowed from the record, not freed below */
+        buffers[count + i] = session_record_get_user_record(records[i]);
+    }
+
+    if(context->session_store.store_sessions_func) {
+        result = context->session_store.store_sessions_func(
+                addresses, buffers, buffers + count, count,
+                context->session_store.user_data);
+        goto complete;
+    }
+
+    assert(context->session_store.store_session_func);
+    for(i = 0; i < count; i++) {
+        signal_buffer *user_buffer = buffers[count + i];
+        result = context->session_store.store_session_func(
+                &addresses[i],
+                signal_buffer_data(buffers[i]), signal_buffer_len(buffers[i]),
+                user_buffer ? signal_buffer_data(user_buffer) : 0,
+                user_buffer ? signal_buffer_len(user_buffer) : 0,
+                context->session_store.user_data);
+        if(result < 0) {
+            goto complete;
+        }
+    }
+
+complete:
+    for(i = 0; i < count; i++) {
+        signal_buffer_free(buffers[i]);
+    }
+    signal_free(context->global_context, buffers);
+    return result;
+}
+
+/*
+ * The cache only ever hands out and takes in copies, so callers never hold
+ * a cached record itself. The copies still share refcounted substructures
+ * such as keys, which is why keyed locks require SIGNAL_ATOMIC_REFCOUNT
+ * when the cache is enabled. Records that were not found in the store are
+ * not cached.
+ */
+static void signal_protocol_session_cache_put_copy(signal_protocol_store_context *context, const signal_protocol_address *address, session_record *record, int dirty, int *result)
+{
+    session_record *record_copy = 0;
+    int copy_result;
+
+    copy_result = session_record_copy(&record_copy, record, context->global_context);
+    if(copy_result >= 0) {
+        copy_result = session_record_cache_put(context->session_cache, address, record_copy, dirty);
+        SIGNAL_UNREF(record_copy);
+    }
+    if(copy_result < 0) {
+        session_record_cache_remove(context->session_cache, address);
+        if(result) {
+            *result = copy_result;
+        }
+    }
+}
+
+/*
+ * Cache a batch of records as dirty, either all of them or none. The
+ * entries they replace are kept until every put has succeeded, and put
+ * back otherwise. The batch must fit in the cache, so that no put evicts
+ * and writes back a record of the same batch.
+ */
+static int signal_protocol_session_cache_put_batch(signal_protocol_store_context *context, const signal_protocol_address *addresses, session_record **records, size_t count)
+{
+    int result = 0;
+    session_record **copies = 0;
+    session_record **previous = 0;
+    int *previous_dirty = 0;
+    size_t put_count = 0;
+    size_t i;
+
+    assert(count <= session_record_cache_get_capacity(context->session_cache));
+
+    copies = signal_malloc(context->global_context, sizeof(session_record *) * count * 2);
+    previous_dirty = signal_malloc(context->global_context, sizeof(int) * count);
+    if(!copies || !previous_dirty) {
+        result = SG_ERR_NOMEM;
+        goto complete;
+    }
+    memset(copies, 0, sizeof(session_record *) * count * 2);
+    memset(previous_dirty, 0, sizeof(int) * count);
+    previous = copies + count;
+
+    for(i = 0; i < count; i++) {
+        result = session_record_copy(&copies[i], records[i], context->global_context);
+        if(result < 0) {
+            goto complete;
+        }
+    }
+
+    signal_lock(context->global_context);
+    for(i = 0; i < count; i++) {
+        previous[i] = session_record_cache_peek(context->session_cache, &addresses[i], &previous_dirty[i]);
+        if(previous[i]) {
+            SIGNAL_REF(previous[i]);
+        }
+    }
+    for(put_count = 0; put_count < count; put_count++) {
+        result = session_record_cache_put(context->session_cache, &addresses[put_count], copies[put_count], 1);
+        if(result < 0) {
+            break;
+        }
+    }
+    if(result < 0) {
+        /* Entries of the batch are still cached, so putting back cannot fail */
+        for(i = 0; i < put_count; i++) {
+            if(previous[i]) {
+                session_record_cache_put(context->session_cache, &addresses[i], previous[i], previous_dirty[i]);
+            }
+            else {
+                session_record_cache_remove(context->session_cache, &addresses[i]);
+            }
+        }
+    }
+    signal_unlock(context->global_context);
+
+complete:
+    if(copies) {
+        for(i = 0; i < count * 2; i++) {
+            SIGNAL_UNREF(copies[i]);
+        }
+    }
+    signal_free(context->global_context, copies);
+    signal_free(context->global_context, previous_dirty);
+    return result;
+}
+
+int signal_protocol_session_load_session(signal_protocol_store_context *context, session_record **record, const signal_protocol_address *address)
+{
+    int result = 0;
+    session_record *cached_record = 0;
+
+    assert(context);
+
+    if(!context->session_cache) {
+        return signal_protocol_session_load_session_uncached(context, record, address);
+    }
+
+    signal_lock(context->global_context);
+    cached_record = session_record_cache_get(context->session_cache, address);
+    if(cached_record) {
+        result = session_record_copy(record, cached_record, context->global_context);
+        signal_unlock(context->global_context);
+        return result;
+    }
+    signal_unlock(context->global_context);
+
+    result = signal_protocol_session_load_session_uncached(context, record, address);
+    if(result >= 0 && !session_record_is_fresh(*record)) {
+        signal_lock(context->global_context);
+        signal_protocol_session_cache_put_copy(context, address, *record, 0, 0);
+        signal_unlock(context->global_context);
+    }
+    return result;
+}
+
+int signal_protocol_session_load_sessions(signal_protocol_store_context *context, session_record **records, const signal_protocol_address *addresses, size_t count)
+{
+    int result = 0;
+    size_t *miss_indexes = 0;
+    signal_protocol_address *miss_addresses = 0;
+    session_record **miss_records = 0;
+    size_t miss_count = 0;
+    size_t i;
+
+    assert(context);
+    assert(records);
+
+    if(!context->session_cache) {
+        return signal_protocol_session_load_sessions_uncached(context, records, addresses, count);
+    }
+
+    memset(records, 0, sizeof(session_record *) * count);
+
+    if(count > SIZE_MAX / sizeof(signal_protocol_address)) {
+        return SG_ERR_NOMEM;
+    }
+    miss_indexes = signal_malloc(context->global_context, sizeof(size_t) * count);
+    miss_addresses = signal_malloc(context->global_context, sizeof(signal_protocol_address) * count);
+    miss_records = signal_malloc(context->global_context, sizeof(session_record *) * count);
+    if(!miss_indexes || !miss_addresses || !miss_records) {
+        result = SG_ERR_NOMEM;
+        goto complete;
+    }
+
+    signal_lock(context->global_context);
+    for(i = 0; i < count; i++) {
+        session_record *cached_record = session_record_cache_get(context->session_cache, &addresses[i]);
+        if(cached_record) {
+            result = session_record_copy(&records[i], cached_record, context->global_context);
+            if(result < 0) {
+                break;
+            }
+        }
+        else {
+            miss_indexes[miss_count] = i;
+            miss_addresses[miss_count] = addresses[i];
+            miss_count++;
+        }
+    }
+    signal_unlock(context->global_context);
+    if(result < 0 || miss_count == 0) {
+        goto complete;
+    }
+
+    result = signal_protocol_session_load_sessions_uncached(context, miss_records, miss_addresses, miss_count);
+    if(result < 0) {
+        goto complete;
+    }
+
+    signal_lock(context->global_context);
+    for(i = 0; i < miss_count; i++) {
+        records[miss_indexes[i]] = miss_records[i];
+        if(!session_record_is_fresh(miss_records[i])) {
+            signal_protocol_session_cache_put_copy(context, &miss_addresses[i], miss_records[i], 0, 0);
+        }
+    }
+    signal_unlock(context->global_context);
+
+complete:
+    signal_free(context->global_context, miss_indexes);
+    signal_free(context->global_context, miss_addresses);
+    signal_free(context->global_context, miss_records);
+    if(result < 0) {
+        for(i = 0; i < count; i++) {
+            SIGNAL_UNREF(records[i]);
+        }
+    }
+    return result;
+}
+
+int signal_protocol_session_store_session(signal_protocol_store_context *context, const signal_protocol_address *address, session_record *record)
+{
+    int result = 0;
+
+    assert(context);
+
+    if(!context->session_cache) {
+        return signal_protocol_session_store_session_uncached(context, address, record);
+    }
+
+    if(context->session_cache_write_policy == SG_SESSION_CACHE_WRITE_BEHIND) {
+        signal_lock(context->global_context);
+        signal_protocol_session_cache_put_copy(context, address, record, 1, &result);
+        signal_unlock(context->global_context);
+        return result;
+    }
+
+    result = signal_protocol_session_store_session_uncached(context, address, record);
+
+    signal_lock(context->global_context);
+    if(result >= 0) {
+        signal_protocol_session_cache_put_copy(context, address, record, 0, 0);
+    }
+    else {
+        session_record_cache_remove(context->session_cache, address);
+    }
+    signal_unlock(context->global_context);
+
+    return result;
+}
+
+int signal_protocol_session_store_sessions(signal_protocol_store_context *context, const signal_protocol_address *addresses, session_record **records, size_t count)
+{
+    int result = 0;
+    size_t i;
+
+    assert(context);
+    assert(records);
+
+    if(count == 0) {
+        return 0;
+    }
+
+    if(!context->session_cache) {
+        return signal_protocol_session_store_sessions_uncached(context, addresses, records, count);
+    }
+
+    if(context->session_cache_write_policy == SG_SESSION_CACHE_WRITE_BEHIND) {
+        if(count <= session_record_cache_get_capacity(context->session_cache)) {
+            return signal_protocol_session_cache_put_batch(context, addresses, records, count);
+        }
+
+        /*
+         * Too large to stage in the cache, so write it through. Pending
+         * writes go first, so that none of them can later overwrite a
+         * record of the batch.
+         */
+        signal_lock(context->global_context);
+        result = session_record_cache_flush(context->session_cache, 0, 0);
+        signal_unlock(context->global_context);
+        if(result < 0) {
+            return result;
+        }
+    }
+
+    result = signal_protocol_session_store_sessions_uncached(context, addresses, records, count);
+
+    signal_lock(context->global_context);
+    for(i = 0; i < count; i++) {
+        if(result >= 0) {
+            signal_protocol_session_cache_put_copy(context, &addresses[i], records[i], 0, 0);
+        }
+        else {
+            session_record_cache_remove(context->session_cache, &addresses[i]);
+        }
+    }
+    signal_unlock(context->global_context);
+
+    return result;
+}
+
 int signal_protocol_session_contains_session(signal_protocol_store_context *context, const signal_protocol_address *address)
 {
     assert(context);
     assert(context->session_store.contains_session_func);
 
+    if(context->session_cache) {
+        int cached;
+        signal_lock(context->global_context);
+        cached = session_record_cache_get(context->session_cache, address) != 0;
+        signal_unlock(context->global_context);
+        if(cached) {
+            return 1;
+        }
+    }
+
     return context->session_store.contains_session_func(
             address,
             context->session_store.user_data);
@@ -823,6 +1998,12 @@ int signal_protocol_session_delete_session(signal_protocol_store_context *contex
     assert(context);
     assert(context->session_store.delete_session_func);
 
+    if(context->session_cache) {
+        signal_lock(context->global_context);
+        session_record_cache_remove(context->session_cache, address);
+        signal_unlock(context->global_context);
+    }
+
     return context->session_store.delete_session_func(
             address,
             context->session_store.user_data);
@@ -833,6 +2014,12 @@ int signal_protocol_session_delete_all_sessions(signal_protocol_store_context *c
     assert(context);
     assert(context->session_store.delete_all_sessions_func);
 
+    if(context->session_cache) {
+        signal_lock(context->global_context);
+        session_record_cache_remove_all(context->session_cache, name, name_len);
+        signal_unlock(context->global_context);
+    }
+
     return context->session_store.delete_all_sessions_func(
             name, name_len,
             context->session_store.user_data);
@@ -58,6 +58,25 @@ extern "C" {
 #define SG_CIPHER_AES_CTR_NOPADDING 1
 #define SG_CIPHER_AES_CBC_PKCS5     2
 
+/* Modes passed to the keyed locking callbacks */
+#define SG_LOCK_READ  1
+#define SG_LOCK_WRITE 2
+
+/* Write policies for the session record cache */
+#define SG_SESSION_CACHE_WRITE_THROUGH 1
+#define SG_SESSION_CACHE_WRITE_BEHIND  2
+
+/*
+ * Reference counting for library types.
+ *
+ * By default reference counts are plain integers, and every use of the
+ * library must be serialized by the client. When the library is built with
+ * SIGNAL_ATOMIC_REFCOUNT, reference counts are updated atomically instead.
+ * Immutable types may then be referenced, used and released from several
+ * threads at once. These are ec_public_key, ec_private_key, ec_key_pair
+ * and ratchet_identity_key_pair. Mutable types, such as session records
+ * and ciphers, still require the locking functions set on the context.
+ */
 void signal_type_ref(signal_type_base *instance);
 void signal_type_unref(signal_type_base *instance);
 
@@ -273,6 +292,15 @@ int signal_int_list_at(signal_int_list *list, unsigned int index);
  */
 void signal_int_list_free(signal_int_list *list);
 
+/**
+ * A contiguous chunk of input data, for callbacks that consume several
+ * buffers in a single call.
+ */
+typedef struct signal_iovec {
+    const uint8_t *data;
+    size_t len;
+} signal_iovec;
+
 typedef struct signal_crypto_provider {
     /**
      * Callback for a secure random number generator.
@@ -408,6 +436,42 @@ typedef struct signal_crypto_provider {
 
     /** User data pointer */
     void *user_data;
+
+    /* Optional callbacks, kept after user_data so that older layouts still match */
+
+    /**
+     * Optional callback for a single-shot HMAC-SHA256 implementation.
+     * This function shall compute the HMAC of the concatenation of the
+     * provided chunks, and write the 32 byte result to the output buffer.
+     *
+     * If set, it is used instead of the init/update/final/cleanup callbacks
+     * wherever the whole input is known up front.
+     *
+     * @param key pointer to the key
+     * @param key_len length of the key
+     * @param iov array of input chunks
+     * @param iov_count number of input chunks
+     * @param output 32 byte buffer to be populated with the result
+     * @return 0 on success, negative on failure
+     */
+    int (*hmac_sha256_oneshot_func)(const uint8_t *key, size_t key_len,
+            const signal_iovec *iov, size_t iov_count,
+            uint8_t *output, void *user_data);
+
+    /**
+     * Optional callback for an HMAC-SHA256 implementation.
+     * This function shall finalize an HMAC calculation, write the 32 byte
+     * result to the output buffer, and reset the context so that it can be
+     * used for another calculation with the same key.
+     *
+     * If set, it is used instead of hmac_sha256_final_func, which avoids
+     * allocating an output buffer and lets a context be reused.
+     *
+     * @param hmac_context private HMAC context pointer
+     * @param output 32 byte buffer to be populated with the result
+     * @return 0 on success, negative on failure
+     */
+    int (*hmac_sha256_final_reset_func)(void *hmac_context, uint8_t *output, void *user_data);
 } signal_crypto_provider;
 
 typedef struct signal_protocol_session_store {
@@ -487,6 +551,48 @@ typedef struct signal_protocol_session_store {
 
     /** User data pointer */
     void *user_data;
+
+    /* Optional callbacks, kept after user_data so that older layouts still match */
+
+    /**
+     * Returns copies of the serialized session records for several
+     * recipient ID + device ID tuples in one call.
+     *
+     * This function is optional. If it is not provided, load_session_func
+     * is called once for each address.
+     *
+     * @param records array of count pointers, initialized to null. Each is
+     *     set to a freshly allocated buffer containing the serialized
+     *     session record, or left unset if no record was found.
+     *     The Signal Protocol library is responsible for freeing these buffers.
+     * @param user_records array of count pointers, initialized to null. Each
+     *     may be set to a freshly allocated buffer containing application
+     *     specific data stored alongside the serialized session record.
+     *     The Signal Protocol library is responsible for freeing these buffers.
+     * @param addresses array of count remote client addresses
+     * @param count number of addresses
+     * @return 0 on success, negative on failure
+     */
+    int (*load_sessions_func)(signal_buffer **records, signal_buffer **user_records, const signal_protocol_address *addresses, size_t count, void *user_data);
+
+    /**
+     * Commit to storage the session records for several recipient ID +
+     * device ID tuples in one call. Either all of the records should be
+     * committed, or none of them.
+     *
+     * This function is optional. If it is not provided, store_session_func
+     * is called once for each address.
+     *
+     * @param addresses array of count remote client addresses
+     * @param records array of count buffers containing the serialized
+     *     session records
+     * @param user_records array of count buffers containing application
+     *     specific data to be stored alongside each record. Entries are null
+     *     where no such data exists.
+     * @param count number of addresses
+     * @return 0 on success, negative on failure
+     */
+    int (*store_sessions_func)(const signal_protocol_address *addresses, signal_buffer **records, signal_buffer **user_records, size_t count, void *user_data);
 } signal_protocol_session_store;
 
 typedef struct signal_protocol_pre_key_store {
@@ -728,6 +834,184 @@ int signal_context_set_crypto_provider(signal_context *context, const signal_cry
 int signal_context_set_locking_functions(signal_context *context,
         void (*lock)(void *user_data), void (*unlock)(void *user_data));
 
+/**
+ * Set locking functions keyed by remote address, to be used instead of the
+ * global lock for operations on a single pairwise session.
+ *
+ * Once set, session_cipher and session_builder operations lock only the
+ * address they operate on, with SG_LOCK_READ for queries and SG_LOCK_WRITE
+ * for anything that updates the stored session. Operations on different
+ * addresses may then run in parallel, so the data store callbacks must be
+ * safe to call concurrently for different addresses.
+ *
+ * These operations still take the global lock briefly, while holding the
+ * address lock, for the shared state of these options:
+ * - the session cache, see signal_protocol_store_context_set_session_cache()
+ * - random buffering in builds without SIGNAL_ATOMIC_REFCOUNT, see
+ *   signal_context_set_random_buffering()
+ * - the key pair pool, see signal_context_set_key_pair_pool()
+ * Without them, the global lock is not taken at all. The library never
+ * takes an address lock while holding the global lock.
+ *
+ * The library never takes the same key twice, so the locks do not need to
+ * be recursive. Queries made on a session_cipher from within its own
+ * decryption callback run under the lock already held by the decryption,
+ * as described at session_cipher_set_decryption_callback(). When one
+ * operation needs several addresses, as with
+ * session_cipher_encrypt_batch(), they are locked in ascending order of
+ * name and then device ID, so concurrent operations cannot deadlock.
+ *
+ * Without SIGNAL_ATOMIC_REFCOUNT, keyed locks cannot be combined with a
+ * session cache, as described at
+ * signal_protocol_store_context_set_session_cache(). Set them before
+ * enabling the cache on any store context of this context.
+ *
+ * @param lock function to lock the given address
+ * @param unlock function to unlock the given address
+ * @return 0 on success, negative on failure
+ */
+int signal_context_set_address_locking_functions(signal_context *context,
+        void (*lock)(const signal_protocol_address *address, int mode, void *user_data),
+        void (*unlock)(const signal_protocol_address *address, int mode, void *user_data));
+
+/**
+ * Set locking functions keyed by sender key name, to be used instead of the
+ * global lock for group_cipher and group_session_builder operations.
+ *
+ * The same rules apply as for signal_context_set_address_locking_functions().
+ *
+ * @param lock function to lock the given sender key name
+ * @param unlock function to unlock the given sender key name
+ * @return 0 on success, negative on failure
+ */
+int signal_context_set_sender_key_locking_functions(signal_context *context,
+        void (*lock)(const signal_protocol_sender_key_name *sender_key_name, int mode, void *user_data),
+        void (*unlock)(const signal_protocol_sender_key_name *sender_key_name, int mode, void *user_data));
+
+/**
+ * Keep the skipped message keys of session and sender key chains as chain
+ * key checkpoints, rather than deriving and storing every skipped key.
+ *
+ * Every interval skipped positions, the chain key is recorded together with
+ * a bitmap of the positions still waiting for a message. The key for a late
+ * message is then derived on demand, at the cost of up to interval - 1 extra
+ * chain steps. A chain with 2000 skipped keys needs about 500 bytes with an
+ * interval of 256, instead of about 160 KB. Skipped keys older than the last
+ * 2000 positions of a chain are dropped, rather than the oldest 2000 keys.
+ *
+ * This weakens forward secrecy within a checkpoint's range. A checkpoint
+ * moves forward when the message at its own position arrives, but keeps
+ * deriving the keys of the later positions in its range that were already
+ * consumed, so a compromised record can expose up to interval - 1 message
+ * keys per checkpoint. Use smaller intervals where that matters.
+ *
+ * Records written in this mode use additional protobuf fields that older
+ * versions of the library ignore, losing the skipped keys. Records holding
+ * individually stored keys remain readable in either mode.
+ *
+ * @param interval positions between checkpoints, from 1 to 2000, or 0 to
+ *     store every skipped key (the default)
+ * @return 0 on success, negative on failure
+ */
+int signal_context_set_skipped_key_checkpoint_interval(signal_context *context, uint32_t interval);
+
+/**
+ * Serve the randomness the library needs from a buffered ChaCha20
+ * generator, rather than calling the random function of the crypto
+ * provider for every key, signature and IV.
+ *
+ * The generator erases its key as it goes, so earlier output cannot be
+ * recovered from its state. It is seeded from the crypto provider on first
+ * use, reseeded after every 64 KB of output, and reseeded in a child
+ * process after a fork.
+ *
+ * When built with SIGNAL_ATOMIC_REFCOUNT, several generators are kept, each
+ * with its own lock, so random draws never take the global lock. A thread
+ * that finds every generator busy calls the crypto provider instead.
+ * Otherwise a single generator is guarded by the global lock, and random
+ * draws from all threads are serialized on it while buffering is enabled.
+ *
+ * When built with SIGNAL_ATOMIC_REFCOUNT, buffering may be turned on or
+ * off while other threads use the context. Turning it off waits for draws
+ * in progress to finish, and later draws call the crypto provider directly.
+ * Otherwise draws check whether buffering is on before taking the global
+ * lock, so that contexts without buffering never take it for randomness,
+ * and buffering must only be turned on or off while no other thread uses
+ * the context.
+ *
+ * Set the allocator first, if any, since the generator state is allocated
+ * through it.
+ *
+ * @param enabled 1 to buffer randomness, 0 to call the crypto provider
+ *     directly (the default)
+ * @return 0 on success, negative on failure
+ */
+int signal_context_set_random_buffering(signal_context *context, int enabled);
+
+/**
+ * Keep a pool of pre-generated key pairs for the ephemeral keys of ratchet
+ * steps and new sessions, so that generating them stays off the message
+ * path. When the pool is empty, key pairs are generated on demand as
+ * before.
+ *
+ * The library does not start threads of its own. The pool is filled by
+ * signal_context_refill_key_pair_pool(), typically from a background
+ * thread of the application, which refill_needed can be used to wake.
+ * Pooled private keys stay in memory until they are used, and are zeroed
+ * when released.
+ *
+ * The pool is guarded by the global lock, which is held only to take or
+ * add a key pair, never while one is generated. This applies with keyed
+ * locks as well.
+ *
+ * Set the allocator first, if any, since the pool is allocated through it.
+ *
+ * @param capacity maximum number of pooled key pairs, or 0 to release the
+ *     pool and generate every key pair on demand (the default)
+ * @param refill_needed optional function called, without the global lock
+ *     held, when taking a key pair leaves the pool at most half full. The
+ *     operation taking the key pair may still hold an address lock.
+ * @return 0 on success, negative on failure
+ */
+int signal_context_set_key_pair_pool(signal_context *context, size_t capacity,
+        void (*refill_needed)(void *user_data));
+
+/**
+ * Generate key pairs until the pool set up by
+ * signal_context_set_key_pair_pool() is full. Keys are generated without
+ * holding the global lock, which is only taken to add each one, so this
+ * may run on another thread while the context is in use.
+ *
+ * @return the number of key pairs added, or negative on failure
+ */
+int signal_context_refill_key_pair_pool(signal_context *context);
+
+/**
+ * @return the number of key pairs currently in the pool
+ */
+size_t signal_context_get_key_pair_pool_count(signal_context *context);
+
+/**
+ * Set the memory allocator used for objects created with this context,
+ * including protobuf-c unpacking.
+ *
+ * The allocator must be set before any object is created with the context,
+ * and the context must outlive every object allocated through it. Buffers
+ * and objects created without a context, such as by signal_buffer_alloc(),
+ * continue to use the C library allocator, and are freed accordingly.
+ *
+ * @param malloc_func function returning size bytes, or 0 on failure
+ * @param realloc_func function resizing memory returned by malloc_func
+ * @param free_func function releasing memory returned by malloc_func or realloc_func
+ * @param user_data pointer passed to all three functions
+ * @return 0 on success, negative on failure
+ */
+int signal_context_set_allocator(signal_context *context,
+        void *(*malloc_func)(size_t size, void *user_data),
+        void *(*realloc_func)(void *ptr, size_t size, void *user_data),
+        void (*free_func)(void *ptr, void *user_data),
+        void *user_data);
+
 /**
  * Set the log function to be used by the Signal Protocol library for logging.
  *
@@ -749,6 +1033,55 @@ int signal_protocol_store_context_set_signed_pre_key_store(signal_protocol_store
 int signal_protocol_store_context_set_identity_key_store(signal_protocol_store_context *context, const signal_protocol_identity_key_store *store);
 int signal_protocol_store_context_set_sender_key_store(signal_protocol_store_context *context, const signal_protocol_sender_key_store *store);
 
+/**
+ * Keep up to capacity deserialized session records in memory, so that
+ * repeated operations on the same address skip the session store and
+ * protobuf encoding. Records are evicted in least recently used order.
+ *
+ * With SG_SESSION_CACHE_WRITE_THROUGH, every stored record is still written
+ * to the session store immediately. With SG_SESSION_CACHE_WRITE_BEHIND,
+ * stored records are only written when they are evicted, when the sessions
+ * of their name are listed, or when the cache is flushed. Pending writes are
+ * flushed on a best effort basis when the store context is destroyed.
+ *
+ * The cache is protected by the global lock of the context. It must be
+ * invalidated whenever the session store is changed other than through
+ * this store context.
+ *
+ * Records handed out by the cache are copies, but they share refcounted
+ * substructures such as keys with the cached record. Once keyed locks are
+ * set with signal_context_set_address_locking_functions(), callers on
+ * different addresses may release those shared references concurrently,
+ * so the cache then requires a build with SIGNAL_ATOMIC_REFCOUNT and
+ * this function returns SG_ERR_INVAL otherwise. Keyed locks must therefore
+ * be set before the cache is enabled.
+ *
+ * @param capacity maximum number of cached records, or 0 to disable the
+ *     cache after flushing it
+ * @param write_policy SG_SESSION_CACHE_WRITE_THROUGH or SG_SESSION_CACHE_WRITE_BEHIND
+ * @return 0 on success, negative on failure
+ */
+int signal_protocol_store_context_set_session_cache(signal_protocol_store_context *context, size_t capacity, int write_policy);
+
+/**
+ * Write all pending records in the session cache to the session store.
+ *
+ * @return 0 on success, or the first error returned by the session store
+ */
+int signal_protocol_session_cache_flush(signal_protocol_store_context *context);
+
+/**
+ * Drop the cached record for an address, or every cached record if address
+ * is null. Pending writes for the dropped records are discarded.
+ */
+void signal_protocol_session_cache_invalidate(signal_protocol_store_context *context, const signal_protocol_address *address);
+
+/**
+ * Get the hit, miss, eviction and write back counters of the session cache.
+ * All counters are zero if the cache is not enabled.
+ */
+void signal_protocol_session_cache_get_stats(signal_protocol_store_context *context, signal_protocol_session_cache_stats *stats);
+
 void signal_protocol_store_context_destroy(signal_protocol_store_context *context);
 
 /*
@@ -761,6 +1094,26 @@ void signal_protocol_store_context_destroy(signal_protocol_store_context *contex
 int signal_protocol_session_load_session(signal_protocol_store_context *context, session_record **record, const signal_protocol_address *address);
 int signal_protocol_session_get_sub_device_sessions(signal_protocol_store_context *context, signal_int_list **sessions, const char *name, size_t name_len);
 int signal_protocol_session_store_session(signal_protocol_store_context *context, const signal_protocol_address *address, session_record *record);
+
+/**
+ * Load the session records for several addresses, using the batch callback
+ * of the session store if it has one. Addresses without a stored session
+ * get a fresh, empty record.
+ *
+ * @param records array of count entries, set to the loaded records
+ * @return 0 on success, negative on failure
+ */
+int signal_protocol_session_load_sessions(signal_protocol_store_context *context, session_record **records, const signal_protocol_address *addresses, size_t count);
+
+/**
+ * Store the session records for several addresses, using the batch callback
+ * of the session store if it has one. Every record is serialized before any
+ * is stored, and a write-behind session cache takes either all of the
+ * records or none of them.
+ *
+ * @return 0 on success, negative on failure
+ */
+int signal_protocol_session_store_sessions(signal_protocol_store_context *context, const signal_protocol_address *addresses, session_record **records, size_t count);
 int signal_protocol_session_contains_session(signal_protocol_store_context *context, const signal_protocol_address *address);
 int signal_protocol_session_delete_session(signal_protocol_store_context *context, const signal_protocol_address *address);
 int signal_protocol_session_delete_all_sessions(signal_protocol_store_context *context, const char *name, size_t name_len);
@@ -4,37 +4,117 @@
 #include <protobuf-c/protobuf-c.h>
 #include "LocalStorageProtocol.pb-c.h"
 #include "signal_protocol.h"
+#include "signal_arena.h"
+#include "signal_random.h"
+
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+#include <stdatomic.h>
+typedef atomic_uint signal_ref_count;
+#else
+typedef unsigned int signal_ref_count;
+#endif
 
 struct signal_type_base {
-    unsigned int ref_count;
+    signal_ref_count ref_count;
     void (*destroy)(signal_type_base *instance);
 };
 
 void signal_type_init(signal_type_base *instance,
         void (*destroy_func)(signal_type_base *instance));
 
+/**
+ * Check whether the caller holds the only reference to an instance, and
+ * may therefore modify it in place without affecting other holders.
+ *
+ * @return 1 if the reference count is exactly one, 0 otherwise
+ */
+int signal_type_is_unique(const signal_type_base *instance);
+
 #define SIGNAL_INIT(instance, destroy_func) signal_type_init((signal_type_base *)instance, destroy_func)
 
 struct signal_buffer {
     size_t len;
+    signal_context *context;
     uint8_t data[];
 };
 
+typedef struct signal_key_pair_pool signal_key_pair_pool;
+
 struct signal_context {
     signal_crypto_provider crypto_provider;
     void (*lock)(void *user_data);
     void (*unlock)(void *user_data);
+    void (*lock_address)(const signal_protocol_address *address, int mode, void *user_data);
+    void (*unlock_address)(const signal_protocol_address *address, int mode, void *user_data);
+    void (*lock_sender_key)(const signal_protocol_sender_key_name *sender_key_name, int mode, void *user_data);
+    void (*unlock_sender_key)(const signal_protocol_sender_key_name *sender_key_name, int mode, void *user_data);
     void (*log)(int level, const char *message, size_t len, void *user_data);
+    uint32_t skipped_key_checkpoint_interval;
+    void *(*malloc_func)(size_t size, void *user_data);
+    void *(*realloc_func)(void *ptr, size_t size, void *user_data);
+    void (*free_func)(void *ptr, void *user_data);
+    void *allocator_user_data;
+    ProtobufCAllocator protobuf_allocator;
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    signal_random_pool *_Atomic random_pool;
+    /* Calls that may be using random_pool, which is only freed once there are none */
+    atomic_uint random_pool_users;
+#else
+    signal_random_pool *random_pool;
+#endif
+    signal_key_pair_pool *key_pair_pool;
     void *user_data;
 };
 
+/*
+ * Memory management through the allocator of a context. A null context
+ * stands for the C library allocator. Memory must be released through the
+ * same context it was allocated from.
+ */
+void *signal_malloc(signal_context *context, size_t size);
+void *signal_calloc(signal_context *context, size_t count, size_t size);
+void *signal_realloc(signal_context *context, void *ptr, size_t size);
+void signal_free(signal_context *context, void *ptr);
+
+/*
+ * Buffers allocated from a context. Every buffer remembers its context, so
+ * signal_buffer_free() and the copy functions need no context argument.
+ */
+signal_buffer *signal_buffer_context_alloc(signal_context *context, size_t len);
+signal_buffer *signal_buffer_context_create(signal_context *context, const uint8_t *data, size_t len);
+
 int signal_crypto_random(signal_context *context, uint8_t *data, size_t len);
 
+/*
+ * Key pair for a ratchet step or session setup, taken from the key pair
+ * pool of the context if it has one, or generated.
+ */
+int signal_generate_ephemeral_key_pair(signal_context *context, ec_key_pair **key_pair);
+
 int signal_hmac_sha256_init(signal_context *context, void **hmac_context, const uint8_t *key, size_t key_len);
 int signal_hmac_sha256_update(signal_context *context, void *hmac_context, const uint8_t *data, size_t data_len);
 int signal_hmac_sha256_final(signal_context *context, void *hmac_context, signal_buffer **output);
 void signal_hmac_sha256_cleanup(signal_context *context, void *hmac_context);
 
+#define SIGNAL_HMAC_SHA256_LENGTH 32
+
+/*
+ * Finalize the HMAC calculation into a caller provided buffer of
+ * SIGNAL_HMAC_SHA256_LENGTH bytes. If the provider supports it, the context
+ * is reset and can be reused with the same key.
+ */
+int signal_hmac_sha256_final_into(signal_context *context, void *hmac_context, uint8_t *output);
+int signal_hmac_sha256_can_reset(signal_context *context);
+
+/*
+ * Compute an HMAC over the concatenation of the provided chunks, into a
+ * caller provided buffer of SIGNAL_HMAC_SHA256_LENGTH bytes.
+ */
+int signal_hmac_sha256(signal_context *context,
+        const uint8_t *key, size_t key_len,
+        const signal_iovec *iov, size_t iov_count,
+        uint8_t *output);
+
 int signal_sha512_digest_init(signal_context *context, void **digest_context);
 int signal_sha512_digest_update(signal_context *context, void *digest_context, const uint8_t *data, size_t data_len);
 int signal_sha512_digest_final(signal_context *context, void *digest_context, signal_buffer **output);
@@ -57,31 +137,71 @@ int signal_decrypt(signal_context *context,
 
 void signal_lock(signal_context *context);
 void signal_unlock(signal_context *context);
+
+/*
+ * Lock the state for a single address or sender key name, falling back to
+ * the global lock if no keyed locking functions have been set.
+ */
+void signal_lock_address(signal_context *context, const signal_protocol_address *address, int mode);
+void signal_unlock_address(signal_context *context, const signal_protocol_address *address, int mode);
+void signal_lock_sender_key(signal_context *context, const signal_protocol_sender_key_name *sender_key_name, int mode);
+void signal_unlock_sender_key(signal_context *context, const signal_protocol_sender_key_name *sender_key_name, int mode);
+
+/*
+ * Lock several addresses for one operation. The array of pointers is sorted
+ * in place into the canonical lock order, and duplicate addresses are only
+ * locked once. Pass the same array to signal_unlock_addresses().
+ */
+void signal_lock_addresses(signal_context *context, const signal_protocol_address **addresses, size_t count, int mode);
+void signal_unlock_addresses(signal_context *context, const signal_protocol_address **addresses, size_t count, int mode);
 void signal_log(signal_context *context, int level, const char *format, ...);
 void signal_explicit_bzero(void *v, size_t n);
 int signal_constant_memcmp(const void *s1, const void *s2, size_t n);
 
 /*------------------------------------------------------------------------*/
 
+/*
+ * Serialize a public key into caller provided memory of
+ * EC_PUBLIC_KEY_SERIALIZED_LENGTH bytes, in the format produced by
+ * ec_public_key_serialize().
+ */
+#define EC_PUBLIC_KEY_SERIALIZED_LENGTH 33
+void ec_public_key_serialize_into(uint8_t *data, const ec_public_key *key);
+
+/*
+ * The EC_PUBLIC_KEY_SERIALIZED_LENGTH bytes of the serialized form of a
+ * public key, kept with the key, so no memory is allocated or copied.
+ */
+const uint8_t *ec_public_key_get_serialized(const ec_public_key *key);
+
 /*
  * Functions used for internal protocol buffers serialization support.
+ * Memory held by prepared structures is allocated from the given arena,
+ * and is released with it.
  */
 
-int ec_public_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_public_key *key);
-int ec_private_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_private_key *key);
+int ec_public_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_public_key *key, signal_arena *arena);
+int ec_private_key_serialize_protobuf(ProtobufCBinaryData *buffer, const ec_private_key *key, signal_arena *arena);
 
-int ratchet_chain_key_get_key_protobuf(const ratchet_chain_key *chain_key, ProtobufCBinaryData *buffer);
-int ratchet_root_key_get_key_protobuf(const ratchet_root_key *root_key, ProtobufCBinaryData *buffer);
+int ratchet_chain_key_get_key_protobuf(const ratchet_chain_key *chain_key, ProtobufCBinaryData *buffer, signal_arena *arena);
+int ratchet_root_key_get_key_protobuf(const ratchet_root_key *root_key, ProtobufCBinaryData *buffer, signal_arena *arena);
 
-int session_state_serialize_prepare(session_state *state, Textsecure__SessionStructure *session_structure);
-void session_state_serialize_prepare_free(Textsecure__SessionStructure *session_structure);
+/* Typical arena usage of a prepared session state */
+#define SESSION_STATE_SERIALIZE_SIZE_HINT 1024
+
+int session_state_serialize_prepare(session_state *state, Textsecure__SessionStructure *session_structure, signal_arena *arena);
 int session_state_deserialize_protobuf(session_state **state, Textsecure__SessionStructure *session_structure, signal_context *global_context);
 
-int sender_key_state_serialize_prepare(sender_key_state *state, Textsecure__SenderKeyStateStructure *state_structure);
-void sender_key_state_serialize_prepare_free(Textsecure__SenderKeyStateStructure *state_structure);
+int sender_key_state_serialize_prepare(sender_key_state *state, Textsecure__SenderKeyStateStructure *state_structure, signal_arena *arena);
 int sender_key_state_deserialize_protobuf(sender_key_state **state, Textsecure__SenderKeyStateStructure *state_structure, signal_context *global_context);
 
 void signal_protocol_str_serialize_protobuf(ProtobufCBinaryData *buffer, const char *str);
-char *signal_protocol_str_deserialize_protobuf(ProtobufCBinaryData *buffer);
+char *signal_protocol_str_deserialize_protobuf(ProtobufCBinaryData *buffer, signal_context *global_context);
+
+/*
+ * Allocator for the generated unpack and free_unpacked functions, or 0 for
+ * the protobuf-c default if the context has no allocator set.
+ */
+ProtobufCAllocator *signal_protobuf_allocator(signal_context *global_context);
 
 #endif /* SIGNAL_PROTOCOL_INTERNAL_H */
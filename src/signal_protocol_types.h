@@ -33,6 +33,16 @@ typedef struct signal_context signal_context;
  */
 typedef struct signal_protocol_store_context signal_protocol_store_context;
 
+/*
+ * Counters reported by the session record cache of a data store context
+ */
+typedef struct signal_protocol_session_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t write_backs;
+} signal_protocol_session_cache_stats;
+
 /*
  * Address of an Signal Protocol message recipient
  */
@@ -0,0 +1,328 @@
+#include "signal_random.h"
+
+#include <string.h>
+#include <assert.h>
+
+#ifndef _WINDOWS
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#ifdef MADV_WIPEONFORK
+#define SIGNAL_RANDOM_WIPEONFORK 1
+#endif
+
+#include "signal_protocol_internal.h"
+
+#define SIGNAL_RANDOM_KEY_LEN 32
+#define SIGNAL_RANDOM_BLOCK_LEN 64
+#define SIGNAL_RANDOM_BUFFER_BLOCKS 12
+#define SIGNAL_RANDOM_BUFFER_LEN (SIGNAL_RANDOM_BUFFER_BLOCKS * SIGNAL_RANDOM_BLOCK_LEN)
+
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+/* Threads that find every generator busy use the crypto provider directly */
+#define SIGNAL_RANDOM_GENERATOR_COUNT 8
+#else
+#define SIGNAL_RANDOM_GENERATOR_COUNT 1
+#endif
+
+typedef struct signal_random_generator
+{
+    uint8_t key[SIGNAL_RANDOM_KEY_LEN];
+    /* Keystream not yet handed out is at the end of the buffer */
+    uint8_t buffer[SIGNAL_RANDOM_BUFFER_LEN];
+    size_t available;
+    size_t output_since_seed;
+    int seeded;
+    /* Generation of the pool when this generator was last seeded */
+    unsigned int seed_generation;
+#ifndef _WINDOWS
+    pid_t pid;
+#endif
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    atomic_flag busy;
+#endif
+} signal_random_generator;
+
+struct signal_random_pool
+{
+    signal_context *global_context;
+    signal_random_generator generators[SIGNAL_RANDOM_GENERATOR_COUNT];
+    /* Advanced to have every generator seeded again */
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    atomic_uint generation;
+#else
+    unsigned int generation;
+#endif
+#ifdef SIGNAL_RANDOM_WIPEONFORK
+    /* One byte per generator, set when seeding and zeroed by the kernel in a forked child */
+    volatile uint8_t *fork_guard;
+    size_t fork_guard_len;
+#endif
+};
+
+#define SIGNAL_RANDOM_ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define SIGNAL_RANDOM_QUARTERROUND(a, b, c, d) \
+    a += b; d ^= a; d = SIGNAL_RANDOM_ROTL32(d, 16); \
+    c += d; b ^= c; b = SIGNAL_RANDOM_ROTL32(b, 12); \
+    a += b; d ^= a; d = SIGNAL_RANDOM_ROTL32(d, 8); \
+    c += d; b ^= c; b = SIGNAL_RANDOM_ROTL32(b, 7);
+
+static uint32_t signal_random_load32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void signal_random_store32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+/*
+ * The first blocks of ChaCha20 keystream for the key, with a zero nonce.
+ * Every key is used for a single refill, so the nonce never needs to vary.
+ */
+static void signal_random_chacha20(uint8_t *out, size_t blocks, const uint8_t *key)
+{
+    uint32_t input[16];
+    uint32_t x[16];
+    size_t block;
+    int i;
+
+    input[0] = 0x61707865;
+    input[1] = 0x3320646e;
+    input[2] = 0x79622d32;
+    input[3] = 0x6b206574;
+    for(i = 0; i < 8; i++) {
+        input[4 + i] = signal_random_load32(key + 4 * i);
+    }
+    input[13] = 0;
+    input[14] = 0;
+    input[15] = 0;
+
+    for(block = 0; block < blocks; block++) {
+        input[12] = (uint32_t)block;
+        memcpy(x, input, sizeof(x));
+        for(i = 0; i < 10; i++) {
+            SIGNAL_RANDOM_QUARTERROUND(x[0], x[4], x[8], x[12])
+            SIGNAL_RANDOM_QUARTERROUND(x[1], x[5], x[9], x[13])
+            SIGNAL_RANDOM_QUARTERROUND(x[2], x[6], x[10], x[14])
+            SIGNAL_RANDOM_QUARTERROUND(x[3], x[7], x[11], x[15])
+            SIGNAL_RANDOM_QUARTERROUND(x[0], x[5], x[10], x[15])
+            SIGNAL_RANDOM_QUARTERROUND(x[1], x[6], x[11], x[12])
+            SIGNAL_RANDOM_QUARTERROUND(x[2], x[7], x[8], x[13])
+            SIGNAL_RANDOM_QUARTERROUND(x[3], x[4], x[9], x[14])
+        }
+        for(i = 0; i < 16; i++) {
+            signal_random_store32(out + block * SIGNAL_RANDOM_BLOCK_LEN + 4 * i, x[i] + input[i]);
+        }
+    }
+
+    signal_explicit_bzero(input, sizeof(input));
+    signal_explicit_bzero(x, sizeof(x));
+}
+
+static void signal_random_generator_refill(signal_random_generator *generator)
+{
+    signal_random_chacha20(generator->buffer, SIGNAL_RANDOM_BUFFER_BLOCKS, generator->key);
+    memcpy(generator->key, generator->buffer, SIGNAL_RANDOM_KEY_LEN);
+    signal_explicit_bzero(generator->buffer, SIGNAL_RANDOM_KEY_LEN);
+    generator->available = SIGNAL_RANDOM_BUFFER_LEN - SIGNAL_RANDOM_KEY_LEN;
+}
+
+static unsigned int signal_random_pool_get_generation(signal_random_pool *pool)
+{
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    return atomic_load_explicit(&pool->generation, memory_order_relaxed);
+#else
+    return pool->generation;
+#endif
+}
+
+static int signal_random_generator_seed(signal_random_pool *pool, size_t index, unsigned int generation)
+{
+    int result = 0;
+    signal_random_generator *generator = &pool->generators[index];
+    uint8_t seed[SIGNAL_RANDOM_KEY_LEN];
+    int i;
+
+    result = pool->global_context->crypto_provider.random_func(seed, sizeof(seed),
+            pool->global_context->crypto_provider.user_data);
+    if(result < 0) {
+        goto complete;
+    }
+
+    /* Mixing into the old key keeps it as strong as the better of the two */
+    for(i = 0; i < SIGNAL_RANDOM_KEY_LEN; i++) {
+        generator->key[i] ^= seed[i];
+    }
+
+    /* Drop what the old key produced */
+    signal_explicit_bzero(generator->buffer, sizeof(generator->buffer));
+    signal_random_generator_refill(generator);
+    generator->output_since_seed = 0;
+    generator->seeded = 1;
+    generator->seed_generation = generation;
+#ifdef SIGNAL_RANDOM_WIPEONFORK
+    if(pool->fork_guard) {
+        pool->fork_guard[index] = 1;
+    }
+#endif
+#ifndef _WINDOWS
+    generator->pid = getpid();
+#endif
+
+complete:
+    signal_explicit_bzero(seed, sizeof(seed));
+    return result;
+}
+
+/*
+ * A forked child would otherwise repeat the output of its parent. Checking
+ * the guard page avoids a getpid() system call on every use.
+ */
+static int signal_random_generator_forked(signal_random_pool *pool, size_t index)
+{
+#ifdef SIGNAL_RANDOM_WIPEONFORK
+    if(pool->fork_guard) {
+        return pool->fork_guard[index] == 0;
+    }
+#endif
+#ifndef _WINDOWS
+    return pool->generators[index].pid != getpid();
+#else
+    (void)pool;
+    (void)index;
+    return 0;
+#endif
+}
+
+static int signal_random_generator_fill(signal_random_pool *pool, size_t index, uint8_t *data, size_t len)
+{
+    int result = 0;
+    signal_random_generator *generator = &pool->generators[index];
+    unsigned int generation = signal_random_pool_get_generation(pool);
+    size_t n;
+
+    if(!generator->seeded || generator->seed_generation != generation
+            || generator->output_since_seed >= SIGNAL_RANDOM_RESEED_INTERVAL
+            || signal_random_generator_forked(pool, index)) {
+        result = signal_random_generator_seed(pool, index, generation);
+        if(result < 0) {
+            return result;
+        }
+    }
+
+    while(len > 0) {
+        if(generator->available == 0) {
+            signal_random_generator_refill(generator);
+        }
+        n = len < generator->available ? len : generator->available;
+        memcpy(data, generator->buffer + SIGNAL_RANDOM_BUFFER_LEN - generator->available, n);
+        signal_explicit_bzero(generator->buffer + SIGNAL_RANDOM_BUFFER_LEN - generator->available, n);
+        generator->available -= n;
+        generator->output_since_seed += n;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int signal_random_pool_create(signal_random_pool **pool, signal_context *global_context)
+{
+    signal_random_pool *result_pool;
+
+    assert(global_context);
+
+    result_pool = signal_malloc(global_context, sizeof(signal_random_pool));
+    if(!result_pool) {
+        return SG_ERR_NOMEM;
+    }
+    memset(result_pool, 0, sizeof(signal_random_pool));
+    result_pool->global_context = global_context;
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    {
+        size_t i;
+        for(i = 0; i < SIGNAL_RANDOM_GENERATOR_COUNT; i++) {
+            atomic_flag_clear(&result_pool->generators[i].busy);
+        }
+        atomic_init(&result_pool->generation, 0);
+    }
+#endif
+
+#ifdef SIGNAL_RANDOM_WIPEONFORK
+    {
+        /* Kernels without MADV_WIPEONFORK fall back to comparing process IDs */
+        size_t len = (size_t)sysconf(_SC_PAGESIZE);
+        void *page = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(page != MAP_FAILED) {
+            if(madvise(page, len, MADV_WIPEONFORK) == 0) {
+                result_pool->fork_guard = page;
+                result_pool->fork_guard_len = len;
+            }
+            else {
+                munmap(page, len);
+            }
+        }
+    }
+#endif
+
+    *pool = result_pool;
+    return 0;
+}
+
+int signal_random_pool_fill(signal_random_pool *pool, uint8_t *data, size_t len)
+{
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    int result;
+    size_t i;
+
+    assert(pool);
+
+    /* Trying in order keeps a thread that runs alone on the same generator */
+    for(i = 0; i < SIGNAL_RANDOM_GENERATOR_COUNT; i++) {
+        signal_random_generator *generator = &pool->generators[i];
+        if(!atomic_flag_test_and_set_explicit(&generator->busy, memory_order_acquire)) {
+            result = signal_random_generator_fill(pool, i, data, len);
+            atomic_flag_clear_explicit(&generator->busy, memory_order_release);
+            return result;
+        }
+    }
+
+    return pool->global_context->crypto_provider.random_func(data, len,
+            pool->global_context->crypto_provider.user_data);
+#else
+    assert(pool);
+    return signal_random_generator_fill(pool, 0, data, len);
+#endif
+}
+
+void signal_random_pool_reseed(signal_random_pool *pool)
+{
+    assert(pool);
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    atomic_fetch_add_explicit(&pool->generation, 1, memory_order_relaxed);
+#else
+    pool->generation++;
+#endif
+}
+
+void signal_random_pool_free(signal_random_pool *pool)
+{
+    if(pool) {
+        signal_context *global_context = pool->global_context;
+#ifdef SIGNAL_RANDOM_WIPEONFORK
+        if(pool->fork_guard) {
+            munmap((void *)pool->fork_guard, pool->fork_guard_len);
+        }
+#endif
+        signal_explicit_bzero(pool, sizeof(signal_random_pool));
+        signal_free(global_context, pool);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef SIGNAL_RANDOM_H
+#define SIGNAL_RANDOM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "signal_protocol_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Buffered randomness for a context, from a ChaCha20 generator with fast
+ * key erasure. Each refill produces a block of keystream whose first 32
+ * bytes immediately replace the key, and the rest is handed out and zeroed
+ * as it is used, so a later compromise of the state reveals nothing about
+ * earlier output.
+ *
+ * The key is seeded from the random function of the crypto provider, and
+ * reseeded after SIGNAL_RANDOM_RESEED_INTERVAL bytes of output, and in a
+ * child process after a fork.
+ *
+ * With SIGNAL_ATOMIC_REFCOUNT, a pool holds several generators, each
+ * claimed with its own try-lock, and a thread that finds all of them busy
+ * is served by the crypto provider directly. Otherwise a pool has a single
+ * generator, is not thread-safe, and the context guards it with its global
+ * lock.
+ */
+typedef struct signal_random_pool signal_random_pool;
+
+/* Bytes of output between reseeds from the crypto provider */
+#define SIGNAL_RANDOM_RESEED_INTERVAL 65536
+
+int signal_random_pool_create(signal_random_pool **pool, signal_context *global_context);
+
+/**
+ * Fill data with len random bytes, seeding a generator first if needed.
+ *
+ * @return 0 on success, or the error of the crypto provider
+ */
+int signal_random_pool_fill(signal_random_pool *pool, uint8_t *data, size_t len);
+
+/**
+ * Seed every generator of the pool again before its next use, as after a
+ * change of crypto provider.
+ */
+void signal_random_pool_reseed(signal_random_pool *pool);
+
+void signal_random_pool_free(signal_random_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SIGNAL_RANDOM_H */
@@ -155,7 +155,9 @@ void setup_test_crypto_provider(signal_context *context)
             .sha512_digest_cleanup_func = test_sha512_digest_cleanup,
             .encrypt_func = test_encrypt,
             .decrypt_func = test_decrypt,
-            .user_data = 0
+            .user_data = 0,
+            .hmac_sha256_oneshot_func = test_hmac_sha256_oneshot,
+            .hmac_sha256_final_reset_func = test_hmac_sha256_final_reset
     };
 
     signal_context_set_crypto_provider(context, &provider);
@@ -163,6 +165,76 @@ void setup_test_crypto_provider(signal_context *context)
 
 /*------------------------------------------------------------------------*/
 
+#define TEST_ALLOCATOR_MAGIC 0x5349474e414c4c43ULL
+
+typedef struct test_allocation_header {
+    uint64_t magic;
+    size_t size;
+} test_allocation_header;
+
+void *test_allocator_malloc(size_t size, void *user_data)
+{
+    test_allocator *allocator = user_data;
+    test_allocation_header *header = malloc(sizeof(test_allocation_header) + size);
+    if(!header) {
+        return 0;
+    }
+    header->magic = TEST_ALLOCATOR_MAGIC;
+    header->size = size;
+    allocator->allocation_count++;
+    allocator->live_count++;
+    return header + 1;
+}
+
+void *test_allocator_realloc(void *ptr, size_t size, void *user_data)
+{
+    test_allocation_header *header;
+    test_allocation_header *new_header;
+
+    if(!ptr) {
+        return test_allocator_malloc(size, user_data);
+    }
+
+    /* Memory that did not come from this allocator fails here */
+    header = (test_allocation_header *)ptr - 1;
+    ck_assert(header->magic == TEST_ALLOCATOR_MAGIC);
+
+    new_header = realloc(header, sizeof(test_allocation_header) + size);
+    if(!new_header) {
+        return 0;
+    }
+    new_header->size = size;
+    return new_header + 1;
+}
+
+void test_allocator_free(void *ptr, void *user_data)
+{
+    test_allocator *allocator = user_data;
+    test_allocation_header *header;
+
+    if(!ptr) {
+        return;
+    }
+
+    header = (test_allocation_header *)ptr - 1;
+    ck_assert(header->magic == TEST_ALLOCATOR_MAGIC);
+    ck_assert_int_gt(allocator->live_count, 0);
+    header->magic = 0;
+    allocator->live_count--;
+    free(header);
+}
+
+void setup_test_allocator(signal_context *context, test_allocator *allocator)
+{
+    int result;
+
+    memset(allocator, 0, sizeof(test_allocator));
+    result = signal_context_set_allocator(context,
+            test_allocator_malloc, test_allocator_realloc, test_allocator_free,
+            allocator);
+    ck_assert_int_eq(result, 0);
+}
+
 void setup_test_store_context(signal_protocol_store_context **context, signal_context *global_context)
 {
     int result = 0;
@@ -337,6 +409,34 @@ int test_session_store_delete_all_sessions(const char *name, size_t name_len, vo
     return result;
 }
 
+int test_session_store_load_sessions(signal_buffer **records, signal_buffer **user_records, const signal_protocol_address *addresses, size_t count, void *user_data)
+{
+    size_t i;
+    for(i = 0; i < count; i++) {
+        int result = test_session_store_load_session(&records[i], &user_records[i], &addresses[i], user_data);
+        if(result < 0) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+int test_session_store_store_sessions(const signal_protocol_address *addresses, signal_buffer **records, signal_buffer **user_records, size_t count, void *user_data)
+{
+    size_t i;
+    for(i = 0; i < count; i++) {
+        int result = test_session_store_store_session(&addresses[i],
+                signal_buffer_data(records[i]), signal_buffer_len(records[i]),
+                user_records[i] ? signal_buffer_data(user_records[i]) : 0,
+                user_records[i] ? signal_buffer_len(user_records[i]) : 0,
+                user_data);
+        if(result < 0) {
+            return result;
+        }
+    }
+    return 0;
+}
+
 void test_session_store_destroy(void *user_data)
 {
     test_session_store_data *data = user_data;
@@ -352,7 +452,7 @@ void test_session_store_destroy(void *user_data)
     free(data);
 }
 
-void setup_test_session_store(signal_protocol_store_context *context)
+void setup_test_session_store_with_batch(signal_protocol_store_context *context, int batch)
 {
     test_session_store_data *data = malloc(sizeof(test_session_store_data));
     memset(data, 0, sizeof(test_session_store_data));
@@ -365,12 +465,19 @@ void setup_test_session_store(signal_protocol_store_context *context)
         .delete_session_func = test_session_store_delete_session,
         .delete_all_sessions_func = test_session_store_delete_all_sessions,
         .destroy_func = test_session_store_destroy,
-        .user_data = data
+        .user_data = data,
+        .load_sessions_func = batch ? test_session_store_load_sessions : 0,
+        .store_sessions_func = batch ? test_session_store_store_sessions : 0
     };
 
     signal_protocol_store_context_set_session_store(context, &store);
 }
 
+void setup_test_session_store(signal_protocol_store_context *context)
+{
+    setup_test_session_store_with_batch(context, 1);
+}
+
 /*------------------------------------------------------------------------*/
 
 typedef struct {
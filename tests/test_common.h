@@ -22,6 +22,10 @@ int test_hmac_sha256_init(void **hmac_context, const uint8_t *key, size_t key_le
 int test_hmac_sha256_update(void *hmac_context, const uint8_t *data, size_t data_len, void *user_data);
 int test_hmac_sha256_final(void *hmac_context, signal_buffer **output, void *user_data);
 void test_hmac_sha256_cleanup(void *hmac_context, void *user_data);
+int test_hmac_sha256_final_reset(void *hmac_context, uint8_t *output, void *user_data);
+int test_hmac_sha256_oneshot(const uint8_t *key, size_t key_len,
+        const signal_iovec *iov, size_t iov_count,
+        uint8_t *output, void *user_data);
 int test_sha512_digest_init(void **digest_context, void *user_data);
 int test_sha512_digest_update(void *digest_context, const uint8_t *data, size_t data_len, void *user_data);
 int test_sha512_digest_final(void *digest_context, signal_buffer **output, void *user_data);
@@ -41,6 +45,17 @@ int test_decrypt(signal_buffer **output,
         void *user_data);
 void setup_test_crypto_provider(signal_context *context);
 
+/* Test allocator, which checks every free and counts live allocations */
+typedef struct test_allocator {
+    size_t allocation_count;
+    size_t live_count;
+} test_allocator;
+
+void *test_allocator_malloc(size_t size, void *user_data);
+void *test_allocator_realloc(void *ptr, size_t size, void *user_data);
+void test_allocator_free(void *ptr, void *user_data);
+void setup_test_allocator(signal_context *context, test_allocator *allocator);
+
 /* Test data store context */
 void setup_test_store_context(signal_protocol_store_context **context, signal_context *global_context);
 
@@ -51,8 +66,11 @@ int test_session_store_store_session(const signal_protocol_address *address, uin
 int test_session_store_contains_session(const signal_protocol_address *address, void *user_data);
 int test_session_store_delete_session(const signal_protocol_address *address, void *user_data);
 int test_session_store_delete_all_sessions(const char *name, size_t name_len, void *user_data);
+int test_session_store_load_sessions(signal_buffer **records, signal_buffer **user_records, const signal_protocol_address *addresses, size_t count, void *user_data);
+int test_session_store_store_sessions(const signal_protocol_address *addresses, signal_buffer **records, signal_buffer **user_records, size_t count, void *user_data);
 void test_session_store_destroy(void *user_data);
 void setup_test_session_store(signal_protocol_store_context *context);
+void setup_test_session_store_with_batch(signal_protocol_store_context *context, int batch);
 
 /* Test pre-key store */
 int test_pre_key_store_load_pre_key(signal_buffer **record, uint32_t pre_key_id, void *user_data);
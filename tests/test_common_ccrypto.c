@@ -5,6 +5,7 @@
 #include <CommonCrypto/CommonCryptor.h>
 
 #include <stdio.h>
+#include <string.h>
 
 int test_random_generator(uint8_t *data, size_t len, void *user_data)
 {
@@ -40,12 +41,14 @@ complete:
 
 int test_hmac_sha256_init(void **hmac_context, const uint8_t *key, size_t key_len, void *user_data)
 {
-    CCHmacContext *ctx = malloc(sizeof(CCHmacContext));
+    /* The second context keeps the keyed initial state for resets */
+    CCHmacContext *ctx = malloc(sizeof(CCHmacContext) * 2);
     if(!ctx) {
         return SG_ERR_NOMEM;
     }
 
     CCHmacInit(ctx, kCCHmacAlgSHA256, key, key_len);
+    memcpy(&ctx[1], &ctx[0], sizeof(CCHmacContext));
     *hmac_context = ctx;
 
     return 0;
@@ -74,6 +77,30 @@ int test_hmac_sha256_final(void *hmac_context, signal_buffer **output, void *use
     return 0;
 }
 
+int test_hmac_sha256_final_reset(void *hmac_context, uint8_t *output, void *user_data)
+{
+    CCHmacContext *ctx = hmac_context;
+    CCHmacFinal(&ctx[0], output);
+    memcpy(&ctx[0], &ctx[1], sizeof(CCHmacContext));
+    return 0;
+}
+
+int test_hmac_sha256_oneshot(const uint8_t *key, size_t key_len,
+        const signal_iovec *iov, size_t iov_count,
+        uint8_t *output, void *user_data)
+{
+    CCHmacContext ctx;
+    size_t i;
+
+    CCHmacInit(&ctx, kCCHmacAlgSHA256, key, key_len);
+    for(i = 0; i < iov_count; i++) {
+        CCHmacUpdate(&ctx, iov[i].data, iov[i].len);
+    }
+    CCHmacFinal(&ctx, output);
+
+    return 0;
+}
+
 void test_hmac_sha256_cleanup(void *hmac_context, void *user_data)
 {
     if(hmac_context) {
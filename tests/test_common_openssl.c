@@ -71,6 +71,50 @@ complete:
     return result;
 }
 
+int test_hmac_sha256_final_reset(void *hmac_context, uint8_t *output, void *user_data)
+{
+    unsigned int len = 0;
+    HMAC_CTX *ctx = hmac_context;
+
+    if(HMAC_Final(ctx, output, &len) != 1 || len != SHA256_DIGEST_LENGTH) {
+        return SG_ERR_UNKNOWN;
+    }
+
+    /* Passing a null key and digest restarts with the previous key */
+    if(HMAC_Init_ex(ctx, 0, 0, 0, 0) != 1) {
+        return SG_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+int test_hmac_sha256_oneshot(const uint8_t *key, size_t key_len,
+        const signal_iovec *iov, size_t iov_count,
+        uint8_t *output, void *user_data)
+{
+    int result = 0;
+    void *ctx = 0;
+    size_t i;
+
+    result = test_hmac_sha256_init(&ctx, key, key_len, user_data);
+    if(result < 0) {
+        goto complete;
+    }
+
+    for(i = 0; i < iov_count; i++) {
+        result = test_hmac_sha256_update(ctx, iov[i].data, iov[i].len, user_data);
+        if(result < 0) {
+            goto complete;
+        }
+    }
+
+    result = test_hmac_sha256_final_reset(ctx, output, user_data);
+
+complete:
+    test_hmac_sha256_cleanup(ctx, user_data);
+    return result;
+}
+
 void test_hmac_sha256_cleanup(void *hmac_context, void *user_data)
 {
     if(hmac_context) {
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+
+#include "../src/signal_protocol.h"
+#include "signal_crypto_builtin.h"
+#include "crypto_builtin_cpu.h"
+#include "crypto_builtin_sha.h"
+#include "crypto_builtin_aes.h"
+#include "hkdf.h"
+#include "test_common.h"
+
+signal_context *global_context;
+signal_crypto_provider builtin;
+
+void test_setup()
+{
+    int result;
+    result = signal_context_create(&global_context, 0);
+    ck_assert_int_eq(result, 0);
+    signal_context_set_log_function(global_context, test_log);
+
+    result = signal_context_set_builtin_crypto_provider(global_context);
+    ck_assert_int_eq(result, 0);
+    signal_crypto_builtin_provider(&builtin);
+}
+
+void test_setup_portable()
+{
+    test_setup();
+    crypto_builtin_cpu_set_mask(0);
+}
+
+void test_teardown()
+{
+    crypto_builtin_cpu_set_mask(~0U);
+    signal_context_destroy(global_context);
+}
+
+static void fill_random(uint8_t *data, size_t len)
+{
+    int result = test_random_generator(data, len, 0);
+    ck_assert_int_eq(result, 0);
+}
+
+START_TEST(test_sha256_vector)
+{
+    static const uint8_t abc_digest[] = {
+            0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+            0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+            0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+            0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+    static const uint8_t long_digest[] = {
+            0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8,
+            0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+            0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67,
+            0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1};
+    const char *long_message = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    crypto_builtin_sha256_ctx ctx;
+    uint8_t digest[CRYPTO_BUILTIN_SHA256_DIGEST_SIZE];
+
+    crypto_builtin_sha256_init(&ctx);
+    crypto_builtin_sha256_update(&ctx, (const uint8_t *)"abc", 3);
+    crypto_builtin_sha256_final(&ctx, digest);
+    ck_assert_int_eq(memcmp(digest, abc_digest, sizeof(digest)), 0);
+
+    crypto_builtin_sha256_init(&ctx);
+    crypto_builtin_sha256_update(&ctx, (const uint8_t *)long_message, 20);
+    crypto_builtin_sha256_update(&ctx, (const uint8_t *)long_message + 20, strlen(long_message) - 20);
+    crypto_builtin_sha256_final(&ctx, digest);
+    ck_assert_int_eq(memcmp(digest, long_digest, sizeof(digest)), 0);
+}
+END_TEST
+
+START_TEST(test_aes_vector)
+{
+    /* FIPS-197 appendix C */
+    static const uint8_t plaintext[] = {
+            0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+            0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+    static const uint8_t ciphertext_128[] = {
+            0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+            0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a};
+    static const uint8_t ciphertext_192[] = {
+            0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0,
+            0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91};
+    static const uint8_t ciphertext_256[] = {
+            0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+            0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89};
+    const uint8_t *expected[] = { ciphertext_128, ciphertext_192, ciphertext_256 };
+    uint8_t key[32];
+    uint8_t iv[16];
+    uint8_t block[16];
+    crypto_builtin_aes_key aes_key;
+    int i;
+
+    for(i = 0; i < 32; i++) {
+        key[i] = (uint8_t)i;
+    }
+
+    for(i = 0; i < 3; i++) {
+        int result = crypto_builtin_aes_set_key(&aes_key, key, 16 + (i * 8));
+        ck_assert_int_eq(result, 0);
+
+        /* A single CBC block with a zero IV is the raw block cipher */
+        memset(iv, 0, sizeof(iv));
+        crypto_builtin_aes_cbc_encrypt(&aes_key, iv, plaintext, block, 1);
+        ck_assert_int_eq(memcmp(block, expected[i], sizeof(block)), 0);
+
+        memset(iv, 0, sizeof(iv));
+        crypto_builtin_aes_cbc_decrypt(&aes_key, iv, block, block, 1);
+        ck_assert_int_eq(memcmp(block, plaintext, sizeof(block)), 0);
+    }
+
+    ck_assert_int_lt(crypto_builtin_aes_set_key(&aes_key, key, 20), 0);
+}
+END_TEST
+
+START_TEST(test_hmac_sha256_matches_reference)
+{
+    int result = 0;
+    uint8_t key[100];
+    uint8_t data[300];
+    uint8_t expected[32];
+    uint8_t actual[32];
+    size_t key_len;
+    size_t data_len;
+    void *hmac_context = 0;
+    signal_buffer *buffer = 0;
+
+    for(key_len = 0; key_len <= sizeof(key); key_len += 7) {
+        for(data_len = 0; data_len <= sizeof(data); data_len += 23) {
+            fill_random(key, key_len);
+            fill_random(data, data_len);
+            signal_iovec iov[2] = {
+                    { data, data_len / 3 },
+                    { data + (data_len / 3), data_len - (data_len / 3) }
+            };
+
+            result = test_hmac_sha256_oneshot(key, key_len, iov, 2, expected, 0);
+            ck_assert_int_eq(result, 0);
+
+            result = builtin.hmac_sha256_oneshot_func(key, key_len, iov, 2, actual, 0);
+            ck_assert_int_eq(result, 0);
+            ck_assert_int_eq(memcmp(expected, actual, sizeof(actual)), 0);
+
+            result = builtin.hmac_sha256_init_func(&hmac_context, key, key_len, 0);
+            ck_assert_int_eq(result, 0);
+            result = builtin.hmac_sha256_update_func(hmac_context, data, data_len, 0);
+            ck_assert_int_eq(result, 0);
+            result = builtin.hmac_sha256_final_reset_func(hmac_context, actual, 0);
+            ck_assert_int_eq(result, 0);
+            ck_assert_int_eq(memcmp(expected, actual, sizeof(actual)), 0);
+
+            /* The context must be usable again after the reset */
+            result = builtin.hmac_sha256_update_func(hmac_context, data, data_len, 0);
+            ck_assert_int_eq(result, 0);
+            result = builtin.hmac_sha256_final_func(hmac_context, &buffer, 0);
+            ck_assert_int_eq(result, 0);
+            ck_assert_int_eq(signal_buffer_len(buffer), sizeof(expected));
+            ck_assert_int_eq(memcmp(expected, signal_buffer_data(buffer), sizeof(expected)), 0);
+
+            signal_buffer_free(buffer);
+            buffer = 0;
+            builtin.hmac_sha256_cleanup_func(hmac_context, 0);
+            hmac_context = 0;
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_sha512_matches_reference)
+{
+    int result = 0;
+    uint8_t data[600];
+    size_t data_len;
+    void *expected_context = 0;
+    void *actual_context = 0;
+    signal_buffer *expected = 0;
+    signal_buffer *actual = 0;
+
+    result = test_sha512_digest_init(&expected_context, 0);
+    ck_assert_int_eq(result, 0);
+    result = builtin.sha512_digest_init_func(&actual_context, 0);
+    ck_assert_int_eq(result, 0);
+
+    for(data_len = 0; data_len <= sizeof(data); data_len += 13) {
+        fill_random(data, data_len);
+
+        result = test_sha512_digest_update(expected_context, data, data_len, 0);
+        ck_assert_int_eq(result, 0);
+        result = test_sha512_digest_final(expected_context, &expected, 0);
+        ck_assert_int_eq(result, 0);
+
+        result = builtin.sha512_digest_update_func(actual_context, data, data_len / 2, 0);
+        ck_assert_int_eq(result, 0);
+        result = builtin.sha512_digest_update_func(actual_context, data + (data_len / 2), data_len - (data_len / 2), 0);
+        ck_assert_int_eq(result, 0);
+        result = builtin.sha512_digest_final_func(actual_context, &actual, 0);
+        ck_assert_int_eq(result, 0);
+
+        ck_assert_int_eq(signal_buffer_compare(expected, actual), 0);
+        signal_buffer_free(expected);
+        signal_buffer_free(actual);
+        expected = 0;
+        actual = 0;
+    }
+
+    test_sha512_digest_cleanup(expected_context, 0);
+    builtin.sha512_digest_cleanup_func(actual_context, 0);
+}
+END_TEST
+
+START_TEST(test_cipher_matches_reference)
+{
+    static const int ciphers[] = { SG_CIPHER_AES_CTR_NOPADDING, SG_CIPHER_AES_CBC_PKCS5 };
+    int result = 0;
+    uint8_t key[32];
+    uint8_t iv[16];
+    uint8_t plaintext[150];
+    signal_buffer *expected = 0;
+    signal_buffer *actual = 0;
+    signal_buffer *decrypted = 0;
+    size_t key_len;
+    size_t plaintext_len;
+    int i;
+
+    for(i = 0; i < 2; i++) {
+        for(key_len = 16; key_len <= 32; key_len += 8) {
+            for(plaintext_len = 0; plaintext_len <= sizeof(plaintext); plaintext_len += 5) {
+                fill_random(key, key_len);
+                fill_random(iv, sizeof(iv));
+                fill_random(plaintext, plaintext_len);
+                /* Exercise the counter carry across byte boundaries */
+                memset(iv + 13, 0xff, 3);
+
+                result = test_encrypt(&expected, ciphers[i], key, key_len, iv, sizeof(iv), plaintext, plaintext_len, 0);
+                ck_assert_int_ge(result, 0);
+
+                result = builtin.encrypt_func(&actual, ciphers[i], key, key_len, iv, sizeof(iv), plaintext, plaintext_len, 0);
+                ck_assert_int_eq(result, 0);
+                ck_assert_int_eq(signal_buffer_compare(expected, actual), 0);
+
+                result = builtin.decrypt_func(&decrypted, ciphers[i], key, key_len, iv, sizeof(iv),
+                        signal_buffer_data(actual), signal_buffer_len(actual), 0);
+                ck_assert_int_eq(result, 0);
+                ck_assert_int_eq(signal_buffer_len(decrypted), plaintext_len);
+                ck_assert_int_eq(memcmp(signal_buffer_data(decrypted), plaintext, plaintext_len), 0);
+
+                signal_buffer_free(expected);
+                signal_buffer_free(actual);
+                signal_buffer_free(decrypted);
+                expected = 0;
+                actual = 0;
+                decrypted = 0;
+            }
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_cbc_bad_padding)
+{
+    int result = 0;
+    uint8_t key[16];
+    uint8_t iv[16];
+    uint8_t chain[16];
+    uint8_t plaintext[32];
+    uint8_t ciphertext[32];
+    crypto_builtin_aes_key aes_key;
+    signal_buffer *output = 0;
+
+    fill_random(key, sizeof(key));
+    fill_random(iv, sizeof(iv));
+    fill_random(plaintext, sizeof(plaintext));
+    crypto_builtin_aes_set_key(&aes_key, key, sizeof(key));
+
+    /* Zero padding byte */
+    plaintext[31] = 0;
+    memcpy(chain, iv, sizeof(iv));
+    crypto_builtin_aes_cbc_encrypt(&aes_key, chain, plaintext, ciphertext, 2);
+    result = builtin.decrypt_func(&output, SG_CIPHER_AES_CBC_PKCS5, key, sizeof(key), iv, sizeof(iv), ciphertext, sizeof(ciphertext), 0);
+    ck_assert_int_lt(result, 0);
+
+    /* Padding longer than a block */
+    plaintext[31] = 17;
+    memcpy(chain, iv, sizeof(iv));
+    crypto_builtin_aes_cbc_encrypt(&aes_key, chain, plaintext, ciphertext, 2);
+    result = builtin.decrypt_func(&output, SG_CIPHER_AES_CBC_PKCS5, key, sizeof(key), iv, sizeof(iv), ciphertext, sizeof(ciphertext), 0);
+    ck_assert_int_lt(result, 0);
+
+    /* Inconsistent padding bytes */
+    memset(plaintext + 28, 4, 4);
+    plaintext[29] = 3;
+    memcpy(chain, iv, sizeof(iv));
+    crypto_builtin_aes_cbc_encrypt(&aes_key, chain, plaintext, ciphertext, 2);
+    result = builtin.decrypt_func(&output, SG_CIPHER_AES_CBC_PKCS5, key, sizeof(key), iv, sizeof(iv), ciphertext, sizeof(ciphertext), 0);
+    ck_assert_int_lt(result, 0);
+
+    /* Truncated ciphertext */
+    result = builtin.decrypt_func(&output, SG_CIPHER_AES_CBC_PKCS5, key, sizeof(key), iv, sizeof(iv), ciphertext, 31, 0);
+    ck_assert_int_lt(result, 0);
+}
+END_TEST
+
+START_TEST(test_hkdf_with_builtin_provider)
+{
+    int result;
+
+    uint8_t ikm[] = {
+            0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
+            0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
+            0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b};
+
+    uint8_t salt[] = {
+            0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+            0x08, 0x09, 0x0a, 0x0b, 0x0c};
+
+    uint8_t info[] = {
+            0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+            0xf8, 0xf9};
+
+    uint8_t okm[] = {
+            0x3c, 0xb2, 0x5f, 0x25, 0xfa, 0xac, 0xd5, 0x7a,
+            0x90, 0x43, 0x4f, 0x64, 0xd0, 0x36, 0x2f, 0x2a,
+            0x2d, 0x2d, 0x0a, 0x90, 0xcf, 0x1a, 0x5a, 0x4c,
+            0x5d, 0xb0, 0x2d, 0x56, 0xec, 0xc4, 0xc5, 0xbf,
+            0x34, 0x00, 0x72, 0x08, 0xd5, 0xb8, 0x87, 0x18,
+            0x58, 0x65};
+
+    hkdf_context *context;
+    result = hkdf_create(&context, 3, global_context);
+    ck_assert_int_eq(result, 0);
+
+    uint8_t *output = 0;
+    result = hkdf_derive_secrets(context, &output, ikm, sizeof(ikm), salt, sizeof(salt), info, sizeof(info), 42);
+    ck_assert_int_eq(result, sizeof(okm));
+
+    ck_assert_int_eq(memcmp(okm, output, result), 0);
+
+    if(output) { free(output); }
+    SIGNAL_UNREF(context);
+}
+END_TEST
+
+static void add_crypto_builtin_tests(TCase *tcase)
+{
+    tcase_add_test(tcase, test_sha256_vector);
+    tcase_add_test(tcase, test_aes_vector);
+    tcase_add_test(tcase, test_hmac_sha256_matches_reference);
+    tcase_add_test(tcase, test_sha512_matches_reference);
+    tcase_add_test(tcase, test_cipher_matches_reference);
+    tcase_add_test(tcase, test_cbc_bad_padding);
+    tcase_add_test(tcase, test_hkdf_with_builtin_provider);
+}
+
+Suite *crypto_builtin_suite(void)
+{
+    Suite *suite = suite_create("crypto_builtin");
+
+    TCase *tcase = tcase_create("case");
+    tcase_add_checked_fixture(tcase, test_setup, test_teardown);
+    add_crypto_builtin_tests(tcase);
+    suite_add_tcase(suite, tcase);
+
+    TCase *tcase_portable = tcase_create("portable");
+    tcase_add_checked_fixture(tcase_portable, test_setup_portable, test_teardown);
+    add_crypto_builtin_tests(tcase_portable);
+    suite_add_tcase(suite, tcase_portable);
+
+    return suite;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *suite;
+    SRunner *runner;
+
+    suite = crypto_builtin_suite();
+    runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
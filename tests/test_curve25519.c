@@ -1,11 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <check.h>
+#include <pthread.h>
 
 #include "../src/signal_protocol.h"
 #include "../src/signal_protocol_internal.h"
 #include "curve.h"
+#include "curve25519/curve25519-donna.h"
+#include "curve25519/ed25519/additions/curve_sigs.h"
+#include "ratchet.h"
 #include "test_common.h"
 
 signal_context *global_context;
@@ -175,6 +180,15 @@ START_TEST(test_curve25519_generate_public)
     /* Assert that expected and actual public keys match */
     ck_assert_int_eq(ec_public_key_compare(alice_expected_public_key, alice_public_key), 0);
 
+    /* Assert that the serialized form kept with the generated key is complete */
+    ck_assert_int_eq(memcmp(ec_public_key_get_serialized(alice_public_key), alicePublic, sizeof(alicePublic)), 0);
+    signal_buffer *serialized = 0;
+    result = ec_public_key_serialize(&serialized, alice_public_key);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(signal_buffer_len(serialized), EC_PUBLIC_KEY_SERIALIZED_LENGTH);
+    ck_assert_int_eq(memcmp(signal_buffer_data(serialized), alicePublic, sizeof(alicePublic)), 0);
+    signal_buffer_free(serialized);
+
     /* Cleanup */
     SIGNAL_UNREF(alice_public_key);
     SIGNAL_UNREF(alice_expected_public_key);
@@ -182,6 +196,49 @@ START_TEST(test_curve25519_generate_public)
 }
 END_TEST
 
+START_TEST(test_curve25519_generate_public_matches_ladder)
+{
+    static const uint8_t basepoint[32] = {9};
+    int result;
+    int i;
+
+    for(i = 0; i < 200; i++) {
+        uint8_t private_data[32];
+        uint8_t expected[32];
+        ec_private_key *private_key = 0;
+        ec_public_key *public_key = 0;
+
+        result = signal_crypto_random(global_context, private_data, sizeof(private_data));
+        ck_assert_int_eq(result, 0);
+
+        /* Cover clamped keys, unclamped keys, and the top bit being set */
+        if(i % 3 == 0) {
+            private_data[0] &= 248;
+            private_data[31] &= 127;
+            private_data[31] |= 64;
+        }
+        else if(i % 3 == 1) {
+            private_data[31] |= 0x80;
+        }
+        if(i == 0) {
+            memset(private_data, 0, sizeof(private_data));
+        }
+
+        curve25519_donna(expected, private_data, basepoint);
+
+        result = curve_decode_private_point(&private_key, private_data, sizeof(private_data), global_context);
+        ck_assert_int_eq(result, 0);
+        result = curve_generate_public_key(&public_key, private_key);
+        ck_assert_int_eq(result, 0);
+
+        ck_assert_int_eq(memcmp(ec_public_key_get_serialized(public_key) + 1, expected, sizeof(expected)), 0);
+
+        SIGNAL_UNREF(public_key);
+        SIGNAL_UNREF(private_key);
+    }
+}
+END_TEST
+
 START_TEST(test_curve25519_random_agreements)
 {
     int result;
@@ -327,6 +384,217 @@ START_TEST(test_curve25519_signature)
 }
 END_TEST
 
+START_TEST(test_curve25519_signature_batch)
+{
+    static const size_t corrupt_bytes[] = {0, 31, 32, 63};
+    static const uint8_t corrupt_masks[] = {0x01, 0x80, 0x01, 0x80, 0x20};
+    const size_t count = 70;
+    int result;
+    size_t i, j;
+    ec_key_pair *key_pairs[70];
+    signal_buffer *signatures[70];
+    uint8_t messages[70][128];
+    curve_signature_batch_entry entries[70];
+
+    for(i = 0; i < count; i++) {
+        result = curve_generate_key_pair(global_context, &key_pairs[i]);
+        ck_assert_int_eq(result, 0);
+        result = signal_crypto_random(global_context, messages[i], sizeof(messages[i]));
+        ck_assert_int_eq(result, 0);
+        result = curve_calculate_signature(global_context, &signatures[i],
+                ec_key_pair_get_private(key_pairs[i]), messages[i], i + 1);
+        ck_assert_int_eq(result, 0);
+
+        entries[i].signing_key = ec_key_pair_get_public(key_pairs[i]);
+        entries[i].message_data = messages[i];
+        entries[i].message_len = i + 1;
+        entries[i].signature_data = signal_buffer_data(signatures[i]);
+        entries[i].signature_len = signal_buffer_len(signatures[i]);
+        entries[i].result = -1;
+    }
+
+    /* An empty batch is trivially valid */
+    result = curve_verify_signature_batch(global_context, entries, 0);
+    ck_assert_int_eq(result, 1);
+
+    /* Valid signatures, spanning more than one internal batch */
+    result = curve_verify_signature_batch(global_context, entries, count);
+    ck_assert_int_eq(result, 1);
+    for(i = 0; i < count; i++) {
+        ck_assert_int_eq(entries[i].result, 1);
+    }
+
+    /* A corrupted signature is found, and the other entries still pass */
+    for(j = 0; j < sizeof(corrupt_masks); j++) {
+        uint8_t *data = signal_buffer_data(signatures[j * 13]);
+        size_t byte = j < 4 ? corrupt_bytes[j] : 63;
+
+        data[byte] ^= corrupt_masks[j];
+        result = curve_verify_signature_batch(global_context, entries, count);
+        ck_assert_int_eq(result, 0);
+        for(i = 0; i < count; i++) {
+            ck_assert_int_eq(entries[i].result, curve_verify_signature(entries[i].signing_key,
+                    entries[i].message_data, entries[i].message_len,
+                    entries[i].signature_data, entries[i].signature_len));
+        }
+        ck_assert_int_eq(entries[j * 13].result, 0);
+        data[byte] ^= corrupt_masks[j];
+    }
+
+    /* A signature for a different message */
+    messages[5][0] ^= 0x01;
+    result = curve_verify_signature_batch(global_context, entries, count);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(entries[5].result, 0);
+    ck_assert_int_eq(entries[4].result, 1);
+    messages[5][0] ^= 0x01;
+
+    /* A malformed entry gets the same error as a single check */
+    entries[9].signature_len = CURVE_SIGNATURE_LEN - 1;
+    result = curve_verify_signature_batch(global_context, entries, count);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(entries[9].result, SG_ERR_INVAL);
+    ck_assert_int_eq(entries[8].result, 1);
+    ck_assert_int_eq(entries[10].result, 1);
+
+    for(i = 0; i < count; i++) {
+        signal_buffer_free(signatures[i]);
+        SIGNAL_UNREF(key_pairs[i]);
+    }
+}
+END_TEST
+
+START_TEST(test_curve25519_signature_cached_key)
+{
+    static const size_t message_lens[] = {0, 1, 33, 256, 257, 1000};
+    int result;
+    size_t i, j, k;
+    ec_key_pair *key_pair = 0;
+    ec_public_key *decoded_key = 0;
+    signal_buffer *serialized = 0;
+    signal_buffer *signature = 0;
+    uint8_t message[1000];
+
+    result = curve_generate_key_pair(global_context, &key_pair);
+    ck_assert_int_eq(result, 0);
+    result = ec_public_key_serialize(&serialized, ec_key_pair_get_public(key_pair));
+    ck_assert_int_eq(result, 0);
+    result = signal_crypto_random(global_context, message, sizeof(message));
+    ck_assert_int_eq(result, 0);
+
+    for(i = 0; i < sizeof(message_lens) / sizeof(message_lens[0]); i++) {
+        uint8_t *data;
+
+        result = curve_calculate_signature(global_context, &signature,
+                ec_key_pair_get_private(key_pair), message, message_lens[i]);
+        ck_assert_int_eq(result, 0);
+        data = signal_buffer_data(signature);
+
+        /* A fresh key decodes on first use, later calls use what it cached */
+        result = curve_decode_point(&decoded_key, signal_buffer_data(serialized),
+                signal_buffer_len(serialized), global_context);
+        ck_assert_int_eq(result, 0);
+
+        /* Every single bit flip, including the sign bit, gives the same
+           result with the cached key as without it */
+        for(j = 0; j < CURVE_SIGNATURE_LEN * 8; j += 7) {
+            for(k = 0; k < 2; k++) {
+                int expected = curve25519_verify(data, signal_buffer_data(serialized) + 1,
+                        message, message_lens[i]) == 0;
+                result = curve_verify_signature(decoded_key, message, message_lens[i],
+                        data, CURVE_SIGNATURE_LEN);
+                ck_assert_int_eq(result, expected);
+                data[j / 8] ^= (uint8_t)(1 << (j % 8));
+            }
+        }
+        data[63] ^= 0x80;
+        result = curve_verify_signature(decoded_key, message, message_lens[i],
+                data, CURVE_SIGNATURE_LEN);
+        ck_assert_int_eq(result, 0);
+        data[63] ^= 0x80;
+
+        result = curve_verify_signature(decoded_key, message, message_lens[i],
+                data, CURVE_SIGNATURE_LEN);
+        ck_assert_int_eq(result, 1);
+        result = curve_verify_signature(ec_key_pair_get_public(key_pair),
+                message, message_lens[i], data, CURVE_SIGNATURE_LEN);
+        ck_assert_int_eq(result, 1);
+
+        SIGNAL_UNREF(decoded_key);
+        decoded_key = 0;
+        signal_buffer_free(signature);
+        signature = 0;
+    }
+
+    /* Cleanup */
+    signal_buffer_free(serialized);
+    SIGNAL_UNREF(key_pair);
+}
+END_TEST
+
+START_TEST(test_curve25519_signature_cached_private_key)
+{
+    int result;
+    int i, j;
+    uint8_t private_data[32];
+    uint8_t random_data[64];
+    uint8_t message[64];
+    uint8_t ed_public[32];
+    uint8_t expected[CURVE_SIGNATURE_LEN];
+    uint8_t actual[CURVE_SIGNATURE_LEN];
+
+    for(i = 0; i < 50; i++) {
+        ec_private_key *private_key = 0;
+        ec_public_key *public_key = 0;
+
+        /* Decoded keys need not be clamped */
+        result = signal_crypto_random(global_context, private_data, sizeof(private_data));
+        ck_assert_int_eq(result, 0);
+        if(i % 2 == 0) {
+            private_data[0] &= 248;
+            private_data[31] &= 127;
+            private_data[31] |= 64;
+        }
+        result = curve_decode_private_point(&private_key, private_data, sizeof(private_data), global_context);
+        ck_assert_int_eq(result, 0);
+        result = curve_generate_public_key(&public_key, private_key);
+        ck_assert_int_eq(result, 0);
+
+        /* Signing with a precomputed public key gives the same signature */
+        result = signal_crypto_random(global_context, random_data, sizeof(random_data));
+        ck_assert_int_eq(result, 0);
+        result = signal_crypto_random(global_context, message, sizeof(message));
+        ck_assert_int_eq(result, 0);
+        result = curve25519_sign(expected, private_data, message, sizeof(message), random_data);
+        ck_assert_int_eq(result, 0);
+        curve25519_sign_pubkey(ed_public, private_data);
+        result = curve25519_sign_with_pubkey(actual, private_data, ed_public,
+                message, sizeof(message), random_data);
+        ck_assert_int_eq(result, 0);
+        ck_assert_int_eq(memcmp(expected, actual, sizeof(expected)), 0);
+
+        /* Later signatures with the key reuse what the first one computed */
+        for(j = 0; j < 3; j++) {
+            signal_buffer *signature = 0;
+            result = curve_calculate_signature(global_context, &signature, private_key,
+                    message, sizeof(message) - j);
+            ck_assert_int_eq(result, 0);
+            result = curve_verify_signature(public_key, message, sizeof(message) - j,
+                    signal_buffer_data(signature), signal_buffer_len(signature));
+            if(i % 2 == 0) {
+                ck_assert_int_eq(result, 1);
+            }
+            ck_assert_int_eq(result, curve25519_verify(signal_buffer_data(signature),
+                    ec_public_key_get_serialized(public_key) + 1, message, sizeof(message) - j) == 0);
+            signal_buffer_free(signature);
+        }
+
+        SIGNAL_UNREF(public_key);
+        SIGNAL_UNREF(private_key);
+    }
+}
+END_TEST
+
 START_TEST(test_curve25519_large_signatures)
 {
     int result;
@@ -477,6 +745,117 @@ START_TEST(test_unique_signature_vector)
 }
 END_TEST
 
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+#define SHARED_KEY_THREAD_COUNT 8
+#define SHARED_KEY_ITERATIONS 200
+#define SHARED_KEY_AGREEMENT_LEN 32
+
+typedef struct {
+    ratchet_identity_key_pair *identity_key_pair;
+    ec_public_key *peer_public_key;
+    const uint8_t *expected_shared;
+    int failures;
+} shared_key_thread_data;
+
+static void *shared_key_thread(void *arg)
+{
+    shared_key_thread_data *data = arg;
+    ec_public_key *public_key = ratchet_identity_key_pair_get_public(data->identity_key_pair);
+    ec_private_key *private_key = ratchet_identity_key_pair_get_private(data->identity_key_pair);
+    static const uint8_t message[] = "shared across threads";
+    int i;
+
+    for(i = 0; i < SHARED_KEY_ITERATIONS; i++) {
+        ec_key_pair *key_pair = 0;
+        signal_buffer *signature = 0;
+        uint8_t *shared = 0;
+        int result;
+
+        /* Takes and releases references on the shared keys */
+        result = ec_key_pair_create(&key_pair, public_key, private_key);
+        if(result < 0) {
+            data->failures++;
+            continue;
+        }
+
+        result = curve_calculate_agreement(&shared, data->peer_public_key, ec_key_pair_get_private(key_pair));
+        if(result != SHARED_KEY_AGREEMENT_LEN || memcmp(shared, data->expected_shared, SHARED_KEY_AGREEMENT_LEN) != 0) {
+            data->failures++;
+        }
+        free(shared);
+
+        if((i % 20) == 0) {
+            result = curve_calculate_signature(global_context, &signature, private_key, message, sizeof(message));
+            if(result < 0 || curve_verify_signature(ec_key_pair_get_public(key_pair), message, sizeof(message),
+                    signal_buffer_data(signature), signal_buffer_len(signature)) != 1) {
+                data->failures++;
+            }
+            signal_buffer_free(signature);
+        }
+
+        SIGNAL_UNREF(key_pair);
+    }
+
+    /* The last thread to finish releases the keys */
+    SIGNAL_UNREF(data->identity_key_pair);
+    SIGNAL_UNREF(data->peer_public_key);
+    return 0;
+}
+
+START_TEST(test_shared_keys_across_threads)
+{
+    int result;
+    int i;
+    ec_key_pair *our_key_pair = 0;
+    ec_key_pair *peer_key_pair = 0;
+    ratchet_identity_key_pair *identity_key_pair = 0;
+    ec_public_key *peer_public_key = 0;
+    uint8_t *expected_shared = 0;
+    pthread_t threads[SHARED_KEY_THREAD_COUNT];
+    shared_key_thread_data data[SHARED_KEY_THREAD_COUNT];
+
+    result = curve_generate_key_pair(global_context, &our_key_pair);
+    ck_assert_int_eq(result, 0);
+    result = curve_generate_key_pair(global_context, &peer_key_pair);
+    ck_assert_int_eq(result, 0);
+
+    result = ratchet_identity_key_pair_create(&identity_key_pair,
+            ec_key_pair_get_public(our_key_pair), ec_key_pair_get_private(our_key_pair));
+    ck_assert_int_eq(result, 0);
+    peer_public_key = ec_key_pair_get_public(peer_key_pair);
+    SIGNAL_REF(peer_public_key);
+    SIGNAL_UNREF(our_key_pair);
+    SIGNAL_UNREF(peer_key_pair);
+
+    result = curve_calculate_agreement(&expected_shared, peer_public_key,
+            ratchet_identity_key_pair_get_private(identity_key_pair));
+    ck_assert_int_eq(result, SHARED_KEY_AGREEMENT_LEN);
+
+    for(i = 0; i < SHARED_KEY_THREAD_COUNT; i++) {
+        data[i].identity_key_pair = identity_key_pair;
+        data[i].peer_public_key = peer_public_key;
+        data[i].expected_shared = expected_shared;
+        data[i].failures = 0;
+        SIGNAL_REF(identity_key_pair);
+        SIGNAL_REF(peer_public_key);
+        result = pthread_create(&threads[i], 0, shared_key_thread, &data[i]);
+        ck_assert_int_eq(result, 0);
+    }
+
+    /* Drop our own references while the threads are still running */
+    SIGNAL_UNREF(identity_key_pair);
+    SIGNAL_UNREF(peer_public_key);
+
+    for(i = 0; i < SHARED_KEY_THREAD_COUNT; i++) {
+        pthread_join(threads[i], 0);
+        ck_assert_int_eq(data[i].failures, 0);
+    }
+
+    free(expected_shared);
+}
+END_TEST
+#endif
+
 Suite *curve25519_suite(void)
 {
     Suite *suite = suite_create("curve25519");
@@ -485,12 +864,23 @@ Suite *curve25519_suite(void)
     tcase_add_test(tcase, test_internal);
     tcase_add_test(tcase, test_curve25519_agreement);
     tcase_add_test(tcase, test_curve25519_generate_public);
+    tcase_add_test(tcase, test_curve25519_generate_public_matches_ladder);
     tcase_add_test(tcase, test_curve25519_random_agreements);
     tcase_add_test(tcase, test_curve25519_signature);
+    tcase_add_test(tcase, test_curve25519_signature_batch);
+    tcase_add_test(tcase, test_curve25519_signature_cached_key);
+    tcase_add_test(tcase, test_curve25519_signature_cached_private_key);
     tcase_add_test(tcase, test_curve25519_large_signatures);
     tcase_add_test(tcase, test_unique_signatures);
     tcase_add_test(tcase, test_unique_signature_vector);
     suite_add_tcase(suite, tcase);
+
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    TCase *tcase_threads = tcase_create("threads");
+    tcase_add_checked_fixture(tcase_threads, test_setup, test_teardown);
+    tcase_add_test(tcase_threads, test_shared_keys_across_threads);
+    suite_add_tcase(suite, tcase_threads);
+#endif
     return suite;
 }
 
@@ -19,9 +19,12 @@ static signal_protocol_sender_key_name GROUP_SENDER = {
         {"+14150001111", 12, 1}
 };
 
+int global_lock_count;
+
 void test_lock(void *user_data)
 {
     pthread_mutex_lock(&global_mutex);
+    global_lock_count++;
 }
 
 void test_unlock(void *user_data)
@@ -52,6 +55,72 @@ void test_teardown()
     signal_context_destroy(global_context);
 }
 
+int sender_key_lock_held;
+int sender_key_lock_calls;
+
+void test_lock_sender_key(const signal_protocol_sender_key_name *sender_key_name, int mode, void *user_data)
+{
+    ck_assert_int_eq(mode, SG_LOCK_WRITE);
+    ck_assert_int_eq(sender_key_lock_held, 0);
+    ck_assert_int_eq(sender_key_name->group_id_len, GROUP_SENDER.group_id_len);
+    sender_key_lock_held = 1;
+    sender_key_lock_calls++;
+}
+
+void test_unlock_sender_key(const signal_protocol_sender_key_name *sender_key_name, int mode, void *user_data)
+{
+    ck_assert_int_eq(mode, SG_LOCK_WRITE);
+    ck_assert_int_eq(sender_key_lock_held, 1);
+    sender_key_lock_held = 0;
+}
+
+void test_setup_sender_key_locks()
+{
+    int result;
+
+    test_setup();
+
+    result = signal_context_set_sender_key_locking_functions(global_context, test_lock_sender_key, test_unlock_sender_key);
+    ck_assert_int_eq(result, 0);
+    global_lock_count = 0;
+    sender_key_lock_held = 0;
+    sender_key_lock_calls = 0;
+}
+
+void test_teardown_sender_key_locks()
+{
+    ck_assert_int_eq(global_lock_count, 0);
+    ck_assert_int_eq(sender_key_lock_held, 0);
+    ck_assert_int_gt(sender_key_lock_calls, 0);
+    test_teardown();
+}
+
+void test_setup_skipped_key_checkpoints()
+{
+    int result;
+
+    test_setup();
+
+    result = signal_context_set_skipped_key_checkpoint_interval(global_context, 16);
+    ck_assert_int_eq(result, 0);
+}
+
+test_allocator global_allocator;
+
+void test_setup_allocator()
+{
+    test_setup();
+    setup_test_allocator(global_context, &global_allocator);
+}
+
+void test_teardown_allocator()
+{
+    /* Everything allocated through the context has been released */
+    ck_assert_int_gt(global_allocator.allocation_count, 0);
+    ck_assert_int_eq(global_allocator.live_count, 0);
+    test_teardown();
+}
+
 START_TEST(test_no_session)
 {
     int result = 0;
@@ -197,6 +266,127 @@ START_TEST(test_basic_encrypt_decrypt)
 }
 END_TEST
 
+START_TEST(test_decrypt_batch)
+{
+    int result = 0;
+    int i;
+    static const int order[5] = {4, 0, 2, 1, 3};
+    ciphertext_message *ciphertexts_from_alice[5];
+    sender_key_message *received[5];
+    sender_key_message *batch[5];
+    sender_key_message *tampered = 0;
+    signal_buffer *plaintexts[5];
+    char expected[32];
+
+    /* Create the test data stores */
+    signal_protocol_store_context *alice_store = 0;
+    setup_test_store_context(&alice_store, global_context);
+
+    signal_protocol_store_context *bob_store = 0;
+    setup_test_store_context(&bob_store, global_context);
+
+    /* Create the session builders */
+    group_session_builder *alice_session_builder = 0;
+    result = group_session_builder_create(&alice_session_builder, alice_store, global_context);
+    ck_assert_int_eq(result, 0);
+
+    group_session_builder *bob_session_builder = 0;
+    result = group_session_builder_create(&bob_session_builder, bob_store, global_context);
+    ck_assert_int_eq(result, 0);
+
+    /* Create the group ciphers */
+    group_cipher *alice_group_cipher = 0;
+    result = group_cipher_create(&alice_group_cipher, alice_store, &GROUP_SENDER, global_context);
+    ck_assert_int_eq(result, 0);
+
+    group_cipher *bob_group_cipher = 0;
+    result = group_cipher_create(&bob_group_cipher, bob_store, &GROUP_SENDER, global_context);
+    ck_assert_int_eq(result, 0);
+
+    /* Create and process Alice's distribution message */
+    sender_key_distribution_message *sent_alice_distribution_message = 0;
+    result = group_session_builder_create_session(alice_session_builder, &sent_alice_distribution_message, &GROUP_SENDER);
+    ck_assert_int_eq(result, 0);
+
+    sender_key_distribution_message *received_alice_distribution_message = 0;
+    signal_buffer *serialized_distribution_message =
+            ciphertext_message_get_serialized((ciphertext_message *)sent_alice_distribution_message);
+    result = sender_key_distribution_message_deserialize(&received_alice_distribution_message,
+            signal_buffer_data(serialized_distribution_message),
+            signal_buffer_len(serialized_distribution_message),
+            global_context);
+    ck_assert_int_eq(result, 0);
+
+    result = group_session_builder_process_session(bob_session_builder, &GROUP_SENDER, received_alice_distribution_message);
+    ck_assert_int_eq(result, 0);
+
+    /* Encrypt a queue of messages from Alice */
+    for(i = 0; i < 5; i++) {
+        signal_buffer *serialized;
+        snprintf(expected, sizeof(expected), "smert ze smert %d", i);
+        result = group_cipher_encrypt(alice_group_cipher,
+                (const uint8_t *)expected, strlen(expected),
+                &ciphertexts_from_alice[i]);
+        ck_assert_int_eq(result, 0);
+
+        serialized = ciphertext_message_get_serialized(ciphertexts_from_alice[i]);
+        result = sender_key_message_deserialize(&received[i],
+                signal_buffer_data(serialized), signal_buffer_len(serialized), global_context);
+        ck_assert_int_eq(result, 0);
+    }
+
+    /* A message with a corrupted signature fails the whole batch */
+    signal_buffer *corrupted = signal_buffer_copy(ciphertext_message_get_serialized(ciphertexts_from_alice[2]));
+    signal_buffer_data(corrupted)[signal_buffer_len(corrupted) - 1] ^= 0x01;
+    result = sender_key_message_deserialize(&tampered,
+            signal_buffer_data(corrupted), signal_buffer_len(corrupted), global_context);
+    ck_assert_int_eq(result, 0);
+    signal_buffer_free(corrupted);
+
+    for(i = 0; i < 5; i++) {
+        batch[i] = received[order[i]];
+        plaintexts[i] = 0;
+    }
+    batch[2] = tampered;
+    result = group_cipher_decrypt_batch(bob_group_cipher, batch, 5, 0, plaintexts);
+    ck_assert_int_eq(result, SG_ERR_INVALID_MESSAGE);
+    for(i = 0; i < 5; i++) {
+        ck_assert_ptr_eq(plaintexts[i], 0);
+    }
+
+    /* The same queue without the corruption, in a shuffled order */
+    batch[2] = received[order[2]];
+    result = group_cipher_decrypt_batch(bob_group_cipher, batch, 5, 0, plaintexts);
+    ck_assert_int_eq(result, 0);
+    for(i = 0; i < 5; i++) {
+        snprintf(expected, sizeof(expected), "smert ze smert %d", order[i]);
+        ck_assert_int_eq(signal_buffer_len(plaintexts[i]), strlen(expected));
+        ck_assert_int_eq(memcmp(signal_buffer_data(plaintexts[i]), expected, strlen(expected)), 0);
+        signal_buffer_free(plaintexts[i]);
+    }
+
+    /* The updated state was stored */
+    signal_buffer *plaintext = 0;
+    result = group_cipher_decrypt(bob_group_cipher, received[0], 0, &plaintext);
+    ck_assert_int_eq(result, SG_ERR_DUPLICATE_MESSAGE);
+
+    /* Cleanup */
+    for(i = 0; i < 5; i++) {
+        SIGNAL_UNREF(received[i]);
+        SIGNAL_UNREF(ciphertexts_from_alice[i]);
+    }
+    SIGNAL_UNREF(tampered);
+    SIGNAL_UNREF(received_alice_distribution_message);
+    SIGNAL_UNREF(sent_alice_distribution_message);
+    group_cipher_free(bob_group_cipher);
+    group_cipher_free(alice_group_cipher);
+    group_session_builder_free(bob_session_builder);
+    group_session_builder_free(alice_session_builder);
+    signal_protocol_store_context_destroy(bob_store);
+    signal_protocol_store_context_destroy(alice_store);
+}
+END_TEST
+
 START_TEST(test_basic_ratchet)
 {
     int result = 0;
@@ -801,6 +991,7 @@ Suite *group_cipher_suite(void)
     tcase_add_checked_fixture(tcase, test_setup, test_teardown);
     tcase_add_test(tcase, test_no_session);
     tcase_add_test(tcase, test_basic_encrypt_decrypt);
+    tcase_add_test(tcase, test_decrypt_batch);
     tcase_add_test(tcase, test_basic_ratchet);
     tcase_add_test(tcase, test_late_join);
     tcase_add_test(tcase, test_out_of_order);
@@ -810,6 +1001,29 @@ Suite *group_cipher_suite(void)
     tcase_add_test(tcase, test_invalid_signature_key);
     suite_add_tcase(suite, tcase);
 
+    TCase *tcase_sender_key_locks = tcase_create("sender_key_locks");
+    tcase_add_checked_fixture(tcase_sender_key_locks, test_setup_sender_key_locks, test_teardown_sender_key_locks);
+    tcase_add_test(tcase_sender_key_locks, test_basic_encrypt_decrypt);
+    tcase_add_test(tcase_sender_key_locks, test_out_of_order);
+    tcase_add_test(tcase_sender_key_locks, test_decrypt_batch);
+    suite_add_tcase(suite, tcase_sender_key_locks);
+
+    TCase *tcase_checkpoints = tcase_create("skipped_key_checkpoints");
+    tcase_add_checked_fixture(tcase_checkpoints, test_setup_skipped_key_checkpoints, test_teardown);
+    tcase_add_test(tcase_checkpoints, test_basic_ratchet);
+    tcase_add_test(tcase_checkpoints, test_out_of_order);
+    tcase_add_test(tcase_checkpoints, test_too_far_in_future);
+    tcase_add_test(tcase_checkpoints, test_message_key_limit);
+    suite_add_tcase(suite, tcase_checkpoints);
+
+    TCase *tcase_allocator = tcase_create("allocator");
+    tcase_add_checked_fixture(tcase_allocator, test_setup_allocator, test_teardown_allocator);
+    tcase_add_test(tcase_allocator, test_basic_ratchet);
+    tcase_add_test(tcase_allocator, test_late_join);
+    tcase_add_test(tcase_allocator, test_out_of_order);
+    tcase_add_test(tcase_allocator, test_decrypt_batch);
+    suite_add_tcase(suite, tcase_allocator);
+
     return suite;
 }
 
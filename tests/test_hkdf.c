@@ -18,6 +18,32 @@ void test_setup()
     setup_test_crypto_provider(global_context);
 }
 
+void test_setup_without_optional_hmac()
+{
+    int result;
+    result = signal_context_create(&global_context, 0);
+    ck_assert_int_eq(result, 0);
+    signal_context_set_log_function(global_context, test_log);
+
+    /* Only the mandatory callbacks, to exercise the fallback paths */
+    signal_crypto_provider provider = {
+            .random_func = test_random_generator,
+            .hmac_sha256_init_func = test_hmac_sha256_init,
+            .hmac_sha256_update_func = test_hmac_sha256_update,
+            .hmac_sha256_final_func = test_hmac_sha256_final,
+            .hmac_sha256_cleanup_func = test_hmac_sha256_cleanup,
+            .sha512_digest_init_func = test_sha512_digest_init,
+            .sha512_digest_update_func = test_sha512_digest_update,
+            .sha512_digest_final_func = test_sha512_digest_final,
+            .sha512_digest_cleanup_func = test_sha512_digest_cleanup,
+            .encrypt_func = test_encrypt,
+            .decrypt_func = test_decrypt,
+            .user_data = 0
+    };
+    result = signal_context_set_crypto_provider(global_context, &provider);
+    ck_assert_int_eq(result, 0);
+}
+
 void test_teardown()
 {
     signal_context_destroy(global_context);
@@ -182,6 +208,13 @@ Suite *hkdf_suite(void)
     tcase_add_test(tcase, test_hkdf_vector_long_v3);
     tcase_add_test(tcase, test_hkdf_vector_v2);
     suite_add_tcase(suite, tcase);
+
+    TCase *tcase_fallback = tcase_create("without_optional_hmac");
+    tcase_add_checked_fixture(tcase_fallback, test_setup_without_optional_hmac, test_teardown);
+    tcase_add_test(tcase_fallback, test_hkdf_vector_v3);
+    tcase_add_test(tcase_fallback, test_hkdf_vector_long_v3);
+    tcase_add_test(tcase_fallback, test_hkdf_vector_v2);
+    suite_add_tcase(suite, tcase_fallback);
     return suite;
 }
 
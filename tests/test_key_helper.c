@@ -1,8 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <check.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <pthread.h>
 
 #include "../src/signal_protocol.h"
+#include "../src/signal_protocol_internal.h"
 #include "key_helper.h"
 #include "test_common.h"
 
@@ -25,6 +30,15 @@ int fake_random_generator(uint8_t *data, size_t len, void *user_data)
     return 0;
 }
 
+int zero_random_calls;
+
+int zero_random_generator(uint8_t *data, size_t len, void *user_data)
+{
+    memset(data, 0, len);
+    zero_random_calls++;
+    return 0;
+}
+
 void test_setup()
 {
     int result;
@@ -254,6 +268,227 @@ START_TEST(test_generate_signed_pre_key)
 }
 END_TEST
 
+static void set_zero_random_generator()
+{
+    signal_crypto_provider provider = {
+            .random_func = zero_random_generator,
+            .hmac_sha256_init_func = test_hmac_sha256_init,
+            .hmac_sha256_update_func = test_hmac_sha256_update,
+            .hmac_sha256_final_func = test_hmac_sha256_final,
+            .hmac_sha256_cleanup_func = test_hmac_sha256_cleanup,
+            .user_data = 0
+    };
+    int result = signal_context_set_crypto_provider(global_context, &provider);
+    ck_assert_int_eq(result, 0);
+    zero_random_calls = 0;
+}
+
+START_TEST(test_random_buffering)
+{
+    /* ChaCha20 keystream for the zero key after the 32 bytes of the next key */
+    static const uint8_t expected[32] = {
+            0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d,
+            0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+            0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c,
+            0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86
+    };
+    uint8_t data[1000];
+    uint8_t previous[32];
+    size_t total;
+    int result;
+
+    set_zero_random_generator();
+    result = signal_context_set_random_buffering(global_context, 1);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(zero_random_calls, 0);
+
+    /* Seeded on first use */
+    result = signal_crypto_random(global_context, data, 32);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(zero_random_calls, 1);
+    ck_assert_int_eq(memcmp(data, expected, sizeof(expected)), 0);
+
+    /* Output never repeats, across refills of the buffer */
+    memcpy(previous, data, sizeof(previous));
+    for(total = 32; total + sizeof(data) < SIGNAL_RANDOM_RESEED_INTERVAL; total += sizeof(data)) {
+        result = signal_crypto_random(global_context, data, sizeof(data));
+        ck_assert_int_eq(result, 0);
+        ck_assert_int_ne(memcmp(data, previous, sizeof(previous)), 0);
+        memcpy(previous, data, sizeof(previous));
+    }
+    ck_assert_int_eq(zero_random_calls, 1);
+
+    /* Reseeded after the interval */
+    result = signal_crypto_random(global_context, data, sizeof(data));
+    ck_assert_int_eq(result, 0);
+    result = signal_crypto_random(global_context, data, sizeof(data));
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(zero_random_calls, 2);
+
+    /* Reseeded from a new crypto provider */
+    set_zero_random_generator();
+    result = signal_crypto_random(global_context, data, 1);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(zero_random_calls, 1);
+
+    /* Calls the crypto provider directly once disabled */
+    result = signal_context_set_random_buffering(global_context, 0);
+    ck_assert_int_eq(result, 0);
+    result = signal_crypto_random(global_context, data, 1);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(zero_random_calls, 2);
+}
+END_TEST
+
+START_TEST(test_random_buffering_fork)
+{
+    uint8_t data[32];
+    int pipe_fds[2];
+    pid_t pid;
+    int status;
+    int result;
+
+    set_zero_random_generator();
+    result = signal_context_set_random_buffering(global_context, 1);
+    ck_assert_int_eq(result, 0);
+    result = signal_crypto_random(global_context, data, sizeof(data));
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(pipe(pipe_fds), 0);
+
+    pid = fork();
+    ck_assert_int_ge(pid, 0);
+    if(pid == 0) {
+        /* The child must reseed rather than continue the parent's stream */
+        result = signal_crypto_random(global_context, data, sizeof(data));
+        if(result < 0 || zero_random_calls != 2 || write(pipe_fds[1], data, sizeof(data)) != sizeof(data)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    else {
+        uint8_t child_data[32];
+        ck_assert_int_eq(read(pipe_fds[0], child_data, sizeof(child_data)), sizeof(child_data));
+        ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+        ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        result = signal_crypto_random(global_context, data, sizeof(data));
+        ck_assert_int_eq(result, 0);
+        ck_assert_int_eq(zero_random_calls, 1);
+        ck_assert_int_ne(memcmp(data, child_data, sizeof(data)), 0);
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+END_TEST
+
+START_TEST(test_generate_pre_keys_buffered)
+{
+    signal_protocol_key_helper_pre_key_list_node *head = 0;
+    signal_protocol_key_helper_pre_key_list_node *node;
+    int result;
+    int count = 0;
+
+    set_zero_random_generator();
+    result = signal_context_set_random_buffering(global_context, 1);
+    ck_assert_int_eq(result, 0);
+
+    result = signal_protocol_key_helper_generate_pre_keys(&head, 1, 100, global_context);
+    ck_assert_int_eq(result, 0);
+    for(node = head; node; node = signal_protocol_key_helper_key_list_next(node)) {
+        count++;
+    }
+    ck_assert_int_eq(count, 100);
+    ck_assert_int_eq(zero_random_calls, 1);
+
+    signal_protocol_key_helper_key_list_free(head);
+}
+END_TEST
+
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+#define RANDOM_THREAD_COUNT 4
+#define RANDOM_THREAD_ITERATIONS 2000
+
+atomic_uint concurrent_random_calls;
+atomic_int random_threads_done;
+
+static int concurrent_random_generator(uint8_t *data, size_t len, void *user_data)
+{
+    (void)user_data;
+    atomic_fetch_add(&concurrent_random_calls, 1);
+    memset(data, 0x5a, len);
+    return 0;
+}
+
+static void *random_thread(void *arg)
+{
+    int *failures = arg;
+    uint8_t data[32];
+    int i;
+
+    for(i = 0; i < RANDOM_THREAD_ITERATIONS; i++) {
+        if(signal_crypto_random(global_context, data, sizeof(data)) < 0) {
+            (*failures)++;
+        }
+    }
+    atomic_fetch_add(&random_threads_done, 1);
+    return 0;
+}
+
+static void run_random_threads(int toggle_buffering)
+{
+    pthread_t threads[RANDOM_THREAD_COUNT];
+    int failures[RANDOM_THREAD_COUNT];
+    int result;
+    int i;
+
+    atomic_store(&random_threads_done, 0);
+    for(i = 0; i < RANDOM_THREAD_COUNT; i++) {
+        failures[i] = 0;
+        result = pthread_create(&threads[i], 0, random_thread, &failures[i]);
+        ck_assert_int_eq(result, 0);
+    }
+
+    /* Turning buffering off must wait for the threads still using the pool */
+    while(toggle_buffering && atomic_load(&random_threads_done) < RANDOM_THREAD_COUNT) {
+        result = signal_context_set_random_buffering(global_context, 0);
+        ck_assert_int_eq(result, 0);
+        result = signal_context_set_random_buffering(global_context, 1);
+        ck_assert_int_eq(result, 0);
+    }
+
+    for(i = 0; i < RANDOM_THREAD_COUNT; i++) {
+        pthread_join(threads[i], 0);
+        ck_assert_int_eq(failures[i], 0);
+    }
+}
+
+START_TEST(test_random_buffering_threads)
+{
+    signal_crypto_provider provider = {
+            .random_func = concurrent_random_generator,
+            .hmac_sha256_init_func = test_hmac_sha256_init,
+            .hmac_sha256_update_func = test_hmac_sha256_update,
+            .hmac_sha256_final_func = test_hmac_sha256_final,
+            .hmac_sha256_cleanup_func = test_hmac_sha256_cleanup,
+            .user_data = 0
+    };
+    int result;
+
+    result = signal_context_set_crypto_provider(global_context, &provider);
+    ck_assert_int_eq(result, 0);
+    result = signal_context_set_random_buffering(global_context, 1);
+    ck_assert_int_eq(result, 0);
+
+    /* Generators are shared without the global lock, so most draws never reach the provider */
+    atomic_store(&concurrent_random_calls, 0);
+    run_random_threads(0);
+    ck_assert_int_lt(atomic_load(&concurrent_random_calls), RANDOM_THREAD_COUNT * RANDOM_THREAD_ITERATIONS / 4);
+
+    run_random_threads(1);
+}
+END_TEST
+#endif
+
 Suite *key_helper_suite(void)
 {
     Suite *suite = suite_create("key_helper");
@@ -263,8 +498,18 @@ Suite *key_helper_suite(void)
     tcase_add_test(tcase, test_generate_identity_key_pair);
     tcase_add_test(tcase, test_generate_pre_keys);
     tcase_add_test(tcase, test_generate_signed_pre_key);
+    tcase_add_test(tcase, test_random_buffering);
+    tcase_add_test(tcase, test_random_buffering_fork);
+    tcase_add_test(tcase, test_generate_pre_keys_buffered);
     suite_add_tcase(suite, tcase);
 
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    TCase *tcase_threads = tcase_create("threads");
+    tcase_add_checked_fixture(tcase_threads, test_setup, test_teardown);
+    tcase_add_test(tcase_threads, test_random_buffering_threads);
+    suite_add_tcase(suite, tcase_threads);
+#endif
+
     return suite;
 }
 
@@ -6,6 +6,8 @@
 #include "curve.h"
 #include "protocol.h"
 #include "ratchet.h"
+#include "protocol_wire.h"
+#include "WhisperTextProtocol.pb-c.h"
 #include "test_common.h"
 
 signal_context *global_context;
@@ -42,6 +44,11 @@ void compare_signal_messages(signal_message *message1, signal_message *message2)
     signal_buffer *body1 = signal_message_get_body(message1);
     signal_buffer *body2 = signal_message_get_body(message2);
     ck_assert_int_eq(signal_buffer_compare(body1, body2), 0);
+
+    size_t body_data_len = 0;
+    const uint8_t *body_data = signal_message_get_body_data(message2, &body_data_len);
+    ck_assert_int_eq(body_data_len, signal_buffer_len(body2));
+    ck_assert_int_eq(memcmp(body_data, signal_buffer_data(body2), body_data_len), 0);
 }
 
 START_TEST(test_serialize_signal_message)
@@ -288,6 +295,371 @@ START_TEST(test_serialize_sender_key_distribution_message)
 }
 END_TEST
 
+/*
+ * Differential tests of the hand-written wire format code against
+ * protobuf-c, on generated messages and on mutations of them.
+ */
+
+#define WIRE_TEST_ROUNDS 2000
+#define WIRE_TEST_MAX_BYTES 300
+#define WIRE_TEST_BUFFER_SIZE 4096
+
+static uint32_t wire_test_state = 0x2545F491;
+
+static uint32_t wire_test_random(void)
+{
+    /* xorshift32 */
+    uint32_t x = wire_test_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    wire_test_state = x;
+    return x;
+}
+
+static uint32_t wire_test_random_uint32(void)
+{
+    switch(wire_test_random() % 4) {
+    case 0: return 0;
+    case 1: return wire_test_random() % 128;
+    case 2: return wire_test_random() % 100000;
+    default: return wire_test_random();
+    }
+}
+
+static void wire_test_random_bytes(ProtobufCBinaryData *bytes, uint8_t *storage)
+{
+    size_t i;
+    bytes->len = wire_test_random() % WIRE_TEST_MAX_BYTES;
+    for(i = 0; i < bytes->len; i++) {
+        storage[i] = (uint8_t)wire_test_random();
+    }
+    bytes->data = storage;
+}
+
+static size_t wire_test_write_varint(uint8_t *out, uint64_t value)
+{
+    size_t i = 0;
+    while(value >= 0x80) {
+        out[i++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[i++] = (uint8_t)value;
+    return i;
+}
+
+/* An encoded field with a random number, wire type and payload */
+static size_t wire_test_random_field(uint8_t *out)
+{
+    size_t len = 0;
+    size_t i, n;
+    uint32_t number = wire_test_random() % 10;
+    uint32_t wire_type = wire_test_random() % 8;
+
+    len += wire_test_write_varint(out, ((uint64_t)number << 3) | wire_type);
+    switch(wire_type) {
+    case 0:
+        len += wire_test_write_varint(out + len,
+                wire_test_random() % 2 ? wire_test_random() : ((uint64_t)wire_test_random() << 32) | wire_test_random());
+        break;
+    case 1:
+    case 5:
+        n = wire_type == 1 ? 8 : 4;
+        for(i = 0; i < n; i++) {
+            out[len++] = (uint8_t)wire_test_random();
+        }
+        break;
+    case 2:
+        n = wire_test_random() % 40;
+        len += wire_test_write_varint(out + len, n);
+        for(i = 0; i < n; i++) {
+            out[len++] = (uint8_t)wire_test_random();
+        }
+        break;
+    default:
+        break;
+    }
+    return len;
+}
+
+/*
+ * Produce a variant of a valid encoding: unchanged, with extra fields
+ * spliced in at a field boundary, duplicated, truncated or with random
+ * bytes changed.
+ */
+static size_t wire_test_mutate(uint8_t *out, const uint8_t *in, size_t len, size_t boundary)
+{
+    size_t out_len = 0;
+    size_t i, n;
+
+    switch(wire_test_random() % 6) {
+    case 0:
+        memcpy(out, in, len);
+        return len;
+    case 1:
+        memcpy(out, in, boundary);
+        out_len = boundary;
+        n = 1 + wire_test_random() % 3;
+        for(i = 0; i < n; i++) {
+            out_len += wire_test_random_field(out + out_len);
+        }
+        memcpy(out + out_len, in + boundary, len - boundary);
+        return out_len + len - boundary;
+    case 2:
+        memcpy(out, in, len);
+        memcpy(out + len, in, boundary);
+        return len + boundary;
+    case 3:
+        n = len > 0 ? wire_test_random() % len : 0;
+        memcpy(out, in, n);
+        return n;
+    default:
+        memcpy(out, in, len);
+        n = 1 + wire_test_random() % 3;
+        for(i = 0; i < n && len > 0; i++) {
+            out[wire_test_random() % len] = (uint8_t)wire_test_random();
+        }
+        return len;
+    }
+}
+
+static void wire_test_compare_bytes(int has_expected, const ProtobufCBinaryData *expected,
+        int has_actual, const protocol_wire_bytes *actual)
+{
+    ck_assert_int_eq(!!has_expected, !!has_actual);
+    if(has_expected) {
+        ck_assert_int_eq(expected->len, actual->len);
+        /* Empty fields may have null data, which memcmp must not be given */
+        if(actual->len > 0) {
+            ck_assert_int_eq(memcmp(expected->data, actual->data, actual->len), 0);
+        }
+    }
+}
+
+static void wire_test_compare_uint32(int has_expected, uint32_t expected,
+        int has_actual, uint32_t actual)
+{
+    ck_assert_int_eq(!!has_expected, !!has_actual);
+    if(has_expected) {
+        ck_assert_uint_eq(expected, actual);
+    }
+}
+
+static void wire_test_check_signal_message(const uint8_t *data, size_t len)
+{
+    protocol_wire_signal_message message;
+    Textsecure__SignalMessage *expected = textsecure__signal_message__unpack(0, len, data);
+    int result = protocol_wire_parse_signal_message(&message, data, len);
+
+    if(!expected) {
+        ck_assert_int_eq(result, SG_ERR_INVALID_PROTO_BUF);
+        return;
+    }
+    ck_assert_int_eq(result, 0);
+    wire_test_compare_bytes(expected->has_ratchetkey, &expected->ratchetkey,
+            message.has_ratchet_key, &message.ratchet_key);
+    wire_test_compare_uint32(expected->has_counter, expected->counter,
+            message.has_counter, message.counter);
+    wire_test_compare_uint32(expected->has_previouscounter, expected->previouscounter,
+            message.has_previous_counter, message.previous_counter);
+    wire_test_compare_bytes(expected->has_ciphertext, &expected->ciphertext,
+            message.has_ciphertext, &message.ciphertext);
+    textsecure__signal_message__free_unpacked(expected, 0);
+}
+
+START_TEST(test_wire_signal_message)
+{
+    int round;
+    uint8_t ratchet_key[WIRE_TEST_MAX_BYTES];
+    uint8_t ciphertext[WIRE_TEST_MAX_BYTES];
+    uint8_t packed[WIRE_TEST_BUFFER_SIZE];
+    uint8_t written[WIRE_TEST_BUFFER_SIZE];
+    uint8_t mutated[WIRE_TEST_BUFFER_SIZE * 2];
+
+    for(round = 0; round < WIRE_TEST_ROUNDS; round++) {
+        Textsecure__SignalMessage message_structure = TEXTSECURE__SIGNAL_MESSAGE__INIT;
+        protocol_wire_signal_message message;
+        size_t len;
+
+        message_structure.has_ratchetkey = wire_test_random() % 4 != 0;
+        wire_test_random_bytes(&message_structure.ratchetkey, ratchet_key);
+        message_structure.has_counter = wire_test_random() % 4 != 0;
+        message_structure.counter = wire_test_random_uint32();
+        message_structure.has_previouscounter = wire_test_random() % 4 != 0;
+        message_structure.previouscounter = wire_test_random_uint32();
+        message_structure.has_ciphertext = wire_test_random() % 4 != 0;
+        wire_test_random_bytes(&message_structure.ciphertext, ciphertext);
+
+        memset(&message, 0, sizeof(message));
+        message.has_ratchet_key = message_structure.has_ratchetkey;
+        message.ratchet_key.data = message_structure.ratchetkey.data;
+        message.ratchet_key.len = message_structure.ratchetkey.len;
+        message.has_counter = message_structure.has_counter;
+        message.counter = message_structure.counter;
+        message.has_previous_counter = message_structure.has_previouscounter;
+        message.previous_counter = message_structure.previouscounter;
+        message.has_ciphertext = message_structure.has_ciphertext;
+        message.ciphertext.data = message_structure.ciphertext.data;
+        message.ciphertext.len = message_structure.ciphertext.len;
+
+        /* Both writers produce the same bytes */
+        len = textsecure__signal_message__pack(&message_structure, packed);
+        ck_assert_int_eq(protocol_wire_signal_message_get_size(&message), len);
+        ck_assert_int_eq(protocol_wire_write_signal_message(written, &message), len);
+        ck_assert_int_eq(memcmp(packed, written, len), 0);
+
+        /* Both parsers agree on valid and mangled encodings */
+        wire_test_check_signal_message(packed, len);
+        len = wire_test_mutate(mutated, packed, len, len > 0 ? wire_test_random() % len : 0);
+        wire_test_check_signal_message(mutated, len);
+    }
+}
+END_TEST
+
+static void wire_test_check_pre_key_signal_message(const uint8_t *data, size_t len)
+{
+    protocol_wire_pre_key_signal_message message;
+    Textsecure__PreKeySignalMessage *expected = textsecure__pre_key_signal_message__unpack(0, len, data);
+    int result = protocol_wire_parse_pre_key_signal_message(&message, data, len);
+
+    if(!expected) {
+        ck_assert_int_eq(result, SG_ERR_INVALID_PROTO_BUF);
+        return;
+    }
+    ck_assert_int_eq(result, 0);
+    wire_test_compare_uint32(expected->has_prekeyid, expected->prekeyid,
+            message.has_pre_key_id, message.pre_key_id);
+    wire_test_compare_bytes(expected->has_basekey, &expected->basekey,
+            message.has_base_key, &message.base_key);
+    wire_test_compare_bytes(expected->has_identitykey, &expected->identitykey,
+            message.has_identity_key, &message.identity_key);
+    wire_test_compare_bytes(expected->has_message, &expected->message,
+            message.has_message, &message.message);
+    wire_test_compare_uint32(expected->has_registrationid, expected->registrationid,
+            message.has_registration_id, message.registration_id);
+    wire_test_compare_uint32(expected->has_signedprekeyid, expected->signedprekeyid,
+            message.has_signed_pre_key_id, message.signed_pre_key_id);
+    textsecure__pre_key_signal_message__free_unpacked(expected, 0);
+}
+
+START_TEST(test_wire_pre_key_signal_message)
+{
+    int round;
+    uint8_t base_key[WIRE_TEST_MAX_BYTES];
+    uint8_t identity_key[WIRE_TEST_MAX_BYTES];
+    uint8_t inner_message[WIRE_TEST_MAX_BYTES];
+    uint8_t packed[WIRE_TEST_BUFFER_SIZE];
+    uint8_t written[WIRE_TEST_BUFFER_SIZE];
+    uint8_t mutated[WIRE_TEST_BUFFER_SIZE * 2];
+
+    for(round = 0; round < WIRE_TEST_ROUNDS; round++) {
+        Textsecure__PreKeySignalMessage message_structure = TEXTSECURE__PRE_KEY_SIGNAL_MESSAGE__INIT;
+        protocol_wire_pre_key_signal_message message;
+        size_t len;
+
+        message_structure.has_prekeyid = wire_test_random() % 4 != 0;
+        message_structure.prekeyid = wire_test_random_uint32();
+        message_structure.has_basekey = wire_test_random() % 4 != 0;
+        wire_test_random_bytes(&message_structure.basekey, base_key);
+        message_structure.has_identitykey = wire_test_random() % 4 != 0;
+        wire_test_random_bytes(&message_structure.identitykey, identity_key);
+        message_structure.has_message = wire_test_random() % 4 != 0;
+        wire_test_random_bytes(&message_structure.message, inner_message);
+        message_structure.has_registrationid = wire_test_random() % 4 != 0;
+        message_structure.registrationid = wire_test_random_uint32();
+        message_structure.has_signedprekeyid = wire_test_random() % 4 != 0;
+        message_structure.signedprekeyid = wire_test_random_uint32();
+
+        memset(&message, 0, sizeof(message));
+        message.has_pre_key_id = message_structure.has_prekeyid;
+        message.pre_key_id = message_structure.prekeyid;
+        message.has_base_key = message_structure.has_basekey;
+        message.base_key.data = message_structure.basekey.data;
+        message.base_key.len = message_structure.basekey.len;
+        message.has_identity_key = message_structure.has_identitykey;
+        message.identity_key.data = message_structure.identitykey.data;
+        message.identity_key.len = message_structure.identitykey.len;
+        message.has_message = message_structure.has_message;
+        message.message.data = message_structure.message.data;
+        message.message.len = message_structure.message.len;
+        message.has_registration_id = message_structure.has_registrationid;
+        message.registration_id = message_structure.registrationid;
+        message.has_signed_pre_key_id = message_structure.has_signedprekeyid;
+        message.signed_pre_key_id = message_structure.signedprekeyid;
+
+        len = textsecure__pre_key_signal_message__pack(&message_structure, packed);
+        ck_assert_int_eq(protocol_wire_pre_key_signal_message_get_size(&message), len);
+        ck_assert_int_eq(protocol_wire_write_pre_key_signal_message(written, &message), len);
+        ck_assert_int_eq(memcmp(packed, written, len), 0);
+
+        wire_test_check_pre_key_signal_message(packed, len);
+        len = wire_test_mutate(mutated, packed, len, len > 0 ? wire_test_random() % len : 0);
+        wire_test_check_pre_key_signal_message(mutated, len);
+    }
+}
+END_TEST
+
+static void wire_test_check_sender_key_message(const uint8_t *data, size_t len)
+{
+    protocol_wire_sender_key_message message;
+    Textsecure__SenderKeyMessage *expected = textsecure__sender_key_message__unpack(0, len, data);
+    int result = protocol_wire_parse_sender_key_message(&message, data, len);
+
+    if(!expected) {
+        ck_assert_int_eq(result, SG_ERR_INVALID_PROTO_BUF);
+        return;
+    }
+    ck_assert_int_eq(result, 0);
+    wire_test_compare_uint32(expected->has_id, expected->id,
+            message.has_id, message.id);
+    wire_test_compare_uint32(expected->has_iteration, expected->iteration,
+            message.has_iteration, message.iteration);
+    wire_test_compare_bytes(expected->has_ciphertext, &expected->ciphertext,
+            message.has_ciphertext, &message.ciphertext);
+    textsecure__sender_key_message__free_unpacked(expected, 0);
+}
+
+START_TEST(test_wire_sender_key_message)
+{
+    int round;
+    uint8_t ciphertext[WIRE_TEST_MAX_BYTES];
+    uint8_t packed[WIRE_TEST_BUFFER_SIZE];
+    uint8_t written[WIRE_TEST_BUFFER_SIZE];
+    uint8_t mutated[WIRE_TEST_BUFFER_SIZE * 2];
+
+    for(round = 0; round < WIRE_TEST_ROUNDS; round++) {
+        Textsecure__SenderKeyMessage message_structure = TEXTSECURE__SENDER_KEY_MESSAGE__INIT;
+        protocol_wire_sender_key_message message;
+        size_t len;
+
+        message_structure.has_id = wire_test_random() % 4 != 0;
+        message_structure.id = wire_test_random_uint32();
+        message_structure.has_iteration = wire_test_random() % 4 != 0;
+        message_structure.iteration = wire_test_random_uint32();
+        message_structure.has_ciphertext = wire_test_random() % 4 != 0;
+        wire_test_random_bytes(&message_structure.ciphertext, ciphertext);
+
+        memset(&message, 0, sizeof(message));
+        message.has_id = message_structure.has_id;
+        message.id = message_structure.id;
+        message.has_iteration = message_structure.has_iteration;
+        message.iteration = message_structure.iteration;
+        message.has_ciphertext = message_structure.has_ciphertext;
+        message.ciphertext.data = message_structure.ciphertext.data;
+        message.ciphertext.len = message_structure.ciphertext.len;
+
+        len = textsecure__sender_key_message__pack(&message_structure, packed);
+        ck_assert_int_eq(protocol_wire_sender_key_message_get_size(&message), len);
+        ck_assert_int_eq(protocol_wire_write_sender_key_message(written, &message), len);
+        ck_assert_int_eq(memcmp(packed, written, len), 0);
+
+        wire_test_check_sender_key_message(packed, len);
+        len = wire_test_mutate(mutated, packed, len, len > 0 ? wire_test_random() % len : 0);
+        wire_test_check_sender_key_message(mutated, len);
+    }
+}
+END_TEST
+
 Suite *protocol_suite(void)
 {
     Suite *suite = suite_create("protocol");
@@ -298,6 +670,9 @@ Suite *protocol_suite(void)
     tcase_add_test(tcase, test_serialize_pre_key_signal_message);
     tcase_add_test(tcase, test_serialize_sender_key_message);
     tcase_add_test(tcase, test_serialize_sender_key_distribution_message);
+    tcase_add_test(tcase, test_wire_signal_message);
+    tcase_add_test(tcase, test_wire_pre_key_signal_message);
+    tcase_add_test(tcase, test_wire_sender_key_message);
     suite_add_tcase(suite, tcase);
 
     return suite;
@@ -174,6 +174,62 @@ START_TEST(test_chain_key_derivation_v3)
 }
 END_TEST
 
+START_TEST(test_chain_key_step)
+{
+    int result = 0;
+    int i;
+
+    uint8_t seed[32];
+    memset(seed, 0x5a, sizeof(seed));
+
+    hkdf_context *kdf;
+    result = hkdf_create(&kdf, 3, global_context);
+    ck_assert_int_eq(result, 0);
+
+    ratchet_chain_key *chain_key;
+    result = ratchet_chain_key_create(&chain_key, kdf, seed, sizeof(seed), 0, global_context);
+    ck_assert_int_eq(result, 0);
+    SIGNAL_UNREF(kdf);
+
+    ratchet_chain_key *stepped_chain_key;
+    result = ratchet_chain_key_copy(&stepped_chain_key, chain_key);
+    ck_assert_int_eq(result, 0);
+
+    /* Stepping in place must match deriving a new chain key each time */
+    for(i = 0; i < 5; i++) {
+        ratchet_message_keys message_keys;
+        ratchet_message_keys stepped_message_keys;
+        ratchet_chain_key *next_chain_key;
+
+        result = ratchet_chain_key_get_message_keys(chain_key, &message_keys);
+        ck_assert_int_eq(result, 0);
+        result = ratchet_chain_key_step(stepped_chain_key, &stepped_message_keys);
+        ck_assert_int_eq(result, 0);
+        ck_assert_int_eq(memcmp(&message_keys, &stepped_message_keys, sizeof(ratchet_message_keys)), 0);
+
+        result = ratchet_chain_key_create_next(chain_key, &next_chain_key);
+        ck_assert_int_eq(result, 0);
+        SIGNAL_UNREF(chain_key);
+        chain_key = next_chain_key;
+
+        signal_buffer *key;
+        signal_buffer *stepped_key;
+        result = ratchet_chain_key_get_key(chain_key, &key);
+        ck_assert_int_eq(result, 0);
+        result = ratchet_chain_key_get_key(stepped_chain_key, &stepped_key);
+        ck_assert_int_eq(result, 0);
+        ck_assert_int_eq(signal_buffer_compare(key, stepped_key), 0);
+        signal_buffer_free(key);
+        signal_buffer_free(stepped_key);
+
+        ck_assert_int_eq(ratchet_chain_key_get_index(stepped_chain_key), i + 1);
+    }
+
+    SIGNAL_UNREF(chain_key);
+    SIGNAL_UNREF(stepped_chain_key);
+}
+END_TEST
+
 START_TEST(test_root_key_derivation_v2)
 {
     int result = 0;
@@ -613,6 +669,7 @@ Suite *ratchet_suite(void)
     tcase_add_checked_fixture(tcase_chain_key, test_setup, test_teardown);
     tcase_add_test(tcase_chain_key, test_chain_key_derivation_v2);
     tcase_add_test(tcase_chain_key, test_chain_key_derivation_v3);
+    tcase_add_test(tcase_chain_key, test_chain_key_step);
     suite_add_tcase(suite, tcase_chain_key);
 
     TCase *tcase_root_key = tcase_create("root_key");
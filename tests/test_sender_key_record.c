@@ -155,6 +155,166 @@ START_TEST(test_serialize_sender_key_state)
 }
 END_TEST
 
+START_TEST(test_serialize_sender_key_state_skipped_keys)
+{
+    int result = 0;
+    uint32_t i;
+    sender_key_state *state = create_test_sender_key_state(1234, 0);
+    sender_chain_key *chain_key = sender_key_state_get_chain_key(state);
+    sender_message_key *message_keys[2010];
+
+    SIGNAL_REF(chain_key);
+
+    /* Store more skipped keys than the state keeps */
+    for(i = 0; i < 2010; i++) {
+        sender_chain_key *next_chain_key = 0;
+
+        result = sender_chain_key_create_message_key(chain_key, &message_keys[i]);
+        ck_assert_int_ge(result, 0);
+        result = sender_key_state_add_sender_message_key(state, message_keys[i]);
+        ck_assert_int_eq(result, 0);
+
+        result = sender_chain_key_create_next(chain_key, &next_chain_key);
+        ck_assert_int_ge(result, 0);
+        SIGNAL_UNREF(chain_key);
+        chain_key = next_chain_key;
+    }
+    SIGNAL_UNREF(chain_key);
+
+    /* The oldest keys were evicted */
+    for(i = 0; i < 10; i++) {
+        ck_assert_int_eq(sender_key_state_has_sender_message_key(state, i), 0);
+    }
+    ck_assert_int_eq(sender_key_state_has_sender_message_key(state, 10), 1);
+    ck_assert_int_eq(sender_key_state_has_sender_message_key(state, 2009), 1);
+
+    /* Leave a hole in the middle */
+    sender_message_key *removed = sender_key_state_remove_sender_message_key(state, 1000);
+    ck_assert_ptr_ne(removed, 0);
+    compare_sender_message_keys(message_keys[1000], removed);
+    SIGNAL_UNREF(removed);
+    ck_assert_int_eq(sender_key_state_has_sender_message_key(state, 1000), 0);
+    ck_assert_ptr_eq(sender_key_state_remove_sender_message_key(state, 1000), 0);
+
+    /* Round trip the state */
+    signal_buffer *buffer = 0;
+    result = sender_key_state_serialize(&buffer, state);
+    ck_assert_int_ge(result, 0);
+
+    sender_key_state *state_deserialized = 0;
+    result = sender_key_state_deserialize(&state_deserialized,
+            signal_buffer_data(buffer), signal_buffer_len(buffer), global_context);
+    ck_assert_int_eq(result, 0);
+    compare_sender_key_states(state, state_deserialized);
+
+    /* Every remaining key survives, and nothing else */
+    for(i = 0; i < 2010; i++) {
+        int expected = i >= 10 && i != 1000;
+        ck_assert_int_eq(sender_key_state_has_sender_message_key(state_deserialized, i), expected);
+        if(expected) {
+            sender_message_key *message_key = sender_key_state_remove_sender_message_key(state_deserialized, i);
+            ck_assert_ptr_ne(message_key, 0);
+            compare_sender_message_keys(message_keys[i], message_key);
+            SIGNAL_UNREF(message_key);
+        }
+    }
+
+    /* Cleanup */
+    for(i = 0; i < 2010; i++) {
+        SIGNAL_UNREF(message_keys[i]);
+    }
+    signal_buffer_free(buffer);
+    SIGNAL_UNREF(state);
+    SIGNAL_UNREF(state_deserialized);
+}
+END_TEST
+
+START_TEST(test_serialize_sender_key_state_checkpoints)
+{
+    int result = 0;
+    uint32_t i;
+    sender_key_state *state = 0;
+    sender_chain_key *chain_key = 0;
+    sender_message_key *message_keys[2010];
+
+    result = signal_context_set_skipped_key_checkpoint_interval(global_context, 16);
+    ck_assert_int_eq(result, 0);
+
+    state = create_test_sender_key_state(1234, 0);
+    chain_key = sender_key_state_get_chain_key(state);
+    SIGNAL_REF(chain_key);
+
+    /* Derive the expected keys the eager way */
+    for(i = 0; i < 2010; i++) {
+        sender_chain_key *next_chain_key = 0;
+
+        result = sender_chain_key_create_message_key(chain_key, &message_keys[i]);
+        ck_assert_int_ge(result, 0);
+
+        result = sender_chain_key_create_next(chain_key, &next_chain_key);
+        ck_assert_int_ge(result, 0);
+        SIGNAL_UNREF(chain_key);
+        chain_key = next_chain_key;
+    }
+
+    /* Skipping lands the state on the same chain key */
+    result = sender_key_state_skip_sender_message_keys(state, 2010);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(sender_chain_key_get_iteration(sender_key_state_get_chain_key(state)), 2010);
+    ck_assert_int_eq(signal_buffer_compare(
+            sender_chain_key_get_seed(sender_key_state_get_chain_key(state)),
+            sender_chain_key_get_seed(chain_key)), 0);
+    SIGNAL_UNREF(chain_key);
+
+    /* Positions older than the window were dropped */
+    for(i = 0; i < 10; i++) {
+        ck_assert_int_eq(sender_key_state_has_sender_message_key(state, i), 0);
+    }
+    ck_assert_int_eq(sender_key_state_has_sender_message_key(state, 10), 1);
+    ck_assert_int_eq(sender_key_state_has_sender_message_key(state, 2009), 1);
+    ck_assert_int_eq(sender_key_state_has_sender_message_key(state, 2010), 0);
+
+    /* Leave a hole in the middle */
+    sender_message_key *removed = sender_key_state_remove_sender_message_key(state, 1000);
+    ck_assert_ptr_ne(removed, 0);
+    compare_sender_message_keys(message_keys[1000], removed);
+    SIGNAL_UNREF(removed);
+    ck_assert_ptr_eq(sender_key_state_remove_sender_message_key(state, 1000), 0);
+
+    /* Round trip the state, which keeps checkpoints instead of keys */
+    signal_buffer *buffer = 0;
+    result = sender_key_state_serialize(&buffer, state);
+    ck_assert_int_ge(result, 0);
+    ck_assert_int_lt(signal_buffer_len(buffer), 8192);
+
+    sender_key_state *state_deserialized = 0;
+    result = sender_key_state_deserialize(&state_deserialized,
+            signal_buffer_data(buffer), signal_buffer_len(buffer), global_context);
+    ck_assert_int_eq(result, 0);
+    compare_sender_key_states(state, state_deserialized);
+
+    /* Every remaining key survives, in any order, and nothing else */
+    for(i = 2010; i-- > 0;) {
+        int expected = i >= 10 && i != 1000;
+        ck_assert_int_eq(sender_key_state_has_sender_message_key(state_deserialized, i), expected);
+        if(expected) {
+            sender_message_key *message_key = sender_key_state_remove_sender_message_key(state_deserialized, i);
+            ck_assert_ptr_ne(message_key, 0);
+            compare_sender_message_keys(message_keys[i], message_key);
+            SIGNAL_UNREF(message_key);
+        }
+    }
+
+    /* Cleanup */
+    for(i = 0; i < 2010; i++) {
+        SIGNAL_UNREF(message_keys[i]);
+    }
+    signal_buffer_free(buffer);
+    SIGNAL_UNREF(state);
+    SIGNAL_UNREF(state_deserialized);
+}
+END_TEST
+
 void compare_sender_key_records(sender_key_record *record1, sender_key_record *record2)
 {
     int empty1 = sender_key_record_is_empty(record1);
@@ -327,6 +487,8 @@ Suite *sender_key_record_suite(void)
     TCase *tcase = tcase_create("case");
     tcase_add_checked_fixture(tcase, test_setup, test_teardown);
     tcase_add_test(tcase, test_serialize_sender_key_state);
+    tcase_add_test(tcase, test_serialize_sender_key_state_skipped_keys);
+    tcase_add_test(tcase, test_serialize_sender_key_state_checkpoints);
     tcase_add_test(tcase, test_serialize_sender_key_record);
     tcase_add_test(tcase, test_serialize_sender_key_record_with_states);
     tcase_add_test(tcase, test_sender_key_record_too_many_states);
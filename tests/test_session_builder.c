@@ -4,6 +4,7 @@
 #include <pthread.h>
 
 #include "../src/signal_protocol.h"
+#include "signal_protocol_internal.h"
 #include "session_record.h"
 #include "session_state.h"
 #include "session_cipher.h"
@@ -618,6 +619,94 @@ START_TEST(test_bad_signed_pre_key_signature)
 }
 END_TEST
 
+START_TEST(test_process_pre_key_bundles)
+{
+    int result = 0;
+    int i;
+    signal_protocol_address bob_addresses[3] = {
+            {"+14152222222", 12, 1},
+            {"+14152222222", 12, 2},
+            {"+14152222222", 12, 3}
+    };
+    session_pre_key_bundle *bob_bundles[3];
+    int results[3];
+
+    /* Create Alice's data store */
+    signal_protocol_store_context *alice_store = 0;
+    setup_test_store_context(&alice_store, global_context);
+
+    /* Create Bob's data store, his devices share its identity key */
+    signal_protocol_store_context *bob_store = 0;
+    setup_test_store_context(&bob_store, global_context);
+
+    /* Create a pre key bundle for each of Bob's devices */
+    for(i = 0; i < 3; i++) {
+        uint32_t bob_local_registration_id = 0;
+        ec_key_pair *bob_pre_key_pair = 0;
+        ec_key_pair *bob_signed_pre_key_pair = 0;
+        ratchet_identity_key_pair *bob_identity_key_pair = 0;
+        signal_buffer *bob_signed_pre_key_signature = 0;
+
+        result = signal_protocol_identity_get_local_registration_id(bob_store, &bob_local_registration_id);
+        ck_assert_int_eq(result, 0);
+        result = curve_generate_key_pair(global_context, &bob_pre_key_pair);
+        ck_assert_int_eq(result, 0);
+        result = curve_generate_key_pair(global_context, &bob_signed_pre_key_pair);
+        ck_assert_int_eq(result, 0);
+        result = signal_protocol_identity_get_key_pair(bob_store, &bob_identity_key_pair);
+        ck_assert_int_eq(result, 0);
+
+        result = curve_calculate_signature(global_context,
+                &bob_signed_pre_key_signature,
+                ratchet_identity_key_pair_get_private(bob_identity_key_pair),
+                ec_public_key_get_serialized(ec_key_pair_get_public(bob_signed_pre_key_pair)),
+                EC_PUBLIC_KEY_SERIALIZED_LENGTH);
+        ck_assert_int_eq(result, 0);
+
+        /* Intentionally corrupt the signature of the second device */
+        if(i == 1) {
+            signal_buffer_data(bob_signed_pre_key_signature)[7] ^= 0x10;
+        }
+
+        result = session_pre_key_bundle_create(&bob_bundles[i],
+                bob_local_registration_id,
+                bob_addresses[i].device_id,
+                31337, /* pre key ID */
+                ec_key_pair_get_public(bob_pre_key_pair),
+                22, /* signed pre key ID */
+                ec_key_pair_get_public(bob_signed_pre_key_pair),
+                signal_buffer_data(bob_signed_pre_key_signature),
+                signal_buffer_len(bob_signed_pre_key_signature),
+                ratchet_identity_key_pair_get_public(bob_identity_key_pair));
+        ck_assert_int_eq(result, 0);
+
+        SIGNAL_UNREF(bob_pre_key_pair);
+        SIGNAL_UNREF(bob_signed_pre_key_pair);
+        SIGNAL_UNREF(bob_identity_key_pair);
+        signal_buffer_free(bob_signed_pre_key_signature);
+    }
+
+    /* Process the bundles together, the bad one does not stop the others */
+    result = session_builder_process_pre_key_bundles(alice_store,
+            bob_addresses, bob_bundles, 3, results, global_context);
+    ck_assert_int_eq(result, SG_ERR_INVALID_KEY);
+    ck_assert_int_eq(results[0], SG_SUCCESS);
+    ck_assert_int_eq(results[1], SG_ERR_INVALID_KEY);
+    ck_assert_int_eq(results[2], SG_SUCCESS);
+
+    ck_assert_int_eq(signal_protocol_session_contains_session(alice_store, &bob_addresses[0]), 1);
+    ck_assert_int_eq(signal_protocol_session_contains_session(alice_store, &bob_addresses[1]), 0);
+    ck_assert_int_eq(signal_protocol_session_contains_session(alice_store, &bob_addresses[2]), 1);
+
+    /* Cleanup */
+    for(i = 0; i < 3; i++) {
+        SIGNAL_UNREF(bob_bundles[i]);
+    }
+    signal_protocol_store_context_destroy(alice_store);
+    signal_protocol_store_context_destroy(bob_store);
+}
+END_TEST
+
 START_TEST(test_repeat_bundle_message_v2)
 {
     int result = 0;
@@ -1526,6 +1615,7 @@ Suite *session_builder_suite(void)
     tcase_add_test(tcase, test_basic_pre_key_v2);
     tcase_add_test(tcase, test_basic_pre_key_v3);
     tcase_add_test(tcase, test_bad_signed_pre_key_signature);
+    tcase_add_test(tcase, test_process_pre_key_bundles);
     tcase_add_test(tcase, test_repeat_bundle_message_v2);
     tcase_add_test(tcase, test_repeat_bundle_message_v3);
     tcase_add_test(tcase, test_bad_message_bundle);
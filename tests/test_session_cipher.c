@@ -10,15 +10,19 @@
 #include "curve.h"
 #include "ratchet.h"
 #include "protocol.h"
+#include "message_key_checkpoints.h"
 #include "test_common.h"
 
 signal_context *global_context;
 pthread_mutex_t global_mutex;
 pthread_mutexattr_t global_mutex_attr;
 
+int global_lock_count;
+
 void test_lock(void *user_data)
 {
     pthread_mutex_lock(&global_mutex);
+    global_lock_count++;
 }
 
 void test_unlock(void *user_data)
@@ -52,6 +56,135 @@ void test_teardown()
     pthread_mutexattr_destroy(&global_mutex_attr);
 }
 
+#define MAX_HELD_ADDRESS_LOCKS 8
+
+signal_protocol_address held_address_locks[MAX_HELD_ADDRESS_LOCKS];
+int held_address_lock_modes[MAX_HELD_ADDRESS_LOCKS];
+int held_address_lock_count;
+
+static int compare_addresses(const signal_protocol_address *address1, const signal_protocol_address *address2)
+{
+    size_t len = address1->name_len < address2->name_len ? address1->name_len : address2->name_len;
+    int result = memcmp(address1->name, address2->name, len);
+    if(result == 0) {
+        result = (int)address1->name_len - (int)address2->name_len;
+    }
+    if(result == 0) {
+        result = address1->device_id - address2->device_id;
+    }
+    return result;
+}
+
+void test_lock_address(const signal_protocol_address *address, int mode, void *user_data)
+{
+    ck_assert(mode == SG_LOCK_READ || mode == SG_LOCK_WRITE);
+    ck_assert_int_lt(held_address_lock_count, MAX_HELD_ADDRESS_LOCKS);
+
+    /* Locks held together must be taken in ascending order, which also rules out recursion */
+    if(held_address_lock_count > 0) {
+        ck_assert_int_gt(compare_addresses(address, &held_address_locks[held_address_lock_count - 1]), 0);
+    }
+    held_address_locks[held_address_lock_count] = *address;
+    held_address_lock_modes[held_address_lock_count] = mode;
+    held_address_lock_count++;
+}
+
+void test_unlock_address(const signal_protocol_address *address, int mode, void *user_data)
+{
+    ck_assert_int_gt(held_address_lock_count, 0);
+    held_address_lock_count--;
+    ck_assert_int_eq(compare_addresses(address, &held_address_locks[held_address_lock_count]), 0);
+    ck_assert_int_eq(mode, held_address_lock_modes[held_address_lock_count]);
+}
+
+void test_setup_address_locks()
+{
+    int result;
+
+    test_setup();
+
+    result = signal_context_set_address_locking_functions(global_context, test_lock_address, test_unlock_address);
+    ck_assert_int_eq(result, 0);
+    global_lock_count = 0;
+    held_address_lock_count = 0;
+}
+
+void test_teardown_address_locks()
+{
+    /* Every operation is covered by an address lock */
+    ck_assert_int_eq(global_lock_count, 0);
+    ck_assert_int_eq(held_address_lock_count, 0);
+    test_teardown();
+}
+
+void test_setup_skipped_key_checkpoints()
+{
+    int result;
+
+    test_setup();
+
+    result = signal_context_set_skipped_key_checkpoint_interval(global_context, 16);
+    ck_assert_int_eq(result, 0);
+}
+
+test_allocator global_allocator;
+
+void test_setup_allocator()
+{
+    test_setup();
+    setup_test_allocator(global_context, &global_allocator);
+}
+
+void test_teardown_allocator()
+{
+    /* Everything allocated through the context has been released */
+    ck_assert_int_gt(global_allocator.allocation_count, 0);
+    ck_assert_int_eq(global_allocator.live_count, 0);
+    test_teardown();
+}
+
+#define KEY_PAIR_POOL_CAPACITY 8
+
+int key_pair_pool_refill_requests;
+
+void test_key_pair_pool_refill_needed(void *user_data)
+{
+    key_pair_pool_refill_requests++;
+}
+
+void test_setup_key_pair_pool()
+{
+    int result;
+
+    test_setup();
+
+    result = signal_context_set_key_pair_pool(global_context, KEY_PAIR_POOL_CAPACITY,
+            test_key_pair_pool_refill_needed);
+    ck_assert_int_eq(result, 0);
+    result = signal_context_refill_key_pair_pool(global_context);
+    ck_assert_int_eq(result, KEY_PAIR_POOL_CAPACITY);
+    key_pair_pool_refill_requests = 0;
+}
+
+void test_setup_address_locks_key_pair_pool()
+{
+    test_setup_key_pair_pool();
+
+    int result = signal_context_set_address_locking_functions(global_context, test_lock_address, test_unlock_address);
+    ck_assert_int_eq(result, 0);
+    global_lock_count = 0;
+    held_address_lock_count = 0;
+}
+
+void test_teardown_address_locks_key_pair_pool()
+{
+    /* The pool is the only thing guarded by the global lock, and it was used */
+    ck_assert_int_gt(global_lock_count, 0);
+    ck_assert_int_lt(signal_context_get_key_pair_pool_count(global_context), KEY_PAIR_POOL_CAPACITY);
+    ck_assert_int_eq(held_address_lock_count, 0);
+    test_teardown();
+}
+
 void initialize_sessions_v3(session_state *alice_state, session_state *bob_state);
 void run_interaction(session_record *alice_session_record, session_record *bob_session_record);
 
@@ -476,15 +609,1109 @@ START_TEST(test_message_key_limits)
 }
 END_TEST
 
-Suite *session_cipher_suite(void)
+#define BATCH_DEVICE_COUNT 5
+
+static void run_encrypt_batch(int batch, int cache_write_policy, size_t cache_capacity)
 {
-    Suite *suite = suite_create("session_cipher");
+    int i;
+    int round;
+    int result = 0;
+    static const char plaintext[] = "smert ze smert";
+    size_t plaintext_len = sizeof(plaintext) - 1;
 
-    TCase *tcase = tcase_create("case");
-    tcase_add_checked_fixture(tcase, test_setup, test_teardown);
-    tcase_add_test(tcase, test_basic_session_v3);
-    tcase_add_test(tcase, test_message_key_limits);
-    suite_add_tcase(suite, tcase);
+    signal_protocol_address alice_address = {
+            "+14159999999", 12, 1
+    };
+
+    signal_protocol_address bob_addresses[BATCH_DEVICE_COUNT + 1];
+    signal_protocol_store_context *bob_stores[BATCH_DEVICE_COUNT];
+    session_cipher *bob_ciphers[BATCH_DEVICE_COUNT];
+    ciphertext_message *messages[BATCH_DEVICE_COUNT + 1];
+
+    /* Create Alice's data store, only the session store is needed */
+    signal_protocol_store_context *alice_store = 0;
+    result = signal_protocol_store_context_create(&alice_store, global_context);
+    ck_assert_int_eq(result, 0);
+    setup_test_session_store_with_batch(alice_store, batch);
+    if(cache_write_policy) {
+        result = signal_protocol_store_context_set_session_cache(alice_store, cache_capacity, cache_write_policy);
+        ck_assert_int_eq(result, 0);
+    }
+
+    for(i = 0; i < BATCH_DEVICE_COUNT + 1; i++) {
+        bob_addresses[i].name = "+14158888888";
+        bob_addresses[i].name_len = 12;
+        /* Descending, so that address locks have to be reordered */
+        bob_addresses[i].device_id = BATCH_DEVICE_COUNT - i;
+    }
+
+    /* Establish a session with each of Bob's devices */
+    for(i = 0; i < BATCH_DEVICE_COUNT; i++) {
+        session_record *alice_session_record = 0;
+        result = session_record_create(&alice_session_record, 0, global_context);
+        ck_assert_int_eq(result, 0);
+
+        session_record *bob_session_record = 0;
+        result = session_record_create(&bob_session_record, 0, global_context);
+        ck_assert_int_eq(result, 0);
+
+        initialize_sessions_v3(
+                session_record_get_state(alice_session_record),
+                session_record_get_state(bob_session_record));
+
+        setup_test_store_context(&bob_stores[i], global_context);
+        if(cache_write_policy) {
+            result = signal_protocol_store_context_set_session_cache(bob_stores[i], 1, cache_write_policy);
+            ck_assert_int_eq(result, 0);
+        }
+
+        result = signal_protocol_session_store_session(alice_store, &bob_addresses[i], alice_session_record);
+        ck_assert_int_eq(result, 0);
+        result = signal_protocol_session_store_session(bob_stores[i], &alice_address, bob_session_record);
+        ck_assert_int_eq(result, 0);
+
+        result = session_cipher_create(&bob_ciphers[i], bob_stores[i], &alice_address, global_context);
+        ck_assert_int_eq(result, 0);
+
+        uint32_t version = 0;
+        result = session_cipher_get_session_version(bob_ciphers[i], &version);
+        ck_assert_int_eq(result, 0);
+        ck_assert_int_eq(version, 3);
+
+        SIGNAL_UNREF(alice_session_record);
+        SIGNAL_UNREF(bob_session_record);
+    }
+
+    /* Each round only decrypts if the previous one committed every record */
+    for(round = 0; round < 3; round++) {
+        result = session_cipher_encrypt_batch(alice_store,
+                bob_addresses, BATCH_DEVICE_COUNT,
+                (const uint8_t *)plaintext, plaintext_len,
+                messages, global_context);
+        ck_assert_int_eq(result, 0);
+
+        for(i = 0; i < BATCH_DEVICE_COUNT; i++) {
+            signal_buffer *decrypted = 0;
+            ck_assert_ptr_ne(messages[i], 0);
+            ck_assert_int_eq(ciphertext_message_get_type(messages[i]), CIPHERTEXT_SIGNAL_TYPE);
+
+            result = session_cipher_decrypt_signal_message(bob_ciphers[i], (signal_message *)messages[i], 0, &decrypted);
+            ck_assert_int_eq(result, 0);
+            ck_assert_int_eq(signal_buffer_len(decrypted), plaintext_len);
+            ck_assert_int_eq(memcmp(signal_buffer_data(decrypted), plaintext, plaintext_len), 0);
+
+            signal_buffer_free(decrypted);
+            SIGNAL_UNREF(messages[i]);
+        }
+
+        /* A device without a session fails the whole batch */
+        result = session_cipher_encrypt_batch(alice_store,
+                bob_addresses, BATCH_DEVICE_COUNT + 1,
+                (const uint8_t *)plaintext, plaintext_len,
+                messages, global_context);
+        ck_assert_int_lt(result, 0);
+        for(i = 0; i < BATCH_DEVICE_COUNT + 1; i++) {
+            ck_assert_ptr_eq(messages[i], 0);
+        }
+
+        if(cache_write_policy && round == 1) {
+            /* The next round must find the latest records in the store */
+            result = signal_protocol_session_cache_flush(alice_store);
+            ck_assert_int_eq(result, 0);
+            signal_protocol_session_cache_invalidate(alice_store, 0);
+            for(i = 0; i < BATCH_DEVICE_COUNT; i++) {
+                result = signal_protocol_session_cache_flush(bob_stores[i]);
+                ck_assert_int_eq(result, 0);
+                signal_protocol_session_cache_invalidate(bob_stores[i], &alice_address);
+            }
+        }
+    }
+
+    if(cache_write_policy) {
+        signal_protocol_session_cache_stats stats;
+        signal_protocol_session_cache_get_stats(alice_store, &stats);
+        ck_assert_int_gt(stats.hits, 0);
+        ck_assert_int_gt(stats.misses, 0);
+        if(cache_capacity < BATCH_DEVICE_COUNT) {
+            ck_assert_int_gt(stats.evictions, 0);
+        }
+        if(cache_write_policy == SG_SESSION_CACHE_WRITE_BEHIND) {
+            ck_assert_int_gt(stats.write_backs, 0);
+        }
+        else {
+            ck_assert_int_eq(stats.write_backs, 0);
+        }
+    }
+
+    /* Cleanup */
+    for(i = 0; i < BATCH_DEVICE_COUNT; i++) {
+        session_cipher_free(bob_ciphers[i]);
+        signal_protocol_store_context_destroy(bob_stores[i]);
+    }
+    signal_protocol_store_context_destroy(alice_store);
+}
+
+START_TEST(test_encrypt_batch)
+{
+    run_encrypt_batch(1, 0, 0);
+}
+END_TEST
+
+START_TEST(test_encrypt_batch_without_store_callbacks)
+{
+    run_encrypt_batch(0, 0, 0);
+}
+END_TEST
+
+START_TEST(test_encrypt_batch_session_cache_write_through)
+{
+    /* Smaller than the batch, so that every round evicts records */
+    run_encrypt_batch(1, SG_SESSION_CACHE_WRITE_THROUGH, BATCH_DEVICE_COUNT - 2);
+}
+END_TEST
+
+START_TEST(test_encrypt_batch_session_cache_write_behind)
+{
+    /* Too large to stage, so every batch is written through */
+    run_encrypt_batch(1, SG_SESSION_CACHE_WRITE_BEHIND, BATCH_DEVICE_COUNT - 2);
+}
+END_TEST
+
+START_TEST(test_encrypt_batch_session_cache_write_behind_staged)
+{
+    run_encrypt_batch(1, SG_SESSION_CACHE_WRITE_BEHIND, BATCH_DEVICE_COUNT + 1);
+}
+END_TEST
+
+START_TEST(test_session_cache_write_behind)
+{
+    int result = 0;
+    session_record *record = 0;
+    session_record *loaded_record = 0;
+    signal_int_list *sessions = 0;
+    signal_protocol_session_cache_stats stats;
+
+    signal_protocol_address address = {
+            "+14159999999", 12, 1
+    };
+
+    signal_protocol_store_context *store = 0;
+    setup_test_store_context(&store, global_context);
+    result = signal_protocol_store_context_set_session_cache(store, 4, SG_SESSION_CACHE_WRITE_BEHIND);
+    ck_assert_int_eq(result, 0);
+
+    session_record *bob_record = 0;
+    result = session_record_create(&record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+    result = session_record_create(&bob_record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+    initialize_sessions_v3(session_record_get_state(record), session_record_get_state(bob_record));
+    SIGNAL_UNREF(bob_record);
+
+    /* A pending write is visible through the store context only */
+    result = signal_protocol_session_store_session(store, &address, record);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(signal_protocol_session_contains_session(store, &address), 1);
+
+    result = signal_protocol_session_load_session(store, &loaded_record, &address);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(session_record_is_fresh(loaded_record), 0);
+    ck_assert_ptr_ne(loaded_record, record);
+    SIGNAL_UNREF(loaded_record);
+
+    /* Invalidating discards it */
+    signal_protocol_session_cache_invalidate(store, &address);
+    ck_assert_int_eq(signal_protocol_session_contains_session(store, &address), 0);
+
+    /* Listing sessions writes it back first */
+    result = signal_protocol_session_store_session(store, &address, record);
+    ck_assert_int_eq(result, 0);
+    result = signal_protocol_session_get_sub_device_sessions(store, &sessions, address.name, address.name_len);
+    ck_assert_int_ge(result, 0);
+    ck_assert_int_eq(signal_int_list_size(sessions), 1);
+    signal_int_list_free(sessions);
+
+    signal_protocol_session_cache_invalidate(store, 0);
+    result = signal_protocol_session_load_session(store, &loaded_record, &address);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(session_record_is_fresh(loaded_record), 0);
+    SIGNAL_UNREF(loaded_record);
+
+    /* Deleting removes both the cached and the stored record */
+    result = signal_protocol_session_delete_session(store, &address);
+    ck_assert_int_eq(result, 1);
+    ck_assert_int_eq(signal_protocol_session_contains_session(store, &address), 0);
+
+    signal_protocol_session_cache_get_stats(store, &stats);
+    ck_assert_int_eq(stats.write_backs, 1);
+    ck_assert_int_eq(stats.evictions, 0);
+
+    SIGNAL_UNREF(record);
+    signal_protocol_store_context_destroy(store);
+}
+END_TEST
+
+START_TEST(test_skipped_key_checkpoints)
+{
+    int i;
+    int result = 0;
+
+    signal_protocol_address alice_address = {
+            "+14159999999", 12, 1
+    };
+
+    signal_protocol_address bob_address = {
+            "+14158888888", 12, 1
+    };
+
+    static const char alice_plaintext[] = "smoke signals";
+    size_t alice_plaintext_len = sizeof(alice_plaintext) - 1;
+
+    /* Create and initialize the sessions */
+    session_record *alice_session_record = 0;
+    result = session_record_create(&alice_session_record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+
+    session_record *bob_session_record = 0;
+    result = session_record_create(&bob_session_record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+
+    initialize_sessions_v3(
+            session_record_get_state(alice_session_record),
+            session_record_get_state(bob_session_record));
+
+    signal_protocol_store_context *alice_store = 0;
+    setup_test_store_context(&alice_store, global_context);
+
+    signal_protocol_store_context *bob_store = 0;
+    setup_test_store_context(&bob_store, global_context);
+
+    result = signal_protocol_session_store_session(alice_store, &bob_address, alice_session_record);
+    ck_assert_int_eq(result, 0);
+    result = signal_protocol_session_store_session(bob_store, &alice_address, bob_session_record);
+    ck_assert_int_eq(result, 0);
+
+    session_cipher *alice_cipher = 0;
+    result = session_cipher_create(&alice_cipher, alice_store, &bob_address, global_context);
+    ck_assert_int_eq(result, 0);
+
+    session_cipher *bob_cipher = 0;
+    result = session_cipher_create(&bob_cipher, bob_store, &alice_address, global_context);
+    ck_assert_int_eq(result, 0);
+
+    signal_buffer *inflight[1000];
+    for(i = 0; i < 1000; i++) {
+        ciphertext_message *alice_message = 0;
+        result = session_cipher_encrypt(alice_cipher, (uint8_t *)alice_plaintext, alice_plaintext_len, &alice_message);
+        ck_assert_int_eq(result, 0);
+        inflight[i] = signal_buffer_copy(ciphertext_message_get_serialized(alice_message));
+        SIGNAL_UNREF(alice_message);
+    }
+
+    /* Decrypting the newest message leaves 999 skipped keys behind */
+    signal_buffer *plaintext_buffer = signal_buffer_create((uint8_t *)alice_plaintext, alice_plaintext_len);
+    decrypt_and_compare_messages(bob_cipher, inflight[999], plaintext_buffer);
+
+    /* The stored record holds checkpoints instead of 999 message keys */
+    session_record *loaded_record = 0;
+    signal_buffer *serialized_record = 0;
+    result = signal_protocol_session_load_session(bob_store, &loaded_record, &alice_address);
+    ck_assert_int_eq(result, 0);
+    result = session_record_serialize(&serialized_record, loaded_record);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_lt(signal_buffer_len(serialized_record), 4096);
+    signal_buffer_free(serialized_record);
+    SIGNAL_UNREF(loaded_record);
+
+    /* Every late message still decrypts, in any order, exactly once */
+    for(i = 998; i >= 0; i -= 3) {
+        decrypt_and_compare_messages(bob_cipher, inflight[i], plaintext_buffer);
+    }
+    for(i = 0; i < 999; i++) {
+        signal_message *message = 0;
+        signal_buffer *buffer = 0;
+        result = signal_message_deserialize(&message,
+                signal_buffer_data(inflight[i]), signal_buffer_len(inflight[i]), global_context);
+        ck_assert_int_eq(result, 0);
+        result = session_cipher_decrypt_signal_message(bob_cipher, message, 0, &buffer);
+        if((998 - i) % 3 == 0) {
+            ck_assert_int_eq(result, SG_ERR_DUPLICATE_MESSAGE);
+        }
+        else {
+            ck_assert_int_eq(result, 0);
+            ck_assert_int_eq(signal_buffer_len(buffer), alice_plaintext_len);
+            ck_assert_int_eq(memcmp(signal_buffer_data(buffer), alice_plaintext, alice_plaintext_len), 0);
+        }
+        signal_buffer_free(buffer);
+        SIGNAL_UNREF(message);
+    }
+
+    /* Cleanup */
+    for(i = 0; i < 1000; i++) {
+        signal_buffer_free(inflight[i]);
+    }
+    signal_buffer_free(plaintext_buffer);
+    SIGNAL_UNREF(alice_session_record);
+    SIGNAL_UNREF(bob_session_record);
+    session_cipher_free(alice_cipher);
+    session_cipher_free(bob_cipher);
+    signal_protocol_store_context_destroy(alice_store);
+    signal_protocol_store_context_destroy(bob_store);
+}
+END_TEST
+
+START_TEST(test_skipped_key_checkpoint_advance)
+{
+    int result = 0;
+    uint8_t chain_key[MESSAGE_KEY_CHECKPOINT_KEY_LENGTH];
+    uint8_t expected_key[MESSAGE_KEY_CHECKPOINT_KEY_LENGTH];
+    uint32_t counter = 0;
+    message_key_checkpoints *checkpoints = 0;
+    message_key_checkpoints *reference = 0;
+
+    /* Checkpoints at positions 0 and 4, every position available */
+    result = message_key_checkpoints_create(&checkpoints, 4, 2000, global_context);
+    ck_assert_int_eq(result, 0);
+    memset(chain_key, 0x55, sizeof(chain_key));
+    result = message_key_checkpoints_skip(checkpoints, chain_key, 0, 8);
+    ck_assert_int_eq(result, 0);
+    result = message_key_checkpoints_copy(&reference, checkpoints);
+    ck_assert_int_eq(result, 0);
+
+    /* Taking the position of a checkpoint moves it to the next available one */
+    result = message_key_checkpoints_take(reference, 1, expected_key);
+    ck_assert_int_eq(result, 1);
+    result = message_key_checkpoints_take(checkpoints, 0, chain_key);
+    ck_assert_int_eq(result, 1);
+    ck_assert_int_eq(message_key_checkpoints_get_checkpoint_count(checkpoints), 2);
+    ck_assert_int_eq(memcmp(message_key_checkpoints_get_checkpoint(checkpoints, 0, &counter),
+            expected_key, sizeof(expected_key)), 0);
+    ck_assert_int_eq(counter, 1);
+
+    /* Consumed positions are skipped over */
+    result = message_key_checkpoints_take(checkpoints, 2, chain_key);
+    ck_assert_int_eq(result, 1);
+    result = message_key_checkpoints_take(reference, 3, expected_key);
+    ck_assert_int_eq(result, 1);
+    result = message_key_checkpoints_take(checkpoints, 1, chain_key);
+    ck_assert_int_eq(result, 1);
+    ck_assert_int_eq(memcmp(message_key_checkpoints_get_checkpoint(checkpoints, 0, &counter),
+            expected_key, sizeof(expected_key)), 0);
+    ck_assert_int_eq(counter, 3);
+
+    /* The position still derives its key, and a spent range drops its checkpoint */
+    result = message_key_checkpoints_take(checkpoints, 3, chain_key);
+    ck_assert_int_eq(result, 1);
+    ck_assert_int_eq(memcmp(chain_key, expected_key, sizeof(expected_key)), 0);
+    ck_assert_int_eq(message_key_checkpoints_get_checkpoint_count(checkpoints), 1);
+    message_key_checkpoints_get_checkpoint(checkpoints, 0, &counter);
+    ck_assert_int_eq(counter, 4);
+    ck_assert_int_eq(message_key_checkpoints_count(checkpoints), 4);
+
+    result = message_key_checkpoints_take(reference, 5, expected_key);
+    ck_assert_int_eq(result, 1);
+    result = message_key_checkpoints_take(checkpoints, 5, chain_key);
+    ck_assert_int_eq(result, 1);
+    ck_assert_int_eq(memcmp(chain_key, expected_key, sizeof(expected_key)), 0);
+
+    SIGNAL_UNREF(checkpoints);
+    SIGNAL_UNREF(reference);
+}
+END_TEST
+
+#define FAILING_STORE_DEVICE_COUNT 5
+
+/* Keeps only the user record of each device, and fails stores on request */
+typedef struct {
+    int fail_stores;
+    signal_buffer *user_records[FAILING_STORE_DEVICE_COUNT];
+} failing_session_store_data;
+
+static int failing_session_store_load_session(signal_buffer **record, signal_buffer **user_record, const signal_protocol_address *address, void *user_data)
+{
+    (void)record;
+    (void)user_record;
+    (void)address;
+    (void)user_data;
+    return 0;
+}
+
+static int failing_session_store_get_sub_device_sessions(signal_int_list **sessions, const char *name, size_t name_len, void *user_data)
+{
+    (void)name;
+    (void)name_len;
+    (void)user_data;
+    *sessions = signal_int_list_alloc();
+    return *sessions ? 0 : SG_ERR_NOMEM;
+}
+
+static int failing_session_store_store_session(const signal_protocol_address *address, uint8_t *record, size_t record_len, uint8_t *user_record_data, size_t user_record_len, void *user_data)
+{
+    failing_session_store_data *data = user_data;
+
+    (void)record;
+    (void)record_len;
+    ck_assert_int_lt(address->device_id, FAILING_STORE_DEVICE_COUNT);
+    if(data->fail_stores) {
+        return SG_ERR_UNKNOWN;
+    }
+    signal_buffer_free(data->user_records[address->device_id]);
+    data->user_records[address->device_id] = signal_buffer_create(user_record_data, user_record_len);
+    return 0;
+}
+
+static int failing_session_store_contains_session(const signal_protocol_address *address, void *user_data)
+{
+    (void)address;
+    (void)user_data;
+    return 0;
+}
+
+static int failing_session_store_delete_session(const signal_protocol_address *address, void *user_data)
+{
+    (void)address;
+    (void)user_data;
+    return 0;
+}
+
+static int failing_session_store_delete_all_sessions(const char *name, size_t name_len, void *user_data)
+{
+    (void)name;
+    (void)name_len;
+    (void)user_data;
+    return 0;
+}
+
+static session_record *create_tagged_record(const char *tag)
+{
+    session_record *record = 0;
+    int result = session_record_create(&record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+    session_record_set_user_record(record, signal_buffer_create((const uint8_t *)tag, strlen(tag)));
+    return record;
+}
+
+static void assert_record_tag(signal_buffer *user_record, const char *tag)
+{
+    ck_assert_ptr_ne(user_record, 0);
+    ck_assert_int_eq(signal_buffer_len(user_record), strlen(tag));
+    ck_assert_int_eq(memcmp(signal_buffer_data(user_record), tag, strlen(tag)), 0);
+}
+
+START_TEST(test_session_cache_write_behind_batch_failure)
+{
+    int result = 0;
+    int i;
+    session_record *records[3] = {0};
+    session_record *batch_records[2] = {0};
+    session_record *loaded_record = 0;
+    failing_session_store_data data;
+    signal_protocol_address addresses[4];
+
+    memset(&data, 0, sizeof(data));
+    signal_protocol_session_store session_store = {
+        .load_session_func = failing_session_store_load_session,
+        .get_sub_device_sessions_func = failing_session_store_get_sub_device_sessions,
+        .store_session_func = failing_session_store_store_session,
+        .contains_session_func = failing_session_store_contains_session,
+        .delete_session_func = failing_session_store_delete_session,
+        .delete_all_sessions_func = failing_session_store_delete_all_sessions,
+        .user_data = &data
+    };
+
+    for(i = 0; i < 4; i++) {
+        addresses[i].name = "+14159999999";
+        addresses[i].name_len = 12;
+        addresses[i].device_id = i + 1;
+    }
+
+    signal_protocol_store_context *store = 0;
+    result = signal_protocol_store_context_create(&store, global_context);
+    ck_assert_int_eq(result, 0);
+    result = signal_protocol_store_context_set_session_store(store, &session_store);
+    ck_assert_int_eq(result, 0);
+    result = signal_protocol_store_context_set_session_cache(store, 3, SG_SESSION_CACHE_WRITE_BEHIND);
+    ck_assert_int_eq(result, 0);
+
+    /* Fill the cache with pending writes for devices 1 to 3 */
+    records[0] = create_tagged_record("a0");
+    records[1] = create_tagged_record("b0");
+    records[2] = create_tagged_record("c0");
+    for(i = 0; i < 3; i++) {
+        result = signal_protocol_session_store_session(store, &addresses[i], records[i]);
+        ck_assert_int_eq(result, 0);
+    }
+
+    /*
+     * Device 1 is replaced in place, then device 4 has to evict device 2,
+     * whose write back fails. The whole batch must be undone.
+     */
+    batch_records[0] = create_tagged_record("a1");
+    batch_records[1] = create_tagged_record("d1");
+    const signal_protocol_address batch_addresses[2] = { addresses[0], addresses[3] };
+    data.fail_stores = 1;
+    result = signal_protocol_session_store_sessions(store, batch_addresses, batch_records, 2);
+    ck_assert_int_lt(result, 0);
+    data.fail_stores = 0;
+
+    result = signal_protocol_session_load_session(store, &loaded_record, &addresses[0]);
+    ck_assert_int_eq(result, 0);
+    assert_record_tag(session_record_get_user_record(loaded_record), "a0");
+    SIGNAL_UNREF(loaded_record);
+
+    result = signal_protocol_session_load_session(store, &loaded_record, &addresses[3]);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(session_record_is_fresh(loaded_record), 1);
+    SIGNAL_UNREF(loaded_record);
+
+    /* The earlier pending writes are still intact */
+    result = signal_protocol_session_cache_flush(store);
+    ck_assert_int_eq(result, 0);
+    assert_record_tag(data.user_records[1], "a0");
+    assert_record_tag(data.user_records[2], "b0");
+    assert_record_tag(data.user_records[3], "c0");
+    ck_assert_ptr_eq(data.user_records[4], 0);
+
+    /* With a working store the same batch goes through */
+    result = signal_protocol_session_store_sessions(store, batch_addresses, batch_records, 2);
+    ck_assert_int_eq(result, 0);
+    result = signal_protocol_session_load_session(store, &loaded_record, &addresses[0]);
+    ck_assert_int_eq(result, 0);
+    assert_record_tag(session_record_get_user_record(loaded_record), "a1");
+    SIGNAL_UNREF(loaded_record);
+
+    signal_protocol_store_context_destroy(store);
+    for(i = 0; i < 3; i++) {
+        SIGNAL_UNREF(records[i]);
+    }
+    for(i = 0; i < 2; i++) {
+        SIGNAL_UNREF(batch_records[i]);
+    }
+    for(i = 0; i < FAILING_STORE_DEVICE_COUNT; i++) {
+        signal_buffer_free(data.user_records[i]);
+    }
+}
+END_TEST
+
+typedef struct {
+    int calls;
+    uint32_t version;
+    int version_result;
+    int registration_id_result;
+    int encrypt_result;
+} decryption_callback_data;
+
+static int test_decryption_callback(session_cipher *cipher, signal_buffer *plaintext, void *decrypt_context)
+{
+    decryption_callback_data *data = decrypt_context;
+    uint32_t remote_id = 0;
+    ciphertext_message *message = 0;
+
+    data->calls++;
+    data->version_result = session_cipher_get_session_version(cipher, &data->version);
+    data->registration_id_result = session_cipher_get_remote_registration_id(cipher, &remote_id);
+    data->encrypt_result = session_cipher_encrypt(cipher,
+            signal_buffer_data(plaintext), signal_buffer_len(plaintext), &message);
+    SIGNAL_UNREF(message);
+    return 0;
+}
+
+START_TEST(test_decryption_callback_queries)
+{
+    int result = 0;
+    static const char plaintext[] = "smert ze smert";
+    decryption_callback_data data;
+    signal_buffer *decrypted = 0;
+    ciphertext_message *message = 0;
+
+    signal_protocol_address alice_address = {
+            "+14159999999", 12, 1
+    };
+    signal_protocol_address bob_address = {
+            "+14158888888", 12, 1
+    };
+
+    session_record *alice_session_record = 0;
+    result = session_record_create(&alice_session_record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+    session_record *bob_session_record = 0;
+    result = session_record_create(&bob_session_record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+    initialize_sessions_v3(
+            session_record_get_state(alice_session_record),
+            session_record_get_state(bob_session_record));
+
+    signal_protocol_store_context *alice_store = 0;
+    setup_test_store_context(&alice_store, global_context);
+    signal_protocol_store_context *bob_store = 0;
+    setup_test_store_context(&bob_store, global_context);
+    result = signal_protocol_session_store_session(alice_store, &bob_address, alice_session_record);
+    ck_assert_int_eq(result, 0);
+    result = signal_protocol_session_store_session(bob_store, &alice_address, bob_session_record);
+    ck_assert_int_eq(result, 0);
+
+    session_cipher *alice_cipher = 0;
+    result = session_cipher_create(&alice_cipher, alice_store, &bob_address, global_context);
+    ck_assert_int_eq(result, 0);
+    session_cipher *bob_cipher = 0;
+    result = session_cipher_create(&bob_cipher, bob_store, &alice_address, global_context);
+    ck_assert_int_eq(result, 0);
+    session_cipher_set_decryption_callback(bob_cipher, test_decryption_callback);
+
+    result = session_cipher_encrypt(alice_cipher, (const uint8_t *)plaintext, sizeof(plaintext) - 1, &message);
+    ck_assert_int_eq(result, 0);
+
+    /* The decryption holds the address lock, which the queries must not take again */
+    memset(&data, 0, sizeof(data));
+    result = session_cipher_decrypt_signal_message(bob_cipher, (signal_message *)message, &data, &decrypted);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(data.calls, 1);
+    ck_assert_int_eq(data.version_result, 0);
+    ck_assert_int_eq(data.version, 3);
+    ck_assert_int_eq(data.registration_id_result, 0);
+    ck_assert_int_eq(data.encrypt_result, SG_ERR_INVAL);
+
+    /* Cleanup */
+    signal_buffer_free(decrypted);
+    SIGNAL_UNREF(message);
+    session_cipher_free(alice_cipher);
+    session_cipher_free(bob_cipher);
+    signal_protocol_store_context_destroy(alice_store);
+    signal_protocol_store_context_destroy(bob_store);
+    SIGNAL_UNREF(alice_session_record);
+    SIGNAL_UNREF(bob_session_record);
+}
+END_TEST
+
+#define CACHE_THREAD_COUNT 4
+
+/* One mutex per device ID, which is coarser than needed but enough to let devices run in parallel */
+pthread_mutex_t device_mutexes[CACHE_THREAD_COUNT + 1];
+
+void test_lock_device(const signal_protocol_address *address, int mode, void *user_data)
+{
+    (void)mode;
+    (void)user_data;
+    pthread_mutex_lock(&device_mutexes[address->device_id]);
+}
+
+void test_unlock_device(const signal_protocol_address *address, int mode, void *user_data)
+{
+    (void)mode;
+    (void)user_data;
+    pthread_mutex_unlock(&device_mutexes[address->device_id]);
+}
+
+void test_setup_device_locks()
+{
+    int i;
+    int result;
+
+    test_setup();
+
+    for(i = 0; i < CACHE_THREAD_COUNT + 1; i++) {
+        pthread_mutex_init(&device_mutexes[i], 0);
+    }
+    result = signal_context_set_address_locking_functions(global_context, test_lock_device, test_unlock_device);
+    ck_assert_int_eq(result, 0);
+}
+
+void test_teardown_device_locks()
+{
+    int i;
+
+    test_teardown();
+
+    for(i = 0; i < CACHE_THREAD_COUNT + 1; i++) {
+        pthread_mutex_destroy(&device_mutexes[i]);
+    }
+}
+
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+/* Serialized records by device ID, safe to use from several threads */
+typedef struct {
+    pthread_mutex_t mutex;
+    signal_buffer *records[CACHE_THREAD_COUNT + 1];
+} threaded_session_store_data;
+
+static int threaded_session_store_load_session(signal_buffer **record, signal_buffer **user_record, const signal_protocol_address *address, void *user_data)
+{
+    threaded_session_store_data *data = user_data;
+    int result = 0;
+
+    (void)user_record;
+    pthread_mutex_lock(&data->mutex);
+    if(data->records[address->device_id]) {
+        *record = signal_buffer_copy(data->records[address->device_id]);
+        result = *record ? 1 : SG_ERR_NOMEM;
+    }
+    pthread_mutex_unlock(&data->mutex);
+    return result;
+}
+
+static int threaded_session_store_get_sub_device_sessions(signal_int_list **sessions, const char *name, size_t name_len, void *user_data)
+{
+    (void)name;
+    (void)name_len;
+    (void)user_data;
+    *sessions = signal_int_list_alloc();
+    return *sessions ? 0 : SG_ERR_NOMEM;
+}
+
+static int threaded_session_store_store_session(const signal_protocol_address *address, uint8_t *record, size_t record_len, uint8_t *user_record_data, size_t user_record_len, void *user_data)
+{
+    threaded_session_store_data *data = user_data;
+    signal_buffer *buffer = signal_buffer_create(record, record_len);
+
+    (void)user_record_data;
+    (void)user_record_len;
+    if(!buffer) {
+        return SG_ERR_NOMEM;
+    }
+    pthread_mutex_lock(&data->mutex);
+    signal_buffer_free(data->records[address->device_id]);
+    data->records[address->device_id] = buffer;
+    pthread_mutex_unlock(&data->mutex);
+    return 0;
+}
+
+static int threaded_session_store_contains_session(const signal_protocol_address *address, void *user_data)
+{
+    threaded_session_store_data *data = user_data;
+    int result;
+
+    pthread_mutex_lock(&data->mutex);
+    result = data->records[address->device_id] ? 1 : 0;
+    pthread_mutex_unlock(&data->mutex);
+    return result;
+}
+
+static int threaded_session_store_delete_session(const signal_protocol_address *address, void *user_data)
+{
+    threaded_session_store_data *data = user_data;
+    int result;
+
+    pthread_mutex_lock(&data->mutex);
+    result = data->records[address->device_id] ? 1 : 0;
+    signal_buffer_free(data->records[address->device_id]);
+    data->records[address->device_id] = 0;
+    pthread_mutex_unlock(&data->mutex);
+    return result;
+}
+
+static int threaded_session_store_delete_all_sessions(const char *name, size_t name_len, void *user_data)
+{
+    (void)name;
+    (void)name_len;
+    (void)user_data;
+    return 0;
+}
+
+typedef struct {
+    session_cipher *alice_cipher;
+    session_cipher *bob_cipher;
+} session_cache_thread_data;
+
+static void *session_cache_thread(void *arg)
+{
+    session_cache_thread_data *data = arg;
+    static const char plaintext[] = "smert ze smert";
+    size_t plaintext_len = sizeof(plaintext) - 1;
+    int i;
+
+    for(i = 0; i < 50; i++) {
+        ciphertext_message *message = 0;
+        signal_buffer *decrypted = 0;
+        int result;
+
+        /* Replies make both sides step the ratchet, creating new shared keys */
+        if(i % 5 == 4) {
+            result = session_cipher_encrypt(data->bob_cipher, (const uint8_t *)plaintext, plaintext_len, &message);
+            if(result == 0) {
+                result = session_cipher_decrypt_signal_message(data->alice_cipher, (signal_message *)message, 0, &decrypted);
+            }
+        }
+        else {
+            result = session_cipher_encrypt(data->alice_cipher, (const uint8_t *)plaintext, plaintext_len, &message);
+            if(result == 0) {
+                result = session_cipher_decrypt_signal_message(data->bob_cipher, (signal_message *)message, 0, &decrypted);
+            }
+        }
+        if(result == 0 && (signal_buffer_len(decrypted) != plaintext_len ||
+                memcmp(signal_buffer_data(decrypted), plaintext, plaintext_len) != 0)) {
+            result = SG_ERR_UNKNOWN;
+        }
+        signal_buffer_free(decrypted);
+        SIGNAL_UNREF(message);
+        if(result < 0) {
+            return (void *)1;
+        }
+    }
+    return 0;
+}
+#endif
+
+START_TEST(test_session_cache_address_locks)
+{
+    int result = 0;
+    signal_protocol_store_context *alice_store = 0;
+
+    result = signal_protocol_store_context_create(&alice_store, global_context);
+    ck_assert_int_eq(result, 0);
+
+#ifdef SIGNAL_ATOMIC_REFCOUNT
+    int i;
+    threaded_session_store_data store_data;
+    signal_protocol_store_context *bob_stores[CACHE_THREAD_COUNT];
+    session_cache_thread_data thread_data[CACHE_THREAD_COUNT];
+    pthread_t threads[CACHE_THREAD_COUNT];
+
+    signal_protocol_address alice_address = {
+            "+14159999999", 12, 0
+    };
+    signal_protocol_address bob_addresses[CACHE_THREAD_COUNT];
+
+    memset(&store_data, 0, sizeof(store_data));
+    pthread_mutex_init(&store_data.mutex, 0);
+    signal_protocol_session_store store = {
+        .load_session_func = threaded_session_store_load_session,
+        .get_sub_device_sessions_func = threaded_session_store_get_sub_device_sessions,
+        .store_session_func = threaded_session_store_store_session,
+        .contains_session_func = threaded_session_store_contains_session,
+        .delete_session_func = threaded_session_store_delete_session,
+        .delete_all_sessions_func = threaded_session_store_delete_all_sessions,
+        .destroy_func = 0,
+        .user_data = &store_data
+    };
+    result = signal_protocol_store_context_set_session_store(alice_store, &store);
+    ck_assert_int_eq(result, 0);
+
+    /* Smaller than the number of devices, so that threads evict each other's records */
+    result = signal_protocol_store_context_set_session_cache(alice_store, CACHE_THREAD_COUNT / 2, SG_SESSION_CACHE_WRITE_BEHIND);
+    ck_assert_int_eq(result, 0);
+
+    for(i = 0; i < CACHE_THREAD_COUNT; i++) {
+        session_record *alice_session_record = 0;
+        session_record *bob_session_record = 0;
+
+        bob_addresses[i].name = "+14158888888";
+        bob_addresses[i].name_len = 12;
+        bob_addresses[i].device_id = i + 1;
+
+        result = session_record_create(&alice_session_record, 0, global_context);
+        ck_assert_int_eq(result, 0);
+        result = session_record_create(&bob_session_record, 0, global_context);
+        ck_assert_int_eq(result, 0);
+        initialize_sessions_v3(
+                session_record_get_state(alice_session_record),
+                session_record_get_state(bob_session_record));
+
+        setup_test_store_context(&bob_stores[i], global_context);
+        result = signal_protocol_session_store_session(alice_store, &bob_addresses[i], alice_session_record);
+        ck_assert_int_eq(result, 0);
+        result = signal_protocol_session_store_session(bob_stores[i], &alice_address, bob_session_record);
+        ck_assert_int_eq(result, 0);
+        SIGNAL_UNREF(alice_session_record);
+        SIGNAL_UNREF(bob_session_record);
+
+        result = session_cipher_create(&thread_data[i].alice_cipher, alice_store, &bob_addresses[i], global_context);
+        ck_assert_int_eq(result, 0);
+        result = session_cipher_create(&thread_data[i].bob_cipher, bob_stores[i], &alice_address, global_context);
+        ck_assert_int_eq(result, 0);
+    }
+
+    for(i = 0; i < CACHE_THREAD_COUNT; i++) {
+        ck_assert_int_eq(pthread_create(&threads[i], 0, session_cache_thread, &thread_data[i]), 0);
+    }
+    for(i = 0; i < CACHE_THREAD_COUNT; i++) {
+        void *thread_result = 0;
+        ck_assert_int_eq(pthread_join(threads[i], &thread_result), 0);
+        ck_assert_ptr_eq(thread_result, 0);
+    }
+
+    signal_protocol_session_cache_stats stats;
+    signal_protocol_session_cache_get_stats(alice_store, &stats);
+    ck_assert_int_gt(stats.evictions, 0);
+
+    for(i = 0; i < CACHE_THREAD_COUNT; i++) {
+        session_cipher_free(thread_data[i].alice_cipher);
+        session_cipher_free(thread_data[i].bob_cipher);
+        signal_protocol_store_context_destroy(bob_stores[i]);
+    }
+    signal_protocol_store_context_destroy(alice_store);
+    for(i = 0; i < CACHE_THREAD_COUNT + 1; i++) {
+        signal_buffer_free(store_data.records[i]);
+    }
+    pthread_mutex_destroy(&store_data.mutex);
+#else
+    /* Cached copies share references that threads on different addresses would race on */
+    result = signal_protocol_store_context_set_session_cache(alice_store, 2, SG_SESSION_CACHE_WRITE_BEHIND);
+    ck_assert_int_eq(result, SG_ERR_INVAL);
+    result = signal_protocol_store_context_set_session_cache(alice_store, 0, SG_SESSION_CACHE_WRITE_BEHIND);
+    ck_assert_int_eq(result, 0);
+    signal_protocol_store_context_destroy(alice_store);
+#endif
+}
+END_TEST
+
+START_TEST(test_set_allocator_incomplete)
+{
+    test_allocator allocator;
+    int result = signal_context_set_allocator(global_context,
+            test_allocator_malloc, 0, test_allocator_free, &allocator);
+    ck_assert_int_eq(result, SG_ERR_INVAL);
+}
+END_TEST
+
+static void *key_pair_pool_refill_thread(void *arg)
+{
+    int *running = arg;
+    while(__atomic_load_n(running, __ATOMIC_ACQUIRE)) {
+        if(signal_context_refill_key_pair_pool(global_context) < 0) {
+            return (void *)1;
+        }
+    }
+    return 0;
+}
+
+START_TEST(test_key_pair_pool)
+{
+    int result = 0;
+    int running = 1;
+    void *thread_result = 0;
+    pthread_t thread;
+    session_record *alice_session_record = 0;
+    session_record *bob_session_record = 0;
+
+    ck_assert_int_eq(signal_context_get_key_pair_pool_count(global_context), KEY_PAIR_POOL_CAPACITY);
+    result = signal_context_refill_key_pair_pool(global_context);
+    ck_assert_int_eq(result, 0);
+
+    /* Session setup and ratchet steps take their key pairs from the pool */
+    result = session_record_create(&alice_session_record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+    result = session_record_create(&bob_session_record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+    initialize_sessions_v3(
+            session_record_get_state(alice_session_record),
+            session_record_get_state(bob_session_record));
+    ck_assert_int_eq(signal_context_get_key_pair_pool_count(global_context), KEY_PAIR_POOL_CAPACITY - 1);
+    ck_assert_int_eq(key_pair_pool_refill_requests, 0);
+
+    /* Ratchet steps take more, asking for a refill once half are gone */
+    run_interaction(alice_session_record, bob_session_record);
+    ck_assert_int_lt(signal_context_get_key_pair_pool_count(global_context), KEY_PAIR_POOL_CAPACITY / 2);
+    ck_assert_int_gt(key_pair_pool_refill_requests, 0);
+    SIGNAL_UNREF(alice_session_record);
+    SIGNAL_UNREF(bob_session_record);
+
+    /* Key pairs are generated on demand once the pool is empty */
+    result = signal_context_set_key_pair_pool(global_context, 1, test_key_pair_pool_refill_needed);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(signal_context_get_key_pair_pool_count(global_context), 1);
+    result = session_record_create(&alice_session_record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+    result = session_record_create(&bob_session_record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+    initialize_sessions_v3(
+            session_record_get_state(alice_session_record),
+            session_record_get_state(bob_session_record));
+    run_interaction(alice_session_record, bob_session_record);
+    ck_assert_int_eq(signal_context_get_key_pair_pool_count(global_context), 0);
+    SIGNAL_UNREF(alice_session_record);
+    SIGNAL_UNREF(bob_session_record);
+    result = signal_context_set_key_pair_pool(global_context, KEY_PAIR_POOL_CAPACITY, 0);
+    ck_assert_int_eq(result, 0);
+
+    /* Refilled from another thread while sessions use it */
+    result = session_record_create(&alice_session_record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+    result = session_record_create(&bob_session_record, 0, global_context);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(pthread_create(&thread, 0, key_pair_pool_refill_thread, &running), 0);
+    initialize_sessions_v3(
+            session_record_get_state(alice_session_record),
+            session_record_get_state(bob_session_record));
+    run_interaction(alice_session_record, bob_session_record);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    ck_assert_int_eq(pthread_join(thread, &thread_result), 0);
+    ck_assert_ptr_eq(thread_result, 0);
+    SIGNAL_UNREF(alice_session_record);
+    SIGNAL_UNREF(bob_session_record);
+
+    /* Pooled key pairs carry over to a smaller pool, and are released with it */
+    result = signal_context_refill_key_pair_pool(global_context);
+    ck_assert_int_ge(result, 0);
+    ck_assert_int_eq(signal_context_get_key_pair_pool_count(global_context), KEY_PAIR_POOL_CAPACITY);
+    result = signal_context_set_key_pair_pool(global_context, 2, 0);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(signal_context_get_key_pair_pool_count(global_context), 2);
+    result = signal_context_set_key_pair_pool(global_context, 0, 0);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(signal_context_get_key_pair_pool_count(global_context), 0);
+    result = signal_context_refill_key_pair_pool(global_context);
+    ck_assert_int_eq(result, 0);
+}
+END_TEST
+
+Suite *session_cipher_suite(void)
+{
+    Suite *suite = suite_create("session_cipher");
+
+    TCase *tcase = tcase_create("case");
+    tcase_add_checked_fixture(tcase, test_setup, test_teardown);
+    tcase_add_test(tcase, test_basic_session_v3);
+    tcase_add_test(tcase, test_message_key_limits);
+    tcase_add_test(tcase, test_encrypt_batch);
+    tcase_add_test(tcase, test_encrypt_batch_without_store_callbacks);
+    tcase_add_test(tcase, test_encrypt_batch_session_cache_write_through);
+    tcase_add_test(tcase, test_encrypt_batch_session_cache_write_behind);
+    tcase_add_test(tcase, test_encrypt_batch_session_cache_write_behind_staged);
+    tcase_add_test(tcase, test_session_cache_write_behind);
+    tcase_add_test(tcase, test_session_cache_write_behind_batch_failure);
+    tcase_add_test(tcase, test_set_allocator_incomplete);
+    tcase_add_test(tcase, test_decryption_callback_queries);
+    suite_add_tcase(suite, tcase);
+
+    TCase *tcase_address_locks = tcase_create("address_locks");
+    tcase_add_checked_fixture(tcase_address_locks, test_setup_address_locks, test_teardown_address_locks);
+    tcase_add_test(tcase_address_locks, test_basic_session_v3);
+    tcase_add_test(tcase_address_locks, test_encrypt_batch);
+    tcase_add_test(tcase_address_locks, test_decryption_callback_queries);
+    suite_add_tcase(suite, tcase_address_locks);
+
+    TCase *tcase_device_locks = tcase_create("device_locks");
+    tcase_add_checked_fixture(tcase_device_locks, test_setup_device_locks, test_teardown_device_locks);
+    tcase_add_test(tcase_device_locks, test_session_cache_address_locks);
+    suite_add_tcase(suite, tcase_device_locks);
+
+    TCase *tcase_checkpoints = tcase_create("skipped_key_checkpoints");
+    tcase_add_checked_fixture(tcase_checkpoints, test_setup_skipped_key_checkpoints, test_teardown);
+    tcase_add_test(tcase_checkpoints, test_basic_session_v3);
+    tcase_add_test(tcase_checkpoints, test_message_key_limits);
+    tcase_add_test(tcase_checkpoints, test_skipped_key_checkpoints);
+    tcase_add_test(tcase_checkpoints, test_skipped_key_checkpoint_advance);
+    suite_add_tcase(suite, tcase_checkpoints);
+
+    TCase *tcase_allocator = tcase_create("allocator");
+    tcase_add_checked_fixture(tcase_allocator, test_setup_allocator, test_teardown_allocator);
+    tcase_add_test(tcase_allocator, test_basic_session_v3);
+    tcase_add_test(tcase_allocator, test_message_key_limits);
+    tcase_add_test(tcase_allocator, test_encrypt_batch_session_cache_write_behind);
+    tcase_add_test(tcase_allocator, test_encrypt_batch_session_cache_write_behind_staged);
+    suite_add_tcase(suite, tcase_allocator);
+
+    TCase *tcase_key_pair_pool = tcase_create("key_pair_pool");
+    tcase_add_checked_fixture(tcase_key_pair_pool, test_setup_key_pair_pool, test_teardown);
+    tcase_add_test(tcase_key_pair_pool, test_basic_session_v3);
+    tcase_add_test(tcase_key_pair_pool, test_key_pair_pool);
+    suite_add_tcase(suite, tcase_key_pair_pool);
+
+    TCase *tcase_address_locks_key_pair_pool = tcase_create("address_locks_key_pair_pool");
+    tcase_add_checked_fixture(tcase_address_locks_key_pair_pool,
+            test_setup_address_locks_key_pair_pool, test_teardown_address_locks_key_pair_pool);
+    tcase_add_test(tcase_address_locks_key_pair_pool, test_basic_session_v3);
+    suite_add_tcase(suite, tcase_address_locks_key_pair_pool);
 
     return suite;
 }
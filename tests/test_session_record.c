@@ -579,6 +579,387 @@ START_TEST(test_session_receiver_chain_count)
 }
 END_TEST
 
+START_TEST(test_session_message_keys)
+{
+    int result = 0;
+    uint32_t i = 0;
+    hkdf_context *kdf = 0;
+    session_state *state = 0;
+    session_state *state_deserialized = 0;
+    ratchet_chain_key *chain_key = 0;
+    ec_public_key *ratchet_key = 0;
+    signal_buffer *buffer = 0;
+    ratchet_message_keys message_keys;
+    ratchet_message_keys message_keys_result;
+
+    result = hkdf_create(&kdf, 2, global_context);
+    ck_assert_int_eq(result, 0);
+
+    uint8_t keySeed[32];
+    memset(keySeed, 0x42, sizeof(keySeed));
+
+    result = ratchet_chain_key_create(&chain_key, kdf, keySeed, sizeof(keySeed), 0, global_context);
+    ck_assert_int_eq(result, 0);
+
+    ratchet_key = create_test_ec_public_key(global_context);
+    ck_assert_ptr_ne(ratchet_key, 0);
+
+    result = session_state_create(&state, global_context);
+    ck_assert_int_eq(result, 0);
+
+    result = session_state_add_receiver_chain(state, ratchet_key, chain_key);
+    ck_assert_int_eq(result, 0);
+
+    /* Store more skipped keys than the limit, with distinct contents */
+    for(i = 0; i < 2100; i++) {
+        memset(&message_keys, 0, sizeof(message_keys));
+        memcpy(message_keys.cipher_key, &i, sizeof(i));
+        message_keys.counter = i;
+        result = session_state_set_message_keys(state, ratchet_key, &message_keys);
+        ck_assert_int_eq(result, 0);
+    }
+
+    /* The oldest keys must have been evicted */
+    ck_assert_int_eq(session_state_has_message_keys(state, ratchet_key, 0), 0);
+    ck_assert_int_eq(session_state_has_message_keys(state, ratchet_key, 99), 0);
+    ck_assert_int_eq(session_state_has_message_keys(state, ratchet_key, 100), 1);
+    ck_assert_int_eq(session_state_has_message_keys(state, ratchet_key, 2099), 1);
+
+    /* Remove a key from the middle */
+    result = session_state_remove_message_keys(state, &message_keys_result, ratchet_key, 1000);
+    ck_assert_int_eq(result, 1);
+    ck_assert_int_eq(message_keys_result.counter, 1000);
+    ck_assert_int_eq(memcmp(message_keys_result.cipher_key, &message_keys_result.counter, sizeof(uint32_t)), 0);
+    ck_assert_int_eq(session_state_has_message_keys(state, ratchet_key, 1000), 0);
+    result = session_state_remove_message_keys(state, &message_keys_result, ratchet_key, 1000);
+    ck_assert_int_eq(result, 0);
+
+    /* The freed slot should delay the next eviction by one */
+    memset(&message_keys, 0, sizeof(message_keys));
+    message_keys.counter = 2100;
+    result = session_state_set_message_keys(state, ratchet_key, &message_keys);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(session_state_has_message_keys(state, ratchet_key, 100), 1);
+
+    message_keys.counter = 2101;
+    result = session_state_set_message_keys(state, ratchet_key, &message_keys);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(session_state_has_message_keys(state, ratchet_key, 100), 0);
+    ck_assert_int_eq(session_state_has_message_keys(state, ratchet_key, 101), 1);
+
+    /* Round trip through serialization */
+    result = session_state_serialize(&buffer, state);
+    ck_assert_int_eq(result, 0);
+
+    result = session_state_deserialize(&state_deserialized,
+            signal_buffer_data(buffer), signal_buffer_len(buffer), global_context);
+    ck_assert_int_eq(result, 0);
+
+    for(i = 0; i < 2102; i++) {
+        int expected = (i > 100 && i != 1000) ? 1 : 0;
+        ck_assert_int_eq(session_state_has_message_keys(state_deserialized, ratchet_key, i), expected);
+    }
+
+    result = session_state_remove_message_keys(state_deserialized, &message_keys_result, ratchet_key, 1500);
+    ck_assert_int_eq(result, 1);
+    ck_assert_int_eq(message_keys_result.counter, 1500);
+    ck_assert_int_eq(memcmp(message_keys_result.cipher_key, &message_keys_result.counter, sizeof(uint32_t)), 0);
+
+    /* Cleanup */
+    signal_buffer_free(buffer);
+    SIGNAL_UNREF(chain_key);
+    SIGNAL_UNREF(ratchet_key);
+    SIGNAL_UNREF(kdf);
+    SIGNAL_UNREF(state);
+    SIGNAL_UNREF(state_deserialized);
+}
+END_TEST
+
+START_TEST(test_session_state_checkpoint)
+{
+    int result = 0;
+    ec_public_key *receiver_chain_ratchet_key1 = create_test_ec_public_key(global_context);
+    ec_public_key *receiver_chain_ratchet_key2 = create_test_ec_public_key(global_context);
+    session_state *state = create_test_session_state(receiver_chain_ratchet_key1, receiver_chain_ratchet_key2);
+    session_state *state_copy = 0;
+    signal_buffer *buffer = 0;
+    signal_buffer *buffer_copy = 0;
+    ratchet_message_keys message_keys;
+
+    /* A copy must serialize identically to the original */
+    result = session_state_copy(&state_copy, state, global_context);
+    ck_assert_int_eq(result, 0);
+
+    result = session_state_serialize(&buffer, state);
+    ck_assert_int_eq(result, 0);
+    result = session_state_serialize(&buffer_copy, state_copy);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(signal_buffer_compare(buffer, buffer_copy), 0);
+
+    /* Modifying the copy's skipped keys must not affect the original */
+    result = session_state_remove_message_keys(state_copy, &message_keys, receiver_chain_ratchet_key1, 0);
+    ck_assert_int_eq(result, 1);
+    ck_assert_int_eq(session_state_has_message_keys(state_copy, receiver_chain_ratchet_key1, 0), 0);
+    ck_assert_int_eq(session_state_has_message_keys(state, receiver_chain_ratchet_key1, 0), 1);
+
+    memset(&message_keys, 0, sizeof(message_keys));
+    message_keys.counter = 5;
+    result = session_state_set_message_keys(state_copy, receiver_chain_ratchet_key2, &message_keys);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(session_state_has_message_keys(state, receiver_chain_ratchet_key2, 5), 0);
+
+    /* Rolling back restores the checkpointed contents */
+    result = session_state_checkpoint(state);
+    ck_assert_int_eq(result, 0);
+
+    session_state_set_previous_counter(state, 99);
+    result = session_state_remove_message_keys(state, &message_keys, receiver_chain_ratchet_key2, 0);
+    ck_assert_int_eq(result, 1);
+    message_keys.counter = 6;
+    result = session_state_set_message_keys(state, receiver_chain_ratchet_key1, &message_keys);
+    ck_assert_int_eq(result, 0);
+    session_state_clear_unacknowledged_pre_key_message(state);
+
+    session_state_rollback(state);
+
+    ck_assert_int_eq(session_state_get_previous_counter(state), 4);
+    ck_assert_int_eq(session_state_has_message_keys(state, receiver_chain_ratchet_key2, 0), 1);
+    ck_assert_int_eq(session_state_has_message_keys(state, receiver_chain_ratchet_key1, 6), 0);
+    ck_assert_int_eq(session_state_has_unacknowledged_pre_key_message(state), 1);
+
+    signal_buffer_free(buffer_copy);
+    buffer_copy = 0;
+    result = session_state_serialize(&buffer_copy, state);
+    ck_assert_int_eq(result, 0);
+    ck_assert_int_eq(signal_buffer_compare(buffer, buffer_copy), 0);
+
+    /* Committing keeps the changes */
+    result = session_state_checkpoint(state);
+    ck_assert_int_eq(result, 0);
+    session_state_set_previous_counter(state, 7);
+    session_state_commit(state);
+    session_state_rollback(state);
+    ck_assert_int_eq(session_state_get_previous_counter(state), 7);
+
+    /* Cleanup */
+    signal_buffer_free(buffer);
+    signal_buffer_free(buffer_copy);
+    SIGNAL_UNREF(state);
+    SIGNAL_UNREF(state_copy);
+    SIGNAL_UNREF(receiver_chain_ratchet_key1);
+    SIGNAL_UNREF(receiver_chain_ratchet_key2);
+}
+END_TEST
+
+START_TEST(test_serialize_scratch_allocations)
+{
+    int result = 0;
+    test_allocator allocator;
+    size_t live_count;
+    size_t allocation_count;
+    int i;
+
+    setup_test_allocator(global_context, &allocator);
+
+    ec_public_key *receiver_chain_ratchet_key1 = create_test_ec_public_key(global_context);
+    ec_public_key *receiver_chain_ratchet_key2 = create_test_ec_public_key(global_context);
+
+    /* Create a record with a few archived states */
+    session_state *state = create_test_session_state(receiver_chain_ratchet_key1, receiver_chain_ratchet_key2);
+    session_record *record = 0;
+    result = session_record_create(&record, state, global_context);
+    ck_assert_int_eq(result, 0);
+    SIGNAL_UNREF(state);
+    for(i = 0; i < 3; i++) {
+        result = session_record_archive_current_state(record);
+        ck_assert_int_eq(result, 0);
+        fill_test_session_state(session_record_get_state(record), receiver_chain_ratchet_key1, receiver_chain_ratchet_key2);
+    }
+
+    /* Serialization temporaries come from a few scratch blocks, not one allocation per field */
+    live_count = allocator.live_count;
+    allocation_count = allocator.allocation_count;
+    signal_buffer *buffer = 0;
+    result = session_record_serialize(&buffer, record);
+    ck_assert_int_ge(result, 0);
+    ck_assert_int_le(allocator.allocation_count - allocation_count, 4);
+    ck_assert_int_eq(allocator.live_count, live_count + 1);
+
+    /* Nothing but the record itself outlives deserialization */
+    session_record *record_deserialized = 0;
+    result = session_record_deserialize(&record_deserialized,
+            signal_buffer_data(buffer), signal_buffer_len(buffer), global_context);
+    ck_assert_int_ge(result, 0);
+    SIGNAL_UNREF(record_deserialized);
+    ck_assert_int_eq(allocator.live_count, live_count + 1);
+
+    /* Cleanup */
+    signal_buffer_free(buffer);
+    SIGNAL_UNREF(record);
+    SIGNAL_UNREF(receiver_chain_ratchet_key1);
+    SIGNAL_UNREF(receiver_chain_ratchet_key2);
+    ck_assert_int_eq(allocator.live_count, 0);
+}
+END_TEST
+
+START_TEST(test_lazy_previous_states)
+{
+    int result = 0;
+    int i;
+    ec_public_key *receiver_chain_ratchet_key1 = create_test_ec_public_key(global_context);
+    ec_public_key *receiver_chain_ratchet_key2 = create_test_ec_public_key(global_context);
+
+    /* Create a record with a few archived states */
+    session_state *state = create_test_session_state(receiver_chain_ratchet_key1, receiver_chain_ratchet_key2);
+    session_record *record = 0;
+    result = session_record_create(&record, state, global_context);
+    ck_assert_int_eq(result, 0);
+    SIGNAL_UNREF(state);
+    for(i = 0; i < 3; i++) {
+        result = session_record_archive_current_state(record);
+        ck_assert_int_eq(result, 0);
+        fill_test_session_state(session_record_get_state(record), receiver_chain_ratchet_key1, receiver_chain_ratchet_key2);
+    }
+
+    signal_buffer *buffer = 0;
+    result = session_record_serialize(&buffer, record);
+    ck_assert_int_ge(result, 0);
+
+    session_record *record_deserialized = 0;
+    result = session_record_deserialize(&record_deserialized,
+            signal_buffer_data(buffer), signal_buffer_len(buffer), global_context);
+    ck_assert_int_ge(result, 0);
+
+    /* Archived states are matched without being decoded */
+    session_record_state_node *previous_node = session_record_get_previous_states_head(record);
+    session_state *archived_state = session_record_get_previous_states_element(
+            session_record_get_previous_states_next(previous_node));
+    ck_assert_int_eq(session_record_has_session_state(record_deserialized, 2,
+            session_state_get_alice_base_key(archived_state)), 1);
+    ck_assert_int_eq(session_record_has_session_state(record_deserialized, 3,
+            session_state_get_alice_base_key(archived_state)), 0);
+    ck_assert_int_eq(session_record_has_session_state(record_deserialized, 2,
+            receiver_chain_ratchet_key1), 0);
+
+    /* A loaded archived state is not kept, and the record re-serializes unchanged */
+    previous_node = session_record_get_previous_states_head(record_deserialized);
+    session_state *loaded_state = 0;
+    result = session_record_load_previous_states_element(previous_node, &loaded_state);
+    ck_assert_int_eq(result, 0);
+    compare_session_states(session_record_get_previous_states_element(session_record_get_previous_states_head(record)),
+            loaded_state, receiver_chain_ratchet_key1, receiver_chain_ratchet_key2);
+    SIGNAL_UNREF(loaded_state);
+
+    signal_buffer *buffer_reserialized = 0;
+    result = session_record_serialize(&buffer_reserialized, record_deserialized);
+    ck_assert_int_ge(result, 0);
+    ck_assert_int_eq(signal_buffer_compare(buffer, buffer_reserialized), 0);
+    signal_buffer_free(buffer_reserialized);
+
+    /* Accessing an archived state decodes it in place */
+    session_state *state_deserialized = session_record_get_previous_states_element(previous_node);
+    ck_assert_ptr_ne(state_deserialized, 0);
+    ck_assert_ptr_eq(session_record_get_previous_states_element(previous_node), state_deserialized);
+    result = session_record_load_previous_states_element(previous_node, &loaded_state);
+    ck_assert_int_eq(result, 0);
+    ck_assert_ptr_eq(loaded_state, state_deserialized);
+    SIGNAL_UNREF(loaded_state);
+
+    result = session_record_serialize(&buffer_reserialized, record_deserialized);
+    ck_assert_int_ge(result, 0);
+    ck_assert_int_eq(signal_buffer_compare(buffer, buffer_reserialized), 0);
+    signal_buffer_free(buffer_reserialized);
+
+    /* Cleanup */
+    signal_buffer_free(buffer);
+    SIGNAL_UNREF(record);
+    SIGNAL_UNREF(record_deserialized);
+    SIGNAL_UNREF(receiver_chain_ratchet_key1);
+    SIGNAL_UNREF(receiver_chain_ratchet_key2);
+}
+END_TEST
+
+START_TEST(test_previous_states_index)
+{
+    int result = 0;
+    int i;
+    ec_public_key *ratchet_keys[4][2];
+    ec_public_key *unknown_key = create_test_ec_public_key(global_context);
+
+    for(i = 0; i < 4; i++) {
+        ratchet_keys[i][0] = create_test_ec_public_key(global_context);
+        ratchet_keys[i][1] = create_test_ec_public_key(global_context);
+    }
+
+    /* Create a record whose archived states each have their own receiver chains */
+    session_state *state = create_test_session_state(ratchet_keys[0][0], ratchet_keys[0][1]);
+    session_record *record = 0;
+    result = session_record_create(&record, state, global_context);
+    ck_assert_int_eq(result, 0);
+    SIGNAL_UNREF(state);
+    for(i = 1; i < 4; i++) {
+        result = session_record_archive_current_state(record);
+        ck_assert_int_eq(result, 0);
+        fill_test_session_state(session_record_get_state(record), ratchet_keys[i][0], ratchet_keys[i][1]);
+    }
+
+    signal_buffer *buffer = 0;
+    result = session_record_serialize(&buffer, record);
+    ck_assert_int_ge(result, 0);
+
+    session_record *record_deserialized = 0;
+    result = session_record_deserialize(&record_deserialized,
+            signal_buffer_data(buffer), signal_buffer_len(buffer), global_context);
+    ck_assert_int_ge(result, 0);
+
+    /* Both built and deserialized records find each archived state by its ratchet keys */
+    session_record *records[2] = { record, record_deserialized };
+    int j;
+    for(j = 0; j < 2; j++) {
+        session_record_state_node *node = session_record_get_previous_states_head(records[j]);
+        for(i = 2; i >= 0; i--) {
+            ck_assert_ptr_ne(node, 0);
+            ck_assert_ptr_eq(session_record_find_previous_states_receiver(records[j], ratchet_keys[i][0]), node);
+            ck_assert_ptr_eq(session_record_find_previous_states_receiver(records[j], ratchet_keys[i][1]), node);
+            node = session_record_get_previous_states_next(node);
+        }
+        ck_assert_ptr_eq(node, 0);
+
+        /* Keys of the current state and unknown keys are not archived */
+        ck_assert_ptr_eq(session_record_find_previous_states_receiver(records[j], ratchet_keys[3][0]), 0);
+        ck_assert_ptr_eq(session_record_find_previous_states_receiver(records[j], unknown_key), 0);
+    }
+
+    /* A state handed out for modification is still found once it gains a receiver chain */
+    session_record_state_node *node = session_record_get_previous_states_head(record_deserialized);
+    session_state *archived_state = session_record_get_previous_states_element(node);
+    ck_assert_ptr_ne(archived_state, 0);
+    ratchet_chain_key *chain_key = session_state_get_receiver_chain_key(archived_state, ratchet_keys[2][0]);
+    ck_assert_ptr_ne(chain_key, 0);
+    result = session_state_add_receiver_chain(archived_state, unknown_key, chain_key);
+    ck_assert_int_eq(result, 0);
+    ck_assert_ptr_eq(session_record_find_previous_states_receiver(record_deserialized, unknown_key), node);
+    ck_assert_int_eq(session_record_has_session_state(record_deserialized, 2,
+            session_state_get_alice_base_key(archived_state)), 1);
+
+    /* Removed states are no longer found */
+    session_record_get_previous_states_remove(record_deserialized, node);
+    ck_assert_ptr_eq(session_record_find_previous_states_receiver(record_deserialized, unknown_key), 0);
+    ck_assert_ptr_eq(session_record_find_previous_states_receiver(record_deserialized, ratchet_keys[2][0]), 0);
+    ck_assert_ptr_ne(session_record_find_previous_states_receiver(record_deserialized, ratchet_keys[1][0]), 0);
+
+    /* Cleanup */
+    signal_buffer_free(buffer);
+    SIGNAL_UNREF(record);
+    SIGNAL_UNREF(record_deserialized);
+    for(i = 0; i < 4; i++) {
+        SIGNAL_UNREF(ratchet_keys[i][0]);
+        SIGNAL_UNREF(ratchet_keys[i][1]);
+    }
+    SIGNAL_UNREF(unknown_key);
+}
+END_TEST
+
 Suite *session_record_suite(void)
 {
     Suite *suite = suite_create("session_record");
@@ -588,6 +969,11 @@ Suite *session_record_suite(void)
     tcase_add_test(tcase, test_serialize_single_session);
     tcase_add_test(tcase, test_serialize_multiple_sessions);
     tcase_add_test(tcase, test_session_receiver_chain_count);
+    tcase_add_test(tcase, test_session_message_keys);
+    tcase_add_test(tcase, test_session_state_checkpoint);
+    tcase_add_test(tcase, test_serialize_scratch_allocations);
+    tcase_add_test(tcase, test_lazy_previous_states);
+    tcase_add_test(tcase, test_previous_states_index);
     suite_add_tcase(suite, tcase);
 
     return suite;